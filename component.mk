@@ -41,6 +41,17 @@ WOLFSSL_OBJS := \
     wolfssl/wolfcrypt/src/wc_port.o \
     wolfssl/wolfcrypt/src/wc_encrypt.o
 
+ifdef CONFIG_HOMEKIT_CRYPTO_HW
+WOLFSSL_OBJS := $(filter-out wolfssl/wolfcrypt/src/integer.o,$(WOLFSSL_OBJS))
+WOLFSSL_OBJS += \
+    wolfssl/wolfcrypt/src/tfm.o     \
+    wolfssl/wolfcrypt/src/port/Espressif/esp32_mp.o     \
+    wolfssl/wolfcrypt/src/port/Espressif/esp32_sha.o    \
+    wolfssl/wolfcrypt/src/port/Espressif/esp32_util.o
+
+COMPONENT_SRCDIRS += wolfssl/wolfcrypt/src/port/Espressif
+endif
+
 COMPONENT_OBJS := $(HOMEKIT_OBJS) $(WOLFSSL_OBJS) 
 
 WOLFSSL_SETTINGS =        \
@@ -81,6 +92,16 @@ WOLFSSL_SETTINGS =        \
     -DHAVE_CERTIFICATE_STATUS_REQUEST \
     -DCUSTOM_RAND_GENERATE_SEED=os_get_random
 
+# FP_MAX_BITS: SRP-3072 needs twice the modulus width in fastmath
+ifdef CONFIG_HOMEKIT_CRYPTO_HW
+WOLFSSL_SETTINGS +=       \
+    -DWOLFSSL_ESPIDF      \
+    -DWOLFSSL_ESPWROOM32  \
+    -DUSE_FAST_MATH       \
+    -DTFM_TIMING_RESISTANT\
+    -DFP_MAX_BITS=8192
+endif
+
 LWIP_INCDIRS = \
     -I$(IDF_PATH)/components/lwip/system \
     -I$(IDF_PATH)/components/lwip/include/lwip \
@@ -98,11 +119,15 @@ CFLAGS = \
     -nostdlib                   \
     -ggdb                       \
     -Os                         \
-    -DDEBUG                    \
     -std=gnu99                  \
     -Wno-old-style-declaration  \
     $(LWIP_INCDIRS)             \
     $(FREERTOS_INCDIRS)         \
     $(WOLFSSL_SETTINGS)
 
+# the session cipher is on the path of every byte, build it for speed
+ifdef CONFIG_HOMEKIT_AEAD_FAST
+src/chacha20_poly1305.o: CFLAGS += -O2
+endif
+
 CXXFLAGS += -std=c++17 -Wno-missing-field-initializers
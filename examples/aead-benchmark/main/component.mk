@@ -0,0 +1,2 @@
+# the cipher is internal to the homekit component
+CFLAGS += -I$(PROJECT_PATH)/../../src
@@ -0,0 +1,107 @@
+/*
+ * Session cipher throughput: encrypts a 16 KB message, the size of a large
+ * /accessories response, frame by frame and in one call, then decrypts it.
+ * Build once with and once without CONFIG_HOMEKIT_AEAD_FAST to compare the
+ * built-in ChaCha20-Poly1305 with wolfCrypt.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+
+#include "chacha20_poly1305.h"
+
+#define FRAME_LENGTH    1024
+#define NR_FRAMES       16
+#define NR_ROUNDS       32
+
+#define AAD_LENGTH      2
+#define FRAME_SIZE      (AAD_LENGTH + FRAME_LENGTH + CHACHA20_POLY1305_AUTH_TAG_LENGTH)
+
+static uint8_t key[32];
+static uint8_t message[NR_FRAMES * FRAME_SIZE];
+static uint8_t plain_text[FRAME_LENGTH];
+
+static void _frames_fill(void)
+{
+    for (int i=0; i<NR_FRAMES; i++) {
+        uint8_t* frame = message + i * FRAME_SIZE;
+        frame[0] = FRAME_LENGTH % 256;
+        frame[1] = FRAME_LENGTH / 256;
+        esp_fill_random(frame + AAD_LENGTH, FRAME_LENGTH);
+    }
+}
+
+static void _report(const char* name, int64_t us)
+{
+    int64_t bytes = (int64_t)NR_ROUNDS * NR_FRAMES * FRAME_LENGTH;
+    printf("[AEAD] %-12s %8lld us %6lld KB/s\n", name, us, bytes * 1000000 / us / 1024);
+}
+
+static void _encrypt_each(uint64_t* count)
+{
+    for (int i=0; i<NR_FRAMES; i++) {
+        uint8_t* frame = message + i * FRAME_SIZE;
+        uint8_t nonce[CHACHA20_POLY1305_NONCE_LENGTH];
+        chacha20_poly1305_counter_nonce(nonce, (*count)++);
+        chacha20_poly1305_encrypt_with_nonce(nonce, key, frame, AAD_LENGTH,
+                frame + AAD_LENGTH, FRAME_LENGTH, frame + AAD_LENGTH);
+    }
+}
+
+static int _decrypt_each(uint64_t* count)
+{
+    for (int i=0; i<NR_FRAMES; i++) {
+        uint8_t* frame = message + i * FRAME_SIZE;
+        uint8_t nonce[CHACHA20_POLY1305_NONCE_LENGTH];
+        chacha20_poly1305_counter_nonce(nonce, (*count)++);
+        if (chacha20_poly1305_decrypt_with_nonce(nonce, key, frame, AAD_LENGTH, frame + AAD_LENGTH,
+                    FRAME_LENGTH + CHACHA20_POLY1305_AUTH_TAG_LENGTH, plain_text) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void benchmark_task(void* arg)
+{
+    esp_fill_random(key, sizeof(key));
+    _frames_fill();
+
+    uint64_t count = 0;
+    int64_t start = esp_timer_get_time();
+    for (int i=0; i<NR_ROUNDS; i++)
+        _encrypt_each(&count);
+    _report("per frame", esp_timer_get_time() - start);
+
+    count = 0;
+    start = esp_timer_get_time();
+    for (int i=0; i<NR_ROUNDS; i++)
+        chacha20_poly1305_encrypt_frames(key, &count, message, sizeof(message));
+    _report("one call", esp_timer_get_time() - start);
+
+    /* encrypted exactly once, so the tags have to match on every round */
+    _frames_fill();
+    count = 0;
+    chacha20_poly1305_encrypt_frames(key, &count, message, sizeof(message));
+
+    int err = 0;
+    start = esp_timer_get_time();
+    for (int i=0; i<NR_ROUNDS; i++) {
+        count = 0;
+        err |= _decrypt_each(&count);
+    }
+    _report("decrypt", esp_timer_get_time() - start);
+    if (err < 0)
+        printf("[AEAD] decrypt failed\n");
+
+    vTaskDelete(NULL);
+}
+
+void app_main()
+{
+    xTaskCreate(benchmark_task, "benchmark", 4096, NULL, 5, NULL);
+}
@@ -0,0 +1,161 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_timer.h"
+
+#include "httpd_host.h"
+
+#define HTTPD_RX_LENGTH 4096
+
+struct httpd_conn {
+    void* user_data;
+    bool close;
+    bool close_after_send;
+    double last_io;
+    double timer;
+
+    char rx[HTTPD_RX_LENGTH];
+    int rx_len;
+    char* tx;
+    int tx_size;
+    int tx_len;
+};
+
+static struct httpd_ops _ops;
+
+void httpd_init(struct httpd_ops* ops) {
+    _ops = *ops;
+}
+
+void* httpd_bind(int port, void* user_data) {
+    struct httpd_conn* l = calloc(1, sizeof(struct httpd_conn));
+    if (l == NULL)
+        return NULL;
+
+    l->user_data = user_data;
+    return l;
+}
+
+struct httpd_conn* httpd_host_connect(void* listener) {
+    struct httpd_conn* l = listener;
+    struct httpd_conn* c = calloc(1, sizeof(struct httpd_conn));
+    if (c == NULL)
+        return NULL;
+
+    c->user_data = l->user_data;
+    c->last_io = httpd_time();
+    if (_ops.accept)
+        _ops.accept(c->user_data, c);
+    return c;
+}
+
+void* httpd_host_user_data(struct httpd_conn* conn) {
+    return conn->user_data;
+}
+
+int httpd_host_recv(struct httpd_conn* conn, const void* data, int len) {
+    if (conn->rx_len + len > HTTPD_RX_LENGTH) {
+        printf("[ERR] receive buffer full. length:%d\n", len);
+        return -1;
+    }
+
+    memcpy(conn->rx + conn->rx_len, data, len);
+    conn->rx_len += len;
+    conn->last_io = httpd_time();
+
+    int consumed = _ops.recv(conn->user_data, conn, conn->rx, conn->rx_len);
+    if (consumed > 0)
+        httpd_recv_consume(conn, consumed);
+
+    return conn->close ? -1 : 0;
+}
+
+char* httpd_host_sent(struct httpd_conn* conn, int* len) {
+    *len = conn->tx_len;
+    return conn->tx;
+}
+
+void httpd_host_sent_clear(struct httpd_conn* conn) {
+    conn->tx_len = 0;
+}
+
+void httpd_wakeup(void) {
+}
+
+void httpd_wakeup_from_isr(BaseType_t* woken) {
+}
+
+void httpd_user_data_set(struct httpd_conn* conn, void* user_data) {
+    conn->user_data = user_data;
+}
+
+double httpd_time(void) {
+    return esp_timer_get_time() / 1000000.0;
+}
+
+double httpd_last_io(struct httpd_conn* conn) {
+    return conn->last_io;
+}
+
+void httpd_timer_set(struct httpd_conn* conn, double when) {
+    conn->timer = when;
+}
+
+int httpd_send(struct httpd_conn* conn, const void* data, int len) {
+    int room;
+    char* out = httpd_send_buffer(conn, len, len, &room);
+    if (out == NULL)
+        return -1;
+
+    memcpy(out, data, len);
+    httpd_send_commit(conn, len);
+    return 0;
+}
+
+/* grows like a mongoose buffer, the whole response is always taken */
+char* httpd_send_buffer(struct httpd_conn* conn, int want, int min, int* len) {
+    if (conn->tx_size - conn->tx_len < want) {
+        int size = conn->tx_len + want;
+        char* tx = realloc(conn->tx, size);
+        if (tx == NULL) {
+            printf("[ERR] realloc failed. size:%d\n", size);
+            return NULL;
+        }
+        conn->tx = tx;
+        conn->tx_size = size;
+    }
+
+    *len = want;
+    return conn->tx + conn->tx_len;
+}
+
+void httpd_send_commit(struct httpd_conn* conn, int len) {
+    conn->tx_len += len;
+    conn->last_io = httpd_time();
+}
+
+char* httpd_recv_buffer(struct httpd_conn* conn, int* len) {
+    *len = conn->rx_len;
+    return conn->rx;
+}
+
+void httpd_recv_consume(struct httpd_conn* conn, int len) {
+    if (len <= 0 || len > conn->rx_len)
+        return;
+    memmove(conn->rx, conn->rx + len, conn->rx_len - len);
+    conn->rx_len -= len;
+}
+
+void httpd_close(struct httpd_conn* conn) {
+    conn->close = true;
+}
+
+void httpd_close_after_send(struct httpd_conn* conn) {
+    conn->close_after_send = true;
+}
+
+bool httpd_closing(struct httpd_conn* conn) {
+    return conn->close;
+}
@@ -0,0 +1,18 @@
+#ifndef _HTTPD_HOST_H_
+#define _HTTPD_HOST_H_
+
+#include "httpd.h"
+
+/*
+ * An in-memory transport behind httpd.h. The benchmark plays the
+ * controller: what it passes to httpd_host_recv goes through the recv op
+ * as if it came off a socket, and what hap.c sends is collected until
+ * httpd_host_sent_clear.
+ */
+struct httpd_conn* httpd_host_connect(void* listener);
+void* httpd_host_user_data(struct httpd_conn* conn);
+int httpd_host_recv(struct httpd_conn* conn, const void* data, int len);
+char* httpd_host_sent(struct httpd_conn* conn, int* len);
+void httpd_host_sent_clear(struct httpd_conn* conn);
+
+#endif //#ifndef _HTTPD_HOST_H_
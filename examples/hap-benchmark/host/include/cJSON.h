@@ -0,0 +1,2 @@
+#pragma once
+/* hap_internal.h includes it, nothing the benchmarks build uses cJSON */
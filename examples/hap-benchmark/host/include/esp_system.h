@@ -0,0 +1,3 @@
+#pragma once
+#include <stdint.h>
+void esp_fill_random(void* buf, int len);
@@ -0,0 +1,25 @@
+#pragma once
+/* what the benchmarked sources use of FreeRTOS, everything runs on one thread */
+#include <stdint.h>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+typedef void* QueueHandle_t;
+typedef void* TaskHandle_t;
+
+#define pdTRUE              1
+#define pdFALSE             0
+#define pdPASS              1
+#define portMAX_DELAY       0xffffffff
+#define pdMS_TO_TICKS(ms)   (ms)
+#define tskIDLE_PRIORITY    0
+#define IRAM_ATTR
+
+typedef struct { int unused; } portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED    {0}
+#define portENTER_CRITICAL(mux)         (void)(mux)
+#define portEXIT_CRITICAL(mux)          (void)(mux)
+#define portENTER_CRITICAL_ISR(mux)     (void)(mux)
+#define portEXIT_CRITICAL_ISR(mux)      (void)(mux)
+#define portYIELD_FROM_ISR()            do {} while (0)
@@ -0,0 +1,3 @@
+#pragma once
+/* only the key size for hkdf.h, the fast AEAD doesn't need wolfCrypt */
+#define CHACHA20_POLY1305_AEAD_KEYSIZE 32
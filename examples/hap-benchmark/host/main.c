@@ -0,0 +1,489 @@
+/*
+ * The HAP hot paths that build without wolfSSL, on the build host: TLV and
+ * JSON, the accessory database and characteristic requests, the built-in
+ * ChaCha20-Poly1305 and the framing of encrypted sessions in hap.c.
+ * The transport is kept in memory, see httpd_host.c, and the session is
+ * verified by hand, so no controller and no pairing is needed.
+ * Allocations are counted through the --wrap of malloc, calloc and
+ * realloc, see stubs.c. The numbers only compare builds on the same
+ * host, the device runs ../main, which also times pair-verify as that
+ * needs wolfSSL. A self test of the cipher runs first, the exit status is not 0
+ * when it or any benchmark failed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_timer.h"
+
+#include "hap.h"
+#include "hap_internal.h"
+#include "accessories.h"
+#include "chacha20_poly1305.h"
+#include "httpd_host.h"
+#include "json.h"
+#include "stubs.h"
+#include "tlv.h"
+
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
+
+#define ACCESSORY_ID    "B3:1C:4E:00:00:01"
+
+#define RESPONSE_HEADER_LENGTH  128
+#define RESPONSE_BODY_LENGTH    1024
+
+/* iids follow the order the services and characteristics are added in */
+#define GET_QUERY       "id=1.9,1.10,1.11,1.12,1.14"
+#define PUT_BODY        "{\"characteristics\":[{\"aid\":1,\"iid\":9,\"value\":true},{\"aid\":1,\"iid\":10,\"value\":75}]}"
+#define SUBSCRIBE_BODY  "{\"characteristics\":[{\"aid\":1,\"iid\":9,\"ev\":true}]}"
+
+#define GET_REQUEST     "GET /characteristics?" GET_QUERY " HTTP/1.1\r\nHost: benchmark\r\n\r\n"
+#define ACCESSORIES_REQUEST "GET /accessories HTTP/1.1\r\nHost: benchmark\r\n\r\n"
+#define NR_PIPELINED    4
+
+#define AAD_LENGTH      2
+#define FRAME_LENGTH    1024
+#define FRAME_SIZE      (AAD_LENGTH + FRAME_LENGTH + CHACHA20_POLY1305_AUTH_TAG_LENGTH)
+
+#define TLV_ITEM_LENGTH 384
+
+static struct hap_accessory* acc;
+static struct httpd_conn* conn;
+static struct hap_connection* session;
+
+static char res_header[RESPONSE_HEADER_LENGTH];
+static char res_body[RESPONSE_BODY_LENGTH];
+static char req_body[RESPONSE_BODY_LENGTH];
+
+static bool on;
+static int brightness = 50;
+static void* on_ev;
+
+static uint8_t frame[FRAME_SIZE];
+static uint64_t frame_count;
+
+static uint8_t tlv_item[TLV_ITEM_LENGTH];
+static uint8_t tlv_msg[TLV_ITEM_LENGTH + 64];
+static int tlv_msg_len;
+
+/* controller side requests, encrypted once with the session counter from 0 */
+static struct {
+    uint8_t msg[NR_PIPELINED * (AAD_LENGTH + sizeof(GET_REQUEST) + CHACHA20_POLY1305_AUTH_TAG_LENGTH)];
+    int len;
+} get_frames, pipelined_frames, accessories_frames;
+
+static void* _on_read(void* arg)
+{
+    return (void*)on;
+}
+
+static void _on_write(void* arg, void* value, int len)
+{
+    on = (bool)value;
+}
+
+static void _on_event(void* arg, void* ev_handle, bool enable)
+{
+    on_ev = enable ? ev_handle : NULL;
+}
+
+static void* _brightness_read(void* arg)
+{
+    return (void*)(intptr_t)brightness;
+}
+
+static void _brightness_write(void* arg, void* value, int len)
+{
+    brightness = (intptr_t)value;
+}
+
+static void* _temperature_read(void* arg)
+{
+    return (void*)2150;
+}
+
+static void hap_object_init(void* arg)
+{
+    void* accessory_object = hap_accessory_add(acc);
+
+    struct hap_characteristic information[] = {
+        {HAP_CHARACTER_IDENTIFY, (void*)true, NULL, NULL, NULL, NULL},
+        {HAP_CHARACTER_MANUFACTURER, (void*)"BENCHMARK", NULL, NULL, NULL, NULL},
+        {HAP_CHARACTER_MODEL, (void*)"HOST_ACC", NULL, NULL, NULL, NULL},
+        {HAP_CHARACTER_NAME, (void*)"BENCHMARK", NULL, NULL, NULL, NULL},
+        {HAP_CHARACTER_SERIAL_NUMBER, (void*)"0123456789", NULL, NULL, NULL, NULL},
+        {HAP_CHARACTER_FIRMWARE_REVISION, (void*)"1.0", NULL, NULL, NULL, NULL},
+    };
+    hap_service_and_characteristics_add(acc, accessory_object, HAP_SERVICE_ACCESSORY_INFORMATION, information, ARRAY_SIZE(information));
+
+    struct hap_characteristic lightbulb[] = {
+        {HAP_CHARACTER_ON, (void*)false, NULL, _on_read, _on_write, _on_event},
+        {HAP_CHARACTER_BRIGHTNESS, (void*)50, NULL, _brightness_read, _brightness_write, NULL},
+        {HAP_CHARACTER_HUE, (void*)0, NULL, NULL, NULL, NULL},
+        {HAP_CHARACTER_SATURATION, (void*)0, NULL, NULL, NULL, NULL},
+    };
+    hap_service_and_characteristics_add(acc, accessory_object, HAP_SERVICE_LIGHTBULB, lightbulb, ARRAY_SIZE(lightbulb));
+
+    struct hap_characteristic thermometer[] = {
+        {HAP_CHARACTER_CURRENT_TEMPERATURE, (void*)2150, NULL, _temperature_read, NULL, NULL},
+    };
+    hap_service_and_characteristics_add(acc, accessory_object, HAP_SERVICE_TEMPERATURE_SENSOR, thermometer, ARRAY_SIZE(thermometer));
+}
+
+/* RFC 8439 section 2.8.2 */
+static int _aead_self_test(void)
+{
+    static const char plain_text[] = "Ladies and Gentlemen of the class of '99: "
+        "If I could offer you only one tip for the future, sunscreen would be it.";
+    static const uint8_t cipher_text[] = {
+        0xd3, 0x1a, 0x8d, 0x34, 0x64, 0x8e, 0x60, 0xdb, 0x7b, 0x86, 0xaf, 0xbc, 0x53, 0xef, 0x7e, 0xc2,
+        0xa4, 0xad, 0xed, 0x51, 0x29, 0x6e, 0x08, 0xfe, 0xa9, 0xe2, 0xb5, 0xa7, 0x36, 0xee, 0x62, 0xd6,
+        0x3d, 0xbe, 0xa4, 0x5e, 0x8c, 0xa9, 0x67, 0x12, 0x82, 0xfa, 0xfb, 0x69, 0xda, 0x92, 0x72, 0x8b,
+        0x1a, 0x71, 0xde, 0x0a, 0x9e, 0x06, 0x0b, 0x29, 0x05, 0xd6, 0xa5, 0xb6, 0x7e, 0xcd, 0x3b, 0x36,
+        0x92, 0xdd, 0xbd, 0x7f, 0x2d, 0x77, 0x8b, 0x8c, 0x98, 0x03, 0xae, 0xe3, 0x28, 0x09, 0x1b, 0x58,
+        0xfa, 0xb3, 0x24, 0xe4, 0xfa, 0xd6, 0x75, 0x94, 0x55, 0x85, 0x80, 0x8b, 0x48, 0x31, 0xd7, 0xbc,
+        0x3f, 0xf4, 0xde, 0xf0, 0x8e, 0x4b, 0x7a, 0x9d, 0xe5, 0x76, 0xd2, 0x65, 0x86, 0xce, 0xc6, 0x4b,
+        0x61, 0x16,
+        /* tag */
+        0x1a, 0xe1, 0x0b, 0x59, 0x4f, 0x09, 0xe2, 0x6a, 0x7e, 0x90, 0x2e, 0xcb, 0xd0, 0x60, 0x06, 0x91,
+    };
+    uint8_t aad[] = {0x50, 0x51, 0x52, 0x53, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7};
+    uint8_t nonce[] = {0x07, 0x00, 0x00, 0x00, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47};
+    uint8_t key[32];
+    for (int i=0; i<sizeof(key); i++)
+        key[i] = 0x80 + i;
+
+    int len = sizeof(plain_text) - 1;
+    uint8_t encrypted[sizeof(cipher_text)];
+    uint8_t decrypted[sizeof(plain_text)];
+
+    if (chacha20_poly1305_encrypt_with_nonce(nonce, key, aad, sizeof(aad),
+                (uint8_t*)plain_text, len, encrypted) < 0 ||
+            memcmp(encrypted, cipher_text, sizeof(cipher_text)) != 0) {
+        printf("[BENCHMARK] RFC 8439 encrypt mismatch\n");
+        return -1;
+    }
+
+    if (chacha20_poly1305_decrypt_with_nonce(nonce, key, aad, sizeof(aad),
+                encrypted, sizeof(encrypted), decrypted) < 0 ||
+            memcmp(decrypted, plain_text, len) != 0) {
+        printf("[BENCHMARK] RFC 8439 decrypt mismatch\n");
+        return -1;
+    }
+
+    /* a flipped bit has to fail the tag */
+    encrypted[0] ^= 1;
+    if (chacha20_poly1305_decrypt_with_nonce(nonce, key, aad, sizeof(aad),
+                encrypted, sizeof(encrypted), decrypted) == 0) {
+        printf("[BENCHMARK] RFC 8439 forgery accepted\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int _tlv_encode(void)
+{
+    uint8_t state[] = {3};
+    struct tlv_writer writer;
+    tlv_writer_init(&writer, tlv_msg, sizeof(tlv_msg));
+    tlv_writer_put(&writer, HAP_TLV_TYPE_STATE, sizeof(state), state);
+    /* longer than an item, it is split into fragments */
+    if (tlv_writer_put(&writer, HAP_TLV_TYPE_ENCRYPTED_DATA, sizeof(tlv_item), tlv_item) < 0)
+        return -1;
+
+    tlv_msg_len = writer.len;
+    return 0;
+}
+
+static int _tlv_decode(void)
+{
+    struct tlv_reader reader;
+    if (tlv_reader_init(&reader, tlv_msg, tlv_msg_len) < 0)
+        return -1;
+
+    const struct tlv_item* item = tlv_reader_get(&reader, HAP_TLV_TYPE_ENCRYPTED_DATA);
+    int err = (item && item->length == sizeof(tlv_item)) ? 0 : -1;
+    tlv_reader_free(&reader);
+    return err;
+}
+
+static int _json_write(void)
+{
+    struct json json;
+    json_init(&json, res_body, sizeof(res_body));
+    json_literal(&json, "{\"characteristics\":[");
+    for (int i=0; i<16; i++) {
+        if (i)
+            json_literal(&json, ",");
+        json_literal(&json, "{\"aid\":");
+        json_int(&json, 1);
+        json_literal(&json, ",\"iid\":");
+        json_int(&json, 9 + i);
+        json_literal(&json, ",\"value\":");
+        json_float(&json, 21.5f + i);
+        json_literal(&json, "}");
+    }
+    json_literal(&json, "]}");
+
+    return json.len < json.size ? 0 : -1;
+}
+
+static int _json_read(void)
+{
+    int len = strlen(PUT_BODY);
+    memcpy(req_body, PUT_BODY, len);
+
+    struct json_reader reader;
+    json_reader_init(&reader, req_body, len);
+
+    struct json_token token;
+    int nr_tokens = 0;
+    enum json_type type;
+    while ((type = json_read(&reader, &token)) != JSON_END) {
+        if (type == JSON_ERROR)
+            return -1;
+        nr_tokens++;
+    }
+
+    return nr_tokens ? 0 : -1;
+}
+
+static int _accessories(void)
+{
+    int header_len = sizeof(res_header);
+    char* body = NULL;
+    int body_len = 0;
+
+    int err = hap_acc_accessories_do(acc, res_header, &header_len, &body, &body_len);
+    hap_acc_accessories_do_free(body);
+    return err;
+}
+
+/* the database is built from scratch, not copied from the cached text */
+static int _accessories_build(void)
+{
+    hap_acc_accessories_invalidate(acc);
+    return _accessories();
+}
+
+static int _characteristics_get(void)
+{
+    int header_len = sizeof(res_header);
+    char* body = res_body;
+    int body_len = sizeof(res_body);
+    char query[] = GET_QUERY;
+
+    int err = hap_acc_characteristic_get(acc, session, query, strlen(query), res_header, &header_len, &body, &body_len);
+    if (body != res_body)
+        free(body);
+    return err;
+}
+
+static int _characteristics_put(void)
+{
+    int header_len = sizeof(res_header);
+
+    /* parsing decodes strings in place */
+    int len = strlen(PUT_BODY);
+    memcpy(req_body, PUT_BODY, len);
+
+    return hap_acc_characteristic_put(acc, session, req_body, len, res_header, &header_len);
+}
+
+static int _event(void)
+{
+    int header_len = sizeof(res_header);
+    int body_len = sizeof(res_body);
+
+    union hap_value value = { .b = !on };
+    on = value.b;
+    hap_acc_event_post(acc, on_ev, &value);
+    if (hap_acc_event_collect(acc) == 0)
+        return -1;
+
+    return hap_acc_event_response(acc, session, res_header, &header_len, res_body, &body_len);
+}
+
+static int _frame_encrypt(void)
+{
+    uint8_t key[HKDF_KEY_LEN] = {0,};
+
+    frame[0] = FRAME_LENGTH % 256;
+    frame[1] = FRAME_LENGTH / 256;
+    return chacha20_poly1305_encrypt_frames(key, &frame_count, frame, sizeof(frame));
+}
+
+/* decrypts a copy, the frame stays as it was encrypted */
+static int _frame_decrypt(void)
+{
+    static uint8_t plain_text[FRAME_LENGTH];
+    uint8_t key[HKDF_KEY_LEN] = {0,};
+    uint8_t nonce[CHACHA20_POLY1305_NONCE_LENGTH];
+    chacha20_poly1305_counter_nonce(nonce, frame_count - 1);
+
+    return chacha20_poly1305_decrypt_with_nonce(nonce, key, frame, AAD_LENGTH, frame + AAD_LENGTH,
+            FRAME_LENGTH + CHACHA20_POLY1305_AUTH_TAG_LENGTH, plain_text);
+}
+
+/* one frame per request, as a controller writes them */
+static void _requests_encrypt(const char* request, int nr_requests, uint8_t* msg, int* msg_len)
+{
+    int len = strlen(request);
+    uint64_t count = 0;
+
+    *msg_len = 0;
+    for (int i=0; i<nr_requests; i++) {
+        uint8_t* f = msg + *msg_len;
+        f[0] = len % 256;
+        f[1] = len / 256;
+        memcpy(f + AAD_LENGTH, request, len);
+        *msg_len += AAD_LENGTH + len + CHACHA20_POLY1305_AUTH_TAG_LENGTH;
+    }
+    chacha20_poly1305_encrypt_frames(session->decrypt_key, &count, msg, *msg_len);
+}
+
+/* the first frame of the response has to open with a success status */
+static int _response_check(void)
+{
+    int len;
+    uint8_t* sent = (uint8_t*)httpd_host_sent(session->nc, &len);
+    if (len < AAD_LENGTH)
+        return -1;
+
+    int plain_len = sent[1] * 256 + sent[0];
+    if (len < AAD_LENGTH + plain_len + CHACHA20_POLY1305_AUTH_TAG_LENGTH)
+        return -1;
+
+    static char plain_text[FRAME_LENGTH + 1];
+    uint8_t nonce[CHACHA20_POLY1305_NONCE_LENGTH];
+    chacha20_poly1305_counter_nonce(nonce, 0);
+    if (chacha20_poly1305_decrypt_with_nonce(nonce, session->encrypt_key, sent, AAD_LENGTH,
+                sent + AAD_LENGTH, plain_len + CHACHA20_POLY1305_AUTH_TAG_LENGTH, (uint8_t*)plain_text) < 0)
+        return -1;
+
+    plain_text[plain_len] = 0;
+    return strncmp(plain_text, "HTTP/1.1 200", 12) == 0 ? 0 : -1;
+}
+
+/* through the recv op: decrypt, parse, serve, encrypt into the send buffer */
+static int _framed(const uint8_t* msg, int len)
+{
+    session->decrypt_count = 0;
+    session->encrypt_count = 0;
+    httpd_host_sent_clear(session->nc);
+
+    if (httpd_host_recv(session->nc, msg, len) < 0)
+        return -1;
+
+    return _response_check();
+}
+
+static int _framed_get(void)
+{
+    return _framed(get_frames.msg, get_frames.len);
+}
+
+static int _framed_pipelined(void)
+{
+    return _framed(pipelined_frames.msg, pipelined_frames.len);
+}
+
+static int _framed_accessories(void)
+{
+    return _framed(accessories_frames.msg, accessories_frames.len);
+}
+
+static int nr_failed;
+
+static void _run(const char* name, int (*op)(void), int rounds)
+{
+    /* a first call to fill caches and lazily built state */
+    if (op() < 0) {
+        printf("[BENCHMARK] %-20s failed\n", name);
+        nr_failed++;
+        return;
+    }
+
+    int allocs = stubs_nr_allocs();
+    op();
+    allocs = stubs_nr_allocs() - allocs;
+
+    int64_t start = esp_timer_get_time();
+    for (int i=0; i<rounds; i++)
+        op();
+    int64_t us = esp_timer_get_time() - start;
+    if (us == 0)
+        us = 1;
+
+    printf("[BENCHMARK] %-20s %8lld ops/s %8.2f us/op %4d allocs/op\n",
+            name, (long long)((int64_t)rounds * 1000000 / us), (double)us / rounds, allocs);
+}
+
+static int _session_open(void)
+{
+    if (hap_accessory_start(acc) < 0)
+        return -1;
+
+    conn = httpd_host_connect(acc->bind);
+    if (conn == NULL)
+        return -1;
+
+    /* keys of the controller side are the same, only swapped */
+    session = httpd_host_user_data(conn);
+    memset(session->decrypt_key, 0x11, sizeof(session->decrypt_key));
+    memset(session->encrypt_key, 0x22, sizeof(session->encrypt_key));
+    session->pair_verified = true;
+
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    int rounds = (argc > 1) ? atoi(argv[1]) : 10000;
+    if (rounds <= 0)
+        rounds = 1;
+
+    if (_aead_self_test() < 0)
+        return 1;
+
+    hap_init();
+
+    hap_accessory_callback_t callback;
+    callback.hap_object_init = hap_object_init;
+    acc = hap_accessory_prepare("BENCHMARK", ACCESSORY_ID, "053-58-197", "BENCHMARK",
+            HAP_ACCESSORY_CATEGORY_LIGHTBULB, 811, 1, NULL, &callback);
+    if (acc == NULL || _session_open() < 0) {
+        printf("[BENCHMARK] accessory setup failed\n");
+        return 1;
+    }
+
+    int len = strlen(SUBSCRIBE_BODY);
+    int header_len = sizeof(res_header);
+    _accessories();
+    memcpy(req_body, SUBSCRIBE_BODY, len);
+    hap_acc_characteristic_put(acc, session, req_body, len, res_header, &header_len);
+
+    for (int i=0; i<TLV_ITEM_LENGTH; i++)
+        tlv_item[i] = i;
+    _requests_encrypt(GET_REQUEST, 1, get_frames.msg, &get_frames.len);
+    _requests_encrypt(GET_REQUEST, NR_PIPELINED, pipelined_frames.msg, &pipelined_frames.len);
+    _requests_encrypt(ACCESSORIES_REQUEST, 1, accessories_frames.msg, &accessories_frames.len);
+
+    _run("tlv encode", _tlv_encode, rounds);
+    _run("tlv decode", _tlv_decode, rounds);
+    _run("json write", _json_write, rounds);
+    _run("json read", _json_read, rounds);
+    _run("/accessories", _accessories, rounds);
+    _run("/accessories build", _accessories_build, rounds / 10);
+    _run("GET 5 ids", _characteristics_get, rounds);
+    _run("PUT 2 values", _characteristics_put, rounds);
+    _run("event", _event, rounds);
+    _run("encrypt 1024 B", _frame_encrypt, rounds);
+    _run("decrypt 1024 B", _frame_decrypt, rounds);
+    _run("framed GET", _framed_get, rounds);
+    _run("framed GET x4", _framed_pipelined, rounds);
+    _run("framed /accessories", _framed_accessories, rounds / 10);
+
+    return nr_failed ? 1 : 0;
+}
@@ -0,0 +1,294 @@
+/*
+ * What the benchmarked sources link against besides each other: FreeRTOS
+ * and ESP-IDF functions on top of libc, and the modules that need wolfCrypt
+ * or flash. None of them is on a benchmarked path, they only let
+ * hap.c and accessories.c link and an accessory be prepared.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+
+#include "advertise.h"
+#include "ed25519.h"
+#include "hkdf.h"
+#include "iosdevice.h"
+#include "logger.h"
+#include "nvs.h"
+#include "pair_setup.h"
+#include "pair_verify.h"
+#include "pairings.h"
+#include "stubs.h"
+#include "worker.h"
+
+/* counted like heap tracing counts them on the device */
+static int nr_allocs;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size)
+{
+    nr_allocs++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t nmemb, size_t size)
+{
+    nr_allocs++;
+    return __real_calloc(nmemb, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+    nr_allocs++;
+    return __real_realloc(ptr, size);
+}
+
+int stubs_nr_allocs(void)
+{
+    return nr_allocs;
+}
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+void esp_fill_random(void* buf, int len)
+{
+    uint8_t* p = buf;
+    for (int i=0; i<len; i++)
+        p[i] = rand();
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+}
+
+/* a ring of fixed size items, nothing ever waits on it */
+struct queue {
+    int length;
+    int item_size;
+    int head;
+    int nr_items;
+    uint8_t items[];
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    struct queue* q = calloc(1, sizeof(struct queue) + length * item_size);
+    if (q == NULL)
+        return NULL;
+
+    q->length = length;
+    q->item_size = item_size;
+    return q;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void* item, TickType_t wait)
+{
+    struct queue* q = queue;
+    if (q->nr_items == q->length)
+        return pdFALSE;
+
+    int tail = (q->head + q->nr_items++) % q->length;
+    memcpy(q->items + tail * q->item_size, item, q->item_size);
+    return pdTRUE;
+}
+
+BaseType_t xQueueSendFromISR(QueueHandle_t queue, const void* item, BaseType_t* woken)
+{
+    return xQueueSend(queue, item, 0);
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t wait)
+{
+    struct queue* q = queue;
+    if (q->nr_items == 0)
+        return pdFALSE;
+
+    memcpy(item, q->items + q->head * q->item_size, q->item_size);
+    q->head = (q->head + 1) % q->length;
+    q->nr_items--;
+    return pdTRUE;
+}
+
+/* built with LOGGER_LEVEL 0, no record is ever written */
+int logger_init(void)
+{
+    return 0;
+}
+
+void logger_write(int level, const char* tag, const char* fmt,
+        uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
+{
+}
+
+/* pairing jobs are refused, hap.c answers them as failed */
+int worker_init(void (*notify)(void))
+{
+    return 0;
+}
+
+int worker_submit(void (*work)(void* arg), void (*done)(void* arg), void* arg)
+{
+    return -1;
+}
+
+int worker_submit_background(void (*work)(void* arg), void (*done)(void* arg), void* arg)
+{
+    return -1;
+}
+
+void worker_complete(void)
+{
+}
+
+void* advertise_accessory_add(char* name, char* id, char* host, int port, uint32_t config_number,
+        enum hap_accessory_category category, enum advertise_accessory_state state)
+{
+    static int advertise;
+    return &advertise;
+}
+
+void advertise_accessory_remove(void* adv_instance)
+{
+}
+
+void advertise_accessory_state_set(void* adv_instance, enum advertise_accessory_state state)
+{
+}
+
+void advertise_accessory_config_number_set(void* adv_instance, uint32_t config_number)
+{
+}
+
+/* nothing is stored, the accessory gets a new key on every run */
+int nvs_get(char* key, uint8_t* value, int len)
+{
+    return 0;
+}
+
+int nvs_set(char* key, uint8_t* value, int len)
+{
+    return 0;
+}
+
+int nvs_erase(char* key)
+{
+    return 0;
+}
+
+int ed25519_key_generate(uint8_t public_key[], uint8_t private_key[])
+{
+    memset(public_key, 0, ED25519_PUBLIC_KEY_LENGTH);
+    memset(private_key, 0, ED28819_PRIVATE_KEY_LENGTH);
+    return 0;
+}
+
+void* ed25519_key_create(uint8_t public_key[], uint8_t private_key[])
+{
+    static int key;
+    return &key;
+}
+
+void ed25519_key_free(void* key)
+{
+}
+
+int hkdf_key_get(enum hkdf_key_type type, uint8_t* inkey, int inkey_len, uint8_t* outkey)
+{
+    return -1;
+}
+
+/* no controller is paired, the session in main.c is verified by hand */
+void* iosdevice_pairings_init(char accessory_id[])
+{
+    static int pairings;
+    return &pairings;
+}
+
+void iosdevice_pairings_cleanup(void* handle)
+{
+}
+
+int iosdevice_pairings_foreach(void* handle,
+        void (*fn)(void* arg, const struct iosdevice* idevice), void* arg)
+{
+    return 0;
+}
+
+int iosdevice_pairings_commit(void* handle, bool force)
+{
+    return 0;
+}
+
+void* pair_setup_init(char* acc_id, char* setup_code, void* iosdevices, uint8_t* public_key, void* ltk)
+{
+    return NULL;
+}
+
+void pair_setup_cleanup(void* _ps)
+{
+}
+
+int pair_setup_admit(void* _ps, const char* req_body, int req_body_len,
+        char* res_header, int* res_header_len, char** res_body, int* res_body_len)
+{
+    return -1;
+}
+
+int pair_setup_do(void* _ps, const char* req_body, int req_body_len,
+        char* res_header, int* res_header_len, char** res_body, int* res_body_len)
+{
+    return -1;
+}
+
+void pair_setup_done(void* _ps)
+{
+}
+
+void pair_setup_do_free(char* res_body)
+{
+}
+
+void* pair_verify_init(char* acc_id, void* iosdevices, uint8_t* public_key, void* ltk)
+{
+    return NULL;
+}
+
+void pair_verify_cleanup(void* _pv)
+{
+}
+
+int pair_verify_do(void* pair_verify, const char* req_body, int req_body_len,
+        char* res_header, int* res_header_len, char** res_body, int* res_body_len,
+        bool* verified, char* session_key, char* controller_id)
+{
+    return -1;
+}
+
+void pair_verify_do_free(char* res_body)
+{
+}
+
+int pairings_do(void* iosdevices, const char* controller_id, const char* req_body, int req_body_len,
+        char* res_header, int* res_header_len, char** res_body, int* res_body_len)
+{
+    return -1;
+}
+
+void pairings_do_free(char* res_body)
+{
+}
@@ -0,0 +1,18 @@
+#ifndef _STUBS_H_
+#define _STUBS_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The benchmark is linked with --wrap for malloc, calloc and realloc, so
+ * stubs.c sees every allocation made. Returns how many were made so far.
+ */
+int stubs_nr_allocs(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //#ifndef _STUBS_H_
@@ -0,0 +1,2 @@
+# the benchmarked code is internal to the homekit component
+CFLAGS += -I$(PROJECT_PATH)/../../src -I$(PROJECT_PATH)/../../wolfssl
@@ -0,0 +1,375 @@
+/*
+ * Benchmarks of the HAP hot paths. They run against an accessory that is
+ * prepared but never started, with a session that has no socket, so neither
+ * Wi-Fi nor a controller is needed. Compare the numbers before and after a
+ * change. With CONFIG_HEAP_TRACING the allocations of one operation are
+ * counted as well.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "nvs_flash.h"
+#ifdef CONFIG_HEAP_TRACING
+#include "esp_heap_trace.h"
+#endif
+
+#include "hap.h"
+#include "hap_internal.h"
+#include "accessories.h"
+#include "chacha20_poly1305.h"
+#include "iosdevice.h"
+#include "pair_verify.h"
+#include "tlv.h"
+
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
+
+#define ACCESSORY_ID    "B3:1C:4E:00:00:01"
+#define CONTROLLER_ID   "BE1C4E00-0000-4000-8000-000000000001"
+
+#define RESPONSE_HEADER_LENGTH  128
+#define RESPONSE_BODY_LENGTH    1024
+
+/* iids follow the order the services and characteristics are added in */
+#define GET_QUERY       "id=1.9,1.10,1.11,1.12,1.14"
+#define PUT_BODY        "{\"characteristics\":[{\"aid\":1,\"iid\":9,\"value\":true},{\"aid\":1,\"iid\":10,\"value\":75}]}"
+#define SUBSCRIBE_BODY  "{\"characteristics\":[{\"aid\":1,\"iid\":9,\"ev\":true}]}"
+
+#define FRAME_LENGTH    1024
+#define FRAME_SIZE      (2 + FRAME_LENGTH + CHACHA20_POLY1305_AUTH_TAG_LENGTH)
+
+#ifdef CONFIG_HEAP_TRACING
+#define NR_HEAP_RECORDS 64
+static heap_trace_record_t heap_records[NR_HEAP_RECORDS];
+#endif
+
+static struct hap_accessory* acc;
+static struct hap_connection* session;
+
+static char res_header[RESPONSE_HEADER_LENGTH];
+static char res_body[RESPONSE_BODY_LENGTH];
+static char req_body[RESPONSE_BODY_LENGTH];
+
+static bool on;
+static int brightness = 50;
+static void* on_ev;
+
+static uint8_t frame[FRAME_SIZE];
+static uint64_t frame_count;
+
+static struct {
+    uint8_t public[ED25519_PUBLIC_KEY_LENGTH];
+    uint8_t private[ED28819_PRIVATE_KEY_LENGTH];
+} controller;
+
+static void* _on_read(void* arg)
+{
+    return (void*)on;
+}
+
+static void _on_write(void* arg, void* value, int len)
+{
+    on = (bool)value;
+}
+
+static void _on_event(void* arg, void* ev_handle, bool enable)
+{
+    on_ev = enable ? ev_handle : NULL;
+}
+
+static void* _brightness_read(void* arg)
+{
+    return (void*)brightness;
+}
+
+static void _brightness_write(void* arg, void* value, int len)
+{
+    brightness = (int)value;
+}
+
+static void* _temperature_read(void* arg)
+{
+    return (void*)2150;
+}
+
+static void hap_object_init(void* arg)
+{
+    void* accessory_object = hap_accessory_add(acc);
+
+    struct hap_characteristic information[] = {
+        {HAP_CHARACTER_IDENTIFY, (void*)true, NULL, NULL, NULL, NULL},
+        {HAP_CHARACTER_MANUFACTURER, (void*)"BENCHMARK", NULL, NULL, NULL, NULL},
+        {HAP_CHARACTER_MODEL, (void*)"ESP32_ACC", NULL, NULL, NULL, NULL},
+        {HAP_CHARACTER_NAME, (void*)"BENCHMARK", NULL, NULL, NULL, NULL},
+        {HAP_CHARACTER_SERIAL_NUMBER, (void*)"0123456789", NULL, NULL, NULL, NULL},
+        {HAP_CHARACTER_FIRMWARE_REVISION, (void*)"1.0", NULL, NULL, NULL, NULL},
+    };
+    hap_service_and_characteristics_add(acc, accessory_object, HAP_SERVICE_ACCESSORY_INFORMATION, information, ARRAY_SIZE(information));
+
+    struct hap_characteristic lightbulb[] = {
+        {HAP_CHARACTER_ON, (void*)false, NULL, _on_read, _on_write, _on_event},
+        {HAP_CHARACTER_BRIGHTNESS, (void*)50, NULL, _brightness_read, _brightness_write, NULL},
+        {HAP_CHARACTER_HUE, (void*)0, NULL, NULL, NULL, NULL},
+        {HAP_CHARACTER_SATURATION, (void*)0, NULL, NULL, NULL, NULL},
+    };
+    hap_service_and_characteristics_add(acc, accessory_object, HAP_SERVICE_LIGHTBULB, lightbulb, ARRAY_SIZE(lightbulb));
+
+    struct hap_characteristic thermometer[] = {
+        {HAP_CHARACTER_CURRENT_TEMPERATURE, (void*)2150, NULL, _temperature_read, NULL, NULL},
+    };
+    hap_service_and_characteristics_add(acc, accessory_object, HAP_SERVICE_TEMPERATURE_SENSOR, thermometer, ARRAY_SIZE(thermometer));
+}
+
+static int _accessories(void)
+{
+    int header_len = sizeof(res_header);
+    char* body = NULL;
+    int body_len = 0;
+
+    int err = hap_acc_accessories_do(acc, res_header, &header_len, &body, &body_len);
+    hap_acc_accessories_do_free(body);
+    return err;
+}
+
+/* the database is built from scratch, not copied from the cached text */
+static int _accessories_build(void)
+{
+    hap_acc_accessories_invalidate(acc);
+    return _accessories();
+}
+
+static int _characteristics_get(void)
+{
+    int header_len = sizeof(res_header);
+    char* body = res_body;
+    int body_len = sizeof(res_body);
+    char query[] = GET_QUERY;
+
+    int err = hap_acc_characteristic_get(acc, session, query, strlen(query), res_header, &header_len, &body, &body_len);
+    if (body != res_body)
+        free(body);
+    return err;
+}
+
+static int _characteristics_put(void)
+{
+    int header_len = sizeof(res_header);
+
+    /* parsing decodes strings in place */
+    int len = strlen(PUT_BODY);
+    memcpy(req_body, PUT_BODY, len);
+
+    return hap_acc_characteristic_put(acc, session, req_body, len, res_header, &header_len);
+}
+
+static int _event(void)
+{
+    int header_len = sizeof(res_header);
+    int body_len = sizeof(res_body);
+
+    union hap_value value = { .b = !on };
+    on = value.b;
+    hap_acc_event_post(acc, on_ev, &value);
+    if (hap_acc_event_collect(acc) == 0)
+        return -1;
+
+    return hap_acc_event_response(acc, session, res_header, &header_len, res_body, &body_len);
+}
+
+static int _frame_encrypt(void)
+{
+    uint8_t key[HKDF_KEY_LEN] = {0,};
+
+    frame[0] = FRAME_LENGTH % 256;
+    frame[1] = FRAME_LENGTH / 256;
+    return chacha20_poly1305_encrypt_frames(key, &frame_count, frame, sizeof(frame));
+}
+
+/* decrypts a copy, the frame stays as it was encrypted */
+static int _frame_decrypt(void)
+{
+    static uint8_t plain_text[FRAME_LENGTH];
+    uint8_t key[HKDF_KEY_LEN] = {0,};
+    uint8_t nonce[CHACHA20_POLY1305_NONCE_LENGTH];
+    chacha20_poly1305_counter_nonce(nonce, frame_count - 1);
+
+    return chacha20_poly1305_decrypt_with_nonce(nonce, key, frame, 2, frame + 2,
+            FRAME_LENGTH + CHACHA20_POLY1305_AUTH_TAG_LENGTH, plain_text);
+}
+
+static int _pair_verify_request(void* pv, const uint8_t* req, int req_len, struct tlv_reader* res, uint8_t** res_msg)
+{
+    int header_len = sizeof(res_header);
+    int res_len = 0;
+    bool verified = false;
+    char session_key[CURVE25519_SECRET_LENGTH];
+    char controller_id[IOSDEVICE_ID_LEN];
+
+    *res_msg = NULL;
+    if (pair_verify_do(pv, (const char*)req, req_len, res_header, &header_len,
+                (char**)res_msg, &res_len, &verified, session_key, controller_id) < 0)
+        return -1;
+
+    return tlv_reader_init(res, *res_msg, res_len);
+}
+
+/*
+ * M1 to M4 with the controller side done here as well. Only pair_verify_do
+ * counts in a controller's view, but both sides share the curve25519 and
+ * chacha20 costs, so the total is what regressions show in.
+ */
+static int _pair_verify(void)
+{
+    int err = -1;
+    uint8_t* m2 = NULL;
+    uint8_t* m4 = NULL;
+    struct tlv_reader reader = {0,};
+    void* pv = pair_verify_init(acc->id, acc->iosdevices, acc->keys.public, acc->keys.ltk);
+    if (pv == NULL)
+        return -1;
+
+    uint8_t curve_public[CURVE25519_KEY_LENGTH];
+    uint8_t curve_private[CURVE25519_KEY_LENGTH];
+    curve25519_key_generate(curve_public, curve_private);
+
+    uint8_t m1[64];
+    uint8_t state[] = {1};
+    struct tlv_writer writer;
+    tlv_writer_init(&writer, m1, sizeof(m1));
+    tlv_writer_put(&writer, HAP_TLV_TYPE_STATE, sizeof(state), state);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_PUBLICKEY, CURVE25519_KEY_LENGTH, curve_public);
+
+    if (_pair_verify_request(pv, m1, writer.len, &reader, &m2) < 0)
+        goto out;
+
+    const struct tlv_item* acc_curve_public = tlv_reader_get(&reader, HAP_TLV_TYPE_PUBLICKEY);
+    if (acc_curve_public == NULL || acc_curve_public->length != CURVE25519_KEY_LENGTH)
+        goto out;
+
+    uint8_t shared[CURVE25519_SECRET_LENGTH];
+    int shared_len = sizeof(shared);
+    curve25519_shared_secret((uint8_t*)acc_curve_public->value, curve_private, shared, &shared_len);
+
+    uint8_t info[CURVE25519_KEY_LENGTH * 2 + sizeof(CONTROLLER_ID) - 1];
+    memcpy(info, curve_public, CURVE25519_KEY_LENGTH);
+    memcpy(info + CURVE25519_KEY_LENGTH, CONTROLLER_ID, sizeof(CONTROLLER_ID) - 1);
+    memcpy(info + CURVE25519_KEY_LENGTH + sizeof(CONTROLLER_ID) - 1, acc_curve_public->value, CURVE25519_KEY_LENGTH);
+
+    uint8_t signature[ED25519_SIGN_LENGTH];
+    int signature_len = sizeof(signature);
+    ed25519_sign(controller.public, controller.private, info, sizeof(info), signature, &signature_len);
+
+    uint8_t subtlv[128];
+    tlv_writer_init(&writer, subtlv, sizeof(subtlv) - CHACHA20_POLY1305_AUTH_TAG_LENGTH);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_IDENTIFIER, sizeof(CONTROLLER_ID) - 1, (uint8_t*)CONTROLLER_ID);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_SIGNATURE, signature_len, signature);
+
+    uint8_t key[HKDF_KEY_LEN];
+    hkdf_key_get(HKDF_KEY_TYPE_PAIR_VERIFY_ENCRYPT, shared, shared_len, key);
+    int subtlv_len = writer.len;
+    chacha20_poly1305_encrypt(CHACHA20_POLY1305_TYPE_PV03, key, NULL, 0, subtlv, subtlv_len, subtlv);
+    subtlv_len += CHACHA20_POLY1305_AUTH_TAG_LENGTH;
+
+    uint8_t m3[192];
+    state[0] = 3;
+    tlv_writer_init(&writer, m3, sizeof(m3));
+    tlv_writer_put(&writer, HAP_TLV_TYPE_STATE, sizeof(state), state);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_ENCRYPTED_DATA, subtlv_len, subtlv);
+
+    tlv_reader_free(&reader);
+    if (_pair_verify_request(pv, m3, writer.len, &reader, &m4) < 0)
+        goto out;
+
+    const struct tlv_item* m4_state = tlv_reader_get(&reader, HAP_TLV_TYPE_STATE);
+    const struct tlv_item* m4_error = tlv_reader_get(&reader, HAP_TLV_TYPE_ERROR);
+    if (m4_state && m4_state->value[0] == 4 && m4_error == NULL)
+        err = 0;
+
+out:
+    tlv_reader_free(&reader);
+    pair_verify_do_free((char*)m2);
+    pair_verify_do_free((char*)m4);
+    pair_verify_cleanup(pv);
+    return err;
+}
+
+static void _run(const char* name, int (*op)(void), int rounds)
+{
+    /* a first call to fill caches and lazily built state */
+    if (op() < 0) {
+        printf("[BENCHMARK] %-20s failed\n", name);
+        return;
+    }
+
+#ifdef CONFIG_HEAP_TRACING
+    heap_trace_start(HEAP_TRACE_ALL);
+    op();
+    heap_trace_stop();
+    int allocs = heap_trace_get_count();
+#endif
+
+    int64_t start = esp_timer_get_time();
+    for (int i=0; i<rounds; i++)
+        op();
+    int64_t us = esp_timer_get_time() - start;
+
+#ifdef CONFIG_HEAP_TRACING
+    printf("[BENCHMARK] %-20s %8lld ops/s %8lld us/op %4d allocs/op\n",
+            name, (int64_t)rounds * 1000000 / us, us / rounds, allocs);
+#else
+    printf("[BENCHMARK] %-20s %8lld ops/s %8lld us/op\n",
+            name, (int64_t)rounds * 1000000 / us, us / rounds);
+#endif
+}
+
+static void benchmark_task(void* arg)
+{
+    _run("/accessories", _accessories, 200);
+    _run("/accessories build", _accessories_build, 50);
+    _run("GET 5 ids", _characteristics_get, 200);
+    _run("PUT 2 values", _characteristics_put, 200);
+    _run("event", _event, 200);
+    _run("encrypt 1024 B", _frame_encrypt, 200);
+    _run("decrypt 1024 B", _frame_decrypt, 200);
+    _run("pair-verify", _pair_verify, 5);
+
+    vTaskDelete(NULL);
+}
+
+void app_main()
+{
+    ESP_ERROR_CHECK(nvs_flash_init());
+#ifdef CONFIG_HEAP_TRACING
+    ESP_ERROR_CHECK(heap_trace_init_standalone(heap_records, NR_HEAP_RECORDS));
+#endif
+
+    hap_init();
+
+    hap_accessory_callback_t callback;
+    callback.hap_object_init = hap_object_init;
+    acc = hap_accessory_prepare("BENCHMARK", ACCESSORY_ID, "053-58-197", "BENCHMARK",
+            HAP_ACCESSORY_CATEGORY_LIGHTBULB, 811, 1, NULL, &callback);
+    if (acc == NULL)
+        return;
+
+    /* a verified session without a socket, the responses are only built */
+    session = calloc(1, sizeof(struct hap_connection));
+    session->a = acc;
+    session->pair_verified = true;
+
+    int len = strlen(SUBSCRIBE_BODY);
+    int header_len = sizeof(res_header);
+    _accessories();
+    memcpy(req_body, SUBSCRIBE_BODY, len);
+    hap_acc_characteristic_put(acc, session, req_body, len, res_header, &header_len);
+
+    /* the pairing is held in memory only, the accessory is never polled to commit it */
+    ed25519_key_generate(controller.public, controller.private);
+    iosdevice_pairings_add(acc->iosdevices, CONTROLLER_ID, (char*)controller.public, IOSDEVICE_PERMISSION_ADMIN);
+
+    xTaskCreate(benchmark_task, "benchmark", 8192, NULL, 5, NULL);
+}
@@ -162,17 +162,6 @@ static esp_err_t event_handler(void *ctx, system_event_t *event)
         ESP_LOGI(TAG, "got ip:%s",
                  ip4addr_ntoa(&event->event_info.got_ip.ip_info.ip));
         xEventGroupSetBits(wifi_event_group, WIFI_CONNECTED_BIT);
-        {
-            hap_init();
-
-            uint8_t mac[6];
-            esp_wifi_get_mac(ESP_IF_WIFI_STA, mac);
-            char accessory_id[32] = {0,};
-            sprintf(accessory_id, "%02X:%02X:%02X:%02X:%02X:%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-            hap_accessory_callback_t callback;
-            callback.hap_object_init = hap_object_init;
-            acc = hap_accessory_register((char*)ACCESSORY_NAME, accessory_id, (char*)"053-58-197", (char*)MANUFACTURER_NAME, HAP_ACCESSORY_CATEGORY_OTHER, 811, 1, NULL, &callback);
-        }
         break;
     case SYSTEM_EVENT_STA_DISCONNECTED:
         esp_wifi_connect();
@@ -216,4 +205,18 @@ extern "C" void app_main()
     xTaskCreate( &temperature_humidity_monitoring_task, "dht22", 4096, NULL, 5, NULL );
 
     wifi_init_sta();
+
+    /* keys and pairings are read while the station associates */
+    hap_init();
+
+    uint8_t mac[6];
+    esp_wifi_get_mac(ESP_IF_WIFI_STA, mac);
+    char accessory_id[32] = {0,};
+    sprintf(accessory_id, "%02X:%02X:%02X:%02X:%02X:%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    hap_accessory_callback_t callback;
+    callback.hap_object_init = hap_object_init;
+    acc = hap_accessory_prepare((char*)ACCESSORY_NAME, accessory_id, (char*)"053-58-197", (char*)MANUFACTURER_NAME, HAP_ACCESSORY_CATEGORY_OTHER, 811, 1, NULL, &callback);
+
+    xEventGroupWaitBits(wifi_event_group, WIFI_CONNECTED_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+    hap_accessory_start(acc);
 }
@@ -180,6 +180,34 @@ enum hap_characteristic_type {
     HAP_CHARACTER_COLOR_TEMPERATURE = 0xCE,
 };
 
+/*
+ * Value of tlv8 and data characteristics.
+ * read, initial_value and events hand out a pointer to one of these, the
+ * bytes are sent base64 encoded and have to stay valid until then, like
+ * strings do. write gets the decoded bytes and their length instead.
+ */
+struct hap_data {
+    const uint8_t* buf;
+    int len;
+};
+
+/*
+ * Typed characteristic value, the member in use follows the format of the
+ * characteristic: b for bool, u for uint8 and uint32, u64 for uint64, i for
+ * int, f for float, s for string and d for tlv8 and data.
+ * Unlike the void* callbacks, floats are kept as they are instead of being
+ * scaled by 100 into an int.
+ */
+union hap_value {
+    bool b;
+    uint32_t u;
+    uint64_t u64;
+    int32_t i;
+    float f;
+    const char* s;
+    struct hap_data d;
+};
+
 struct hap_characteristic {
     enum hap_characteristic_type type;
     void* initial_value;
@@ -204,6 +232,21 @@ struct hap_characteristic_ex {
     bool override_valid_values;
     size_t num_valid_values;
     int* valid_values;
+
+    /* typed callbacks, used instead of base.read and base.write when set */
+    union hap_value (*read_value)(void* arg);
+    void (*write_value)(void* arg, union hap_value value);
+
+    /*
+     * Cache mode. Reads are served from memory and the read callbacks are
+     * never called, the application pushes every change with
+     * hap_event_response or hap_event_value_response instead. That works
+     * without subscribers too, and only a value that differs from the one
+     * held goes out as an event.
+     */
+    bool cached;
+    /* when set, receives the handle of the characteristic to push values on */
+    void** handle;
 };
 
 typedef struct {
@@ -211,15 +254,109 @@ typedef struct {
 } hap_accessory_callback_t;
 
 int hap_event_response(void* acc_instance, void* ev_handle, void* value);
+int hap_event_response_from_isr(void* acc_instance, void* ev_handle, void* value);
+int hap_event_value_response(void* acc_instance, void* ev_handle, union hap_value value);
+int hap_event_value_response_from_isr(void* acc_instance, void* ev_handle, union hap_value value);
+/*
+ * Adds an accessory object, the first one gets aid 1 and each further one
+ * the next aid. A bridge registers with HAP_ACCESSORY_CATEGORY_BRIDGE and
+ * adds every bridged accessory from its hap_object_init, all of them share
+ * the listener, the pairings and the sessions of the bridge. Keep the order
+ * stable and bump config_number when it changes, controllers know them by aid.
+ */
 void* hap_accessory_add(void* acc_instance);
-void hap_service_and_characteristics_add(void* acc_instance, void* accssories_objects,
+/*
+ * Return -1 when the service can't be added, the accessory is then left
+ * as it was.
+ */
+int hap_service_and_characteristics_add(void* acc_instance, void* accssories_objects,
         enum hap_service_type type, struct hap_characteristic* cs, int nr_cs);
-void hap_service_and_characteristics_ex_add(void* acc_instance, void* accssories_objects,
+int hap_service_and_characteristics_ex_add(void* acc_instance, void* accssories_objects,
         enum hap_service_type type, struct hap_characteristic_ex* cs, int nr_cs);
 
+/*
+ * Optional. The writes of one PUT /characteristics are delivered between
+ * begin and commit, so they can be applied to the hardware in one pass.
+ * Both get the callback_arg of hap_accessory_register, begin only comes
+ * before the first write.
+ */
+void hap_accessory_write_batch_set(void* acc_instance, void (*begin)(void* arg), void (*commit)(void* arg));
+
+/*
+ * Call after changing services or characteristics, from hap_object_init like
+ * the changes themselves. Bumps c#, so controllers fetch /accessories again.
+ * Returns the new number, store it and register with it from then on.
+ */
+uint32_t hap_accessory_config_number_bump(void* acc_instance);
+
 void* hap_accessory_register(const char* name, const char* id, const char* pincode, const char* vendor, enum hap_accessory_category category,
                         int port, uint32_t config_number, void* callback_arg, hap_accessory_callback_t* callback);
 
+/*
+ * hap_accessory_register in two stages, to shorten the way back after a power
+ * cut. prepare loads the long term keys and the pairings from flash and needs
+ * no network, call it right after esp_wifi_start() so it runs while the
+ * station associates. start brings up mDNS and the listener, call it once an
+ * IP is assigned. Calling start again after a reconnect does nothing.
+ */
+void* hap_accessory_prepare(const char* name, const char* id, const char* pincode, const char* vendor, enum hap_accessory_category category,
+                        int port, uint32_t config_number, void* callback_arg, hap_accessory_callback_t* callback);
+int hap_accessory_start(void* acc_instance);
+
+/*
+ * Runtime counters, kept with CONFIG_HOMEKIT_METRICS only. Latencies are
+ * collected in buckets that each cover four times the range of the one
+ * before: below 250 us, 1 ms, 4 ms, ... and the last one for the rest.
+ */
+enum hap_metrics_endpoint {
+    HAP_METRICS_PAIR_SETUP,
+    HAP_METRICS_PAIR_VERIFY,
+    HAP_METRICS_ACCESSORIES,
+    HAP_METRICS_CHARACTERISTICS_GET,
+    HAP_METRICS_CHARACTERISTICS_PUT,
+    HAP_METRICS_PAIRINGS,
+    HAP_METRICS_NR_ENDPOINTS,
+};
+
+#define HAP_METRICS_NR_BUCKETS  8
+
+struct hap_metrics_latency {
+    uint32_t count;
+    uint32_t max_us;
+    uint64_t total_us;
+    uint32_t buckets[HAP_METRICS_NR_BUCKETS];
+};
+
+struct hap_metrics {
+    struct hap_metrics_latency requests[HAP_METRICS_NR_ENDPOINTS];
+
+    /* values pushed by the application, and event messages sent to sessions */
+    uint32_t events_posted;
+    uint32_t events_sent;
+
+    uint64_t bytes_encrypted;
+    uint64_t bytes_decrypted;
+    /* spent in ChaCha20-Poly1305 on the session path */
+    uint64_t crypto_us;
+
+    uint32_t sessions;
+    uint32_t sessions_max;
+
+    /* filled in when read */
+    uint32_t heap_free;
+    uint32_t heap_free_min;
+};
+
+/* a consistent copy of the counters, -1 when they are not kept */
+int hap_metrics_get(struct hap_metrics* metrics);
+/* starts the counters over, the session count is kept */
+void hap_metrics_reset(void);
+/*
+ * The counters as JSON text, for a read callback of a characteristic or
+ * the log. Returns the length the text needs like snprintf, -1 when the
+ * counters are not kept.
+ */
+int hap_metrics_json(char* buf, int size);
 
 void hap_init(void);
 
@@ -1,16 +1,63 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <tuple>
+#include <type_traits>
 #include <vector>
 #include <functional>
 #include <math.h>
 
 #include "hap.h"
+#include "hap_characteristics.h"
 
 namespace HAP
 {
 
+/**
+ * @brief Compile time metadata of a characteristic type, from HAP_CHARACTERISTICS.
+ *        Only defined for the known types, so using any other one fails to build.
+ * 
+ * @tparam Type characteristic type
+ */
+template <hap_characteristic_type Type>
+struct characteristic_traits;
+
+#define HAP_CHARACTERISTIC_TRAITS(type, perms_, format_, unit_) \
+    template <> \
+    struct characteristic_traits<type> \
+    { \
+        static constexpr int perms = perms_; \
+        static constexpr hap_format format = format_; \
+        static constexpr hap_unit unit = unit_; \
+    };
+HAP_CHARACTERISTICS(HAP_CHARACTERISTIC_TRAITS)
+#undef HAP_CHARACTERISTIC_TRAITS
+
+/**
+ * @brief C++ type holding values of a format.
+ * 
+ * @tparam Format characteristic format
+ */
+template <hap_format Format> struct format_value;
+template <> struct format_value<HAP_FORMAT_BOOL> { using type = bool; };
+template <> struct format_value<HAP_FORMAT_UINT8> { using type = uint8_t; };
+template <> struct format_value<HAP_FORMAT_UINT32> { using type = uint32_t; };
+template <> struct format_value<HAP_FORMAT_UINT64> { using type = uint64_t; };
+template <> struct format_value<HAP_FORMAT_INT> { using type = int32_t; };
+template <> struct format_value<HAP_FORMAT_FLOAT> { using type = float; };
+template <> struct format_value<HAP_FORMAT_STRING> { using type = std::string; };
+template <> struct format_value<HAP_FORMAT_TLV8> { using type = std::vector<uint8_t>; };
+template <> struct format_value<HAP_FORMAT_DATA> { using type = std::vector<uint8_t>; };
+
+/**
+ * @brief C++ type holding values of a characteristic type.
+ * 
+ * @tparam Type characteristic type
+ */
+template <hap_characteristic_type Type>
+using characteristic_value_t = typename format_value<characteristic_traits<Type>::format>::type;
+
 class Accessory;
 
 class Characteristic
@@ -27,6 +74,12 @@ public:
             return;
         }
 
+        if (is_typed())
+        {
+            value_changed(read_typed());
+            return;
+        }
+
         value_changed(read());
     }
 
@@ -59,9 +112,27 @@ protected:
      */
     void value_changed(void* new_value)
     {
-        if (event_handle)
+        if (void* handle = push_handle())
         {
-            hap_event_response(accessory_handle, event_handle, new_value);
+            hap_event_response(accessory_handle, handle, new_value);
+        }
+
+        for (auto &listener : value_changed_listeners)
+        {
+            if (listener) listener(this);
+        }
+    }
+
+    /**
+     * @brief Same as value_changed(void*), for typed characteristics.
+     * 
+     * @param new_value updated value
+     */
+    void value_changed(hap_value new_value)
+    {
+        if (void* handle = push_handle())
+        {
+            hap_event_value_response(accessory_handle, handle, new_value);
         }
 
         for (auto &listener : value_changed_listeners)
@@ -101,6 +172,37 @@ protected:
      */
     virtual bool canWrite() const = 0;
 
+    /**
+     * @brief Gets a value indicating whether the value is passed as a hap_value.
+     *        read_typed() and write_typed() are then used instead of read() and write().
+     * 
+     * @return true if the characteristic is typed
+     */
+    virtual bool is_typed() const { return false; }
+
+    /**
+     * @brief Gets a value indicating whether reads are served from the value last pushed.
+     *        read() is then only used for the initial value, and every change
+     *        has to be reported through value_changed() or notify().
+     * 
+     * @return true if the characteristic is cached
+     */
+    virtual bool is_cached() const { return false; }
+
+    /**
+     * @brief Gets the current value of a typed characteristic.
+     * 
+     * @return hap_value value
+     */
+    virtual hap_value read_typed() const { return hap_value{}; }
+
+    /**
+     * @brief Writes a new value to a typed characteristic.
+     * 
+     * @param value new value
+     */
+    virtual void write_typed(hap_value value) {}
+
     /**
      * @brief Gets max value information.
      * 
@@ -131,6 +233,8 @@ protected:
     friend void* read_characteristic(void *arg);
     friend void write_characteristic(void *arg, void *value, int len);
     friend void set_characteristic_event_handle(void *arg, void *event_handle, bool enable);
+    friend hap_value read_typed_characteristic(void *arg);
+    friend void write_typed_characteristic(void *arg, hap_value value);
 
     friend Accessory; // Needs to set accessory_handle.
 
@@ -140,13 +244,20 @@ private:
         event_handle = enable ? handle : nullptr;
     }
 
-    hap_characteristic_ex get_characteristic_struct() const;
+    /* cached characteristics push on every change, the others only to subscribers */
+    void* push_handle() const
+    {
+        return is_cached() ? value_handle : event_handle;
+    }
+
+    hap_characteristic_ex get_characteristic_struct();
     static void delete_characteristic_struct_internals(hap_characteristic_ex &cs);
     std::vector<std::function<void(Characteristic*)>> value_changed_listeners {};
 
     const hap_characteristic_type type;
     void* accessory_handle;
     void* event_handle{nullptr};
+    void* value_handle{nullptr};
 };
 
 /**
@@ -194,14 +305,20 @@ protected:
 
     void* read() const override
     {
-        return (void*)(readString().c_str());
+        value = readString();
+        return (void*)value.c_str();
     }
 
     void write(void *value, size_t len) override
     {
-        writeString({ (char*)value });
-        value_changed(value);
+        this->value.assign((char*)value, len);
+        writeString(this->value);
+        value_changed((void*)this->value.c_str());
     }
+
+private:
+    /* keeps the last value alive until it has been sent */
+    mutable std::string value;
 };
 
 /**
@@ -227,6 +344,68 @@ protected:
     bool canWrite() const override { return writeFunction != nullptr; }
 };
 
+/**
+ * @brief Data Characteristic, for the tlv8 and data formats.
+ *        Values are byte buffers and are never treated as strings.
+ * 
+ */
+class DataCharacteristic : public Characteristic
+{
+protected:
+
+    DataCharacteristic(hap_characteristic_type type)
+        : Characteristic{type}
+    {
+    }
+
+    virtual std::vector<uint8_t> readData() const = 0;
+    virtual void writeData(std::vector<uint8_t>) = 0;
+
+    void* read() const override
+    {
+        value = readData();
+        data = { value.data(), static_cast<int>(value.size()) };
+        return (void*)&data;
+    }
+
+    void write(void *value, size_t len) override
+    {
+        auto bytes = static_cast<const uint8_t*>(value);
+        this->value.assign(bytes, bytes + len);
+        data = { this->value.data(), static_cast<int>(this->value.size()) };
+        writeData(this->value);
+        value_changed((void*)&data);
+    }
+
+private:
+    /* keeps the last value alive until it has been sent */
+    mutable std::vector<uint8_t> value;
+    mutable hap_data data;
+};
+
+/**
+ * @brief Functional Data Characteristic
+ * 
+ */
+class DataFunctionCharacteristic : public DataCharacteristic, public FunctionCharacteristic<std::vector<uint8_t>>
+{
+public:
+    DataFunctionCharacteristic(hap_characteristic_type type,
+                               std::function<std::vector<uint8_t>()> readFunction,
+                               std::function<void(std::vector<uint8_t>)> writeFunction)
+        : DataCharacteristic{type},
+          FunctionCharacteristic{readFunction, writeFunction}
+    {
+    }
+
+protected:
+    std::vector<uint8_t> readData() const override { return readFunction(); }
+    void writeData(std::vector<uint8_t> value) override { writeFunction(value); }
+
+    bool canRead() const override { return readFunction != nullptr; }
+    bool canWrite() const override { return writeFunction != nullptr; }
+};
+
 /**
  * @brief Float Characteristic
  * 
@@ -253,6 +432,22 @@ protected:
         value_changed(value);
     }
 
+    /* typed, so floats keep their precision instead of going through an int */
+    bool is_typed() const override { return true; }
+
+    hap_value read_typed() const override
+    {
+        hap_value value{};
+        value.f = readFloat();
+        return value;
+    }
+
+    void write_typed(hap_value value) override
+    {
+        writeFloat(value.f);
+        value_changed(value);
+    }
+
     virtual std::tuple<bool,float> get_max_value_override_float() const
         { return std::make_tuple(false, 0.0f); }
     virtual std::tuple<bool,float> get_min_value_override_float() const
@@ -379,7 +574,154 @@ protected:
     bool canWrite() const override { return writeFunction != nullptr; }
 };
 
+namespace detail
+{
+
+/*
+ * Conversions between the C++ value types and hap_value, or the void*
+ * values of the C API. One overload per type of format_value.
+ */
+inline hap_value to_value(bool v) { hap_value h{}; h.b = v; return h; }
+inline hap_value to_value(uint8_t v) { hap_value h{}; h.u = v; return h; }
+inline hap_value to_value(uint32_t v) { hap_value h{}; h.u = v; return h; }
+inline hap_value to_value(uint64_t v) { hap_value h{}; h.u64 = v; return h; }
+inline hap_value to_value(int32_t v) { hap_value h{}; h.i = v; return h; }
+inline hap_value to_value(float v) { hap_value h{}; h.f = v; return h; }
+inline hap_value to_value(const std::string &v) { hap_value h{}; h.s = v.c_str(); return h; }
+inline hap_value to_value(const std::vector<uint8_t> &v)
+    { hap_value h{}; h.d = { v.data(), static_cast<int>(v.size()) }; return h; }
+
+inline void from_value(hap_value h, bool &v) { v = h.b; }
+inline void from_value(hap_value h, uint8_t &v) { v = h.u; }
+inline void from_value(hap_value h, uint32_t &v) { v = h.u; }
+inline void from_value(hap_value h, uint64_t &v) { v = h.u64; }
+inline void from_value(hap_value h, int32_t &v) { v = h.i; }
+inline void from_value(hap_value h, float &v) { v = h.f; }
+inline void from_value(hap_value h, std::string &v) { v.assign(h.s ? h.s : ""); }
+inline void from_value(hap_value h, std::vector<uint8_t> &v) { v.assign(h.d.buf, h.d.buf + h.d.len); }
+
+/* storage keeps what a void* may point to */
+template <typename T>
+inline void* to_legacy(const T &v, hap_value &storage) { return reinterpret_cast<void*>(static_cast<intptr_t>(v)); }
+inline void* to_legacy(const float &v, hap_value &storage)
+    { return reinterpret_cast<void*>(static_cast<intptr_t>(lroundf(v * 100))); }
+inline void* to_legacy(const std::string &v, hap_value &storage) { return (void*)v.c_str(); }
+inline void* to_legacy(const std::vector<uint8_t> &v, hap_value &storage)
+    { storage = to_value(v); return &storage.d; }
+
+template <typename T>
+inline void from_legacy(void* value, size_t len, T &v) { v = static_cast<T>(reinterpret_cast<intptr_t>(value)); }
+inline void from_legacy(void* value, size_t len, bool &v) { v = value != nullptr; }
+inline void from_legacy(void* value, size_t len, float &v) { v = reinterpret_cast<intptr_t>(value) / 100.0f; }
+inline void from_legacy(void* value, size_t len, std::string &v) { v.assign((char*)value, len); }
+inline void from_legacy(void* value, size_t len, std::vector<uint8_t> &v)
+    { v.assign((uint8_t*)value, (uint8_t*)value + len); }
+
+template <typename F, typename V>
+struct reads_as : std::is_convertible<typename std::result_of<F&()>::type, V> {};
+template <typename V>
+struct reads_as<std::nullptr_t, V> : std::true_type {};
+
+} // namespace detail
+
+/**
+ * @brief Characteristic calling a read and a write callable, stored inline.
+ *        The value type follows from the characteristic type, see characteristic_traits.
+ *        Lambdas and function pointers are kept as they are, nothing is allocated
+ *        besides the value itself for strings and data. Pass nullptr for a
+ *        callable the characteristic doesn't have.
+ * 
+ * @tparam Type characteristic type
+ * @tparam Read callable returning the value
+ * @tparam Write callable taking the value
+ */
+template <hap_characteristic_type Type, typename Read, typename Write = std::nullptr_t>
+class CallableCharacteristic : public Characteristic
+{
+public:
+    using value_type = characteristic_value_t<Type>;
+
+    static_assert(detail::reads_as<Read, value_type>::value,
+                  "read returns a type that doesn't fit the format of the characteristic");
+
+    CallableCharacteristic(Read read, Write write = nullptr)
+        : Characteristic{Type},
+          read_function(read),
+          write_function(write)
+    {
+    }
+
+    /**
+     * @brief Gets the value last read or written.
+     * 
+     * @return const value_type& value, valid until the next read or write
+     */
+    const value_type& value() const { return current; }
+
+protected:
+    using can_read = std::integral_constant<bool, !std::is_same<Read, std::nullptr_t>::value>;
+    using can_write = std::integral_constant<bool, !std::is_same<Write, std::nullptr_t>::value>;
+
+    bool canRead() const override { return can_read::value; }
+    bool canWrite() const override { return can_write::value; }
+    bool is_typed() const override { return true; }
+
+    void* read() const override
+    {
+        call_read(can_read{});
+        return detail::to_legacy(current, storage);
+    }
+
+    void write(void *value, size_t len) override
+    {
+        detail::from_legacy(value, len, current);
+        call_write(can_write{});
+        value_changed(detail::to_value(current));
+    }
+
+    hap_value read_typed() const override
+    {
+        call_read(can_read{});
+        return detail::to_value(current);
+    }
+
+    void write_typed(hap_value value) override
+    {
+        detail::from_value(value, current);
+        call_write(can_write{});
+        value_changed(detail::to_value(current));
+    }
+
+private:
+    void call_read(std::true_type) const { current = read_function(); }
+    void call_read(std::false_type) const {}
+    void call_write(std::true_type) { write_function(current); }
+    void call_write(std::false_type) {}
+
+    mutable Read read_function;
+    Write write_function;
+
+    /* reads return pointers into these, so they outlive the call */
+    mutable value_type current{};
+    mutable hap_value storage{};
+};
+
+/**
+ * @brief Makes a CallableCharacteristic, deducing the callable types.
+ * 
+ * @tparam Type characteristic type
+ * @param read callable returning the value, or nullptr
+ * @param write callable taking the value, or nullptr
+ */
+template <hap_characteristic_type Type, typename Read, typename Write = std::nullptr_t>
+CallableCharacteristic<Type, Read, Write> make_characteristic(Read read, Write write = nullptr)
+{
+    return CallableCharacteristic<Type, Read, Write>{read, write};
+}
+
 void accessory_init(void* arg);
+void accessory_write_begin(void* arg);
+void accessory_write_commit(void* arg);
 
 /**
  * @brief Homekit Accessory Protocol Accessory
@@ -390,10 +732,25 @@ class Accessory
 public:
     /**
      * @brief Call to initialize and register the accessory.
+     *        Same as prepare_accessory() followed by start_accessory().
      * 
      */
     void register_accessory();
 
+    /**
+     * @brief Loads the keys and pairings from flash, needs no network.
+     *        Call right after starting Wi-Fi so it runs while the station associates.
+     * 
+     */
+    void prepare_accessory();
+
+    /**
+     * @brief Brings up mDNS and the listener, call once an IP is assigned.
+     *        Calling it again after a reconnect does nothing.
+     * 
+     */
+    void start_accessory();
+
 protected:
     /**
      * @brief Construct a new Accessory object.
@@ -432,15 +789,66 @@ protected:
     {
     }
 
+    /**
+     * @brief Construct an Accessory that is added behind a Bridge.
+     *        It has no id, setup code or port of its own, see Bridge::add_accessory().
+     * 
+     * @param name name of the device
+     * @param manufacturer_name manufacturer name
+     * @param firmware_version firmware version
+     * @param model device model
+     * @param serial_number device serial number
+     */
+    Accessory(const std::string &name,
+                 const std::string &manufacturer_name,
+                 const std::string &firmware_version,
+                 const std::string &model,
+                 const std::string &serial_number)
+            : Accessory{name, none, none, manufacturer_name, firmware_version, model, serial_number,
+                        HAP_ACCESSORY_CATEGORY_OTHER, 0, 0}
+    {
+    }
+
     void add_service(hap_service_type service_type,
                      const std::vector<Characteristic*> &characteristics);
 
     virtual void init() = 0;
 
+    /**
+     * @brief Called before the first characteristic write of a request.
+     *        The writes that follow can be staged and applied in write_commit().
+     * 
+     */
+    virtual void write_begin() {}
+
+    /**
+     * @brief Called once all characteristic writes of a request are delivered.
+     * 
+     */
+    virtual void write_commit() {}
+
+    /**
+     * @brief Call from init() after changing the services or characteristics.
+     *        Controllers fetch the attribute database again.
+     * 
+     * @return the new configuration version, store it and construct with it from then on
+     */
+    uint32_t configuration_changed()
+    {
+        return hap_accessory_config_number_bump(accessory_handle);
+    }
+
     friend void accessory_init(void* arg);
+    friend void accessory_write_begin(void* arg);
+    friend void accessory_write_commit(void* arg);
+
+    friend class Bridge; // Attaches the bridged accessories.
 
 private:
     void init_callback();
+    void attach(void* handle);
+
+    static const std::string none;
 
     const std::string &name;
     const std::string &id;
@@ -461,4 +869,79 @@ private:
     static bool hap_initialized;
 };
 
+/**
+ * @brief Homekit Accessory Protocol Bridge.
+ *        The bridged accessories get their own aids but share the listener,
+ *        the pairings and the encrypted sessions of the bridge, so every
+ *        controller costs the same however many there are.
+ * 
+ */
+class Bridge : public Accessory
+{
+public:
+    /**
+     * @brief Adds an accessory behind the bridge.
+     *        Call before register_accessory(). The aids follow the order of the
+     *        calls, keep it stable or increment the configuration version.
+     * 
+     * @param accessory accessory constructed without id, setup code and port
+     */
+    void add_accessory(Accessory* accessory)
+    {
+        bridged.push_back(accessory);
+    }
+
+protected:
+    /**
+     * @brief Construct a new Bridge object, see Accessory for the parameters.
+     * 
+     */
+    Bridge(const std::string &name,
+           const std::string &id,
+           const std::string &setup_code,
+           const std::string &manufacturer_name,
+           const std::string &firmware_version,
+           const std::string &model,
+           const std::string &serial_number,
+           int port,
+           int configuration_version)
+        : Accessory{name, id, setup_code, manufacturer_name, firmware_version, model, serial_number,
+                    HAP_ACCESSORY_CATEGORY_BRIDGE, port, configuration_version}
+    {
+    }
+
+    /**
+     * @brief Adds the bridged accessories, after the services of the bridge itself.
+     *        Overrides have to call it.
+     * 
+     */
+    void init() override
+    {
+        for (auto accessory : bridged)
+        {
+            accessory->attach(accessory_handle);
+        }
+    }
+
+    /* the writes of one request may span the bridged accessories */
+    void write_begin() override
+    {
+        for (auto accessory : bridged)
+        {
+            accessory->write_begin();
+        }
+    }
+
+    void write_commit() override
+    {
+        for (auto accessory : bridged)
+        {
+            accessory->write_commit();
+        }
+    }
+
+private:
+    std::vector<Accessory*> bridged;
+};
+
 } // namespace HAP
\ No newline at end of file
@@ -0,0 +1,147 @@
+#ifndef _HAP_CHARACTERISTICS_H_
+#define _HAP_CHARACTERISTICS_H_
+
+#include "hap.h"
+
+enum hap_perms {
+    HAP_PERMS_READ = 0x01,
+    HAP_PERMS_WRITE = 0x02,
+    HAP_PERMS_EVENT = 0x04,
+};
+
+/* the member of union hap_value in use follows the format */
+enum hap_format {
+    HAP_FORMAT_BOOL,
+    HAP_FORMAT_UINT8,
+    HAP_FORMAT_UINT32,
+    HAP_FORMAT_UINT64,
+    HAP_FORMAT_INT,
+    HAP_FORMAT_FLOAT,
+    HAP_FORMAT_STRING,
+    HAP_FORMAT_TLV8,
+    HAP_FORMAT_DATA,
+};
+
+enum hap_unit {
+    HAP_UNIT_NONE,
+    HAP_UNIT_CELSIUS,
+    HAP_UNIT_PERCENTAGE,
+    HAP_UNIT_ARCDEGREES,
+    HAP_UNIT_LUX,
+    HAP_UNIT_SECONDS,
+};
+
+/*
+ * Permissions, format and unit of every characteristic type.
+ * Expand with X(type, perms, format, unit), the accessories module builds
+ * its lookup table from it and hap.hpp its compile time traits.
+ */
+#define HAP_CHARACTERISTICS(X) \
+    X(HAP_CHARACTER_ADMINISTRATOR_ONLY_ACCESS, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_BOOL, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_AUDIO_FEEDBACK, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_BOOL, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_BRIGHTNESS, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_INT, HAP_UNIT_PERCENTAGE) \
+    X(HAP_CHARACTER_COOLING_THRESHOLD_TEMPERATURE, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_FLOAT, HAP_UNIT_CELSIUS) \
+    X(HAP_CHARACTER_CURRENT_DOOR_STATE, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_CURRENT_HEATING_COOLING_STATE, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_CURRENT_RELATIVE_HUMIDITY, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_FLOAT, HAP_UNIT_PERCENTAGE) \
+    X(HAP_CHARACTER_CURRENT_TEMPERATURE, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_FLOAT, HAP_UNIT_CELSIUS) \
+    X(HAP_CHARACTER_FIRMWARE_REVISION, HAP_PERMS_READ, HAP_FORMAT_STRING, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_HARDWARE_REVISION, HAP_PERMS_READ, HAP_FORMAT_STRING, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_HEATING_THRESHOLD_TEMPERATURE, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_FLOAT, HAP_UNIT_CELSIUS) \
+    X(HAP_CHARACTER_HUE, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_FLOAT, HAP_UNIT_ARCDEGREES) \
+    X(HAP_CHARACTER_IDENTIFY, HAP_PERMS_WRITE, HAP_FORMAT_BOOL, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_LOCK_CONTROL_POINT, HAP_PERMS_WRITE, HAP_FORMAT_TLV8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_LOCK_CURRENT_STATE, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_LOCK_LAST_KNOWN_ACTION, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_LOCK_MANAGEMENT_AUTO_SECURITY_TIMEOUT, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_UINT32, HAP_UNIT_SECONDS) \
+    X(HAP_CHARACTER_LOCK_TARGET_STATE, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_LOGS, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_TLV8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_MANUFACTURER, HAP_PERMS_READ, HAP_FORMAT_STRING, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_MODEL, HAP_PERMS_READ, HAP_FORMAT_STRING, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_MOTION_DETECTED, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_BOOL, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_NAME, HAP_PERMS_READ, HAP_FORMAT_STRING, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_OBSTRUCTION_DETECTED, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_BOOL, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_ON, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_BOOL, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_OUTLET_IN_USE, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_BOOL, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_ROTATION_DIRECTION, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_INT, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_ROTATION_SPEED, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_FLOAT, HAP_UNIT_PERCENTAGE) \
+    X(HAP_CHARACTER_SATURATION, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_FLOAT, HAP_UNIT_PERCENTAGE) \
+    X(HAP_CHARACTER_SERIAL_NUMBER, HAP_PERMS_READ, HAP_FORMAT_STRING, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_TARGET_DOORSTATE, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_TARGET_HEATING_COOLING_STATE, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_TARGET_RELATIVE_HUMIDITY, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_FLOAT, HAP_UNIT_PERCENTAGE) \
+    X(HAP_CHARACTER_TARGET_TEMPERATURE, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_FLOAT, HAP_UNIT_CELSIUS) \
+    X(HAP_CHARACTER_TEMPERATURE_DISPLAY_UNITS, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_VERSION, HAP_PERMS_READ, HAP_FORMAT_STRING, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_AIR_PARTICULATE_DENSITY, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_FLOAT, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_AIR_PARTICULATE_SIZE, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_SECURITY_SYSTEM_CURRENT_STATE, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_SECURITY_SYSTEM_TARGET_STATE, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_BATTERY_LEVER, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_PERCENTAGE) \
+    X(HAP_CHARACTER_CARBON_MONOXIDE_DETECTED, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_CONTACT_SENSOR_STATE, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_CURRENT_AMBIENT_LIGHT_LEVEL, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_FLOAT, HAP_UNIT_LUX) \
+    X(HAP_CHARACTER_CURRENT_HORIZONTAL_TILT_ANGLE, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_INT, HAP_UNIT_ARCDEGREES) \
+    X(HAP_CHARACTER_CURRENT_POSITION, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_PERCENTAGE) \
+    X(HAP_CHARACTER_CURRENT_VERTICAL_TILT_ANGLE, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_INT, HAP_UNIT_ARCDEGREES) \
+    X(HAP_CHARACTER_HOLD_POSITION, HAP_PERMS_WRITE, HAP_FORMAT_BOOL, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_LEAK_DETECTED, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_OCCUPANCY_DETECTED, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_POSITION_STATE, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_PROGRAMMABLE_SWITCH_EVENT, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_STATUS_ACTIVE, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_BOOL, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_SMOKE_DETECTED, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_STATUS_FAULT, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_STATUS_JAMMED, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_STATUS_LOW_BATTERY, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_STATUS_TAMPERED, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_TARGET_HORIZONTAL_TILT_ANGLE, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_INT, HAP_UNIT_ARCDEGREES) \
+    X(HAP_CHARACTER_TARGET_POSITION, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_PERCENTAGE) \
+    X(HAP_CHARACTER_TARGET_VERTICAL_TILT_ANGLE, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_INT, HAP_UNIT_ARCDEGREES) \
+    X(HAP_CHARACTER_SECURITY_SYSTEM_ALARM_TYPE, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_CHARGING_STATE, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_CARBON_MONOXIDE_LEVEL, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_FLOAT, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_CARBON_MONOXIDE_PEAK_LEVEL, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_FLOAT, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_CARBON_DIOXIDE_DETECTED, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_CARBON_DIOXIDE_LEVEL, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_FLOAT, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_CARBON_DIOXIDE_PEAK_LEVEL, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_FLOAT, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_AIR_QUALITY, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_STREAMING_STATUS, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_TLV8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_SUPPORTED_VIDEO_STREAMING_CONFIGURATION, HAP_PERMS_READ, HAP_FORMAT_TLV8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_SUPPORTED_AUDIO_STREAMING_CONFIGURATION, HAP_PERMS_READ, HAP_FORMAT_TLV8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_SUPPORTED_RTP_CONFIGURATION, HAP_PERMS_READ, HAP_FORMAT_TLV8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_SETUP_ENDPOINTS, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_TLV8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_SELECTED_RTP_STREAM_CONFIGURATION, HAP_PERMS_WRITE, HAP_FORMAT_TLV8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_VOLUME, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_PERCENTAGE) \
+    X(HAP_CHARACTER_MUTE, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_BOOL, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_NIGHT_VISION, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_BOOL, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_OPTICAL_ZOOM, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_FLOAT, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_DIGITAL_ZOOM, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_FLOAT, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_IMAGE_ROTATION, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_FLOAT, HAP_UNIT_ARCDEGREES) \
+    X(HAP_CHARACTER_IMAGE_MIRRORING, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_BOOL, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_ACCESSORY_FLAGS, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT32, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_LOCK_PHYSICAL_CONTROLS, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_CURRENT_AIR_PURIFIER_STATE, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_CURRENT_SLAT_STATE, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_SLAT_TYPE, HAP_PERMS_READ, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_FILTER_LIFE_LEVEL, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_FLOAT, HAP_UNIT_PERCENTAGE) \
+    X(HAP_CHARACTER_FILTER_CHANGE_INDICATION, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_RESET_FILTER_INDICATION, HAP_PERMS_WRITE, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_TARGET_AIR_PURIFIER_STATE, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_TARGET_FAN_STATE, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_CURRENT_FAN_STATE, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_ACTIVE, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_SWING_MODE, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_CURRENT_TILT_ANGLE, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_INT, HAP_UNIT_ARCDEGREES) \
+    X(HAP_CHARACTER_TARGET_TILT_ANGLE, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_INT, HAP_UNIT_ARCDEGREES) \
+    X(HAP_CHARACTER_OZONE_DENSITY, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_FLOAT, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_NITROGEN_DIOXIDE_DENSITY, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_FLOAT, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_SULPHUR_DIOXIDE_DENSITY, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_FLOAT, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_PM2_5_DENSITY, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_FLOAT, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_PM10_DENSITY, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_FLOAT, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_VOC_DENSITY, HAP_PERMS_READ | HAP_PERMS_EVENT, HAP_FORMAT_FLOAT, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_SERVICE_LABEL_INDEX, HAP_PERMS_READ, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_SERVICE_LABEL_NAMESPACE, HAP_PERMS_READ, HAP_FORMAT_UINT8, HAP_UNIT_NONE) \
+    X(HAP_CHARACTER_COLOR_TEMPERATURE, HAP_PERMS_READ | HAP_PERMS_WRITE | HAP_PERMS_EVENT, HAP_FORMAT_UINT32, HAP_UNIT_NONE)
+
+#endif //#ifndef _HAP_CHARACTERISTICS_H_
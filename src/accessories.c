@@ -1,945 +1,1509 @@
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 
-#include <cJSON.h>
-
 #include "advertise.h"
 #include "chacha20_poly1305.h"
 #include "ed25519.h"
 #include "hap.h"
+#include "hap_characteristics.h"
 #include "hap_internal.h"
+#include "accessories.h"
+#include "http_header.h"
 #include "httpd.h"
 #include "iosdevice.h"
-#include "mongoose.h"
+#include "json.h"
 #include "nvs.h"
 #include "pair_setup.h"
 #include "pair_verify.h"
 
-#define HAP_UUID    "%08X-0000-1000-8000-0026BB765291"
-
-struct hap_acc_accessory {
-    struct list_head list;
-    struct list_head services;
+#define HAP_UUID_SUFFIX "-0000-1000-8000-0026BB765291"
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
+
+/*
+ * The attribute database is laid out for bridges with hundreds of
+ * characteristics. Every accessory keeps its services and characteristics
+ * in two arrays in iid order, walked front to back when serializing.
+ * Callbacks and constraints live outside the characteristic: callback sets
+ * are shared by all characteristics that registered the same ones, and
+ * only the few characteristics with ranges or valid values have a
+ * constraints block.
+ * The arrays move while services are added, so the handles given to the
+ * application are the (aid, iid) of the characteristic, see HANDLE.
+ */
+struct hap_attr_callbacks {
+    void* arg;
+    void* (*read)(void* arg);
+    void (*write)(void* arg, void* value, int value_len);
+    union hap_value (*read_value)(void* arg);
+    void (*write_value)(void* arg, union hap_value value);
+    void (*event)(void* arg, void* ev_handle, bool enable);
+};
 
-    int aid;
-    int last_iid;
+struct hap_attr_constraints {
+    uint8_t override_max_value:1;
+    uint8_t override_min_value:1;
+    uint8_t override_min_step:1;
+    uint8_t override_valid_values:1;
+    uint16_t num_valid_values;
+
+    union hap_value max_value;
+    union hap_value min_value;
+    union hap_value min_step;
+    int valid_values[];
 };
 
 struct hap_attr_service {
-    struct list_head list;
-
-    enum hap_service_type type;
-    int iid;
-    int nr_character;
-    void* characters;
+    uint16_t iid;
+    uint16_t type;
+    /* its characteristics are characters[first] to characters[first + nr_character - 1] */
+    uint16_t first;
+    uint16_t nr_character;
 };
 
 struct hap_attr_characteristic {
-    int aid;
-    int iid;
-    enum {
-        PERMS_READ = 0x01,
-        PERMS_WRITE = 0x02,
-        PERMS_EVENT = 0x04,
-    } perms;
-
-    enum {
-        FORMAT_BOOL,
-        FORMAT_UINT8,
-        FORMAT_UINT32,
-        FORMAT_UINT64,
-        FORMAT_INT,
-        FORMAT_FLOAT,
-        FORMAT_STRING,
-        FORMAT_TLV8,
-        FORMAT_DATA,
-    } format;
-
-    enum hap_characteristic_type type;
-    void* initial_value;
-    void* callback_arg;
-    void* (*read)(void* arg);
-    void (*write)(void* arg, void* value, int value_len);
-    void (*event)(void* arg, void* ev_handle, bool enable);
+    uint16_t iid;
+    uint16_t type;
+    /* from the metadata table, see _characteristic_properties_define */
+    uint8_t perms;
+    uint8_t format;
+    uint8_t unit;
+
+    uint8_t cached:1;
+    /* coalescing, see hap_acc_event_post */
+    uint8_t ev_queued:1;
+    uint8_t ev_sent:1;
+    /* may wait for the next power save flush, see _event_deferrable */
+    uint8_t ev_deferrable:1;
+
+    /* bit in the subscription bitmap of every connection, -1 without events */
+    int16_t ev_index;
+    uint16_t nr_subscribers;
+
+    const struct hap_attr_callbacks* cb;
+    /* NULL for most */
+    const struct hap_attr_constraints* constraints;
+
+    /*
+     * last known value, starting from initial_value. Updated by reads,
+     * writes and events, and served when there is no read callback.
+     * In cache mode it is all reads get, the application pushes changes.
+     * The value of a queued event is the last known one too.
+     */
+    union hap_value value;
+    union hap_value ev_sent_value;
+    /* the connection whose write queued the event, it isn't told of it */
+    struct hap_connection* ev_origin;
+};
 
-    bool override_max_value;
-    void* max_value;
+struct hap_acc_accessory {
+    struct hap_accessory* a;
 
-    bool override_min_value;
-    void* min_value;
+    int aid;
+    int last_iid;
 
-    bool override_min_step;
-    void* min_step;
+    struct hap_attr_service* services;
+    int nr_services;
+    struct hap_attr_characteristic* characters;
+    int nr_characters;
+    /* 1 + the position in characters by iid, 0 for services */
+    uint16_t* characters_index;
 
-    bool override_valid_values;
-    size_t num_valid_values;
-    int* valid_values;
+    /* the distinct callback sets, searched when characteristics are added */
+    struct hap_attr_callbacks** callbacks;
+    int nr_callbacks;
 };
 
+/* the ev_handle of a characteristic, never NULL as aids start at 1 */
+#define HANDLE(aid, iid) ((void*)(uintptr_t)((uint32_t)(aid) << 16 | (iid)))
+#define HANDLE_AID(handle) ((int)((uintptr_t)(handle) >> 16))
+#define HANDLE_IID(handle) ((int)((uintptr_t)(handle) & 0xffff))
+
+static const struct hap_attr_callbacks _no_callbacks;
 
-static const char* header_204_fmt = 
+
+static const struct http_header header_204 = HTTP_HEADER_FIXED(
     "HTTP/1.1 204 No Content\r\n"
-    //"Connection: keep-alive\r\n"
-    //"Content-type: application/hap+json\r\n"
-    "\r\n";
+    "Connection: keep-alive\r\n"
+    "\r\n");
 
-static const char* header_200_fmt = 
+static const struct http_header header_200 = HTTP_HEADER(
     "HTTP/1.1 200 OK\r\n"
-    //"Connection: keep-alive\r\n"
+    "Connection: keep-alive\r\n"
     "Content-Type: application/hap+json\r\n"
-    "Content-Length: %d\r\n"
-    "\r\n";
+    "Content-Length: ");
+
+static const struct http_header header_400 = HTTP_HEADER_FIXED(
+    "HTTP/1.1 400 Bad Request\r\n"
+    "Connection: keep-alive\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n");
 
-static const char* header_event_200_fmt = 
+static const struct http_header header_500 = HTTP_HEADER_FIXED(
+    "HTTP/1.1 500 Internal Server Error\r\n"
+    "Connection: keep-alive\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n");
+
+static const struct http_header header_event_200 = HTTP_HEADER(
     "EVENT/1.0 200 OK\r\n"
     "Content-Type: application/hap+json\r\n"
-    "Content-Length: %d\r\n"
-    "\r\n";
+    "Content-Length: ");
 
 int accessories_do(struct hap_accessory* a, char** res_header, int* res_header_len, char** res_body, int* res_body_len);
 void accessories_do_free(char* res_header, char* res_body);
 
-static struct hap_attr_characteristic* _attr_character_find(struct list_head* attr_accessories, int aid, int iid)
+static struct hap_attr_characteristic* _attr_character_find(struct hap_accessory* a, int aid, int iid)
 {
-    struct hap_acc_accessory* a_ptr;
-    struct hap_attr_service* s_ptr;
-    list_for_each_entry(a_ptr, attr_accessories, list) {
-        if (a_ptr->aid != aid)
-            continue;
+    if (aid < 1 || aid > a->last_aid)
+        return NULL;
 
-        list_for_each_entry(s_ptr, &a_ptr->services, list) {
-            struct hap_attr_characteristic* c = (struct hap_attr_characteristic*)&s_ptr->characters;
-            for (int i=0; i<s_ptr->nr_character; i++, c++) {
-                if (c->iid == iid)
-                    return c;
-            }
+    struct hap_acc_accessory* attr_a = a->attr_accessories_index[aid - 1];
+    if (iid < 1 || iid > attr_a->last_iid || attr_a->characters_index[iid] == 0)
+        return NULL;
+
+    return &attr_a->characters[attr_a->characters_index[iid] - 1];
+}
+
+static struct hap_attr_characteristic* _attr_character_handle(struct hap_accessory* a, void* handle)
+{
+    return _attr_character_find(a, HANDLE_AID(handle), HANDLE_IID(handle));
+}
+
+/*
+ * Subscriptions are kept per connection, as a bitmap indexed by ev_index.
+ * The event callback of a characteristic only sees the first subscriber
+ * coming and the last one going, so its ev_handle stays valid while any
+ * controller listens.
+ */
+#define EVENT_BITS 32
+
+static bool _event_subscribed(struct hap_connection* hc, struct hap_attr_characteristic* c)
+{
+    if (c->ev_index < 0 || c->ev_index / EVENT_BITS >= hc->nr_events)
+        return false;
+
+    return hc->events[c->ev_index / EVENT_BITS] & (1u << (c->ev_index % EVENT_BITS));
+}
+
+static int _event_subscribe(struct hap_connection* hc, int aid, struct hap_attr_characteristic* c, bool enable)
+{
+    if (c->ev_index < 0)
+        return -1;
+
+    if (_event_subscribed(hc, c) == enable)
+        return 0;
+
+    int word = c->ev_index / EVENT_BITS;
+    if (word >= hc->nr_events) {
+        uint32_t* events = realloc(hc->events, sizeof(uint32_t) * (word + 1));
+        if (events == NULL) {
+            printf("realloc failed. size:%d\n", word + 1);
+            return -1;
         }
+        memset(events + hc->nr_events, 0, sizeof(uint32_t) * (word + 1 - hc->nr_events));
+        hc->events = events;
+        hc->nr_events = word + 1;
+    }
+
+    if (enable) {
+        hc->events[word] |= 1u << (c->ev_index % EVENT_BITS);
+        if (c->nr_subscribers++ == 0 && c->cb->event)
+            c->cb->event(c->cb->arg, HANDLE(aid, c->iid), true);
+    }
+    else {
+        hc->events[word] &= ~(1u << (c->ev_index % EVENT_BITS));
+        if (--c->nr_subscribers == 0 && c->cb->event)
+            c->cb->event(c->cb->arg, HANDLE(aid, c->iid), false);
     }
-    return NULL;
+
+    return 0;
 }
 
-static cJSON* _value_to_formatized_json(struct hap_attr_characteristic* c, void* value)
+bool hap_acc_event_subscribed(struct hap_connection* hc, void* ev_handle)
 {
-    switch (c->format) {
-        case FORMAT_BOOL:
-            return cJSON_CreateBool((cJSON_bool)value);
-        case FORMAT_UINT8:
-        case FORMAT_UINT32:
-        case FORMAT_UINT64:
-        case FORMAT_INT:
-            return cJSON_CreateNumber((int)value);
-        case FORMAT_FLOAT: {
-            int value_interger = (int)value;
-            double floating_value = (double)value_interger / 100;
-            return cJSON_CreateNumber(floating_value);
+    if (ev_handle == NULL)
+        return false;
+
+    struct hap_attr_characteristic* c = _attr_character_handle(hc->a, ev_handle);
+    return c && _event_subscribed(hc, c);
+}
+
+void hap_acc_event_free(struct hap_connection* hc)
+{
+    struct hap_accessory* a = hc->a;
+    for (int aid=1; aid<=a->last_aid && hc->nr_events; aid++) {
+        struct hap_acc_accessory* attr_a = a->attr_accessories_index[aid - 1];
+        for (int i=0; i<attr_a->nr_characters; i++) {
+            struct hap_attr_characteristic* c = &attr_a->characters[i];
+            if (_event_subscribed(hc, c))
+                _event_subscribe(hc, aid, c, false);
         }
-        case FORMAT_STRING:
-            return cJSON_CreateString((char*)value);
-        default:
-            printf("Unimplemented charac format(%d)\n", c->format);
-            return cJSON_CreateNull();
     }
+
+    /* the block may be reused before the queued events go out */
+    for (int i=0; i<a->nr_ev_queue; i++) {
+        struct hap_attr_characteristic* c = _attr_character_handle(a, a->ev_queue[i]);
+        if (c->ev_origin == hc)
+            c->ev_origin = NULL;
+    }
+
+    if (hc->events)
+        free(hc->events);
+    hc->events = NULL;
+    hc->nr_events = 0;
+}
+
+static const char* const _format_names[] = {
+    [HAP_FORMAT_BOOL] = "bool",
+    [HAP_FORMAT_UINT8] = "uint8",
+    [HAP_FORMAT_UINT32] = "uint32",
+    [HAP_FORMAT_UINT64] = "uint64",
+    [HAP_FORMAT_INT] = "int",
+    [HAP_FORMAT_FLOAT] = "float",
+    [HAP_FORMAT_STRING] = "string",
+    [HAP_FORMAT_TLV8] = "tlv8",
+    [HAP_FORMAT_DATA] = "data",
+};
+
+static const char* const _unit_names[] = {
+    [HAP_UNIT_NONE] = NULL,
+    [HAP_UNIT_CELSIUS] = "celsius",
+    [HAP_UNIT_PERCENTAGE] = "percentage",
+    [HAP_UNIT_ARCDEGREES] = "arcdegrees",
+    [HAP_UNIT_LUX] = "lux",
+    [HAP_UNIT_SECONDS] = "seconds",
+};
+
+static const char* _format_name(struct hap_attr_characteristic* c)
+{
+    return _format_names[c->format];
 }
 
-static cJSON* _attr_characterisic_to_json(struct hap_attr_characteristic* c)
+/* "%08X-0000-1000-8000-0026BB765291" without going through printf */
+static void _type_to_json_text(struct json* json, uint32_t type)
 {
-    cJSON* root = cJSON_CreateObject();
+    static const char hex[] = "0123456789ABCDEF";
+    char uuid[1 + 8 + sizeof(HAP_UUID_SUFFIX)];
 
-    char type[37] = {0,};
-    sprintf(type, HAP_UUID, c->type);
-    cJSON_AddStringToObject(root, "type", type);
-    cJSON_AddNumberToObject(root, "iid", c->iid);
+    uuid[0] = '"';
+    for (int i=0; i<8; i++)
+        uuid[1 + i] = hex[(type >> (28 - i * 4)) & 0x0f];
+    memcpy(uuid + 9, HAP_UUID_SUFFIX, sizeof(HAP_UUID_SUFFIX) - 1);
+    uuid[sizeof(uuid) - 1] = '"';
 
-    cJSON* perms = cJSON_CreateArray(); 
-    cJSON_AddItemToObject(root, "perms", perms);
-    if (c->perms & PERMS_READ)
-        cJSON_AddItemToArray(perms, cJSON_CreateString("pr"));
-    if (c->perms & PERMS_WRITE)
-        cJSON_AddItemToArray(perms, cJSON_CreateString("pw"));
-    if (c->perms & PERMS_EVENT)
-        cJSON_AddItemToArray(perms, cJSON_CreateString("ev"));
+    json_raw(json, uuid, sizeof(uuid));
+}
+
+static void _unit_to_json_text(struct json* json, struct hap_attr_characteristic* c)
+{
+    if (_unit_names[c->unit] == NULL)
+        return;
+
+    json_literal(json, ",\"unit\":");
+    json_string(json, _unit_names[c->unit]);
+}
+
+/*
+ * Values are kept as union hap_value inside the component. The void* API
+ * is converted at the edges, with floats scaled by 100 and tlv8 and data
+ * handed over as a struct hap_data*.
+ */
+static union hap_value _value_from_legacy(struct hap_attr_characteristic* c, void* value)
+{
+    union hap_value v;
+    memset(&v, 0, sizeof(v));
 
     switch (c->format) {
-        case FORMAT_BOOL:
-            cJSON_AddStringToObject(root, "format", "bool");
-            break;
-        case FORMAT_UINT8:
-            cJSON_AddStringToObject(root, "format", "uint8");
+        case HAP_FORMAT_BOOL:
+            v.b = value != NULL;
             break;
-        case FORMAT_UINT32:
-            cJSON_AddStringToObject(root, "format", "uint32");
+        case HAP_FORMAT_UINT8:
+        case HAP_FORMAT_UINT32:
+            v.u = (uint32_t)(uintptr_t)value;
             break;
-        case FORMAT_UINT64:
-            cJSON_AddStringToObject(root, "format", "uint64");
+        case HAP_FORMAT_UINT64:
+            v.u64 = (uintptr_t)value;
             break;
-        case FORMAT_INT:
-            cJSON_AddStringToObject(root, "format", "int");
+        case HAP_FORMAT_INT:
+            v.i = (int)(intptr_t)value;
             break;
-        case FORMAT_FLOAT:
-            cJSON_AddStringToObject(root, "format", "float");
+        case HAP_FORMAT_FLOAT:
+            v.f = (float)(int)(intptr_t)value / 100;
             break;
-        case FORMAT_STRING:
-            cJSON_AddStringToObject(root, "format", "string");
+        case HAP_FORMAT_STRING:
+            v.s = value;
             break;
-        case FORMAT_TLV8:
-            cJSON_AddStringToObject(root, "format", "tlv8");
-            break;
-        case FORMAT_DATA:
-            cJSON_AddStringToObject(root, "format", "data");
+        case HAP_FORMAT_TLV8:
+        case HAP_FORMAT_DATA:
+            if (value)
+                v.d = *(struct hap_data*)value;
             break;
     }
 
-    if (c->perms & PERMS_READ) {
-        void* value = NULL;
-        if (c->read)
-            value = c->read(c->callback_arg);
-        else
-            value = c->initial_value;
+    return v;
+}
 
-        cJSON_AddItemToObject(root, "value", _value_to_formatized_json(c, value));
+union hap_value hap_acc_value_from_legacy(struct hap_accessory* a, void* ev, void* value)
+{
+    struct hap_attr_characteristic* c = _attr_character_handle(a, ev);
+    if (c == NULL) {
+        union hap_value v;
+        memset(&v, 0, sizeof(v));
+        return v;
     }
-    else {
-        if (c->type != HAP_CHARACTER_IDENTIFY)
-            cJSON_AddNullToObject(root, "value");
+
+    return _value_from_legacy(c, value);
+}
+
+/* strings and data written by controllers only live as long as the request buffer */
+static bool _value_scalar(struct hap_attr_characteristic* c)
+{
+    return c->format != HAP_FORMAT_STRING && c->format != HAP_FORMAT_TLV8 && c->format != HAP_FORMAT_DATA;
+}
+
+static bool _value_readable(struct hap_attr_characteristic* c)
+{
+    return c->cached || c->cb->read_value || c->cb->read;
+}
+
+static union hap_value _value_read(struct hap_attr_characteristic* c)
+{
+    if (c->cached)
+        return c->value;
+
+    if (c->cb->read_value)
+        c->value = c->cb->read_value(c->cb->arg);
+    else if (c->cb->read)
+        c->value = _value_from_legacy(c, c->cb->read(c->cb->arg));
+
+    return c->value;
+}
+
+/* len is the length of strings and data, the void* write gets it too */
+static void _value_write(struct hap_attr_characteristic* c, union hap_value v, int len)
+{
+    /* cached values are taken in as a push, see _characteristic_write */
+    if (_value_scalar(c) && !c->cached)
+        c->value = v;
+
+    const struct hap_attr_callbacks* cb = c->cb;
+    if (cb->write_value) {
+        cb->write_value(cb->arg, v);
+        return;
     }
 
-    if (c->override_max_value) {
-        cJSON_AddItemToObject(root, "maxValue", _value_to_formatized_json(c, c->max_value));
+    switch (c->format) {
+        case HAP_FORMAT_BOOL:
+            cb->write(cb->arg, (void*)(intptr_t)v.b, 0);
+            break;
+        case HAP_FORMAT_UINT8:
+        case HAP_FORMAT_UINT32:
+            cb->write(cb->arg, (void*)(uintptr_t)v.u, 0);
+            break;
+        case HAP_FORMAT_UINT64:
+            cb->write(cb->arg, (void*)(uintptr_t)v.u64, 0);
+            break;
+        case HAP_FORMAT_INT:
+            cb->write(cb->arg, (void*)(intptr_t)v.i, 0);
+            break;
+        case HAP_FORMAT_FLOAT:
+            cb->write(cb->arg, (void*)(intptr_t)(int)lroundf(v.f * 100), 0);
+            break;
+        case HAP_FORMAT_STRING:
+            cb->write(cb->arg, (void*)v.s, len);
+            break;
+        case HAP_FORMAT_TLV8:
+        case HAP_FORMAT_DATA:
+            cb->write(cb->arg, (void*)v.d.buf, v.d.len);
+            break;
     }
+}
 
-    if (c->override_min_value) {
-        cJSON_AddItemToObject(root, "minValue", _value_to_formatized_json(c, c->min_value));
+static void _value_to_json_text(struct json* json, struct hap_attr_characteristic* c, const union hap_value* value)
+{
+    switch (c->format) {
+        case HAP_FORMAT_BOOL:
+            json_bool(json, value->b);
+            break;
+        case HAP_FORMAT_UINT8:
+        case HAP_FORMAT_UINT32:
+            json_uint(json, value->u);
+            break;
+        case HAP_FORMAT_UINT64:
+            json_uint(json, value->u64);
+            break;
+        case HAP_FORMAT_INT:
+            json_int(json, value->i);
+            break;
+        case HAP_FORMAT_FLOAT:
+            json_float(json, value->f);
+            break;
+        case HAP_FORMAT_STRING:
+            if (value->s)
+                json_string(json, value->s);
+            else
+                json_null(json);
+            break;
+        case HAP_FORMAT_TLV8:
+        case HAP_FORMAT_DATA:
+            if (value->d.buf)
+                json_base64(json, value->d.buf, value->d.len);
+            else
+                json_null(json);
+            break;
+        default:
+            printf("Unimplemented charac format(%d)\n", c->format);
+            json_null(json);
+            break;
     }
+}
+
+static int _value_from_json(struct hap_attr_characteristic* c, struct json_token* t, union hap_value* v, int* len)
+{
+    memset(v, 0, sizeof(*v));
+    *len = 0;
 
-    if (c->override_min_step) {
-        cJSON_AddItemToObject(root, "minStep", _value_to_formatized_json(c, c->min_step));
+    switch (c->format) {
+        case HAP_FORMAT_STRING:
+            if (t->type != JSON_STRING)
+                return -1;
+            v->s = t->text;
+            *len = t->len;
+            return 0;
+        case HAP_FORMAT_TLV8:
+        case HAP_FORMAT_DATA:
+            if (json_base64_decode(t) < 0)
+                return -1;
+            v->d.buf = (const uint8_t*)t->text;
+            v->d.len = t->len;
+            *len = t->len;
+            return 0;
+        default:
+            break;
     }
 
-    if (c->override_valid_values) {
-        cJSON* valid_values = cJSON_CreateIntArray(c->valid_values, c->num_valid_values);
-        cJSON_AddItemToObject(root, "valid-values", valid_values);
+    if (t->type != JSON_NUMBER && t->type != JSON_TRUE && t->type != JSON_FALSE)
+        return -1;
+
+    switch (c->format) {
+        case HAP_FORMAT_BOOL:
+            v->b = json_number(t) != 0;
+            break;
+        case HAP_FORMAT_UINT8:
+        case HAP_FORMAT_UINT32:
+            v->u = (uint32_t)json_number(t);
+            break;
+        case HAP_FORMAT_UINT64:
+            v->u64 = json_unsigned(t);
+            break;
+        case HAP_FORMAT_INT:
+            v->i = (int32_t)json_number(t);
+            break;
+        case HAP_FORMAT_FLOAT:
+            v->f = (float)json_number(t);
+            break;
+        default:
+            return -1;
     }
 
-    return root;
+    return 0;
 }
 
-static cJSON* _attr_accessories_to_json(struct list_head* attr_accessories)
+static void _perms_to_json_text(struct json* json, struct hap_attr_characteristic* c)
 {
-    cJSON* root = cJSON_CreateObject();
-    cJSON* accessories = cJSON_CreateArray();
-    cJSON_AddItemToObject(root, "accessories", accessories);
+    const char* separator = "";
+    json_literal(json, ",\"perms\":[");
+    if (c->perms & HAP_PERMS_READ) {
+        json_literal(json, "\"pr\"");
+        separator = ",";
+    }
+    if (c->perms & HAP_PERMS_WRITE) {
+        json_raw(json, separator, strlen(separator));
+        json_literal(json, "\"pw\"");
+        separator = ",";
+    }
+    if (c->perms & HAP_PERMS_EVENT) {
+        json_raw(json, separator, strlen(separator));
+        json_literal(json, "\"ev\"");
+    }
+    json_literal(json, "]");
+}
+
+static void _range_to_json_text(struct json* json, struct hap_attr_characteristic* c)
+{
+    const struct hap_attr_constraints* r = c->constraints;
+    if (r == NULL)
+        return;
+
+    if (r->override_max_value) {
+        json_literal(json, ",\"maxValue\":");
+        _value_to_json_text(json, c, &r->max_value);
+    }
 
-    struct hap_acc_accessory* a_ptr;
-    struct hap_attr_service* s_ptr;
-    list_for_each_entry(a_ptr, attr_accessories, list) {
-        cJSON* accessory = cJSON_CreateObject();
-        cJSON* services = cJSON_CreateArray();
+    if (r->override_min_value) {
+        json_literal(json, ",\"minValue\":");
+        _value_to_json_text(json, c, &r->min_value);
+    }
 
-        cJSON_AddItemToArray(accessories, accessory);
-        cJSON_AddNumberToObject(accessory, "aid", a_ptr->aid);
-        cJSON_AddItemToObject(accessory, "services", services);
+    if (r->override_min_step) {
+        json_literal(json, ",\"minStep\":");
+        _value_to_json_text(json, c, &r->min_step);
+    }
 
-        list_for_each_entry(s_ptr, &a_ptr->services, list) {
-            cJSON* service = cJSON_CreateObject();
-            cJSON_AddItemToArray(services, service);
+    if (r->override_valid_values) {
+        json_literal(json, ",\"valid-values\":[");
+        for (int i=0; i<r->num_valid_values; i++) {
+            if (i)
+                json_literal(json, ",");
+            json_int(json, r->valid_values[i]);
+        }
+        json_literal(json, "]");
+    }
+}
 
-            char type[37] = {0,};
-            sprintf(type, HAP_UUID, s_ptr->type);
-            cJSON_AddStringToObject(service, "type", type);
-            cJSON_AddNumberToObject(service, "iid", s_ptr->iid);
+/*
+ * The static part of the attribute database is serialized once.
+ * Only the values that can change are left out, the ones with a read
+ * callback or that can be written or evented. They are spliced in at their
+ * offsets on every request.
+ */
+struct hap_attr_db_value {
+    int offset;
+    struct hap_attr_characteristic* c;
+    union hap_value value;
+};
 
-            cJSON* characteristics = cJSON_CreateArray();
-            cJSON_AddItemToObject(service, "characteristics", characteristics);
+static bool _value_static(struct hap_attr_characteristic* c)
+{
+    return !_value_readable(c) && !(c->perms & (HAP_PERMS_WRITE | HAP_PERMS_EVENT));
+}
+
+struct hap_attr_db {
+    uint32_t config_number;
+    char* text;
+    int text_len;
+    int nr_values;
+    struct hap_attr_db_value values[];
+};
 
-            int i;
-            struct hap_attr_characteristic* c = (struct hap_attr_characteristic*)&s_ptr->characters;
-            for (i=0; i<s_ptr->nr_character; i++, c++) {
-                cJSON* characteristic = _attr_characterisic_to_json(c);
-                cJSON_AddItemToArray(characteristics, characteristic);
+static void _attr_characterisic_to_json_text(struct json* json, struct hap_attr_characteristic* c,
+        struct hap_attr_db_value* values, int* nr_values)
+{
+    json_literal(json, "{\"type\":");
+    _type_to_json_text(json, c->type);
+    json_literal(json, ",\"iid\":");
+    json_int(json, c->iid);
+
+    _perms_to_json_text(json, c);
+    json_literal(json, ",\"format\":");
+    json_string(json, _format_name(c));
+
+    if (c->perms & HAP_PERMS_READ) {
+        json_literal(json, ",\"value\":");
+        if (!_value_static(c)) {
+            if (values) {
+                values[*nr_values].offset = json->len;
+                values[*nr_values].c = c;
             }
+            (*nr_values)++;
         }
+        else {
+            _value_to_json_text(json, c, &c->value);
+        }
+    }
+    else {
+        if (c->type != HAP_CHARACTER_IDENTIFY)
+            json_literal(json, ",\"value\":null");
     }
 
-    return root;
+    _unit_to_json_text(json, c);
+    _range_to_json_text(json, c);
+
+    json_literal(json, "}");
 }
 
-struct cJSON* _characteristic_value_to_json(struct hap_attr_characteristic* c, void* value)
+static void _attr_accessories_to_json_text(struct json* json, struct hap_accessory* a,
+        struct hap_attr_db_value* values, int* nr_values)
 {
-    cJSON* char_json = cJSON_CreateObject();
-    cJSON_AddNumberToObject(char_json, "aid", c->aid);
-    cJSON_AddNumberToObject(char_json, "iid", c->iid);
-    cJSON_AddItemToObject(char_json, "value", _value_to_formatized_json(c, value));
-    return char_json;
+    json_literal(json, "{\"accessories\":[");
+
+    for (int aid=1; aid<=a->last_aid; aid++) {
+        struct hap_acc_accessory* a_ptr = a->attr_accessories_index[aid - 1];
+        if (aid > 1)
+            json_literal(json, ",");
+
+        json_literal(json, "{\"aid\":");
+        json_int(json, a_ptr->aid);
+        json_literal(json, ",\"services\":[");
+
+        for (int j=0; j<a_ptr->nr_services; j++) {
+            struct hap_attr_service* s_ptr = &a_ptr->services[j];
+            struct hap_attr_characteristic* c = &a_ptr->characters[s_ptr->first];
+            if (j)
+                json_literal(json, ",");
+
+            json_literal(json, "{\"type\":");
+            _type_to_json_text(json, s_ptr->type);
+            json_literal(json, ",\"iid\":");
+            json_int(json, s_ptr->iid);
+            json_literal(json, ",\"characteristics\":[");
+
+            for (int i=0; i<s_ptr->nr_character; i++, c++) {
+                if (i)
+                    json_literal(json, ",");
+                _attr_characterisic_to_json_text(json, c, values, nr_values);
+            }
+            json_literal(json, "]}");
+        }
+        json_literal(json, "]}");
+    }
+
+    json_literal(json, "]}");
 }
 
-static cJSON* _characteristic_read(struct hap_attr_characteristic* c)
+static struct hap_attr_db* _attr_db_build(struct hap_accessory* a)
 {
-    if (!c->read)
+    struct json json;
+    int nr_values = 0;
+    json_init(&json, NULL, 0);
+    _attr_accessories_to_json_text(&json, a, NULL, &nr_values);
+
+    int text_len = json.len;
+    struct hap_attr_db* db = malloc(sizeof(struct hap_attr_db) + 
+            sizeof(struct hap_attr_db_value) * nr_values + text_len);
+    if (db == NULL) {
+        printf("malloc failed. size:%d\n", text_len);
         return NULL;
+    }
+
+    db->config_number = a->config_number;
+    db->text = (char*)&db->values[nr_values];
+    db->text_len = text_len;
+    db->nr_values = 0;
+
+    json_init(&json, db->text, db->text_len);
+    _attr_accessories_to_json_text(&json, a, db->values, &db->nr_values);
 
-    void* value = c->read(c->callback_arg);
-    return _characteristic_value_to_json(c, value);
+    return db;
 }
 
-int hap_acc_characteristic_get(struct hap_accessory* a, char* query, int len, char** res_header, int* res_header_len, char** res_body, int* res_body_len)
+static void _attr_db_splice(struct json* json, struct hap_attr_db* db)
 {
-    int aid = 0, iid = 0;
+    int offset = 0;
+    for (int i=0; i<db->nr_values; i++) {
+        json_raw(json, db->text + offset, db->values[i].offset - offset);
+        _value_to_json_text(json, db->values[i].c, &db->values[i].value);
+        offset = db->values[i].offset;
+    }
+    json_raw(json, db->text + offset, db->text_len - offset);
+}
+
+void hap_acc_accessories_invalidate(struct hap_accessory* a)
+{
+    if (a->attr_db) {
+        free(a->attr_db);
+        a->attr_db = NULL;
+    }
+}
 
-    cJSON* root = cJSON_CreateObject();
-    cJSON* characteristics = cJSON_CreateArray();
-    cJSON_AddItemToObject(root, "characteristics", characteristics);
+/*
+ * Responses are written into buffers owned by the caller.
+ * On entry *res_header_len and *res_body_len hold the buffer sizes, on return
+ * the lengths written. When a buffer is too small -1 is returned and the
+ * length holds the size that is required.
+ */
 
-    sscanf(query, "id=%d.%d", &aid, &iid);
-    struct hap_attr_characteristic* c = _attr_character_find(&a->attr_accessories, aid, iid);
-    if (c != NULL) {
-        cJSON* char_json = _characteristic_read(c);
-        cJSON_AddItemToArray(characteristics, char_json);
+static int _body_length(struct json* json, int* res_body_len)
+{
+    if (json->len > json->size) {
+        *res_body_len = json->len;
+        return -1;
     }
 
-    int nr_skip = 6;
-    if (aid / 10)
-        nr_skip++;
-    if (iid / 10)
-        nr_skip++;
+    *res_body_len = json->len;
+    return 0;
+}
 
-    query += nr_skip;
-    len -= nr_skip;
+/*
+ * GET /characteristics?id=1.10,1.11&meta=1&perms=1&type=1&ev=1
+ * The query is tokenized in one pass into a list of (aid, iid) pairs and
+ * a set of flags selecting the optional fields of every characteristic.
+ */
+enum {
+    QUERY_META = 0x01,
+    QUERY_PERMS = 0x02,
+    QUERY_TYPE = 0x04,
+    QUERY_EV = 0x08,
+};
 
-    while (len > 0) {
-        sscanf(query, ",%d.%d", &aid, &iid);
-        c = _attr_character_find(&a->attr_accessories, aid, iid);
-        if (c != NULL) {
-            cJSON* char_json = _characteristic_read(c);
-            cJSON_AddItemToArray(characteristics, char_json);
-        }
+struct hap_acc_query_id {
+    int aid;
+    int iid;
+    /* NULL when the characteristic is missing or can't be read */
+    struct hap_attr_characteristic* c;
+    union hap_value value;
+};
 
-        nr_skip = 4;
-        if (aid / 10)
-            nr_skip++;
-        if (iid / 10)
-            nr_skip++;
+#define QUERY_IDS_ON_STACK 16
+#define QUERY_NUMBER_MAX 99999999
 
-        query += nr_skip;
-        len -= nr_skip;
+static int _query_number(const char** p, const char* end, int* number)
+{
+    const char* s = *p;
+    int n = 0;
+    while (s < end && *s >= '0' && *s <= '9') {
+        if (n > QUERY_NUMBER_MAX)
+            return -1;
+        n = n * 10 + (*s++ - '0');
     }
 
+    if (s == *p)
+        return -1;
 
-    *res_body = cJSON_PrintUnformatted(root);
-    *res_body_len = strlen(*res_body);
-    cJSON_Delete(root);
+    *number = n;
+    *p = s;
+    return 0;
+}
 
-    *res_header = calloc(1, strlen(header_200_fmt) + 16);
-    sprintf(*res_header, header_200_fmt, *res_body_len);
-    *res_header_len = strlen(*res_header);
+static int _query_ids_parse(const char* p, const char* end, struct hap_acc_query_id* ids, int max_ids, int* nr_ids)
+{
+    while (p < end) {
+        if (*nr_ids == max_ids)
+            return -1;
+
+        struct hap_acc_query_id* id = &ids[*nr_ids];
+        if (_query_number(&p, end, &id->aid) < 0)
+            return -1;
+        if (p == end || *p++ != '.')
+            return -1;
+        if (_query_number(&p, end, &id->iid) < 0)
+            return -1;
+        (*nr_ids)++;
+
+        if (p < end && *p++ != ',')
+            return -1;
+    }
 
     return 0;
 }
 
-void hap_acc_characteristic_get_free(char* res_header, char* res_body)
+static bool _query_flag(const char* p, const char* end)
 {
-    if (res_header)
-        free(res_header);
-    if (res_body)
-        free(res_body);
+    int len = end - p;
+    return (len == 1 && *p == '1') || (len == 4 && strncmp(p, "true", 4) == 0);
+}
+
+static int _query_parse(const char* query, int len, struct hap_acc_query_id* ids, int max_ids, int* nr_ids, int* flags)
+{
+    const char* p = query;
+    const char* end = query + len;
+
+    *nr_ids = 0;
+    *flags = 0;
+    while (p < end) {
+        const char* key = p;
+        const char* param_end = memchr(p, '&', end - p);
+        if (param_end == NULL)
+            param_end = end;
+
+        const char* value = memchr(key, '=', param_end - key);
+        if (value) {
+            int key_len = value++ - key;
+            if (key_len == 2 && strncmp(key, "id", 2) == 0) {
+                if (_query_ids_parse(value, param_end, ids, max_ids, nr_ids) < 0)
+                    return -1;
+            }
+            else if (key_len == 4 && strncmp(key, "meta", 4) == 0) {
+                if (_query_flag(value, param_end))
+                    *flags |= QUERY_META;
+            }
+            else if (key_len == 5 && strncmp(key, "perms", 5) == 0) {
+                if (_query_flag(value, param_end))
+                    *flags |= QUERY_PERMS;
+            }
+            else if (key_len == 4 && strncmp(key, "type", 4) == 0) {
+                if (_query_flag(value, param_end))
+                    *flags |= QUERY_TYPE;
+            }
+            else if (key_len == 2 && strncmp(key, "ev", 2) == 0) {
+                if (_query_flag(value, param_end))
+                    *flags |= QUERY_EV;
+            }
+        }
+
+        if (param_end == end)
+            break;
+        p = param_end + 1;
+    }
+
+    return *nr_ids ? 0 : -1;
 }
 
-int hap_acc_characteristic_put(struct hap_accessory* a, struct hap_connection* hc, char* req_body, int req_body_len, char** res_header, int* res_header_len, char** res_body, int* res_body_len)
+static void _characteristic_value_to_json_text(struct json* json, struct hap_connection* hc, int aid, struct hap_attr_characteristic* c, const union hap_value* value, int flags)
 {
-    cJSON* root = cJSON_Parse(req_body);
-    cJSON* char_array_json = cJSON_GetObjectItem(root, "characteristics");
-    int nr_char = cJSON_GetArraySize(char_array_json);
-    for (int i=0; i<nr_char; i++) {
-        cJSON* char_json = cJSON_GetArrayItem(char_array_json, i);
-        int aid = cJSON_GetObjectItem(char_json, "aid")->valueint;
-        int iid = cJSON_GetObjectItem(char_json, "iid")->valueint;
+    json_literal(json, "{\"aid\":");
+    json_int(json, aid);
+    json_literal(json, ",\"iid\":");
+    json_int(json, c->iid);
+    json_literal(json, ",\"value\":");
+    _value_to_json_text(json, c, value);
+
+    if (flags & QUERY_TYPE) {
+        json_literal(json, ",\"type\":");
+        _type_to_json_text(json, c->type);
+    }
+
+    if (flags & QUERY_PERMS)
+        _perms_to_json_text(json, c);
+
+    if (flags & QUERY_META) {
+        json_literal(json, ",\"format\":");
+        json_string(json, _format_name(c));
+        _unit_to_json_text(json, c);
+        _range_to_json_text(json, c);
+    }
 
-        struct hap_attr_characteristic* c = _attr_character_find(&a->attr_accessories, aid, iid);
-        if (c == NULL)
+    if (flags & QUERY_EV) {
+        json_literal(json, ",\"ev\":");
+        json_bool(json, _event_subscribed(hc, c));
+    }
+
+    json_literal(json, "}");
+}
+
+static void _characteristics_to_json_text(struct json* json, struct hap_connection* hc, struct hap_acc_query_id* ids, int nr_ids, int flags, char* buf, int size)
+{
+    int nr_read = 0;
+    json_init(json, buf, size);
+    json_literal(json, "{\"characteristics\":[");
+
+    for (int i=0; i<nr_ids; i++) {
+        if (ids[i].c == NULL)
             continue;
 
-        cJSON* ev_json = cJSON_GetObjectItem(char_json, "ev");
-        if (ev_json && c->event) {
-            if (ev_json->valueint) {
-                c->event(c->callback_arg, (void*)c, (bool)ev_json->valueint);
-            }
-            else {
-                c->event(c->callback_arg, (void*)c, (bool)ev_json->valueint);
-            }
+        if (nr_read++)
+            json_literal(json, ",");
+        _characteristic_value_to_json_text(json, hc, ids[i].aid, ids[i].c, &ids[i].value, flags);
+    }
+
+    json_literal(json, "]}");
+}
+
+/*
+ * On entry *res_body is a buffer of *res_body_len bytes owned by the caller.
+ * When the response doesn't fit a body of the size needed is allocated and
+ * returned in *res_body instead, the caller frees it if it isn't its own.
+ * The read callbacks run once either way, the values are kept between the
+ * two passes.
+ */
+int hap_acc_characteristic_get(struct hap_accessory* a, struct hap_connection* hc, char* query, int len, char* res_header, int* res_header_len, char** res_body, int* res_body_len)
+{
+    /* every pair takes at least 4 bytes, "1.1," */
+    int max_ids = len / 4 + 1;
+    struct hap_acc_query_id ids_on_stack[QUERY_IDS_ON_STACK];
+    struct hap_acc_query_id* ids = ids_on_stack;
+    if (max_ids > QUERY_IDS_ON_STACK) {
+        ids = malloc(sizeof(struct hap_acc_query_id) * max_ids);
+        if (ids == NULL) {
+            printf("malloc failed. size:%d\n", max_ids);
+            *res_body_len = 0;
+            return http_header_write(&header_500, 0, res_header, res_header_len);
         }
+    }
 
-        cJSON* value_json = cJSON_GetObjectItem(char_json, "value");
-        if (value_json && c->write) {
-            if (c->format == FORMAT_FLOAT) {
-                c->write(c->callback_arg, (void*)((int)(value_json->valuedouble * 100)), 0);
-            }
-            else {
-                c->write(c->callback_arg, (void*)value_json->valueint, 0);
-            }
+    int nr_ids, flags;
+    if (_query_parse(query, len, ids, max_ids, &nr_ids, &flags) < 0) {
+        printf("Invalid query %.*s\n", len, query);
+        if (ids != ids_on_stack)
+            free(ids);
+        *res_body_len = 0;
+        return http_header_write(&header_400, 0, res_header, res_header_len);
+    }
+
+    for (int i=0; i<nr_ids; i++) {
+        struct hap_attr_characteristic* c = _attr_character_find(a, ids[i].aid, ids[i].iid);
+        if (c != NULL && !_value_readable(c) && !(c->perms & HAP_PERMS_READ))
+            c = NULL;
+
+        ids[i].c = c;
+        if (c != NULL)
+            ids[i].value = _value_read(c);
+    }
+
+    struct json json;
+    _characteristics_to_json_text(&json, hc, ids, nr_ids, flags, *res_body, *res_body_len);
+    if (json.len > json.size) {
+        char* body = malloc(json.len);
+        if (body == NULL) {
+            printf("malloc failed. size:%d\n", json.len);
+            if (ids != ids_on_stack)
+                free(ids);
+            *res_body_len = 0;
+            return http_header_write(&header_500, 0, res_header, res_header_len);
+        }
+
+        _characteristics_to_json_text(&json, hc, ids, nr_ids, flags, body, json.len);
+        *res_body = body;
+    }
+
+    if (ids != ids_on_stack)
+        free(ids);
+
+    *res_body_len = json.len;
+    return http_header_write(&header_200, *res_body_len, res_header, res_header_len);
+}
+
+/*
+ * PUT /characteristics is parsed in place, without building a document.
+ * Each element of the characteristics array is dispatched as soon as its
+ * closing brace is read.
+ */
+struct hap_acc_write {
+    int aid;
+    int iid;
+    bool has_value;
+    struct json_token value;
+    bool has_ev;
+    struct json_token ev;
+};
+
+static int _event_post(struct hap_accessory* a, void* ev, const union hap_value* value, struct hap_connection* origin);
+
+static void _characteristic_write(struct hap_accessory* a, struct hap_connection* hc, struct hap_acc_write* w)
+{
+    struct hap_attr_characteristic* c = _attr_character_find(a, w->aid, w->iid);
+    if (c == NULL)
+        return;
+
+    if (w->has_ev) {
+        _event_subscribe(hc, w->aid, c, json_number(&w->ev) != 0);
+    }
+
+    if (w->has_value && (c->cb->write_value || c->cb->write)) {
+        union hap_value value;
+        int len;
+        if (_value_from_json(c, &w->value, &value, &len) < 0) {
+            printf("Invalid %s value. aid:%d iid:%d\n", _format_name(c), w->aid, w->iid);
+            return;
         }
+        if (!a->write_batch_open) {
+            a->write_batch_open = true;
+            if (a->write_begin)
+                a->write_begin(a->callback_arg);
+        }
+        _value_write(c, value, len);
+
+        /* the other controllers hear of it, the application's own push is then a no-op */
+        if (c->cached && _value_scalar(c))
+            _event_post(a, HANDLE(w->aid, w->iid), &value, hc);
     }
+}
 
-    cJSON_Delete(root);
+static int _characteristic_write_parse(struct hap_accessory* a, struct hap_connection* hc, struct json_reader* reader)
+{
+    struct hap_acc_write w = {0,};
+    struct json_token key;
+    struct json_token t;
 
-    *res_header = calloc(1, strlen(header_204_fmt) + 1);
-    strcpy(*res_header, header_204_fmt);
-    *res_header_len = strlen(*res_header);
+    while (json_read(reader, &key) != JSON_OBJECT_END) {
+        if (key.type != JSON_STRING)
+            return -1;
 
-    *res_body = NULL;
-    *res_body_len = 0;
+        json_read(reader, &t);
+        if (strcmp(key.text, "aid") == 0 && t.type == JSON_NUMBER) {
+            w.aid = (int)json_number(&t);
+        }
+        else if (strcmp(key.text, "iid") == 0 && t.type == JSON_NUMBER) {
+            w.iid = (int)json_number(&t);
+        }
+        else if (strcmp(key.text, "value") == 0 && t.type >= JSON_STRING) {
+            w.has_value = true;
+            w.value = t;
+        }
+        else if (strcmp(key.text, "ev") == 0 && t.type >= JSON_STRING) {
+            w.has_ev = true;
+            w.ev = t;
+        }
+        else if (json_skip(reader, &t) < 0) {
+            return -1;
+        }
+    }
 
+    _characteristic_write(a, hc, &w);
     return 0;
 }
 
-void hap_acc_characteristic_put_free(char* res_header, char* res_body)
+static int _characteristics_write_parse(struct hap_accessory* a, struct hap_connection* hc, char* req_body, int req_body_len)
 {
-    if (res_header)
-        free(res_header);
-    if (res_body)
-        free(res_body);
+    struct json_reader reader;
+    struct json_token key;
+    struct json_token t;
+
+    json_reader_init(&reader, req_body, req_body_len);
+    if (json_read(&reader, &t) != JSON_OBJECT_BEGIN)
+        return -1;
+
+    while (json_read(&reader, &key) != JSON_OBJECT_END) {
+        if (key.type != JSON_STRING)
+            return -1;
+
+        json_read(&reader, &t);
+        if (strcmp(key.text, "characteristics") != 0 || t.type != JSON_ARRAY_BEGIN) {
+            if (json_skip(&reader, &t) < 0)
+                return -1;
+            continue;
+        }
+
+        while (json_read(&reader, &t) != JSON_ARRAY_END) {
+            if (t.type != JSON_OBJECT_BEGIN)
+                return -1;
+            if (_characteristic_write_parse(a, hc, &reader) < 0)
+                return -1;
+        }
+    }
+
+    return 0;
 }
 
-int hap_acc_accessories_do(struct hap_accessory* a, char** res_header, int* res_header_len, char** res_body, int* res_body_len)
+int hap_acc_characteristic_put(struct hap_accessory* a, struct hap_connection* hc, char* req_body, int req_body_len, char* res_header, int* res_header_len)
 {
-    if (list_empty(&a->attr_accessories)) {
+    const struct http_header* header = &header_204;
+    if (_characteristics_write_parse(a, hc, req_body, req_body_len) < 0) {
+        printf("Invalid characteristics request. length:%d\n", req_body_len);
+        header = &header_400;
+    }
+
+    /* what was written before a parse error is committed all the same */
+    if (a->write_batch_open) {
+        a->write_batch_open = false;
+        if (a->write_commit)
+            a->write_commit(a->callback_arg);
+    }
+
+    return http_header_write(header, 0, res_header, res_header_len);
+}
+
+int hap_acc_accessories_do(struct hap_accessory* a, char* res_header, int* res_header_len, char** res_body, int* res_body_len)
+{
+    if (a->last_aid == 0) {
         a->callback.hap_object_init(a->callback_arg);
     }
-    cJSON* attr_accessories_json = _attr_accessories_to_json(&a->attr_accessories);
 
-    *res_body = cJSON_PrintUnformatted(attr_accessories_json);
-    *res_body_len = strlen(*res_body);
-    cJSON_Delete(attr_accessories_json);
+    struct hap_attr_db* db = a->attr_db;
+    if (db && db->config_number != a->config_number) {
+        hap_acc_accessories_invalidate(a);
+        db = NULL;
+    }
 
-    *res_header = calloc(1, strlen(header_200_fmt) + 16);
-    sprintf(*res_header, header_200_fmt, *res_body_len);
-    *res_header_len = strlen(*res_header);
+    if (db == NULL) {
+        db = a->attr_db = _attr_db_build(a);
+        if (db == NULL)
+            return -1;
+    }
 
-    return 0;
+    for (int i=0; i<db->nr_values; i++) {
+        db->values[i].value = _value_read(db->values[i].c);
+    }
+
+    struct json json;
+    json_init(&json, NULL, 0);
+    _attr_db_splice(&json, db);
+
+    *res_body_len = json.len;
+    *res_body = malloc(*res_body_len + 1);
+    if (*res_body == NULL) {
+        printf("malloc failed. size:%d\n", *res_body_len);
+        return -1;
+    }
+
+    json_init(&json, *res_body, *res_body_len);
+    _attr_db_splice(&json, db);
+    (*res_body)[*res_body_len] = 0;
+
+    return http_header_write(&header_200, *res_body_len, res_header, res_header_len);
 }
 
-void hap_acc_accessories_do_free(char* res_header, char* res_body)
+void hap_acc_accessories_do_free(char* res_body)
 {
-    if (res_header)
-        free(res_header);
     if (res_body)
         free(res_body);
 }
 
-void hap_acc_event_response(void* ev, void* value, char** res_header, int* res_header_len, char** res_body, int* res_body_len)
+/*
+ * Events are coalesced. Posting only records the latest value of a
+ * characteristic and queues it once. hap_acc_event_collect takes the queue
+ * over and leaves out values that didn't change since they were last sent,
+ * then every connection gets one message with the collected characteristics
+ * it subscribed to.
+ * All of this runs on the httpd task.
+ */
+static bool _event_value_equal(struct hap_attr_characteristic* c, const union hap_value* a, const union hap_value* b)
+{
+    switch (c->format) {
+        case HAP_FORMAT_BOOL:
+            return a->b == b->b;
+        case HAP_FORMAT_UINT8:
+        case HAP_FORMAT_UINT32:
+            return a->u == b->u;
+        case HAP_FORMAT_UINT64:
+            return a->u64 == b->u64;
+        case HAP_FORMAT_INT:
+            return a->i == b->i;
+        case HAP_FORMAT_FLOAT:
+            return a->f == b->f;
+        default:
+            /* strings and data are owned by the application, the pointer may not mean much */
+            return false;
+    }
+}
+
+/* origin is the connection that wrote the value, NULL for the application's changes */
+static int _event_post(struct hap_accessory* a, void* ev, const union hap_value* value, struct hap_connection* origin)
+{
+    struct hap_attr_characteristic* c = _attr_character_handle(a, ev);
+    if (c == NULL)
+        return -1;
+
+    /* pushing the value a cached characteristic already holds changes nothing */
+    if (c->cached) {
+        bool changed = !_event_value_equal(c, &c->value, value);
+        c->value = *value;
+        if (c->ev_index < 0 || !changed)
+            return 0;
+    }
+
+    if (c->ev_index < 0)
+        return -1;
+
+    c->value = *value;
+    /* whoever changed it last, the others have to hear of it */
+    c->ev_origin = origin;
+    if (c->ev_queued)
+        return 0;
+
+    if (c->ev_sent && _event_value_equal(c, &c->ev_sent_value, value))
+        return 0;
+
+    c->ev_queued = true;
+    a->ev_queue[a->nr_ev_queue++] = ev;
+    if (!c->ev_deferrable)
+        a->ev_urgent = true;
+    return 0;
+}
+
+int hap_acc_event_post(struct hap_accessory* a, void* ev, const union hap_value* value)
 {
-    struct hap_attr_characteristic* c = ev;
-    cJSON* root = cJSON_CreateObject();
-    cJSON* characteristics = cJSON_CreateArray();
-    cJSON_AddItemToObject(root, "characteristics", characteristics);
-    cJSON* char_json = _characteristic_value_to_json(c, value);
-    cJSON_AddItemToArray(characteristics, char_json);
+    return _event_post(a, ev, value, NULL);
+}
 
-    *res_body = cJSON_PrintUnformatted(root);
-    *res_body_len = strlen(*res_body);
-    cJSON_Delete(root);
+int hap_acc_event_collect(struct hap_accessory* a)
+{
+    a->nr_ev_collected = 0;
+    for (int i=0; i<a->nr_ev_queue; i++) {
+        struct hap_attr_characteristic* c = _attr_character_handle(a, a->ev_queue[i]);
+        c->ev_queued = false;
+        if (c->ev_sent && _event_value_equal(c, &c->ev_sent_value, &c->value))
+            continue;
 
-    *res_header = calloc(1, strlen(header_event_200_fmt) + 16);
-    sprintf(*res_header, header_event_200_fmt, *res_body_len);
-    *res_header_len = strlen(*res_header);
+        c->ev_sent = true;
+        c->ev_sent_value = c->value;
+        a->ev_collected[a->nr_ev_collected++] = a->ev_queue[i];
+    }
+    a->nr_ev_queue = 0;
+    a->ev_urgent = false;
+
+    return a->nr_ev_collected;
 }
 
-void hap_acc_event_response_free(char* res_header, char* res_body)
+int hap_acc_event_response(struct hap_accessory* a, struct hap_connection* hc, char* res_header, int* res_header_len, char* res_body, int* res_body_len)
 {
-    if (res_header)
-        free(res_header);
-    if (res_body)
-        free(res_body);
+    int nr_events = 0;
+    struct json json;
+    json_init(&json, res_body, *res_body_len);
+    json_literal(&json, "{\"characteristics\":[");
+
+    for (int i=0; i<a->nr_ev_collected; i++) {
+        void* ev = a->ev_collected[i];
+        struct hap_attr_characteristic* c = _attr_character_handle(a, ev);
+        /* the writer isn't notified of its own write */
+        if (!_event_subscribed(hc, c) || c->ev_origin == hc)
+            continue;
+
+        if (nr_events++)
+            json_literal(&json, ",");
+        _characteristic_value_to_json_text(&json, NULL, HANDLE_AID(ev), c, &c->ev_sent_value, 0);
+    }
+
+    json_literal(&json, "]}");
+
+    if (nr_events == 0) {
+        *res_header_len = 0;
+        *res_body_len = 0;
+        return 0;
+    }
+
+    if (_body_length(&json, res_body_len) < 0)
+        return -1;
+
+    return http_header_write(&header_event_200, *res_body_len, res_header, res_header_len);
 }
 
 void* hap_acc_accessory_add(void* acc_instance)
 {
     struct hap_accessory* a = acc_instance;
 
+    void** index = realloc(a->attr_accessories_index, sizeof(void*) * (a->last_aid + 1));
+    if (index == NULL) {
+        printf("realloc failed. size:%d\n", a->last_aid + 1);
+        return NULL;
+    }
+    a->attr_accessories_index = index;
+
     struct hap_acc_accessory* attr_a = calloc(1, sizeof(struct hap_acc_accessory));
-    attr_a->aid = ++a->last_aid;
-    list_add_tail(&attr_a->list, &a->attr_accessories);
-    INIT_LIST_HEAD(&attr_a->services);
+    if (attr_a == NULL) {
+        printf("calloc failed. size:%d\n", (int)sizeof(struct hap_acc_accessory));
+        return NULL;
+    }
+    attr_a->aid = a->last_aid + 1;
+    attr_a->a = a;
+    a->attr_accessories_index[a->last_aid++] = attr_a;
 
     return (void*)attr_a;
 }
 
+static int _event_queue_grow(struct hap_accessory* a, int nr_ev_index)
+{
+    /* a characteristic is queued at most once */
+    void** queue = realloc(a->ev_queue, sizeof(void*) * nr_ev_index);
+    if (queue == NULL) {
+        printf("realloc failed. size:%d\n", nr_ev_index);
+        return -1;
+    }
+    a->ev_queue = queue;
+
+    void** collected = realloc(a->ev_collected, sizeof(void*) * nr_ev_index);
+    if (collected == NULL) {
+        printf("realloc failed. size:%d\n", nr_ev_index);
+        return -1;
+    }
+    a->ev_collected = collected;
+
+    return 0;
+}
+
+struct hap_characteristic_meta {
+    uint8_t perms;
+    uint8_t format;
+    uint8_t unit;
+};
+
+/* indexed by type, the types that aren't listed are left all zero */
+#define CHARACTERISTIC_META(type, perms, format, unit) [type] = { perms, format, unit },
+static const struct hap_characteristic_meta _characteristic_meta[] = {
+    HAP_CHARACTERISTICS(CHARACTERISTIC_META)
+};
+#undef CHARACTERISTIC_META
+
 static void _characteristic_properties_define(struct hap_attr_characteristic* c)
 {
-    switch (c->type) {
-        case HAP_CHARACTER_ADMINISTRATOR_ONLY_ACCESS:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_BOOL;
-            break;
-        case HAP_CHARACTER_AUDIO_FEEDBACK:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_BOOL;
-            break;
-        case HAP_CHARACTER_BRIGHTNESS:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_INT;
-            break;
-        case HAP_CHARACTER_COOLING_THRESHOLD_TEMPERATURE:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_FLOAT;
-            break;
-        case HAP_CHARACTER_CURRENT_DOOR_STATE:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_CURRENT_HEATING_COOLING_STATE:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_CURRENT_RELATIVE_HUMIDITY:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_FLOAT;
-            break;
+    if (c->type >= ARRAY_SIZE(_characteristic_meta))
+        return;
+
+    const struct hap_characteristic_meta* meta = &_characteristic_meta[c->type];
+    c->perms = meta->perms;
+    c->format = meta->format;
+    c->unit = meta->unit;
+}
+
+/*
+ * Readings that drift slowly. Held back in power save mode, everything
+ * else, like detections, contacts and switch presses, goes out right away
+ * and takes the held events along.
+ */
+static bool _event_deferrable(enum hap_characteristic_type type)
+{
+    switch (type) {
         case HAP_CHARACTER_CURRENT_TEMPERATURE:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_FLOAT;
-            break;
-        case HAP_CHARACTER_FIRMWARE_REVISION:
-            c->perms = PERMS_READ;
-            c->format = FORMAT_STRING;
-            break;
-        case HAP_CHARACTER_HARDWARE_REVISION:
-            c->perms = PERMS_READ;
-            c->format = FORMAT_STRING;
-            break;
-        case HAP_CHARACTER_HEATING_THRESHOLD_TEMPERATURE:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_FLOAT;
-            break;
-        case HAP_CHARACTER_HUE:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_FLOAT;
-            break;
-        case HAP_CHARACTER_IDENTIFY:
-            c->perms = PERMS_WRITE;
-            c->format = FORMAT_BOOL;
-            break;
-        case HAP_CHARACTER_LOCK_CONTROL_POINT:
-            c->perms = PERMS_WRITE;
-            c->format = FORMAT_TLV8;
-            break;
-        case HAP_CHARACTER_LOCK_CURRENT_STATE:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_LOCK_LAST_KNOWN_ACTION:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_LOCK_MANAGEMENT_AUTO_SECURITY_TIMEOUT:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_UINT32;
-            break;
-        case HAP_CHARACTER_LOCK_TARGET_STATE:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_LOGS:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_TLV8;
-            break;
-        case HAP_CHARACTER_MANUFACTURER:
-            c->perms = PERMS_READ;
-            c->format = FORMAT_STRING;
-            break;
-        case HAP_CHARACTER_MODEL:
-            c->perms = PERMS_READ;
-            c->format = FORMAT_STRING;
-            break;
-        case HAP_CHARACTER_MOTION_DETECTED:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_BOOL;
-            break;
-        case HAP_CHARACTER_NAME:
-            c->perms = PERMS_READ;
-            c->format = FORMAT_STRING;
-            break;
-        case HAP_CHARACTER_OBSTRUCTION_DETECTED:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_BOOL;
-            break;
-        case HAP_CHARACTER_ON:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_BOOL;
-            break;
-        case HAP_CHARACTER_OUTLET_IN_USE:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_BOOL;
-            break;
-        case HAP_CHARACTER_ROTATION_DIRECTION:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_INT;
-            break;
-        case HAP_CHARACTER_ROTATION_SPEED:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_FLOAT;
-            break;
-        case HAP_CHARACTER_SATURATION:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_FLOAT;
-            break;
-        case HAP_CHARACTER_SERIAL_NUMBER:
-            c->perms = PERMS_READ;
-            c->format = FORMAT_STRING;
-            break;
-        case HAP_CHARACTER_TARGET_DOORSTATE:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_TARGET_HEATING_COOLING_STATE:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_TARGET_RELATIVE_HUMIDITY:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_FLOAT;
-            break;
-        case HAP_CHARACTER_TARGET_TEMPERATURE:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_FLOAT;
-            break;
-        case HAP_CHARACTER_TEMPERATURE_DISPLAY_UNITS:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_VERSION:
-            c->perms = PERMS_READ;
-            c->format = FORMAT_STRING;
-            break;
-        case HAP_CHARACTER_AIR_PARTICULATE_DENSITY:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_FLOAT;
-            break;
-        case HAP_CHARACTER_AIR_PARTICULATE_SIZE:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_SECURITY_SYSTEM_CURRENT_STATE:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_SECURITY_SYSTEM_TARGET_STATE:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_BATTERY_LEVER:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_CARBON_MONOXIDE_DETECTED:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_CONTACT_SENSOR_STATE:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
+        case HAP_CHARACTER_CURRENT_RELATIVE_HUMIDITY:
         case HAP_CHARACTER_CURRENT_AMBIENT_LIGHT_LEVEL:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_FLOAT;
-            break;
-        case HAP_CHARACTER_CURRENT_HORIZONTAL_TILT_ANGLE:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_INT;
-            break;
-        case HAP_CHARACTER_CURRENT_POSITION:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_CURRENT_VERTICAL_TILT_ANGLE:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_INT;
-            break;
-        case HAP_CHARACTER_HOLD_POSITION:
-            c->perms = PERMS_WRITE;
-            c->format = FORMAT_BOOL;
-            break;
-        case HAP_CHARACTER_LEAK_DETECTED:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_OCCUPANCY_DETECTED:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_POSITION_STATE:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_PROGRAMMABLE_SWITCH_EVENT:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_STATUS_ACTIVE:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_BOOL;
-            break;
-        case HAP_CHARACTER_SMOKE_DETECTED:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_STATUS_FAULT:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_STATUS_JAMMED:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_STATUS_LOW_BATTERY:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_STATUS_TAMPERED:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_TARGET_HORIZONTAL_TILT_ANGLE:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_INT;
-            break;
-        case HAP_CHARACTER_TARGET_POSITION:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_TARGET_VERTICAL_TILT_ANGLE:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_INT;
-            break;
-        case HAP_CHARACTER_SECURITY_SYSTEM_ALARM_TYPE:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
+        case HAP_CHARACTER_BATTERY_LEVER:
         case HAP_CHARACTER_CHARGING_STATE:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
+        case HAP_CHARACTER_AIR_QUALITY:
+        case HAP_CHARACTER_AIR_PARTICULATE_DENSITY:
         case HAP_CHARACTER_CARBON_MONOXIDE_LEVEL:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_FLOAT;
-            break;
         case HAP_CHARACTER_CARBON_MONOXIDE_PEAK_LEVEL:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_FLOAT;
-            break;
-        case HAP_CHARACTER_CARBON_DIOXIDE_DETECTED:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
         case HAP_CHARACTER_CARBON_DIOXIDE_LEVEL:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_FLOAT;
-            break;
         case HAP_CHARACTER_CARBON_DIOXIDE_PEAK_LEVEL:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_FLOAT;
-            break;
-        case HAP_CHARACTER_AIR_QUALITY:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_STREAMING_STATUS:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_TLV8;
-            break;
-        case HAP_CHARACTER_SUPPORTED_VIDEO_STREAMING_CONFIGURATION:
-            c->perms = PERMS_READ;
-            c->format = FORMAT_TLV8;
-            break;
-        case HAP_CHARACTER_SUPPORTED_AUDIO_STREAMING_CONFIGURATION:
-            c->perms = (PERMS_READ);
-            c->format = FORMAT_TLV8;
-            break;
-        case HAP_CHARACTER_SUPPORTED_RTP_CONFIGURATION:
-            c->perms = (PERMS_READ);
-            c->format = FORMAT_TLV8;
-            break;
-        case HAP_CHARACTER_SETUP_ENDPOINTS:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_TLV8;
-            break;
-        case HAP_CHARACTER_SELECTED_RTP_STREAM_CONFIGURATION:
-            c->perms = (PERMS_WRITE);
-            c->format = FORMAT_TLV8;
-            break;
-        case HAP_CHARACTER_VOLUME:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_MUTE:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_BOOL;
-            break;
-        case HAP_CHARACTER_NIGHT_VISION:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_BOOL;
-            break;
-        case HAP_CHARACTER_OPTICAL_ZOOM:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_FLOAT;
-            break;
-        case HAP_CHARACTER_DIGITAL_ZOOM:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_FLOAT;
-            break;
-        case HAP_CHARACTER_IMAGE_ROTATION:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_FLOAT;
-            break;
-        case HAP_CHARACTER_IMAGE_MIRRORING:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_BOOL;
-            break;
-        case HAP_CHARACTER_ACCESSORY_FLAGS:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT32;
-            break;
-        case HAP_CHARACTER_LOCK_PHYSICAL_CONTROLS:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_CURRENT_AIR_PURIFIER_STATE:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_CURRENT_SLAT_STATE:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_SLAT_TYPE:
-            c->perms = PERMS_READ;
-            c->format = FORMAT_UINT8;
-            break;
         case HAP_CHARACTER_FILTER_LIFE_LEVEL:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_FLOAT;
-            break;
-        case HAP_CHARACTER_FILTER_CHANGE_INDICATION:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_RESET_FILTER_INDICATION:
-            c->perms = PERMS_WRITE;
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_TARGET_AIR_PURIFIER_STATE:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_TARGET_FAN_STATE:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_CURRENT_FAN_STATE:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_ACTIVE:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_SWING_MODE:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_CURRENT_TILT_ANGLE:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_INT;
-            break;
-        case HAP_CHARACTER_TARGET_TILT_ANGLE:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_INT;
-            break;
         case HAP_CHARACTER_OZONE_DENSITY:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_FLOAT;
-            break;
         case HAP_CHARACTER_NITROGEN_DIOXIDE_DENSITY:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_FLOAT;
-            break;
         case HAP_CHARACTER_SULPHUR_DIOXIDE_DENSITY:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_FLOAT;
-            break;
         case HAP_CHARACTER_PM2_5_DENSITY:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_FLOAT;
-            break;
         case HAP_CHARACTER_PM10_DENSITY:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_FLOAT;
-            break;
         case HAP_CHARACTER_VOC_DENSITY:
-            c->perms = (PERMS_READ | PERMS_EVENT);
-            c->format = FORMAT_FLOAT;
-            break;
-        case HAP_CHARACTER_SERVICE_LABEL_INDEX:
-            c->perms = PERMS_READ;
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_SERVICE_LABEL_NAMESPACE:
-            c->perms = PERMS_READ;
-            c->format = FORMAT_UINT8;
-            break;
-        case HAP_CHARACTER_COLOR_TEMPERATURE:
-            c->perms = (PERMS_READ | PERMS_WRITE | PERMS_EVENT);
-            c->format = FORMAT_UINT32;
-            break;
+            return true;
         default:
-            break;
+            return false;
+    }
+}
+
+/* shared with every characteristic of the accessory that registered the same callbacks */
+static const struct hap_attr_callbacks* _callbacks_get(struct hap_acc_accessory* attr_a, const struct hap_characteristic_ex* cs)
+{
+    struct hap_attr_callbacks cb = {
+        .arg = cs->base.callback_arg,
+        .read = cs->base.read,
+        .write = cs->base.write,
+        .read_value = cs->read_value,
+        .write_value = cs->write_value,
+        .event = cs->base.event,
+    };
+
+    if (!cb.read && !cb.write && !cb.read_value && !cb.write_value && !cb.event)
+        return &_no_callbacks;
+
+    for (int i=0; i<attr_a->nr_callbacks; i++) {
+        if (memcmp(attr_a->callbacks[i], &cb, sizeof(cb)) == 0)
+            return attr_a->callbacks[i];
+    }
+
+    struct hap_attr_callbacks** callbacks = realloc(attr_a->callbacks,
+            sizeof(struct hap_attr_callbacks*) * (attr_a->nr_callbacks + 1));
+    if (callbacks == NULL) {
+        printf("realloc failed. size:%d\n", attr_a->nr_callbacks + 1);
+        return NULL;
+    }
+    attr_a->callbacks = callbacks;
+
+    struct hap_attr_callbacks* shared = malloc(sizeof(cb));
+    if (shared == NULL) {
+        printf("malloc failed. size:%d\n", (int)sizeof(cb));
+        return NULL;
     }
+    *shared = cb;
+    attr_a->callbacks[attr_a->nr_callbacks++] = shared;
+
+    return shared;
 }
 
-void* hap_acc_service_and_characteristics_add(void* _attr_a,
+static int _constraints_set(struct hap_attr_characteristic* c, const struct hap_characteristic_ex* cs)
+{
+    bool valid_values = cs->override_valid_values && cs->valid_values;
+    if (!cs->override_max_value && !cs->override_min_value && !cs->override_min_step && !valid_values)
+        return 0;
+
+    int nr_valid_values = valid_values ? cs->num_valid_values : 0;
+    struct hap_attr_constraints* r = calloc(1, sizeof(struct hap_attr_constraints) + sizeof(int) * nr_valid_values);
+    if (r == NULL) {
+        printf("calloc failed. size:%d\n", nr_valid_values);
+        return -1;
+    }
+
+    r->override_max_value = cs->override_max_value;
+    r->max_value = _value_from_legacy(c, cs->max_value);
+
+    r->override_min_value = cs->override_min_value;
+    r->min_value = _value_from_legacy(c, cs->min_value);
+
+    r->override_min_step = cs->override_min_step;
+    r->min_step = _value_from_legacy(c, cs->min_step);
+
+    r->override_valid_values = valid_values;
+    r->num_valid_values = nr_valid_values;
+    if (nr_valid_values)
+        memcpy(r->valid_values, cs->valid_values, sizeof(int) * nr_valid_values);
+
+    c->constraints = r;
+    return 0;
+}
+
+/*
+ * The arrays are grown first and the characteristics set up past the end
+ * of them. Nothing is counted until all of them are, so on a failure the
+ * accessory is left as it was.
+ */
+int hap_acc_service_and_characteristics_add(void* _attr_a,
         enum hap_service_type type, struct hap_characteristic_ex* cs, int nr_cs) 
 {
     struct hap_acc_accessory* attr_a = _attr_a;
-    struct hap_attr_service* attr_s = calloc(1, sizeof(struct hap_attr_service) + sizeof(struct hap_attr_characteristic) * nr_cs);
-    attr_s->iid = ++attr_a->last_iid;
-    attr_s->type = type;;
-    attr_s->nr_character = nr_cs;
-    list_add_tail(&attr_s->list, &attr_a->services);
+    struct hap_accessory* a = attr_a->a;
+    int last_iid = attr_a->last_iid + 1 + nr_cs;
+
+    uint16_t* index = realloc(attr_a->characters_index, sizeof(uint16_t) * (last_iid + 1));
+    if (index == NULL) {
+        printf("realloc failed. size:%d\n", last_iid + 1);
+        return -1;
+    }
+    attr_a->characters_index = index;
 
-    struct hap_attr_characteristic* c = (struct hap_attr_characteristic*)&attr_s->characters;
+    struct hap_attr_service* services = realloc(attr_a->services,
+            sizeof(struct hap_attr_service) * (attr_a->nr_services + 1));
+    if (services == NULL) {
+        printf("realloc failed. size:%d\n", attr_a->nr_services + 1);
+        return -1;
+    }
+    attr_a->services = services;
+
+    struct hap_attr_characteristic* characters = realloc(attr_a->characters,
+            sizeof(struct hap_attr_characteristic) * (attr_a->nr_characters + nr_cs));
+    if (characters == NULL) {
+        printf("realloc failed. size:%d\n", attr_a->nr_characters + nr_cs);
+        return -1;
+    }
+    attr_a->characters = characters;
+
+    int service_iid = attr_a->last_iid + 1;
+    int nr_ev_index = a->nr_ev_index;
+    struct hap_attr_characteristic* first = &attr_a->characters[attr_a->nr_characters];
+    memset(first, 0, sizeof(struct hap_attr_characteristic) * nr_cs);
     for (int i=0; i<nr_cs; i++) {
-        c->callback_arg = cs[i].base.callback_arg;
-        c->iid = ++attr_a->last_iid;
+        struct hap_attr_characteristic* c = &first[i];
+        c->iid = service_iid + 1 + i;
         c->type = cs[i].base.type;
-        c->initial_value = cs[i].base.initial_value;
-        c->read = cs[i].base.read;
-        c->write = cs[i].base.write;
-        c->event = cs[i].base.event;
-        
-        c->override_max_value = cs[i].override_max_value;
-        c->max_value = cs[i].max_value;
-
-        c->override_min_value = cs[i].override_min_value;
-        c->min_value = cs[i].min_value;
-
-        c->override_min_step = cs[i].override_min_step;
-        c->min_step = cs[i].min_step;
-
-        if (cs[i].override_valid_values && cs[i].valid_values) {
-            c->override_valid_values = true;
-            c->num_valid_values = cs[i].num_valid_values;
-            c->valid_values = calloc(c->num_valid_values, sizeof(int));
-            memcpy(c->valid_values, cs[i].valid_values, c->num_valid_values * sizeof(int));
-        } else {
-            c->override_valid_values = false;
-            c->num_valid_values = 0;
-            c->valid_values = NULL;
-        }
+        c->cached = cs[i].cached;
+        c->cb = _callbacks_get(attr_a, &cs[i]);
+        if (c->cb == NULL)
+            goto err;
 
-        c->aid = attr_a->aid;
+        /* the format decides how the void* values are taken */
         _characteristic_properties_define(c);
-        c++;
+        c->value = _value_from_legacy(c, cs[i].base.initial_value);
+
+        if (_constraints_set(c, &cs[i]) < 0)
+            goto err;
+
+        c->ev_index = -1;
+        c->ev_deferrable = _event_deferrable(c->type);
+        if (c->perms & HAP_PERMS_EVENT) {
+            if (_event_queue_grow(a, nr_ev_index + 1) < 0)
+                goto err;
+            c->ev_index = nr_ev_index++;
+        }
     }
 
-    return NULL;
+    struct hap_attr_service* attr_s = &attr_a->services[attr_a->nr_services++];
+    attr_s->iid = service_iid;
+    attr_s->type = type;
+    attr_s->first = attr_a->nr_characters;
+    attr_s->nr_character = nr_cs;
+    attr_a->characters_index[service_iid] = 0;
+
+    for (int i=0; i<nr_cs; i++) {
+        attr_a->characters_index[first[i].iid] = ++attr_a->nr_characters;
+        if (cs[i].handle)
+            *cs[i].handle = HANDLE(attr_a->aid, first[i].iid);
+    }
+    attr_a->last_iid = last_iid;
+    a->nr_ev_index = nr_ev_index;
+
+    return 0;
+
+err:
+    /* the shared callbacks stay, a later service may use them */
+    for (int i=0; i<nr_cs; i++)
+        free((void*)first[i].constraints);
+    return -1;
 }
@@ -5,21 +5,25 @@
 extern "C" {
 #endif
 
+bool hap_acc_event_subscribed(struct hap_connection* hc, void* ev_handle);
 void hap_acc_event_free(struct hap_connection* hc);
-void hap_acc_event_response_free(char* res_header, char* res_body);
-void hap_acc_event_response(void* ev, void* value, char** res_header, int* res_header_len, char** res_body, int* res_body_len);
+int hap_acc_event_post(struct hap_accessory* a, void* ev, const union hap_value* value);
+int hap_acc_event_collect(struct hap_accessory* a);
+int hap_acc_event_response(struct hap_accessory* a, struct hap_connection* hc, char* res_header, int* res_header_len, char* res_body, int* res_body_len);
 
-int hap_acc_characteristic_get(struct hap_accessory* a, char* query, int len, char** res_header, int* res_header_len, char** res_body, int* res_body_len);
-void hap_acc_characteristic_get_free(char* res_header, char* res_body);
+int hap_acc_characteristic_get(struct hap_accessory* a, struct hap_connection* hc, char* query, int len, char* res_header, int* res_header_len, char** res_body, int* res_body_len);
 
-int hap_acc_characteristic_put(struct hap_accessory* a, void* ev_handle, char* req_body, int req_body_len, char** res_header, int* res_header_len, char** res_body, int* res_body_len);
-void hap_acc_characteristic_put_free(char* res_header, char* res_body);
+int hap_acc_characteristic_put(struct hap_accessory* a, struct hap_connection* hc, char* req_body, int req_body_len, char* res_header, int* res_header_len);
 
-int hap_acc_accessories_do(struct hap_accessory* a, char** res_header, int* res_header_len, char** res_body, int* res_body_len);
-void hap_acc_accessories_do_free(char* res_header, char* res_body);
+int hap_acc_accessories_do(struct hap_accessory* a, char* res_header, int* res_header_len, char** res_body, int* res_body_len);
+void hap_acc_accessories_do_free(char* res_body);
+void hap_acc_accessories_invalidate(struct hap_accessory* a);
+
+/* converts a value of the void* API, the format of ev decides how */
+union hap_value hap_acc_value_from_legacy(struct hap_accessory* a, void* ev, void* value);
 
 void* hap_acc_accessory_add(void* acc_instance);
-void* hap_acc_service_and_characteristics_add(void* _attr_a,
+int hap_acc_service_and_characteristics_add(void* _attr_a,
         enum hap_service_type type, struct hap_characteristic_ex* cs, int nr_cs); 
 
 #ifdef __cplusplus
@@ -8,7 +8,8 @@
 
 #define HAP_SERVICE "_hap"
 #define HAP_PROTO "_tcp"
-#define SERVICE_TXT_LEN 4
+/* decimal uint32_t and its terminator */
+#define SERVICE_TXT_LEN 11
 
 struct advertiser {
     char* name;
@@ -23,15 +24,32 @@ struct advertiser {
     //mdns_server_t* mdns;
 };
 
+static void _txt_uint(char txt[SERVICE_TXT_LEN], uint32_t value)
+{
+    char digits[SERVICE_TXT_LEN];
+    int len = 0;
+    do {
+        digits[len++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+
+    for (int i=0; i<len; i++)
+        txt[i] = digits[len - 1 - i];
+    txt[len] = 0;
+}
+
+static void _txt_sf_set(struct advertiser* adv)
+{
+    _txt_uint(adv->service_txt_sf, adv->state == ADVERTISE_ACCESSORY_STATE_NOT_PAIRED ? 1 : 0);
+}
+
+/* the whole set, only when the service is added */
 static void _service_txt_set(struct advertiser* adv) {
 #define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
 
-    memset(adv->service_txt_c_sharp, 0, sizeof(adv->service_txt_c_sharp));
-    sprintf(adv->service_txt_c_sharp, "%d", adv->config_number);
-    memset(adv->service_txt_sf, 0, sizeof(adv->service_txt_sf));
-    sprintf(adv->service_txt_sf, "%d", adv->state == ADVERTISE_ACCESSORY_STATE_NOT_PAIRED ? 1 : 0);
-    memset(adv->service_txt_ci, 0, sizeof(adv->service_txt_ci));
-    sprintf(adv->service_txt_ci, "%d", adv->category);
+    _txt_uint(adv->service_txt_c_sharp, adv->config_number);
+    _txt_sf_set(adv);
+    _txt_uint(adv->service_txt_ci, adv->category);
 
     mdns_txt_item_t hap_service_txt[] = {
         {"c#", adv->service_txt_c_sharp},
@@ -70,7 +88,23 @@ void advertise_accessory_state_set(void* adv_instance, enum advertise_accessory_
         return;
 
     adv->state = state;
-    _service_txt_set(adv);
+    _txt_sf_set(adv);
+    mdns_service_txt_item_set(HAP_SERVICE, HAP_PROTO, "sf", adv->service_txt_sf);
+}
+
+void advertise_accessory_config_number_set(void* adv_instance, uint32_t config_number) {
+    if (adv_instance == NULL) {
+        printf("[ERR] Invalid arg\n");
+        return;
+    }
+
+    struct advertiser* adv = adv_instance;
+    if (adv->config_number == config_number)
+        return;
+
+    adv->config_number = config_number;
+    _txt_uint(adv->service_txt_c_sharp, adv->config_number);
+    mdns_service_txt_item_set(HAP_SERVICE, HAP_PROTO, "c#", adv->service_txt_c_sharp);
 }
 
 void* advertise_accessory_add(char* name, char* id, char* host, int port, uint32_t config_number,
@@ -1,33 +1,354 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <esp_log.h>
+#ifndef CONFIG_HOMEKIT_AEAD_FAST
 #include <wolfssl/wolfcrypt/chacha20_poly1305.h>
+#endif
 
 #include "chacha20_poly1305.h"
 
 #define TAG "CHACHA20_POLY1305"
 
+/* length field in front of each session frame, authenticated as aad */
+#define FRAME_AAD_LENGTH    2
+
 static uint8_t nonce[][CHACHA20_POLY1305_NONCE_LENGTH] = {
     {0, 0, 0, 0, 'P', 'S', '-', 'M', 's', 'g', '0', '5'},
     {0, 0, 0, 0, 'P', 'S', '-', 'M', 's', 'g', '0', '6'},
     {0, 0, 0, 0, 'P', 'V', '-', 'M', 's', 'g', '0', '2'},
     {0, 0, 0, 0, 'P', 'V', '-', 'M', 's', 'g', '0', '3'},
+    {0, 0, 0, 0, 'P', 'R', '-', 'M', 's', 'g', '0', '1'},
+    {0, 0, 0, 0, 'P', 'R', '-', 'M', 's', 'g', '0', '2'},
 };
 
 static uint8_t* _type_to_nonce(enum chacha20_poly1305_type type) {
     return nonce[type];
 }
 
+#ifdef CONFIG_HOMEKIT_AEAD_FAST
+/*
+ * RFC 8439 ChaCha20 and Poly1305, written for the LX6: the 16 state words
+ * of a block stay in locals through the unrolled rounds, and Poly1305 works
+ * on 26-bit limbs held in 32-bit words so every product fits the 32x32->64
+ * multiply (MULL/MULUH) of the core.
+ */
+#define CHACHA20_BLOCK_LENGTH   64
+#define POLY1305_BLOCK_LENGTH   16
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTER_ROUND(a, b, c, d)   \
+    a += b; d ^= a; d = ROTL32(d, 16); \
+    c += d; b ^= c; b = ROTL32(b, 12); \
+    a += b; d ^= a; d = ROTL32(d, 8);  \
+    c += d; b ^= c; b = ROTL32(b, 7);
+
+static inline uint32_t _le32(const uint8_t* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void _le32_put(uint8_t* p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+struct chacha20 {
+    uint32_t input[16];
+};
+
+static void _chacha20_init(struct chacha20* ctx, const uint8_t* key)
+{
+    ctx->input[0] = 0x61707865;
+    ctx->input[1] = 0x3320646e;
+    ctx->input[2] = 0x79622d32;
+    ctx->input[3] = 0x6b206574;
+    for (int i=0; i<8; i++)
+        ctx->input[4 + i] = _le32(key + i * 4);
+}
+
+static void _chacha20_nonce(struct chacha20* ctx, const uint8_t* nonce)
+{
+    ctx->input[12] = 0;
+    ctx->input[13] = _le32(nonce);
+    ctx->input[14] = _le32(nonce + 4);
+    ctx->input[15] = _le32(nonce + 8);
+}
+
+/* key stream of the next block, the block counter moves on */
+static void _chacha20_block(struct chacha20* ctx, uint8_t out[CHACHA20_BLOCK_LENGTH])
+{
+    const uint32_t* in = ctx->input;
+    uint32_t x0 = in[0], x1 = in[1], x2 = in[2], x3 = in[3];
+    uint32_t x4 = in[4], x5 = in[5], x6 = in[6], x7 = in[7];
+    uint32_t x8 = in[8], x9 = in[9], x10 = in[10], x11 = in[11];
+    uint32_t x12 = in[12], x13 = in[13], x14 = in[14], x15 = in[15];
+
+    for (int i=0; i<10; i++) {
+        QUARTER_ROUND(x0, x4, x8, x12);
+        QUARTER_ROUND(x1, x5, x9, x13);
+        QUARTER_ROUND(x2, x6, x10, x14);
+        QUARTER_ROUND(x3, x7, x11, x15);
+        QUARTER_ROUND(x0, x5, x10, x15);
+        QUARTER_ROUND(x1, x6, x11, x12);
+        QUARTER_ROUND(x2, x7, x8, x13);
+        QUARTER_ROUND(x3, x4, x9, x14);
+    }
+
+    _le32_put(out + 0, x0 + in[0]);
+    _le32_put(out + 4, x1 + in[1]);
+    _le32_put(out + 8, x2 + in[2]);
+    _le32_put(out + 12, x3 + in[3]);
+    _le32_put(out + 16, x4 + in[4]);
+    _le32_put(out + 20, x5 + in[5]);
+    _le32_put(out + 24, x6 + in[6]);
+    _le32_put(out + 28, x7 + in[7]);
+    _le32_put(out + 32, x8 + in[8]);
+    _le32_put(out + 36, x9 + in[9]);
+    _le32_put(out + 40, x10 + in[10]);
+    _le32_put(out + 44, x11 + in[11]);
+    _le32_put(out + 48, x12 + in[12]);
+    _le32_put(out + 52, x13 + in[13]);
+    _le32_put(out + 56, x14 + in[14]);
+    _le32_put(out + 60, x15 + in[15]);
+
+    ctx->input[12]++;
+}
+
+/* in and out may be the same buffer */
+static void _chacha20_xor(struct chacha20* ctx, const uint8_t* in, int len, uint8_t* out)
+{
+    uint8_t stream[CHACHA20_BLOCK_LENGTH];
+
+    while (len > 0) {
+        _chacha20_block(ctx, stream);
+
+        int n = len < CHACHA20_BLOCK_LENGTH ? len : CHACHA20_BLOCK_LENGTH;
+        for (int i=0; i<n; i++)
+            out[i] = in[i] ^ stream[i];
+
+        in += n;
+        out += n;
+        len -= n;
+    }
+}
+
+struct poly1305 {
+    uint32_t r[5];
+    uint32_t h[5];
+    uint32_t pad[4];
+};
+
+static void _poly1305_init(struct poly1305* ctx, const uint8_t key[32])
+{
+    ctx->r[0] = (_le32(key + 0)) & 0x3ffffff;
+    ctx->r[1] = (_le32(key + 3) >> 2) & 0x3ffff03;
+    ctx->r[2] = (_le32(key + 6) >> 4) & 0x3ffc0ff;
+    ctx->r[3] = (_le32(key + 9) >> 6) & 0x3f03fff;
+    ctx->r[4] = (_le32(key + 12) >> 8) & 0x00fffff;
+
+    memset(ctx->h, 0, sizeof(ctx->h));
+
+    for (int i=0; i<4; i++)
+        ctx->pad[i] = _le32(key + 16 + i * 4);
+}
+
+/* len is a multiple of the block length, the AEAD pads everything */
+static void _poly1305_blocks(struct poly1305* ctx, const uint8_t* m, int len)
+{
+    const uint32_t r0 = ctx->r[0], r1 = ctx->r[1], r2 = ctx->r[2], r3 = ctx->r[3], r4 = ctx->r[4];
+    const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2], h3 = ctx->h[3], h4 = ctx->h[4];
+
+    while (len >= POLY1305_BLOCK_LENGTH) {
+        h0 += (_le32(m + 0)) & 0x3ffffff;
+        h1 += (_le32(m + 3) >> 2) & 0x3ffffff;
+        h2 += (_le32(m + 6) >> 4) & 0x3ffffff;
+        h3 += (_le32(m + 9) >> 6) & 0x3ffffff;
+        h4 += (_le32(m + 12) >> 8) | (1 << 24);
+
+        uint64_t d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 + (uint64_t)h2 * s3 + (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+        uint64_t d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 + (uint64_t)h2 * s4 + (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+        uint64_t d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 + (uint64_t)h2 * r0 + (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+        uint64_t d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 + (uint64_t)h2 * r1 + (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+        uint64_t d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 + (uint64_t)h2 * r2 + (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+
+        uint32_t c;
+        c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & 0x3ffffff;
+        d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3ffffff;
+        d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3ffffff;
+        d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3ffffff;
+        d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3ffffff;
+        h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+        h1 += c;
+
+        m += POLY1305_BLOCK_LENGTH;
+        len -= POLY1305_BLOCK_LENGTH;
+    }
+
+    ctx->h[0] = h0;
+    ctx->h[1] = h1;
+    ctx->h[2] = h2;
+    ctx->h[3] = h3;
+    ctx->h[4] = h4;
+}
+
+/* feeds data zero padded to the block length */
+static void _poly1305_padded(struct poly1305* ctx, const uint8_t* m, int len)
+{
+    int full = len & ~(POLY1305_BLOCK_LENGTH - 1);
+    _poly1305_blocks(ctx, m, full);
+
+    if (len > full) {
+        uint8_t block[POLY1305_BLOCK_LENGTH] = {0,};
+        memcpy(block, m + full, len - full);
+        _poly1305_blocks(ctx, block, POLY1305_BLOCK_LENGTH);
+    }
+}
+
+static void _poly1305_finish(struct poly1305* ctx, uint8_t tag[CHACHA20_POLY1305_AUTH_TAG_LENGTH])
+{
+    uint32_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2], h3 = ctx->h[3], h4 = ctx->h[4];
+    uint32_t c;
+
+    c = h1 >> 26; h1 &= 0x3ffffff;
+    h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+    h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+    h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+    h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+    h1 += c;
+
+    /* h - p, taken when h >= p, without branching on h */
+    uint32_t g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+    uint32_t g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+    uint32_t g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+    uint32_t g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+    uint32_t g4 = h4 + c - (1 << 26);
+
+    uint32_t mask = (g4 >> 31) - 1;
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+    h3 = (h3 & ~mask) | (g3 & mask);
+    h4 = (h4 & ~mask) | (g4 & mask);
+
+    h0 = h0 | (h1 << 26);
+    h1 = (h1 >> 6) | (h2 << 20);
+    h2 = (h2 >> 12) | (h3 << 14);
+    h3 = (h3 >> 18) | (h4 << 8);
+
+    uint64_t f;
+    f = (uint64_t)h0 + ctx->pad[0]; h0 = (uint32_t)f;
+    f = (uint64_t)h1 + ctx->pad[1] + (f >> 32); h1 = (uint32_t)f;
+    f = (uint64_t)h2 + ctx->pad[2] + (f >> 32); h2 = (uint32_t)f;
+    f = (uint64_t)h3 + ctx->pad[3] + (f >> 32); h3 = (uint32_t)f;
+
+    _le32_put(tag + 0, h0);
+    _le32_put(tag + 4, h1);
+    _le32_put(tag + 8, h2);
+    _le32_put(tag + 12, h3);
+}
+
+/*
+ * Poly1305 tag over aad and cipher text. The one-time key is block 0 of the
+ * key stream, which leaves the ChaCha20 state at block 1 for the payload.
+ */
+static void _aead_tag(struct chacha20* chacha, const uint8_t* aad, int aad_len,
+        const uint8_t* cipher_text, int len, uint8_t tag[CHACHA20_POLY1305_AUTH_TAG_LENGTH])
+{
+    uint8_t block0[CHACHA20_BLOCK_LENGTH];
+    _chacha20_block(chacha, block0);
+
+    struct poly1305 poly;
+    _poly1305_init(&poly, block0);
+    _poly1305_padded(&poly, aad, aad_len);
+    _poly1305_padded(&poly, cipher_text, len);
+
+    uint8_t lengths[POLY1305_BLOCK_LENGTH] = {0,};
+    _le32_put(lengths, aad_len);
+    _le32_put(lengths + 8, len);
+    _poly1305_blocks(&poly, lengths, POLY1305_BLOCK_LENGTH);
+
+    _poly1305_finish(&poly, tag);
+}
+
+static void _seal_with(struct chacha20* chacha, const uint8_t* aad, int aad_len,
+        const uint8_t* plain_text, int len, uint8_t* cipher_text, uint8_t* tag)
+{
+    /* the tag needs the cipher text, the payload is encrypted from block 1 on */
+    chacha->input[12] = 1;
+    _chacha20_xor(chacha, plain_text, len, cipher_text);
+
+    chacha->input[12] = 0;
+    _aead_tag(chacha, aad, aad_len, cipher_text, len, tag);
+}
+
+static int _seal(const uint8_t* key, const uint8_t* nonce, const uint8_t* aad, int aad_len,
+        const uint8_t* plain_text, int len, uint8_t* cipher_text, uint8_t* tag)
+{
+    struct chacha20 chacha;
+    _chacha20_init(&chacha, key);
+    _chacha20_nonce(&chacha, nonce);
+    _seal_with(&chacha, aad, aad_len, plain_text, len, cipher_text, tag);
+    return 0;
+}
+
+static int _open(const uint8_t* key, const uint8_t* nonce, const uint8_t* aad, int aad_len,
+        const uint8_t* cipher_text, int len, const uint8_t* tag, uint8_t* plain_text)
+{
+    struct chacha20 chacha;
+    _chacha20_init(&chacha, key);
+    _chacha20_nonce(&chacha, nonce);
+
+    uint8_t expected[CHACHA20_POLY1305_AUTH_TAG_LENGTH];
+    _aead_tag(&chacha, aad, aad_len, cipher_text, len, expected);
+
+    uint8_t diff = 0;
+    for (int i=0; i<CHACHA20_POLY1305_AUTH_TAG_LENGTH; i++)
+        diff |= expected[i] ^ tag[i];
+    if (diff)
+        return -1;
+
+    _chacha20_xor(&chacha, cipher_text, len, plain_text);
+    return 0;
+}
+#else
+static int _seal(const uint8_t* key, const uint8_t* nonce, const uint8_t* aad, int aad_len,
+        const uint8_t* plain_text, int len, uint8_t* cipher_text, uint8_t* tag)
+{
+    return wc_ChaCha20Poly1305_Encrypt(key, nonce, aad, aad_len, plain_text, len, cipher_text, tag);
+}
+
+static int _open(const uint8_t* key, const uint8_t* nonce, const uint8_t* aad, int aad_len,
+        const uint8_t* cipher_text, int len, const uint8_t* tag, uint8_t* plain_text)
+{
+    return wc_ChaCha20Poly1305_Decrypt(key, nonce, aad, aad_len, cipher_text, len, tag, plain_text);
+}
+#endif
+
+void chacha20_poly1305_counter_nonce(uint8_t nonce[CHACHA20_POLY1305_NONCE_LENGTH], uint64_t count)
+{
+    memset(nonce, 0, 4);
+    for (int i=0; i<8; i++) {
+        nonce[4 + i] = count & 0xff;
+        count >>= 8;
+    }
+}
+
 int chacha20_poly1305_decrypt_with_nonce(uint8_t* nonce, uint8_t* key, uint8_t* aad, int aad_len, uint8_t* encrypted, int encrypted_len, uint8_t* decrypted)
 {
     uint8_t* cipher_text = encrypted;
-    int cipher_text_len = encrypted_len - CHACHA20_POLY1305_AEAD_AUTHTAG_SIZE;
+    int cipher_text_len = encrypted_len - CHACHA20_POLY1305_AUTH_TAG_LENGTH;
     uint8_t* auth_tag = encrypted + cipher_text_len;
 
-    int err = wc_ChaCha20Poly1305_Decrypt(key, nonce, aad, aad_len, cipher_text, cipher_text_len, auth_tag, decrypted);
+    int err = _open(key, nonce, aad, aad_len, cipher_text, cipher_text_len, auth_tag, decrypted);
     if (err < 0) {
-        ESP_LOGE(TAG, "wc_ChaCha20Poly1305_Decrypt failed. err:%d\n", err);
+        ESP_LOGE(TAG, "decrypt failed. err:%d\n", err);
         return -1;
     }
 
@@ -48,14 +369,61 @@ int chacha20_poly1305_encrypt_with_nonce(uint8_t nonce[CHACHA20_POLY1305_NONCE_L
         uint8_t* encrypted)
 {
     uint8_t* auth_tag = encrypted + plain_text_length;
-    int err = wc_ChaCha20Poly1305_Encrypt(key, nonce, aad, aad_len, plain_text, plain_text_length, encrypted, auth_tag);
+    int err = _seal(key, nonce, aad, aad_len, plain_text, plain_text_length, encrypted, auth_tag);
     if (err < 0) {
-        ESP_LOGE(TAG, "wc_ChaCha20Poly1305_Encrypt failed. err:%d\n", err);
+        ESP_LOGE(TAG, "encrypt failed. err:%d\n", err);
         return -1;
     }
     return 0;
 }
 
+/*
+ * Each frame is its 2 byte little endian length, the plain text and room
+ * for the tag. The key is set up once for all of them, only the nonce
+ * changes from frame to frame.
+ */
+int chacha20_poly1305_encrypt_frames(uint8_t* key, uint64_t* count, uint8_t* frames, int len)
+{
+#ifdef CONFIG_HOMEKIT_AEAD_FAST
+    struct chacha20 chacha;
+    _chacha20_init(&chacha, key);
+#endif
+
+    while (len > 0) {
+        if (len < FRAME_AAD_LENGTH) {
+            ESP_LOGE(TAG, "truncated frame. len:%d\n", len);
+            return -1;
+        }
+
+        int plain_len = frames[1] * 256 + frames[0];
+        int frame_len = FRAME_AAD_LENGTH + plain_len + CHACHA20_POLY1305_AUTH_TAG_LENGTH;
+        if (frame_len > len) {
+            ESP_LOGE(TAG, "truncated frame. len:%d frame:%d\n", len, frame_len);
+            return -1;
+        }
+
+        uint8_t frame_nonce[CHACHA20_POLY1305_NONCE_LENGTH];
+        chacha20_poly1305_counter_nonce(frame_nonce, (*count)++);
+
+        uint8_t* plain_text = frames + FRAME_AAD_LENGTH;
+#ifdef CONFIG_HOMEKIT_AEAD_FAST
+        _chacha20_nonce(&chacha, frame_nonce);
+        _seal_with(&chacha, frames, FRAME_AAD_LENGTH, plain_text, plain_len, plain_text, plain_text + plain_len);
+#else
+        int err = _seal(key, frame_nonce, frames, FRAME_AAD_LENGTH, plain_text, plain_len, plain_text, plain_text + plain_len);
+        if (err < 0) {
+            ESP_LOGE(TAG, "encrypt failed. err:%d\n", err);
+            return -1;
+        }
+#endif
+
+        frames += frame_len;
+        len -= frame_len;
+    }
+
+    return 0;
+}
+
 
 int chacha20_poly1305_encrypt(enum chacha20_poly1305_type type, uint8_t* key, 
         uint8_t* aad, int aad_len,
@@ -15,6 +15,8 @@ enum chacha20_poly1305_type {
     CHACHA20_POLY1305_TYPE_PS06,
     CHACHA20_POLY1305_TYPE_PV02,
     CHACHA20_POLY1305_TYPE_PV03,
+    CHACHA20_POLY1305_TYPE_PR01,
+    CHACHA20_POLY1305_TYPE_PR02,
 };
 
 int chacha20_poly1305_decrypt(enum chacha20_poly1305_type type, uint8_t* key, 
@@ -31,6 +33,11 @@ int chacha20_poly1305_encrypt_with_nonce(uint8_t nonce[CHACHA20_POLY1305_NONCE_L
         uint8_t* plain_text, int plain_text_length, 
         uint8_t* encrypted);
 
+/* session nonce: 32 zero bits and the 64-bit frame counter in little endian */
+void chacha20_poly1305_counter_nonce(uint8_t nonce[CHACHA20_POLY1305_NONCE_LENGTH], uint64_t count);
+/* encrypts consecutive session frames in place, *count is the nonce counter of the first */
+int chacha20_poly1305_encrypt_frames(uint8_t* key, uint64_t* count, uint8_t* frames, int len);
+
 
 #ifdef __cplusplus
 }
@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <stdlib.h>
 #include <esp_log.h>
 
 #include <wolfssl/wolfcrypt/ed25519.h>
@@ -101,3 +102,81 @@ int ed25519_sign(uint8_t public_key[], uint8_t private_key[], uint8_t* in, int i
 
     return 0;
 }
+
+void* ed25519_key_create(uint8_t public_key[], uint8_t private_key[])
+{
+    ed25519_key* key = malloc(sizeof(ed25519_key));
+    if (!key) {
+        ESP_LOGE(TAG, "malloc failed. size:%d\n", sizeof(ed25519_key));
+        return NULL;
+    }
+
+    int err = wc_ed25519_init(key);
+    if (err < 0) {
+        ESP_LOGE(TAG, "wc_ed25519_init. err:%d\n", err);
+        free(key);
+        return NULL;
+    }
+
+    if (private_key)
+        err = wc_ed25519_import_private_key(private_key, ED25519_KEY_SIZE, 
+                private_key + ED25519_KEY_SIZE, ED25519_KEY_SIZE, key);
+    else
+        err = wc_ed25519_import_public(public_key, ED25519_PUBLIC_KEY_LENGTH, key);
+    if (err < 0) {
+        ESP_LOGE(TAG, "wc_ed25519_import failed. err:%d\n", err);
+        wc_ed25519_free(key);
+        free(key);
+        return NULL;
+    }
+
+    return key;
+}
+
+int ed25519_key_sign(void* key, uint8_t* in, int in_len, uint8_t* signatured, int* signatured_len)
+{
+    if (!key) {
+        ESP_LOGE(TAG, "Invalid key\n");
+        return -1;
+    }
+
+    int err = wc_ed25519_sign_msg(in, in_len, signatured, (word32*)signatured_len, key);
+    if (err < 0) {
+        ESP_LOGE(TAG, "wc_ed25519_sign_msg. err:%d\n", err);
+        return err;
+    }
+
+    return 0;
+}
+
+int ed25519_key_verify(void* key, uint8_t* signature, int signature_len, uint8_t* msg, int msg_len)
+{
+    if (!key) {
+        ESP_LOGE(TAG, "Invalid key\n");
+        return -1;
+    }
+
+    int verified = 0;
+    int err = wc_ed25519_verify_msg(signature, signature_len, msg, msg_len, 
+            &verified, key);
+    if (err < 0) {
+        ESP_LOGE(TAG, "wc_ed25519_verify_msg. err:%d\n", err);
+        return err;
+    }
+
+    if (verified == 0) {
+        ESP_LOGE(TAG, "verification failed. err:%d\n", err);
+        return -1;
+    }
+
+    return 0;
+}
+
+void ed25519_key_free(void* key)
+{
+    if (!key)
+        return;
+
+    wc_ed25519_free(key);
+    free(key);
+}
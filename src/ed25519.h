@@ -17,6 +17,15 @@ int ed25519_verify(uint8_t* public_key, int key_len,
 
 int ed25519_sign(uint8_t public_key[], uint8_t private_key[], uint8_t* in, int in_len, uint8_t* signatured, int* signated_len);
 
+/* 
+ * Long-lived key contexts, imported once instead of on every operation.
+ * private_key may be NULL for a verify-only key.
+ */
+void* ed25519_key_create(uint8_t public_key[], uint8_t private_key[]);
+int ed25519_key_sign(void* key, uint8_t* in, int in_len, uint8_t* signatured, int* signatured_len);
+int ed25519_key_verify(void* key, uint8_t* signature, int signature_len, uint8_t* msg, int msg_len);
+void ed25519_key_free(void* key);
+
 #ifdef __cplusplus
 }
 #endif
@@ -4,7 +4,10 @@
 #include <stdint.h>
 
 #include <cJSON.h>
+#include <esp_attr.h>
 #include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
 
 #include "advertise.h"
 #include "chacha20_poly1305.h"
@@ -12,216 +15,704 @@
 #include "hap.h"
 #include "hap_internal.h"
 #include "accessories.h"
+#include "http_header.h"
 #include "httpd.h"
 #include "iosdevice.h"
+#include "logger.h"
+#include "metrics.h"
+/* the kernel style one of list.h, mongoose.h brings its own BSD style one */
+#undef LIST_HEAD
 #include "mongoose.h"
 #include "nvs.h"
 #include "pair_setup.h"
 #include "pair_verify.h"
 #include "pairings.h"
+#include "pool.h"
+#include "worker.h"
 
 #define TAG "HAP"
 
 struct hap {
     int nr_accessory;
-    SemaphoreHandle_t mutex;
+    /* value changes posted by application tasks and ISRs */
+    QueueHandle_t events;
+};
+
+struct hap_event {
+    struct hap_accessory* a;
+    void* ev_handle;
+    /* void* values are converted on the httpd task, see _hap_poll */
+    bool legacy;
+    void* legacy_value;
+    union hap_value value;
 };
 
 static struct hap* _hap_desc;
 
-static void _plain_msg_recv(void* connection, struct mg_connection* nc, char* msg, int len);
+/* bounds the number of sessions, see CONFIG_HOMEKIT_MAX_CONNECTIONS */
+POOL_DEFINE(_connection_pool, struct hap_connection, POOL_NR_CONNECTIONS);
+
+static void _plain_msg_recv(void* connection, struct httpd_conn* nc, struct http_message* hm);
+static void _hap_connection_drain(struct hap_connection* hc);
+static void _batch_begin(struct hap_connection* hc);
+static void _batch_end(struct hap_connection* hc);
 
-static int _decrypt(struct hap_connection* hc, char* encrypted, int len, char* decrypted, uint8_t** saveptr)
-{
 #define AAD_LENGTH 2
-    uint8_t* ptr;
-    if (*saveptr == NULL) {
-        ptr = (uint8_t*)encrypted;
-    }
-    else if (*saveptr < (uint8_t*)encrypted + len) {
-        ptr = *saveptr;
-    }
-    else if (*saveptr == (uint8_t*)encrypted + len){
-        ESP_LOGI(TAG, "_decrypt end %d", (int)((char*)*saveptr - encrypted));
+
+#define RESPONSE_HEADER_LENGTH 128
+#define CHARACTERISTIC_GET_BODY_LENGTH 512
+#define EVENT_BODY_LENGTH 512
+#define HTTP_MESSAGE_MAX_LENGTH (16*1024)
+
+#ifndef HAP_EVENT_INTERVAL_MS
+#define HAP_EVENT_INTERVAL_MS 200
+#endif
+
+/* how long power save mode holds readings back, see _event_deferrable */
+#ifdef CONFIG_HOMEKIT_EVENT_POWER_SAVE
+#define HAP_EVENT_DEFER_INTERVAL_MS CONFIG_HOMEKIT_EVENT_POWER_SAVE_INTERVAL_MS
+#else
+#define HAP_EVENT_DEFER_INTERVAL_MS HAP_EVENT_INTERVAL_MS
+#endif
+
+#ifndef HAP_EVENT_QUEUE_LENGTH
+#define HAP_EVENT_QUEUE_LENGTH 32
+#endif
+
+/* seconds without traffic before a session is closed. 0 keeps it open */
+#ifdef CONFIG_HOMEKIT_IDLE_TIMEOUT_UNVERIFIED
+#define HAP_IDLE_TIMEOUT_UNVERIFIED CONFIG_HOMEKIT_IDLE_TIMEOUT_UNVERIFIED
+#else
+#define HAP_IDLE_TIMEOUT_UNVERIFIED 120
+#endif
+
+#ifdef CONFIG_HOMEKIT_IDLE_TIMEOUT_VERIFIED
+#define HAP_IDLE_TIMEOUT_VERIFIED CONFIG_HOMEKIT_IDLE_TIMEOUT_VERIFIED
+#else
+#define HAP_IDLE_TIMEOUT_VERIFIED 0
+#endif
+
+/*
+ * Decrypts one frame in place. The plain text is left right after the length
+ * field, so no scratch buffer is needed.
+ * Returns the number of bytes the frame occupied, 0 if the frame is not
+ * completely received yet, or -1 if the frame could not be authenticated.
+ */
+static int _decrypt(struct hap_connection* hc, uint8_t* frame, int len, char** decrypted, int* decrypted_len)
+{
+    if (len < AAD_LENGTH)
         return 0;
-    }
-    else {
-        ESP_LOGE(TAG, "BUG? BUG? BUG?");
+
+    int plain_len = frame[1] * 256 + frame[0];
+    int frame_len = AAD_LENGTH + plain_len + CHACHA20_POLY1305_AUTH_TAG_LENGTH;
+    if (len < frame_len)
         return 0;
-    }
 
-    int decrypted_len = ptr[1] * 256 + ptr[0];
-    uint8_t nonce[12] = {0,};
-    nonce[4] = hc->decrypt_count % 256;
-    nonce[5] = hc->decrypt_count++ / 256;
+    uint8_t nonce[CHACHA20_POLY1305_NONCE_LENGTH];
+    chacha20_poly1305_counter_nonce(nonce, hc->decrypt_count++);
 
-    if (chacha20_poly1305_decrypt_with_nonce(nonce, hc->decrypt_key, ptr, AAD_LENGTH, 
-                ptr+AAD_LENGTH, decrypted_len + CHACHA20_POLY1305_AUTH_TAG_LENGTH, (uint8_t*)decrypted) < 0) {
+    int64_t start = metrics_time();
+    uint8_t* cipher_text = frame + AAD_LENGTH;
+    if (chacha20_poly1305_decrypt_with_nonce(nonce, hc->decrypt_key, frame, AAD_LENGTH, 
+                cipher_text, plain_len + CHACHA20_POLY1305_AUTH_TAG_LENGTH, cipher_text) < 0) {
         ESP_LOGE(TAG, "chacha20_poly1305_decrypt_with_nonce failed");
-        return 0;
+        return -1;
     }
+    metrics_crypto(0, plain_len, start);
+    hc->nr_frames++;
 
-    *saveptr = ptr + decrypted_len + CHACHA20_POLY1305_AUTH_TAG_LENGTH + AAD_LENGTH;
+    /* auth tag is not needed anymore. terminate the plain text with it */
+    cipher_text[plain_len] = 0;
 
-    return decrypted_len;;
+    *decrypted = (char*)cipher_text;
+    *decrypted_len = plain_len;
+
+    return frame_len;
 }
 
-static void _encrypted_msg_recv(void* connection, struct mg_connection* nc, char* msg, int len) 
+/* HTTP/1.1 keeps the connection by default, HTTP/1.0 only when asked to */
+static bool _http_keep_alive(struct http_message* hm)
 {
-    char* decrypted = calloc(sizeof(char), len);
-    if (decrypted == NULL) {
-        ESP_LOGE(TAG, "calloc failded. size:%d", len);
-        return;
+    struct mg_str* connection = mg_get_http_header(hm, "Connection");
+    if (connection)
+        return mg_vcasecmp(connection, "close") != 0;
+
+    return mg_vcmp(&hm->proto, "HTTP/1.0") != 0;
+}
+
+static const char* _endpoint_names[] = {
+    [HAP_METRICS_PAIR_SETUP] = "pair-setup",
+    [HAP_METRICS_PAIR_VERIFY] = "pair-verify",
+    [HAP_METRICS_ACCESSORIES] = "accessories",
+    [HAP_METRICS_CHARACTERISTICS_GET] = "characteristics GET",
+    [HAP_METRICS_CHARACTERISTICS_PUT] = "characteristics PUT",
+    [HAP_METRICS_PAIRINGS] = "pairings",
+    [HAP_METRICS_NR_ENDPOINTS] = "unknown",
+};
+
+/* endpoint a request is logged and counted under */
+static int _request_endpoint(struct http_message* hm)
+{
+    if (strncmp(hm->uri.p, "/pair-setup", hm->uri.len) == 0)
+        return HAP_METRICS_PAIR_SETUP;
+    if (strncmp(hm->uri.p, "/pair-verify", hm->uri.len) == 0)
+        return HAP_METRICS_PAIR_VERIFY;
+    if (strncmp(hm->uri.p, "/accessories", hm->uri.len) == 0)
+        return HAP_METRICS_ACCESSORIES;
+    if (strncmp(hm->uri.p, "/characteristics", hm->uri.len) == 0) {
+        if (strncmp(hm->method.p, "GET", hm->method.len) == 0)
+            return HAP_METRICS_CHARACTERISTICS_GET;
+        if (strncmp(hm->method.p, "PUT", hm->method.len) == 0)
+            return HAP_METRICS_CHARACTERISTICS_PUT;
+    }
+    if (strncmp(hm->uri.p, "/pairings", hm->uri.len) == 0)
+        return HAP_METRICS_PAIRINGS;
+
+    return HAP_METRICS_NR_ENDPOINTS;
+}
+
+/*
+ * Hands the complete HTTP requests at the start of buf to _plain_msg_recv,
+ * back to back, and returns how many bytes they took. A partial request is
+ * left in place. Once its headers are in, its total length is kept in
+ * hc->msg_len so it is not parsed again until all of it has arrived.
+ * It stops early while a pairing job is in flight or when the session just
+ * switched to encryption, _hap_connection_drain picks up the rest.
+ * A request that does not keep the connection alive is the last one served.
+ * Returns -1 on a malformed or oversized request.
+ */
+static int _http_frame(struct hap_connection* hc, char* buf, int len)
+{
+    bool verified = hc->pair_verified;
+    int consumed = 0;
+
+    while (consumed < len) {
+        if (hc->nr_jobs || hc->pair_verified != verified || 
+                hc->last_request || httpd_closing(hc->nc))
+            break;
+
+        char* msg = buf + consumed;
+        int msg_len = len - consumed;
+        if (hc->msg_len && msg_len < hc->msg_len)
+            break;
+
+        struct http_message hm;
+        int header_len = mg_parse_http(msg, msg_len, &hm, 1);
+        if (header_len < 0)
+            return -1;
+
+        if (header_len == 0) {
+            if (msg_len > HTTP_MESSAGE_MAX_LENGTH)
+                return -1;
+            break;
+        }
+
+        /* a body without Content-Length would run up to the end of the stream */
+        if (hm.body.len == (size_t)~0 || hm.message.len > HTTP_MESSAGE_MAX_LENGTH)
+            return -1;
+
+        hc->msg_len = hm.message.len;
+        if (msg_len < hc->msg_len)
+            break;
+
+        hc->msg_len = 0;
+        consumed += hm.message.len;
+        int endpoint = _request_endpoint(&hm);
+        HAP_LOGI(TAG, "request %p %s", hc->nc, _endpoint_names[endpoint]);
+
+        int64_t start = metrics_time();
+        _plain_msg_recv(hc, hc->nc, &hm);
+        /* the pairing jobs count their own, they finish on the worker */
+        if (endpoint != HAP_METRICS_PAIR_SETUP && endpoint != HAP_METRICS_PAIR_VERIFY)
+            metrics_request(endpoint, start);
+        if (!_http_keep_alive(&hm))
+            hc->last_request = true;
+    }
+
+    /* a pairing job in flight sends its response first, see _pair_done */
+    if (hc->last_request && hc->nr_jobs == 0)
+        httpd_close_after_send(hc->nc);
+
+    return consumed;
+}
+
+static int _buffer_append(struct hap_buffer* b, const char* data, int len)
+{
+    if (b->len + len > b->size) {
+        char* buf = realloc(b->buf, b->len + len);
+        if (buf == NULL) {
+            ESP_LOGE(TAG, "realloc failed. size:%d", b->len + len);
+            return -1;
+        }
+        b->buf = buf;
+        b->size = b->len + len;
     }
 
+    memcpy(b->buf + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+static void _buffer_remove(struct hap_buffer* b, int len)
+{
+    memmove(b->buf, b->buf + len, b->len - len);
+    b->len -= len;
+}
+
+/*
+ * Frames are decrypted in place. While no request is pending, requests are
+ * parsed right out of the decrypted frame. Only a request that spans frames
+ * is copied into hc->plain.
+ */
+static int _encrypted_msg_recv(void* connection, struct httpd_conn* nc, char* msg, int len) 
+{
     struct hap_connection* hc = connection;
-    uint8_t* saveptr = NULL;
-    int decrypted_len = 0;
+    int consumed = 0;
+
+    _batch_begin(hc);
+    while (consumed < len) {
+        char* decrypted = NULL;
+        int decrypted_len = 0;
+
+        int frame_len = _decrypt(hc, (uint8_t*)msg + consumed, len - consumed, &decrypted, &decrypted_len);
+        if (frame_len == 0)
+            break;
+
+        if (frame_len < 0)
+            goto err;
+
+        consumed += frame_len;
 
-    for (decrypted_len = _decrypt(hc, msg, len, decrypted, &saveptr); decrypted_len; 
-         decrypted_len = _decrypt(hc, msg, len, decrypted, &saveptr)) {
-        _plain_msg_recv(connection, nc, decrypted, decrypted_len);
+        if (hc->plain.len == 0) {
+            int framed = _http_frame(hc, decrypted, decrypted_len);
+            if (framed < 0)
+                goto err;
+
+            if (framed < decrypted_len && 
+                    _buffer_append(&hc->plain, decrypted + framed, decrypted_len - framed) < 0)
+                goto err;
+        }
+        else {
+            if (_buffer_append(&hc->plain, decrypted, decrypted_len) < 0)
+                goto err;
+
+            int framed = _http_frame(hc, hc->plain.buf, hc->plain.len);
+            if (framed < 0)
+                goto err;
+            _buffer_remove(&hc->plain, framed);
+        }
     }
+    _batch_end(hc);
 
-    free(decrypted);
+    return consumed;
+
+err:
+    _batch_end(hc);
+    ESP_LOGE(TAG, "bad request, closing %p", nc);
+    httpd_close(nc);
+    return len;
 }
 
 
-static char* _encrypt(struct hap_connection* hc, char* msg, int len, int* encrypted_len)
+#define FRAME_MAX_LENGTH 1024
+
+struct frame_segment {
+    const char* data;
+    int len;
+};
+
+static int _frames_length(int len)
 {
-#define AAD_LENGTH 2
-    char* encrypted = calloc(1, len + (len / 1024 + 1) * (AAD_LENGTH + CHACHA20_POLY1305_AUTH_TAG_LENGTH) + 1);
-    *encrypted_len = 0;
+    int nr_frames = (len + FRAME_MAX_LENGTH - 1) / FRAME_MAX_LENGTH;
+    return len + nr_frames * (AAD_LENGTH + CHACHA20_POLY1305_AUTH_TAG_LENGTH);
+}
 
-    uint8_t nonce[12] = {0,};
-    uint8_t* decrypted_ptr = (uint8_t*)msg;
-    uint8_t* encrypted_ptr = (uint8_t*)encrypted;
+/*
+ * Encrypts the segments as one message straight into the send buffer of the
+ * connection. Each frame's plain text is gathered from the segments into the
+ * send buffer once and encrypted in place there. The frames that fit into
+ * the room the transport has are encrypted in one call, with mongoose that
+ * is all of them.
+ */
+static int _frames_send(struct hap_connection* hc, const struct frame_segment* segs, int nr_segs)
+{
+    uint64_t encrypt_count = hc->encrypt_count;
+    bool committed = false;
+
+    int len = 0;
+    for (int i=0; i<nr_segs; i++) {
+        len += segs[i].len;
+    }
+
+    int seg = 0;
+    int seg_offset = 0;
     while (len > 0) {
-        int chunk_len = (len < 1024) ? len : 1024;
-        len -= chunk_len;
+        int first_len = (len < FRAME_MAX_LENGTH) ? len : FRAME_MAX_LENGTH;
+        int room;
+        uint8_t* out = (uint8_t*)httpd_send_buffer(hc->nc, _frames_length(len),
+                _frames_length(first_len), &room);
+        if (out == NULL)
+            goto err;
+
+        int out_len = 0;
+        int plain_len = 0;
+        while (len > 0) {
+            int chunk_len = (len < FRAME_MAX_LENGTH) ? len : FRAME_MAX_LENGTH;
+            if (out_len + _frames_length(chunk_len) > room)
+                break;
+            len -= chunk_len;
+            plain_len += chunk_len;
+
+            out[out_len++] = chunk_len % 256;
+            out[out_len++] = chunk_len / 256;
+
+            int filled = 0;
+            while (filled < chunk_len) {
+                int n = segs[seg].len - seg_offset;
+                if (n > chunk_len - filled)
+                    n = chunk_len - filled;
+
+                if (n > 0)
+                    memcpy(out + out_len, segs[seg].data + seg_offset, n);
+                out_len += n;
+                filled += n;
+                seg_offset += n;
+                if (seg_offset == segs[seg].len) {
+                    seg++;
+                    seg_offset = 0;
+                }
+            }
+
+            out_len += CHACHA20_POLY1305_AUTH_TAG_LENGTH;
+        }
+
+        /* all frames in the room in one call, the key is set up once */
+        uint64_t batch_count = hc->encrypt_count;
+        int64_t start = metrics_time();
+        if (chacha20_poly1305_encrypt_frames(hc->encrypt_key, &hc->encrypt_count, out, out_len) < 0) {
+            hc->encrypt_count = batch_count;
+            goto err;
+        }
+        metrics_crypto(plain_len, 0, start);
+
+        httpd_send_commit(hc->nc, out_len);
+        committed = true;
+    }
 
-        uint8_t aad[AAD_LENGTH];
-        aad[0] = chunk_len % 256;
-        aad[1] = chunk_len / 256;
+    hc->nr_frames += hc->encrypt_count - encrypt_count;
+    return 0;
 
-        memcpy(encrypted_ptr, aad, AAD_LENGTH);
-        encrypted_ptr += AAD_LENGTH;
-        *encrypted_len += AAD_LENGTH;
+err:
+    ESP_LOGE(TAG, "frames send failed. length:%d", len);
+    /* the peer has part of the message, the stream can't be resumed */
+    if (committed) {
+        hc->nr_frames += hc->encrypt_count - encrypt_count;
+        httpd_close(hc->nc);
+    }
+    else {
+        hc->encrypt_count = encrypt_count;
+    }
+    return -1;
+}
 
-        nonce[4] = hc->encrypt_count % 256;
-        nonce[5] = hc->encrypt_count++ / 256;
+static int _batch_flush(struct hap_connection* hc)
+{
+    if (hc->batch.len == 0)
+        return 0;
 
-        chacha20_poly1305_encrypt_with_nonce(nonce, hc->encrypt_key, aad, AAD_LENGTH, decrypted_ptr, chunk_len, encrypted_ptr);
+    struct frame_segment seg = {hc->batch.buf, hc->batch.len};
+    hc->batch.len = 0;
+    return _frames_send(hc, &seg, 1);
+}
 
-        decrypted_ptr += chunk_len;
-        encrypted_ptr += chunk_len + CHACHA20_POLY1305_AUTH_TAG_LENGTH;
-        *encrypted_len += (chunk_len + CHACHA20_POLY1305_AUTH_TAG_LENGTH);
+/*
+ * Responses to requests that came in together are held back in hc->batch
+ * while it fits in one frame, so pipelined requests cost one seal and one
+ * write instead of one each. Bigger responses go out as they are, after
+ * whatever is held back.
+ */
+static int _encrypt_send(struct hap_connection* hc, const struct frame_segment* segs, int nr_segs)
+{
+    if (hc->batching == 0)
+        return _frames_send(hc, segs, nr_segs);
+
+    int len = 0;
+    for (int i=0; i<nr_segs; i++) {
+        len += segs[i].len;
     }
 
-    return encrypted;
+    if (hc->batch.len + len > FRAME_MAX_LENGTH && _batch_flush(hc) < 0)
+        return -1;
+
+    if (len > FRAME_MAX_LENGTH)
+        return _frames_send(hc, segs, nr_segs);
+
+    int batch_len = hc->batch.len;
+    for (int i=0; i<nr_segs; i++) {
+        if (segs[i].len && _buffer_append(&hc->batch, segs[i].data, segs[i].len) < 0) {
+            hc->batch.len = batch_len;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void _batch_begin(struct hap_connection* hc)
+{
+    hc->batching++;
 }
 
-static void _encrypt_free(char* msg) 
+static void _batch_end(struct hap_connection* hc)
 {
-    if (msg)
-        free(msg);
+    if (--hc->batching == 0)
+        _batch_flush(hc);
+}
+
+static void encrypt_send(struct httpd_conn* nc, struct hap_connection* hc, char* res_header, int header_len, char* body, int body_len)
+{
+    struct frame_segment segs[] = {
+        {res_header, res_header ? header_len : 0},
+        {body, body ? body_len : 0},
+    };
+
+    _encrypt_send(hc, segs, sizeof(segs) / sizeof(segs[0]));
 }
 
-static void encrypt_send(struct mg_connection* nc, struct hap_connection* hc, char* res_header, int header_len, char* body, int body_len)
+static const struct http_header header_500 = HTTP_HEADER_FIXED(
+    "HTTP/1.1 500 Internal Server Error\r\n"
+    "Connection: close\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n");
+
+/* a response that couldn't be built, the controller is told before the connection goes */
+static void _internal_error_send(struct httpd_conn* nc, struct hap_connection* hc)
 {
-    char* plain_text = calloc(1, header_len + body_len + 64);
-    if (res_header)
-        memcpy(plain_text, res_header, header_len);
+    encrypt_send(nc, hc, (char*)header_500.text, header_500.len, NULL, 0);
+    httpd_close_after_send(nc);
+}
 
-    if (body)
-        memcpy(plain_text + header_len, body, body_len);
+/*
+ * The public key operations of pair-setup and pair-verify take up to
+ * seconds. They run on the worker so the httpd task keeps serving the other
+ * sessions, the response is sent when the job comes back.
+ * The connection is kept alive until then, even when it is closed.
+ */
+enum pair_job_type {
+    PAIR_JOB_SETUP,
+    PAIR_JOB_VERIFY,
+};
 
-    int encrypted_len = 0;
-    char* encrypted = _encrypt(hc, plain_text, strlen(plain_text), &encrypted_len);
+struct pair_job {
+    struct hap_connection* hc;
+    enum pair_job_type type;
 
-    free(plain_text);
+    char* req_body;
+    int req_body_len;
 
-    mg_send(nc, encrypted, encrypted_len);
-    _encrypt_free(encrypted);
+    char res_header[RESPONSE_HEADER_LENGTH];
+    int res_header_len;
+    char* res_body;
+    int res_body_len;
+
+    bool verified;
+    char session_key[CURVE25519_SECRET_LENGTH];
+    char controller_id[IOSDEVICE_ID_LEN];
+
+    /* submitted at, the latency counts the wait for the worker too */
+    int64_t start;
+
+    /* ran inline from _http_frame, which goes on with the buffers itself */
+    bool inline_done;
+};
+
+/* sf=1 invites controllers to pair, it follows whether anyone is paired */
+static void _advertise_pairing_update(struct hap_accessory* a)
+{
+    bool paired = iosdevice_pairings_foreach(a->iosdevices, NULL, NULL) > 0;
+    advertise_accessory_state_set(a->advertise,
+            paired ? ADVERTISE_ACCESSORY_STATE_PAIRED : ADVERTISE_ACCESSORY_STATE_NOT_PAIRED);
 }
 
-static void _plain_msg_recv(void* connection, struct mg_connection* nc, char* msg, int len)
+static void _hap_connection_free(struct hap_connection* hc)
 {
-    struct hap_connection* hc = connection;
-    struct hap_accessory* a = hc->a;
-    struct http_message shm, *hm = &shm;
+    if (hc->pair_setup)
+        pair_setup_cleanup(hc->pair_setup);
 
-    char* http_raw_msg = msg;
-    int http_raw_msg_len = len;
-    mg_parse_http(http_raw_msg, http_raw_msg_len, hm, 1);
+    if (hc->pair_verify)
+        pair_verify_cleanup(hc->pair_verify);
 
-    char addr[32];
-    mg_sock_addr_to_str(&nc->sa, addr, sizeof(addr),
-            MG_SOCK_STRINGIFY_IP | MG_SOCK_STRINGIFY_PORT);
+    free(hc->plain.buf);
+    free(hc->batch.buf);
+    pool_free(&_connection_pool, hc);
+}
 
-    ESP_LOGI(TAG, "HTTP request from %s: %.*s %.*s", addr, (int) hm->method.len,
-            hm->method.p, (int) hm->uri.len, hm->uri.p);
+static void _pair_work(void* arg)
+{
+    struct pair_job* job = arg;
+    struct hap_connection* hc = job->hc;
 
-    if (strncmp(hm->uri.p, "/pair-setup", strlen("/pair-setup")) == 0) {
-        if (hc->pair_setup == NULL) {
-            hc->pair_setup = pair_setup_init(a->id, a->pincode, a->iosdevices, a->keys.public, a->keys.private);
-        }
+    int err;
 
-        char* res_header = NULL;
-        int res_header_len = 0;
+    job->res_header_len = sizeof(job->res_header);
+    if (job->type == PAIR_JOB_SETUP) {
+        err = pair_setup_do(hc->pair_setup, job->req_body, job->req_body_len, 
+                job->res_header, &job->res_header_len, &job->res_body, &job->res_body_len);
+    }
+    else {
+        err = pair_verify_do(hc->pair_verify, job->req_body, job->req_body_len, 
+                job->res_header, &job->res_header_len, &job->res_body, &job->res_body_len,
+                &job->verified, job->session_key, job->controller_id);
+    }
 
-        char* res_body = NULL;
-        int body_len = 0;
+    if (err < 0)
+        job->res_header_len = 0;
+}
 
-        pair_setup_do(hc->pair_setup, hm->body.p, hm->body.len, &res_header, &res_header_len, &res_body, &body_len);
+static void _pair_done(void* arg)
+{
+    struct pair_job* job = arg;
+    struct hap_connection* hc = job->hc;
 
-        if (res_header) {
-            mg_send(nc, res_header, res_header_len);
-        }
+    metrics_request(job->type == PAIR_JOB_SETUP ? HAP_METRICS_PAIR_SETUP : HAP_METRICS_PAIR_VERIFY, job->start);
 
-        if (res_body) {
-            mg_send(nc, res_body, body_len);
-        }
+    /* a failed attempt counts even when the client has hung up meanwhile */
+    if (job->type == PAIR_JOB_SETUP)
+        pair_setup_done(hc->pair_setup);
 
-        pair_setup_do_free(res_header, res_body);
+    hc->nr_jobs--;
+    if (hc->closed) {
+        if (hc->nr_jobs == 0)
+            _hap_connection_free(hc);
+        goto out;
     }
-    else if (strncmp(hm->uri.p, "/pair-verify", hm->uri.len) == 0) {
-        if (hc->pair_verify == NULL) {
-            hc->pair_verify = pair_verify_init(a->id, a->iosdevices, a->keys.public, a->keys.private);
-        }
 
-        char* res_header = NULL;
-        int res_header_len = 0;
+    if (job->type == PAIR_JOB_SETUP)
+        _advertise_pairing_update(hc->a);
 
-        char* res_body = NULL;
-        int body_len = 0;
+    if (job->res_header_len) {
+        httpd_send(hc->nc, job->res_header, job->res_header_len);
+    }
+
+    if (job->res_body) {
+        httpd_send(hc->nc, job->res_body, job->res_body_len);
+    }
 
-        pair_verify_do(hc->pair_verify, hm->body.p, hm->body.len, &res_header, &res_header_len, &res_body, &body_len, &hc->pair_verified, hc->session_key);
+    if (hc->last_request)
+        httpd_close_after_send(hc->nc);
+
+    if (job->verified) {
+        memcpy(hc->session_key, job->session_key, CURVE25519_SECRET_LENGTH);
+        memcpy(hc->controller_id, job->controller_id, IOSDEVICE_ID_LEN);
+        hkdf_key_get(HKDF_KEY_TYPE_CONTROL_READ, (uint8_t*)hc->session_key, CURVE25519_SECRET_LENGTH, hc->encrypt_key);
+        hkdf_key_get(HKDF_KEY_TYPE_CONTROL_WRITE, (uint8_t*)hc->session_key, CURVE25519_SECRET_LENGTH, hc->decrypt_key);
+        /* new keys, the counters start over */
+        hc->encrypt_count = 0;
+        hc->decrypt_count = 0;
+        hc->pair_verified = true;
+    }
+
+    /* requests that arrived while the job was running */
+    if (!job->inline_done)
+        _hap_connection_drain(hc);
+
+out:
+    if (job->type == PAIR_JOB_SETUP)
+        pair_setup_do_free(job->res_body);
+    else
+        pair_verify_do_free(job->res_body);
+
+    free(job);
+}
+
+static void _pair_submit(struct hap_connection* hc, enum pair_job_type type, const char* req_body, int req_body_len)
+{
+    /* the request body lives in the receive buffer, it is gone once we return */
+    struct pair_job* job = calloc(1, sizeof(struct pair_job) + req_body_len);
+    if (job == NULL) {
+        ESP_LOGE(TAG, "calloc failed. size:%d", (int)sizeof(struct pair_job) + req_body_len);
+        /* unanswered, the controller would wait for the response until it times out */
+        httpd_close(hc->nc);
+        return;
+    }
+
+    job->hc = hc;
+    job->type = type;
+    job->req_body = (char*)(job + 1);
+    job->req_body_len = req_body_len;
+    memcpy(job->req_body, req_body, req_body_len);
+    job->start = metrics_time();
+
+    /* SRP takes seconds, it gives way to the pair-verify of controllers */
+    hc->nr_jobs++;
+    int err = type == PAIR_JOB_SETUP ?
+        worker_submit_background(_pair_work, _pair_done, job) :
+        worker_submit(_pair_work, _pair_done, job);
+    if (err < 0) {
+        job->inline_done = true;
+        _pair_work(job);
+        _pair_done(job);
+    }
+}
+
+static void _plain_msg_recv(void* connection, struct httpd_conn* nc, struct http_message* hm)
+{
+    struct hap_connection* hc = connection;
+    struct hap_accessory* a = hc->a;
 
-        if (res_header) {
-            mg_send(nc, res_header, res_header_len);
+    if (strncmp(hm->uri.p, "/pair-setup", strlen("/pair-setup")) == 0) {
+        if (hc->pair_setup == NULL) {
+            hc->pair_setup = pair_setup_init(a->id, a->pincode, a->iosdevices, a->keys.public, a->keys.ltk);
+            if (hc->pair_setup == NULL) {
+                httpd_close(nc);
+                return;
+            }
         }
 
-        if (res_body) {
-            mg_send(nc, res_body, body_len);
+        /* busy and throttled attempts are answered here, without any SRP */
+        char res_header[RESPONSE_HEADER_LENGTH];
+        int res_header_len = sizeof(res_header);
+        char* res_body = NULL;
+        int res_body_len = 0;
+        int err = pair_setup_admit(hc->pair_setup, hm->body.p, hm->body.len,
+                res_header, &res_header_len, &res_body, &res_body_len);
+        if (err < 0) {
+            httpd_close(nc);
+            return;
+        }
+        if (err == 0) {
+            _pair_submit(hc, PAIR_JOB_SETUP, hm->body.p, hm->body.len);
+            return;
         }
 
-        if (hc->pair_verified) {
-            hkdf_key_get(HKDF_KEY_TYPE_CONTROL_READ, (uint8_t*)hc->session_key, CURVE25519_SECRET_LENGTH, hc->encrypt_key);
-            hkdf_key_get(HKDF_KEY_TYPE_CONTROL_WRITE, (uint8_t*)hc->session_key, CURVE25519_SECRET_LENGTH, hc->decrypt_key);
+        httpd_send(nc, res_header, res_header_len);
+        httpd_send(nc, res_body, res_body_len);
+        pair_setup_do_free(res_body);
+    }
+    else if (strncmp(hm->uri.p, "/pair-verify", hm->uri.len) == 0) {
+        if (hc->pair_verify == NULL) {
+            hc->pair_verify = pair_verify_init(a->id, a->iosdevices, a->keys.public, a->keys.ltk);
+            if (hc->pair_verify == NULL) {
+                httpd_close(nc);
+                return;
+            }
         }
 
-        pair_verify_do_free(res_header, res_body);
+        _pair_submit(hc, PAIR_JOB_VERIFY, hm->body.p, hm->body.len);
     }
     else if (strncmp(hm->uri.p, "/accessories", hm->uri.len) == 0) {
-        char* res_header = NULL;
-        int res_header_len = 0;
+        char res_header[RESPONSE_HEADER_LENGTH];
+        int res_header_len = sizeof(res_header);
 
         char* res_body = NULL;
         int body_len = 0;
 
-        hap_acc_accessories_do(a, &res_header, &res_header_len, &res_body, &body_len);
-#ifdef DEBUG
+        if (hap_acc_accessories_do(a, res_header, &res_header_len, &res_body, &body_len) < 0) {
+            hap_acc_accessories_do_free(res_body);
+            _internal_error_send(nc, hc);
+            return;
+        }
+#ifdef CONFIG_HOMEKIT_LOG_BODIES
         {
             ESP_LOGI(TAG, "ACC GET RESPONSE");
             ESP_LOGI(TAG, "Header:\n %s", res_header);
@@ -229,122 +720,203 @@ static void _plain_msg_recv(void* connection, struct mg_connection* nc, char* ms
         }
 #endif
         encrypt_send(nc, hc, res_header, res_header_len, res_body, body_len);
-        hap_acc_accessories_do_free(res_header, res_body);
+        hap_acc_accessories_do_free(res_body);
     }
     else if (strncmp(hm->uri.p, "/characteristics", hm->uri.len) == 0) {
         if (strncmp(hm->method.p, "GET", hm->method.len) == 0) {
             char* query = (char*)hm->query_string.p;
             int query_len = (int)hm->query_string.len;
-            char* res_header = NULL;
-            int res_header_len = 0;
-            char* res_body = NULL;
-            int body_len = 0;
-
-            hap_acc_characteristic_get(a, query, query_len, &res_header, &res_header_len, &res_body, &body_len);
-#ifdef DEBUG
+            char res_header[RESPONSE_HEADER_LENGTH];
+            int res_header_len = sizeof(res_header);
+            char res_body_buf[CHARACTERISTIC_GET_BODY_LENGTH];
+            char* res_body = res_body_buf;
+            int body_len = sizeof(res_body_buf);
+
+            if (hap_acc_characteristic_get(a, hc, query, query_len, res_header, &res_header_len, &res_body, &body_len) < 0) {
+                if (res_body != res_body_buf)
+                    free(res_body);
+                _internal_error_send(nc, hc);
+                return;
+            }
+#ifdef CONFIG_HOMEKIT_LOG_BODIES
             {
                 ESP_LOGI(TAG, "------REQUEST-----");
                 ESP_LOGI(TAG, "%.*s", (int)hm->query_string.len, hm->query_string.p);
                 ESP_LOGI(TAG, "------RESPONSE-----");
-                ESP_LOGI(TAG, "%s%s", res_header, res_body);
+                ESP_LOGI(TAG, "%.*s%.*s", res_header_len, res_header, body_len, res_body);
             }
 #endif
             encrypt_send(nc, hc, res_header, res_header_len, res_body, body_len);
-            hap_acc_characteristic_get_free(res_header, res_body);
+            if (res_body != res_body_buf)
+                free(res_body);
         }
         else if (strncmp(hm->method.p, "PUT", hm->method.len) == 0) {
-            char* res_header = NULL;
-            int res_header_len = 0;
-            char* res_body = NULL;
-            int body_len = 0;
+            char res_header[RESPONSE_HEADER_LENGTH];
+            int res_header_len = sizeof(res_header);
 
-            hap_acc_characteristic_put(a, (void*)hc, (char*)hm->body.p, hm->body.len, &res_header, &res_header_len, &res_body, &body_len);
-#ifdef DEBUG
+            if (hap_acc_characteristic_put(a, hc, (char*)hm->body.p, hm->body.len, res_header, &res_header_len) < 0)
+                return;
+#ifdef CONFIG_HOMEKIT_LOG_BODIES
             {
                 ESP_LOGI(TAG, "------REQUEST-----");
                 ESP_LOGI(TAG, "%.*s", (int)hm->query_string.len, hm->query_string.p);
                 ESP_LOGI(TAG, "%.*s", (int)hm->body.len, (char*)hm->body.p);
                 ESP_LOGI(TAG, "------RESPONSE-----");
-                ESP_LOGI(TAG, "%s", res_header);
+                ESP_LOGI(TAG, "%.*s", res_header_len, res_header);
             }
 #endif
-            encrypt_send(nc, hc, res_header, res_header_len, res_body, body_len);
-            hap_acc_characteristic_put_free(res_header, res_body);
+            encrypt_send(nc, hc, res_header, res_header_len, NULL, 0);
         }
     }
     else if (strncmp(hm->uri.p, "/pairings", hm->uri.len) == 0) {
-        char* res_header = NULL;
-        int res_header_len = 0;
+        char res_header[RESPONSE_HEADER_LENGTH];
+        int res_header_len = sizeof(res_header);
 
         char* res_body = NULL;
         int body_len = 0;
 
-        pairings_do(a->iosdevices, hm->body.p, hm->body.len, &res_header, &res_header_len, &res_body, &body_len);
-        if (res_header) {
-            mg_send(nc, res_header, res_header_len);
-        }
+        if (pairings_do(a->iosdevices, hc->controller_id, hm->body.p, hm->body.len, res_header, &res_header_len, &res_body, &body_len) < 0)
+            res_header_len = 0;
+        if (res_header_len)
+            encrypt_send(nc, hc, res_header, res_header_len, res_body, body_len);
+        pairings_do_free(res_body);
 
-        if (res_body) {
-            mg_send(nc, res_body, body_len);
-        }
-        encrypt_send(nc, hc, res_header, res_header_len, res_body, body_len);
-        pairings_do_free(res_header, res_body);
+        _advertise_pairing_update(a);
     }
     else {
         ESP_LOGW(TAG, "NOT HANDLED");
-#ifdef DEBUG
+#ifdef CONFIG_HOMEKIT_LOG_BODIES
         ESP_LOGW(TAG, "%.*s", (int) hm->uri.len, hm->uri.p);
         ESP_LOGW(TAG, "%c%c%c%c", hm->uri.p[0], hm->uri.p[1], hm->uri.p[2], hm->uri.p[3]);
 #endif
     }
 }
 
-static void _msg_recv(void* connection, struct mg_connection* nc, char* msg, int len)
+static int _msg_recv(void* connection, struct httpd_conn* nc, char* msg, int len)
 {
     struct hap_connection* hc = connection;
+    if (hc == NULL)
+        return len;
 
     if (hc->pair_verified) {
-        _encrypted_msg_recv(connection, nc, msg, len);
+        return _encrypted_msg_recv(connection, nc, msg, len);
     }
-    else {
-        _plain_msg_recv(connection, nc, msg, len);
+
+    int framed = _http_frame(hc, msg, len);
+    if (framed < 0) {
+        ESP_LOGE(TAG, "bad request, closing %p", nc);
+        httpd_close(nc);
+        return len;
     }
+
+    /* pair-verify finished inline, the rest is already encrypted */
+    if (hc->pair_verified && framed < len)
+        framed += _encrypted_msg_recv(connection, nc, msg + framed, len - framed);
+
+    return framed;
 }
 
-static void _hap_connection_close(void* connection, struct mg_connection* nc)
+/* processes what was held back in the buffers, as if it just arrived */
+static void _hap_connection_drain(struct hap_connection* hc)
 {
-    struct hap_connection* hc = connection;
+    struct httpd_conn* nc = hc->nc;
+
+    if (hc->pair_verified && hc->plain.len) {
+        _batch_begin(hc);
+        int framed = _http_frame(hc, hc->plain.buf, hc->plain.len);
+        _batch_end(hc);
+        if (framed < 0) {
+            httpd_close(nc);
+            return;
+        }
+        _buffer_remove(&hc->plain, framed);
+    }
 
+    int len;
+    char* buf = httpd_recv_buffer(nc, &len);
+    if (len == 0)
+        return;
 
-    if (hc->pair_setup)
-        pair_setup_cleanup(hc->pair_setup);
+    int consumed = _msg_recv(hc, nc, buf, len);
+    if (consumed > 0)
+        httpd_recv_consume(nc, consumed);
+}
 
-    if (hc->pair_verify)
-        pair_verify_cleanup(hc->pair_setup);
+static void _hap_connection_close(void* connection, struct httpd_conn* nc)
+{
+    struct hap_connection* hc = connection;
+    if (hc == NULL)
+        return;
 
-    xSemaphoreTake(_hap_desc->mutex, 0);
+    if (hc->nr_frames)
+        ESP_LOGI(TAG, "session %p closed after %llu frames", nc, (unsigned long long)hc->nr_frames);
+
+    hap_acc_event_free(hc);
     list_del(&hc->list);
-    xSemaphoreGive(_hap_desc->mutex);
+    metrics_session(-1);
+
+    if (hc->nr_jobs) {
+        hc->closed = true;
+        return;
+    }
 
-    free(hc);
+    _hap_connection_free(hc);
 }
 
-static void _hap_connection_accept(void* accessory, struct mg_connection* nc)
+/*
+ * Makes room for a new session by dropping the unverified one that has been
+ * quiet the longest. Verified sessions are never evicted, so unverified
+ * connections can't lock paired controllers out.
+ * Sessions with a pairing job on the worker keep their block until the job
+ * is back, they are skipped.
+ */
+static int _hap_connection_evict(struct hap_accessory* a)
+{
+    struct hap_connection* victim = NULL;
+    struct hap_connection* hc;
+    list_for_each_entry(hc, &a->connections, list) {
+        if (hc->pair_verified || hc->nr_jobs)
+            continue;
+        if (!victim || httpd_last_io(hc->nc) < httpd_last_io(victim->nc))
+            victim = hc;
+    }
+
+    if (!victim)
+        return -1;
+
+    ESP_LOGW(TAG, "evicting idle unverified connection %p", victim->nc);
+    struct httpd_conn* nc = victim->nc;
+    httpd_user_data_set(nc, NULL);
+    httpd_close(nc);
+    _hap_connection_close(victim, nc);
+
+    return 0;
+}
+
+static void _hap_connection_accept(void* accessory, struct httpd_conn* nc)
 {
     struct hap_accessory* a = accessory;
-    struct hap_connection* hc = calloc(1, sizeof(struct hap_connection));
+    struct hap_connection* hc = pool_alloc(&_connection_pool);
+    if (hc == NULL && _hap_connection_evict(a) == 0)
+        hc = pool_alloc(&_connection_pool);
+
+    if (hc == NULL) {
+        ESP_LOGW(TAG, "too many connections, refused");
+        httpd_user_data_set(nc, NULL);
+        httpd_close(nc);
+        return;
+    }
 
     hc->nc = nc;
     hc->a = a;
     hc->pair_verified = false;
+    metrics_session(1);
 
 
     //INIT_LIST_HEAD(&hc->event_head);
-    nc->user_data = hc;
+    httpd_user_data_set(nc, hc);
 
-    xSemaphoreTake(_hap_desc->mutex, 0);
     list_add(&hc->list, &a->connections);
-    xSemaphoreGive(_hap_desc->mutex);
 }
 
 static void _accessory_ltk_load(struct hap_accessory* a) 
@@ -378,48 +950,214 @@ static void _accessory_ltk_load(struct hap_accessory* a)
         nvs_set(nvs_public_key, a->keys.public, ED25519_PUBLIC_KEY_LENGTH);
         nvs_set(nvs_private_key, a->keys.private, ED28819_PRIVATE_KEY_LENGTH);
     }
+
+    a->keys.ltk = ed25519_key_create(a->keys.public, a->keys.private);
+}
+
+/*
+ * Value changes are only queued here, the httpd task picks them up and
+ * does the encrypt and send on its own. Neither call blocks, when the
+ * queue is full the change is dropped and -1 is returned.
+ */
+static int _event_queue(struct hap_event* event)
+{
+    if (event->ev_handle == NULL)
+        return -1;
+
+    if (xQueueSend(_hap_desc->events, event, 0) != pdTRUE)
+        return -1;
+
+    httpd_wakeup();
+    return 0;
+}
+
+static int IRAM_ATTR _event_queue_from_isr(struct hap_event* event)
+{
+    BaseType_t woken = pdFALSE;
+
+    if (event->ev_handle == NULL)
+        return -1;
+
+    if (xQueueSendFromISR(_hap_desc->events, event, &woken) != pdTRUE)
+        return -1;
+
+    httpd_wakeup_from_isr(&woken);
+    if (woken == pdTRUE)
+        portYIELD_FROM_ISR();
+
+    return 0;
 }
 
 int hap_event_response(void* acc_instance, void* ev_handle, void* value)
 {
-    char* res_header = NULL;
-    int res_header_len = 0;
-    char* res_body = NULL;
-    int body_len = 0;
+    struct hap_event event = {
+        .a = acc_instance,
+        .ev_handle = ev_handle,
+        .legacy = true,
+        .legacy_value = value,
+    };
 
+    return _event_queue(&event);
+}
 
-    hap_acc_event_response(ev_handle, value, &res_header, &res_header_len, &res_body, &body_len);
+int IRAM_ATTR hap_event_response_from_isr(void* acc_instance, void* ev_handle, void* value)
+{
+    struct hap_event event = {
+        .a = acc_instance,
+        .ev_handle = ev_handle,
+        .legacy = true,
+        .legacy_value = value,
+    };
 
-    struct hap_accessory* a = acc_instance;
-    struct hap_connection* hc;
+    return _event_queue_from_isr(&event);
+}
 
-    xSemaphoreTake(_hap_desc->mutex, 0);
-    list_for_each_entry(hc, &a->connections, list) {
+int hap_event_value_response(void* acc_instance, void* ev_handle, union hap_value value)
+{
+    struct hap_event event = {
+        .a = acc_instance,
+        .ev_handle = ev_handle,
+        .value = value,
+    };
+
+    return _event_queue(&event);
+}
+
+int IRAM_ATTR hap_event_value_response_from_isr(void* acc_instance, void* ev_handle, union hap_value value)
+{
+    struct hap_event event = {
+        .a = acc_instance,
+        .ev_handle = ev_handle,
+        .value = value,
+    };
+
+    return _event_queue_from_isr(&event);
+}
+
+static void _event_send(struct hap_connection* hc)
+{
+    char res_header[RESPONSE_HEADER_LENGTH];
+    int res_header_len = sizeof(res_header);
+    char res_body_buf[EVENT_BODY_LENGTH];
+    char* res_body = res_body_buf;
+    int body_len = sizeof(res_body_buf);
+
+    if (hap_acc_event_response(hc->a, hc, res_header, &res_header_len, res_body, &body_len) < 0) {
+        res_body = malloc(body_len);
+        if (res_body == NULL) {
+            ESP_LOGE(TAG, "malloc failed. size:%d", body_len);
+            return;
+        }
+        res_header_len = sizeof(res_header);
+        hap_acc_event_response(hc->a, hc, res_header, &res_header_len, res_body, &body_len);
+    }
+
+    if (body_len) {
+        metrics_event_sent();
         encrypt_send(hc->nc, hc, res_header, res_header_len, res_body, body_len);
+#ifdef CONFIG_HOMEKIT_LOG_BODIES
+        ESP_LOGI(TAG, "%.*s%.*s", res_header_len, res_header, body_len, res_body);
+#endif
     }
-    xSemaphoreGive(_hap_desc->mutex);
 
-    ESP_LOGI(TAG, "%.*s", res_header_len, res_header);
-    ESP_LOGI(TAG, "%.*s", body_len, res_body);
+    if (res_body != res_body_buf)
+        free(res_body);
+}
 
-    hap_acc_event_response_free(res_header, res_body);
+/*
+ * Closes sessions that have been quiet for too long. Each remaining one gets
+ * a timer at its deadline, so the httpd loop wakes up and polls again then.
+ */
+static void _hap_connections_expire(struct hap_accessory* a)
+{
+    double now = httpd_time();
 
-    return 0;
+    struct hap_connection* hc;
+    list_for_each_entry(hc, &a->connections, list) {
+        int timeout = hc->pair_verified ? HAP_IDLE_TIMEOUT_VERIFIED : HAP_IDLE_TIMEOUT_UNVERIFIED;
+        if (timeout == 0 || hc->nr_jobs)
+            continue;
+
+        double deadline = httpd_last_io(hc->nc) + timeout;
+        if (now >= deadline) {
+            ESP_LOGI(TAG, "closing idle connection %p", hc->nc);
+            httpd_close(hc->nc);
+            continue;
+        }
+
+        httpd_timer_set(hc->nc, deadline);
+    }
 }
 
-void* hap_accessory_add(void* acc_instance)
+/*
+ * Called from the httpd task whenever it wakes up. Queued value changes are
+ * merged right away and flushed to the subscribed connections at most once
+ * per HAP_EVENT_INTERVAL_MS. When only readings are queued, power save mode
+ * waits HAP_EVENT_DEFER_INTERVAL_MS instead, so the radio wakes up for one
+ * message every so often rather than for each sample.
+ */
+static void _hap_poll(void* accessory)
 {
-    struct hap_accessory* a = acc_instance;
+    struct hap_accessory* a = accessory;
+
+    worker_complete();
+    _hap_connections_expire(a);
 
-    a->accessories_ojbects = hap_acc_accessory_add(acc_instance);
+    /* pair and unpair changes are written by the httpd task when they settle */
+    double now = httpd_time();
+    double commit_due = 0;
+    int commit_ms = iosdevice_pairings_commit(a->iosdevices, false);
+    if (commit_ms > 0) {
+        commit_due = now + commit_ms / 1000.0;
+        httpd_timer_set(a->bind, commit_due);
+    }
+
+    struct hap_event event;
+    while (xQueueReceive(_hap_desc->events, &event, 0) == pdTRUE) {
+        if (event.legacy)
+            event.value = hap_acc_value_from_legacy(event.a, event.ev_handle, event.legacy_value);
+        hap_acc_event_post(event.a, event.ev_handle, &event.value);
+        metrics_event_posted();
+    }
+
+    if (a->nr_ev_queue == 0)
+        return;
+
+    /*
+     * come back when the interval is over, the httpd task sleeps until then.
+     * The listener has one timer, a pending commit may need it sooner.
+     */
+    int interval_ms = a->ev_urgent ? HAP_EVENT_INTERVAL_MS : HAP_EVENT_DEFER_INTERVAL_MS;
+    double due = a->ev_flush_time + interval_ms / 1000.0;
+    if (now < due) {
+        httpd_timer_set(a->bind, commit_due > 0 && commit_due < due ? commit_due : due);
+        return;
+    }
+    a->ev_flush_time = now;
+
+    if (hap_acc_event_collect(a) == 0)
+        return;
+
+    struct hap_connection* hc;
+    list_for_each_entry(hc, &a->connections, list) {
+        if (hc->pair_verified)
+            _event_send(hc);
+    }
+}
 
-    return a->accessories_ojbects;
+void* hap_accessory_add(void* acc_instance)
+{
+    return hap_acc_accessory_add(acc_instance);
 }
 
-void hap_service_and_characteristics_add(void* acc_instance, void* acc_obj,
+int hap_service_and_characteristics_add(void* acc_instance, void* acc_obj,
         enum hap_service_type type, struct hap_characteristic* cs, int nr_cs) 
 {
     struct hap_characteristic_ex *cs_ex = calloc(nr_cs, sizeof(struct hap_characteristic_ex));
+    if (cs_ex == NULL) {
+        ESP_LOGE(TAG, "calloc failed. size:%d", nr_cs);
+        return -1;
+    }
 
     for (size_t i=0; i < nr_cs; ++i) {
         cs_ex[i].base = cs[i];
@@ -427,26 +1165,53 @@ void hap_service_and_characteristics_add(void* acc_instance, void* acc_obj,
         cs_ex[i].override_min_value = false;
     }
 
-    hap_service_and_characteristics_ex_add(acc_instance, acc_obj, type, cs_ex, nr_cs);
+    int err = hap_service_and_characteristics_ex_add(acc_instance, acc_obj, type, cs_ex, nr_cs);
     free(cs_ex);
+    return err;
 }
 
-void hap_service_and_characteristics_ex_add(void* acc_instance, void* acc_obj,
+int hap_service_and_characteristics_ex_add(void* acc_instance, void* acc_obj,
         enum hap_service_type type, struct hap_characteristic_ex* cs, int nr_cs)
 {
-    hap_acc_service_and_characteristics_add(acc_obj, type, cs, nr_cs);    
+    if (hap_acc_service_and_characteristics_add(acc_obj, type, cs, nr_cs) < 0)
+        return -1;
+
+    hap_acc_accessories_invalidate(acc_instance);
+    return 0;
 }
 
-void* hap_accessory_register(const char* name, const char* id, const char* pincode, const char* vendor, enum hap_accessory_category category,
+uint32_t hap_accessory_config_number_bump(void* acc_instance)
+{
+    struct hap_accessory* a = acc_instance;
+
+    /* c# wraps from 65535 back to 1, 0 is not valid */
+    a->config_number = (a->config_number >= 65535) ? 1 : a->config_number + 1;
+    advertise_accessory_config_number_set(a->advertise, a->config_number);
+
+    /* the attribute database is rebuilt on the next GET /accessories */
+    return a->config_number;
+}
+
+void hap_accessory_write_batch_set(void* acc_instance, void (*begin)(void* arg), void (*commit)(void* arg))
+{
+    struct hap_accessory* a = acc_instance;
+
+    a->write_begin = begin;
+    a->write_commit = commit;
+}
+
+void* hap_accessory_prepare(const char* name, const char* id, const char* pincode, const char* vendor, enum hap_accessory_category category,
                         int port, uint32_t config_number, void* callback_arg, hap_accessory_callback_t* callback)
 {
+    /* more accessories go behind this one as a bridge, see hap_accessory_add */
     if (_hap_desc->nr_accessory != 0) {
+        ESP_LOGE(TAG, "an accessory is already registered, add the others to it as a bridge");
         return NULL;
     }
 
     struct hap_accessory* a = calloc(1, sizeof(struct hap_accessory));
     if (a == NULL) {
-        ESP_LOGE(TAG, "calloc failed. size:%d", sizeof(struct hap_accessory));
+        ESP_LOGE(TAG, "calloc failed. size:%d", (int)sizeof(struct hap_accessory));
         return NULL;
     }
 
@@ -461,23 +1226,54 @@ void* hap_accessory_register(const char* name, const char* id, const char* pinco
     a->callback_arg = callback_arg;
 
     INIT_LIST_HEAD(&a->connections);
-    INIT_LIST_HEAD(&a->attr_accessories);
 
+    /* flash only, nothing here needs the network */
     _accessory_ltk_load(a);
     a->iosdevices = iosdevice_pairings_init(a->id);
-    a->advertise = advertise_accessory_add(a->name, a->id, a->vendor, a->port, a->config_number, a->category,
-                                           ADVERTISE_ACCESSORY_STATE_NOT_PAIRED);
-    a->bind = httpd_bind(port, a);
     _hap_desc->nr_accessory = 1;
 
     return a;
 }
 
+int hap_accessory_start(void* acc_instance)
+{
+    struct hap_accessory* a = acc_instance;
+    if (a == NULL)
+        return -1;
+
+    /* the listener survives reconnects, later calls have nothing to do */
+    if (a->bind)
+        return 0;
+
+    if (a->advertise == NULL) {
+        bool paired = iosdevice_pairings_foreach(a->iosdevices, NULL, NULL) > 0;
+        a->advertise = advertise_accessory_add(a->name, a->id, a->vendor, a->port, a->config_number, a->category,
+                                               paired ? ADVERTISE_ACCESSORY_STATE_PAIRED : ADVERTISE_ACCESSORY_STATE_NOT_PAIRED);
+    }
+
+    a->bind = httpd_bind(a->port, a);
+    return a->bind ? 0 : -1;
+}
+
+void* hap_accessory_register(const char* name, const char* id, const char* pincode, const char* vendor, enum hap_accessory_category category,
+                        int port, uint32_t config_number, void* callback_arg, hap_accessory_callback_t* callback)
+{
+    void* a = hap_accessory_prepare(name, id, pincode, vendor, category, port, config_number, callback_arg, callback);
+    if (a == NULL)
+        return NULL;
+
+    hap_accessory_start(a);
+    return a;
+}
+
 void hap_accessory_remove(void* acc_instance) {
     struct hap_accessory* a = acc_instance;
 
     //no unbind api at mongoose
     advertise_accessory_remove(a->advertise);
+    hap_acc_accessories_invalidate(a);
+    iosdevice_pairings_cleanup(a->iosdevices);
+    ed25519_key_free(a->keys.ltk);
 
     free(a->name);
     free(a->vendor);
@@ -493,12 +1289,22 @@ void hap_init(void)
     if (_hap_desc == NULL)
         return;
 
-    vSemaphoreCreateBinary(_hap_desc->mutex);
+    _hap_desc->events = xQueueCreate(HAP_EVENT_QUEUE_LENGTH, sizeof(struct hap_event));
+    if (_hap_desc->events == NULL) {
+        ESP_LOGE(TAG, "xQueueCreate failed");
+        free(_hap_desc);
+        _hap_desc = NULL;
+        return;
+    }
+
+    logger_init();
+    worker_init(httpd_wakeup);
 
     struct httpd_ops httpd_ops = {
         .accept = _hap_connection_accept,
         .close = _hap_connection_close,
         .recv = _msg_recv,
+        .poll = _hap_poll,
     };
 
     httpd_init(&httpd_ops);
@@ -13,6 +13,7 @@ extern "C" {
 #include "ed25519.h"
 #include "hap.h"
 #include "hkdf.h"
+#include "iosdevice.h"
 #include "list.h"
 
 struct events {
@@ -34,33 +35,77 @@ struct hap_accessory {
     void* iosdevices;
 
     int last_aid;
-    struct list_head attr_accessories;
+    int nr_ev_index;
+    void** ev_queue;
+    int nr_ev_queue;
+    void** ev_collected;
+    int nr_ev_collected;
+    double ev_flush_time;
+    /* something queued that power save mode doesn't hold back */
+    bool ev_urgent;
+    /* by aid - 1, last_aid of them */
+    void** attr_accessories_index;
+    void* attr_db;
     struct list_head connections;
 
     struct {
         uint8_t public[ED25519_PUBLIC_KEY_LENGTH];
         uint8_t private[ED28819_PRIVATE_KEY_LENGTH];
+        void* ltk;
     } keys;
 
     void* callback_arg;
     hap_accessory_callback_t callback;
-    void* accessories_ojbects;
+    /* brackets the writes of one PUT, see hap_accessory_write_batch_set */
+    void (*write_begin)(void* arg);
+    void (*write_commit)(void* arg);
+    bool write_batch_open;
+};
+
+/* growable byte buffer owned by a connection */
+struct hap_buffer {
+    char* buf;
+    int len;
+    int size;
 };
 
 struct hap_connection {
     bool pair_verified;
 
-    struct mg_connection* nc;
+    struct httpd_conn* nc;
     struct hap_accessory *a;
     struct list_head list;
     char session_key[CURVE25519_SECRET_LENGTH];
+    /* pairing id of the controller that verified the session */
+    char controller_id[IOSDEVICE_ID_LEN];
     uint8_t encrypt_key[HKDF_KEY_LEN];
     uint8_t decrypt_key[HKDF_KEY_LEN];
-    int decrypt_count;
-    int encrypt_count;
+    /* frame counters of the session, the nonces are built from them */
+    uint64_t decrypt_count;
+    uint64_t encrypt_count;
+    /* frames of all sessions on the connection, logged on close */
+    uint64_t nr_frames;
+
+    /* decrypted bytes of a request that is not complete yet, see _http_frame */
+    struct hap_buffer plain;
+    int msg_len;
+    /* the client asked to close after the request being served */
+    bool last_request;
+
+    /* responses held back to share one frame, see _encrypt_send */
+    struct hap_buffer batch;
+    int batching;
+
+    /* subscription bitmap, see hap_acc_event_subscribed */
+    uint32_t* events;
+    int nr_events;
 
     void* pair_setup;
     void* pair_verify;
+
+    /* pairing jobs still on the worker, see _pair_submit */
+    int nr_jobs;
+    bool closed;
 };
 
 enum hap_pairing_method {
@@ -69,6 +114,7 @@ enum hap_pairing_method {
     HAP_PAIRING_METHOD_ADD,
     HAP_PAIRING_METHOD_REMOVE,
     HAP_PAIRING_METHOD_LIST,
+    HAP_PAIRING_METHOD_RESUME,
 };
 
 enum hap_tlv_type {
@@ -86,6 +132,7 @@ enum hap_tlv_type {
     HAP_TLV_TYPE_PERMISSION,
     HAP_TLV_TYPE_FRAGMENT_DATA,
     HAP_TLV_TYPE_FRAGMENT_LAST,
+    HAP_TLV_TYPE_SESSION_ID,
     HAP_TLV_TYPE_SEPARATOR = 0xff,
 };
 
@@ -8,6 +8,7 @@ namespace HAP
 {
 
 bool Accessory::hap_initialized {false};
+const std::string Accessory::none {};
 
 void *identify_read(void *arg)
 {
@@ -24,6 +25,16 @@ void write_characteristic(void *arg, void *value, int len)
     static_cast<Characteristic*>(arg)->write(value, static_cast<size_t>(len));
 }
 
+hap_value read_typed_characteristic(void *arg)
+{
+    return static_cast<Characteristic*>(arg)->read_typed();
+}
+
+void write_typed_characteristic(void *arg, hap_value value)
+{
+    static_cast<Characteristic*>(arg)->write_typed(value);
+}
+
 void set_characteristic_event_handle(void *arg, void *event_handle, bool enable)
 {
     static_cast<Characteristic*>(arg)->set_event_handle(event_handle, enable);
@@ -34,7 +45,17 @@ void accessory_init(void *arg)
     static_cast<Accessory*>(arg)->init_callback();
 }
 
-hap_characteristic_ex Characteristic::get_characteristic_struct() const
+void accessory_write_begin(void *arg)
+{
+    static_cast<Accessory*>(arg)->write_begin();
+}
+
+void accessory_write_commit(void *arg)
+{
+    static_cast<Accessory*>(arg)->write_commit();
+}
+
+hap_characteristic_ex Characteristic::get_characteristic_struct()
 {
     void *max_value, *min_value;
     std::vector<int> valid_values;
@@ -68,6 +89,10 @@ hap_characteristic_ex Characteristic::get_characteristic_struct() const
         override_valid_values,
         override_valid_values ? valid_values.size() : 0,
         valid_values_dyn,
+        canRead() && is_typed() ? read_typed_characteristic : nullptr,
+        canWrite() && is_typed() ? write_typed_characteristic : nullptr,
+        is_cached(),
+        &value_handle,
     };
 }
 
@@ -80,6 +105,12 @@ void Characteristic::delete_characteristic_struct_internals(hap_characteristic_e
 }
 
 void Accessory::register_accessory()
+{
+    prepare_accessory();
+    start_accessory();
+}
+
+void Accessory::prepare_accessory()
 {
     if (!hap_initialized)
     {
@@ -87,7 +118,7 @@ void Accessory::register_accessory()
         hap_init();
     }
 
-    accessory_handle = hap_accessory_register(
+    accessory_handle = hap_accessory_prepare(
         name.c_str(),
         id.c_str(),
         setup_code.c_str(),
@@ -98,10 +129,23 @@ void Accessory::register_accessory()
         this,
         &callback
     );
+
+    hap_accessory_write_batch_set(accessory_handle, accessory_write_begin, accessory_write_commit);
+}
+
+void Accessory::start_accessory()
+{
+    hap_accessory_start(accessory_handle);
 }
 
 void Accessory::init_callback()
 {
+    attach(accessory_handle);
+}
+
+void Accessory::attach(void* handle)
+{
+    accessory_handle = handle;
     accessory_object = hap_accessory_add(accessory_handle);
 
     struct hap_characteristic cs[] = {
@@ -34,7 +34,23 @@ static struct hkdf_salt_info _hkdf_salt_info[] = {
     {   /* HKDF_KEY_TYPE_CONTROL_WRITE */
         .salt = "Control-Salt",
         .info = "Control-Write-Encryption-Key",
-    }
+    },
+    {   /* HKDF_KEY_TYPE_PAIR_VERIFY_RESUME_SESSION_ID */
+        .salt = "Pair-Verify-ResumeSessionID-Salt",
+        .info = "Pair-Verify-ResumeSessionID-Info",
+    },
+    {   /* HKDF_KEY_TYPE_PAIR_RESUME_REQUEST */
+        .salt = NULL,
+        .info = "Pair-Resume-Request-Info",
+    },
+    {   /* HKDF_KEY_TYPE_PAIR_RESUME_RESPONSE */
+        .salt = NULL,
+        .info = "Pair-Resume-Response-Info",
+    },
+    {   /* HKDF_KEY_TYPE_PAIR_RESUME_SHARED_SECRET */
+        .salt = NULL,
+        .info = "Pair-Resume-Shared-Secret-Info",
+    },
 };
 
 static struct hkdf_salt_info* _salt_info_get(enum hkdf_key_type type)
@@ -42,13 +58,14 @@ static struct hkdf_salt_info* _salt_info_get(enum hkdf_key_type type)
     return &_hkdf_salt_info[type];
 }
 
-int hkdf_key_get(enum hkdf_key_type type, uint8_t* inkey, int inkey_len, uint8_t* outkey)
+int hkdf_key_get_with_salt(enum hkdf_key_type type, uint8_t* salt, int salt_len, 
+        uint8_t* inkey, int inkey_len, uint8_t* outkey)
 {
     uint8_t key[CHACHA20_POLY1305_AEAD_KEYSIZE];
     struct hkdf_salt_info* salt_info = _salt_info_get(type);
 
     int err = wc_HKDF(SHA512, inkey, inkey_len, 
-            (uint8_t*)salt_info->salt, strlen(salt_info->salt), 
+            salt, salt_len, 
             (uint8_t*)salt_info->info, strlen(salt_info->info),
             key, CHACHA20_POLY1305_AEAD_KEYSIZE);
 
@@ -61,3 +78,10 @@ int hkdf_key_get(enum hkdf_key_type type, uint8_t* inkey, int inkey_len, uint8_t
     return 0;
 }
 
+int hkdf_key_get(enum hkdf_key_type type, uint8_t* inkey, int inkey_len, uint8_t* outkey)
+{
+    struct hkdf_salt_info* salt_info = _salt_info_get(type);
+
+    return hkdf_key_get_with_salt(type, (uint8_t*)salt_info->salt, strlen(salt_info->salt), 
+            inkey, inkey_len, outkey);
+}
@@ -17,10 +17,17 @@ enum hkdf_key_type {
     HKDF_KEY_TYPE_PAIR_VERIFY_ENCRYPT,
     HKDF_KEY_TYPE_CONTROL_READ,
     HKDF_KEY_TYPE_CONTROL_WRITE,
+    HKDF_KEY_TYPE_PAIR_VERIFY_RESUME_SESSION_ID,
+    HKDF_KEY_TYPE_PAIR_RESUME_REQUEST,
+    HKDF_KEY_TYPE_PAIR_RESUME_RESPONSE,
+    HKDF_KEY_TYPE_PAIR_RESUME_SHARED_SECRET,
     HKDF_KEY_TYPE_LENGTH,
 };
 
 int hkdf_key_get(enum hkdf_key_type type, uint8_t* inkey, int inkey_len, uint8_t* outkey);
+/* for the types whose salt is not a constant */
+int hkdf_key_get_with_salt(enum hkdf_key_type type, uint8_t* salt, int salt_len, 
+        uint8_t* inkey, int inkey_len, uint8_t* outkey);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,38 @@
+#include <string.h>
+
+#include "http_header.h"
+
+int http_header_write(const struct http_header* header, int content_length, char* buf, int* len)
+{
+    char digits[10];
+    int nr_digits = 0;
+
+    if (header->content_length) {
+        unsigned int n = content_length < 0 ? 0 : content_length;
+        do {
+            digits[nr_digits++] = '0' + n % 10;
+            n /= 10;
+        } while (n);
+    }
+
+    int required = header->len + (header->content_length ? nr_digits + 4 : 0);
+    if (required > *len) {
+        *len = required;
+        return -1;
+    }
+
+    memcpy(buf, header->text, header->len);
+    char* p = buf + header->len;
+    if (header->content_length) {
+        while (nr_digits)
+            *p++ = digits[--nr_digits];
+        memcpy(p, "\r\n\r\n", 4);
+    }
+
+    /* terminated when there is room, for logging */
+    if (required < *len)
+        buf[required] = 0;
+
+    *len = required;
+    return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef _HTTP_HEADER_H_
+#define _HTTP_HEADER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+/*
+ * Response headers are constant text that ends in "Content-Length: ", only
+ * the length and the blank line are written per response. A fixed header
+ * is complete as it is and copied verbatim.
+ */
+struct http_header {
+    const char* text;
+    int len;
+    bool content_length;
+};
+
+#define HTTP_HEADER(_text)          { _text, sizeof(_text) - 1, true }
+#define HTTP_HEADER_FIXED(_text)    { _text, sizeof(_text) - 1, false }
+
+/* digits of the length and the blank line */
+#define HTTP_HEADER_LENGTH_EXTRA    14
+
+/*
+ * On entry *len holds the size of buf, on return the length written.
+ * When buf is too small -1 is returned and *len holds the size required.
+ */
+int http_header_write(const struct http_header* header, int content_length, char* buf, int* len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //#ifndef _HTTP_HEADER_H_
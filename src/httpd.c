@@ -1,61 +1,149 @@
-
 #include <stdio.h>
 
+#include "esp_attr.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/timers.h"
 
 #include "mongoose.h"
 #include "httpd.h"
+#include "logger.h"
+
+#ifndef CONFIG_HOMEKIT_HTTPD_LWIP
+#define TAG "HTTPD"
+
+/* the connections handed out are mongoose's own */
+#define _NC(conn) ((struct mg_connection*)(conn))
+#define _CONN(nc) ((struct httpd_conn*)(nc))
 
 static struct httpd_ops _ops;
 static struct mg_mgr _mgr;
 static SemaphoreHandle_t _httpd_mutex;
 
+/*
+ * The task sleeps in select() until a socket is ready or the earliest
+ * mongoose timer is due. Work queued from other tasks wakes it up with a
+ * datagram to a loopback socket, see httpd_wakeup.
+ */
+#define HTTPD_IDLE_TIMEOUT_MS (60 * 60 * 1000)
+
+/* tasks waiting for _httpd_mutex, the loop steps aside for them */
+static volatile int _nr_mutex_waiters;
+
+static sock_t _wakeup_sock = INVALID_SOCKET;
+static union socket_address _wakeup_addr;
+
 static void _httpd_task(void* arg) {
     while (1) {
-        xSemaphoreTake(_httpd_mutex, 0);
-        mg_mgr_poll(&_mgr, 1000);
+        xSemaphoreTake(_httpd_mutex, portMAX_DELAY);
+        mg_mgr_poll(&_mgr, HTTPD_IDLE_TIMEOUT_MS);
         xSemaphoreGive(_httpd_mutex);
+
+        while (_nr_mutex_waiters)
+            vTaskDelay(1);
+    }
+}
+
+static void _wakeup_handler(struct mg_connection* nc, int ev, void *p, void* user_data) {
+    switch (ev) {
+        case MG_EV_ACCEPT: {
+            /* keep the pseudo connection of the sender around */
+            nc->flags &= ~MG_F_SEND_AND_CLOSE;
+            break;
+        }
+        case MG_EV_RECV: {
+            mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static int _wakeup_init(void) {
+    struct mg_connection* nc = mg_bind(&_mgr, "udp://127.0.0.1:0", _wakeup_handler, NULL);
+    if (nc == NULL) {
+        printf("[ERR] wakeup mg_bind failed\n");
+        return -1;
+    }
+
+    socklen_t len = sizeof(_wakeup_addr.sin);
+    if (getsockname(nc->sock, &_wakeup_addr.sa, &len) < 0) {
+        printf("[ERR] wakeup getsockname failed\n");
+        return -1;
+    }
+
+    _wakeup_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (_wakeup_sock == INVALID_SOCKET) {
+        printf("[ERR] wakeup socket failed\n");
+        return -1;
     }
+    mg_set_non_blocking_mode(_wakeup_sock);
+
+    return 0;
+}
+
+void httpd_wakeup(void) {
+    if (_wakeup_sock == INVALID_SOCKET)
+        return;
+
+    /* a full socket buffer means a wakeup is pending already */
+    char c = 0;
+    sendto(_wakeup_sock, &c, 1, 0, &_wakeup_addr.sa, sizeof(_wakeup_addr.sin));
+}
+
+static void _httpd_wakeup_pended(void* arg1, uint32_t arg2) {
+    httpd_wakeup();
+}
+
+/* the timer task sends the datagram, sockets can't be used from an ISR */
+void IRAM_ATTR httpd_wakeup_from_isr(BaseType_t* woken) {
+    xTimerPendFunctionCallFromISR(_httpd_wakeup_pended, NULL, 0, woken);
 }
 
 static void mg_ev_handler(struct mg_connection* nc, int ev, void *p, void* user_data) {
     switch (ev)     {
         case MG_EV_ACCEPT: {
             if (_ops.accept) {
-                _ops.accept(user_data, nc);
+                _ops.accept(user_data, _CONN(nc));
             }
 
-            char addr[32];
-            mg_sock_addr_to_str(&nc->sa, addr, sizeof(addr),
-                                MG_SOCK_STRINGIFY_IP | MG_SOCK_STRINGIFY_PORT);
-            printf("[HTTPD] Connection %p from %s\n", nc, addr);
+            uint8_t* ip = (uint8_t*)&nc->sa.sin.sin_addr.s_addr;
+            HAP_LOGI(TAG, "connection %p from %u.%u.%u.%u:%u", nc,
+                    ip[0], ip[1], ip[2], ip[3], ntohs(nc->sa.sin.sin_port));
             break;
         }
         case MG_EV_RECV: {
-            printf("[HTTPD] MG_EV_RECV\n");
+            HAP_LOGD(TAG, "recv %p %d bytes", nc, (int)nc->recv_mbuf.len);
             if (_ops.recv) {
-                _ops.recv(user_data, nc, nc->recv_mbuf.buf, nc->recv_mbuf.len);
+                int consumed = _ops.recv(user_data, _CONN(nc), nc->recv_mbuf.buf, nc->recv_mbuf.len);
+                if (consumed > 0)
+                    mbuf_remove(&nc->recv_mbuf, consumed);
             }
             break;
         }
         case MG_EV_POLL: {
+            if (_ops.poll && (nc->flags & MG_F_LISTENING)) {
+                _ops.poll(user_data);
+            }
             break;
         }
         case MG_EV_CLOSE: {
-            printf("[HTTPD] MG_EV_CLOSE");
-            printf("Connection %p closed\n", nc);
+            HAP_LOGI(TAG, "connection %p closed", nc);
             if (_ops.close) {
-                _ops.close(user_data, nc);
+                _ops.close(user_data, _CONN(nc));
             }
             break;
         }
         case MG_EV_SEND: {
-            printf("[HTTPD] MG_EV_SEND. %d\n", *((int*)user_data));
+            HAP_LOGD(TAG, "sent %p %d bytes", nc, *((int*)p));
+            break;
+        }
+        case MG_EV_TIMER: {
             break;
         }
         default: {
-            printf("[HTTPD] DEFAULT:%d\n", ev);
+            HAP_LOGD(TAG, "event %p %d", nc, ev);
             break;
         }
     }
@@ -69,7 +157,10 @@ void* httpd_bind(int port, void* user_data) {
     char port_string[8] = {0,};
     sprintf(port_string, "%d", port);
 
-    xSemaphoreTake(_httpd_mutex, 0);
+    _nr_mutex_waiters++;
+    httpd_wakeup();
+    xSemaphoreTake(_httpd_mutex, portMAX_DELAY);
+    _nr_mutex_waiters--;
 
     nc = mg_bind(&_mgr, port_string, mg_ev_handler, user_data);
     if (nc == NULL) {
@@ -77,7 +168,7 @@ void* httpd_bind(int port, void* user_data) {
         goto err_mg_bind;
     }
 
-    mg_set_protocol_http_websocket(nc);
+    /* no http protocol handler, hap frames the requests on its own */
 
 err_mg_bind:
     xSemaphoreGive(_httpd_mutex);
@@ -89,5 +180,70 @@ void httpd_init(struct httpd_ops* ops) {
     mg_mgr_init(&_mgr, NULL);
     _httpd_mutex = xSemaphoreCreateMutex();
     _ops = *ops;
-    xTaskCreate(_httpd_task, "httpd_task", HTTPD_STACK, NULL, 5, NULL);
+    _wakeup_init();
+    /* the other core is left to the pairing worker */
+    xTaskCreatePinnedToCore(_httpd_task, "httpd_task", HTTPD_STACK, NULL, 5, NULL, 0);
+}
+
+void httpd_user_data_set(struct httpd_conn* conn, void* user_data) {
+    _NC(conn)->user_data = user_data;
+}
+
+double httpd_time(void) {
+    return mg_time();
+}
+
+double httpd_last_io(struct httpd_conn* conn) {
+    return _NC(conn)->last_io_time;
+}
+
+void httpd_timer_set(struct httpd_conn* conn, double when) {
+    mg_set_timer(_NC(conn), when);
+}
+
+int httpd_send(struct httpd_conn* conn, const void* data, int len) {
+    mg_send(_NC(conn), data, len);
+    return 0;
+}
+
+/* the send mbuf grows, there is always room for all of want */
+char* httpd_send_buffer(struct httpd_conn* conn, int want, int min, int* len) {
+    struct mbuf* io = &_NC(conn)->send_mbuf;
+    if (io->size < io->len + want) {
+        mbuf_resize(io, io->len + want);
+        if (io->size < io->len + want) {
+            printf("[ERR] mbuf_resize failed. size:%d\n", (int)(io->len + want));
+            return NULL;
+        }
+    }
+
+    *len = want;
+    return io->buf + io->len;
+}
+
+void httpd_send_commit(struct httpd_conn* conn, int len) {
+    _NC(conn)->send_mbuf.len += len;
+    _NC(conn)->last_io_time = (time_t) mg_time();
+}
+
+char* httpd_recv_buffer(struct httpd_conn* conn, int* len) {
+    *len = _NC(conn)->recv_mbuf.len;
+    return _NC(conn)->recv_mbuf.buf;
+}
+
+void httpd_recv_consume(struct httpd_conn* conn, int len) {
+    mbuf_remove(&_NC(conn)->recv_mbuf, len);
+}
+
+void httpd_close(struct httpd_conn* conn) {
+    _NC(conn)->flags |= MG_F_CLOSE_IMMEDIATELY;
+}
+
+void httpd_close_after_send(struct httpd_conn* conn) {
+    _NC(conn)->flags |= MG_F_SEND_AND_CLOSE;
+}
+
+bool httpd_closing(struct httpd_conn* conn) {
+    return _NC(conn)->flags & MG_F_CLOSE_IMMEDIATELY;
 }
+#endif //#ifndef CONFIG_HOMEKIT_HTTPD_LWIP
@@ -5,17 +5,63 @@
 extern "C" {
 #endif
 
-#include "mongoose.h"
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+
+/*
+ * A listener or a client connection of the transport. It is mongoose's
+ * connection, or with CONFIG_HOMEKIT_HTTPD_LWIP a socket with static
+ * buffers, see httpd_lwip.c.
+ */
+struct httpd_conn;
 
 struct httpd_ops {
-    void (*accept)(void* user_data, struct mg_connection* nc);
-    void (*close)(void* user_data, struct mg_connection* nc);
-    void (*recv)(void* user_data, struct mg_connection* nc, char* msg, int length);
+    void (*accept)(void* user_data, struct httpd_conn* conn);
+    void (*close)(void* user_data, struct httpd_conn* conn);
+    /* returns the number of bytes consumed from msg */
+    int (*recv)(void* user_data, struct httpd_conn* conn, char* msg, int length);
+    /* called with the user_data of every bound port on each wakeup */
+    void (*poll)(void* user_data);
 };
 
 void* httpd_bind(int port, void* user_data);
 void httpd_init(struct httpd_ops* ops);
 
+/* makes the httpd task run its poll hooks as soon as possible */
+void httpd_wakeup(void);
+void httpd_wakeup_from_isr(BaseType_t* woken);
+
+/*
+ * The rest is for the httpd task only, from within the ops.
+ * A connection starts out with the user_data of its listener.
+ */
+void httpd_user_data_set(struct httpd_conn* conn, void* user_data);
+
+/* seconds, the clock of httpd_last_io and httpd_timer_set */
+double httpd_time(void);
+double httpd_last_io(struct httpd_conn* conn);
+/* wakes the httpd task up at when, one timer per connection or listener */
+void httpd_timer_set(struct httpd_conn* conn, double when);
+
+int httpd_send(struct httpd_conn* conn, const void* data, int len);
+/*
+ * Returns room for at least min and at most want bytes at the end of the
+ * output, *len is set to its size. Nothing of it is sent before
+ * httpd_send_commit. NULL when min bytes don't fit.
+ */
+char* httpd_send_buffer(struct httpd_conn* conn, int want, int min, int* len);
+void httpd_send_commit(struct httpd_conn* conn, int len);
+
+/* what was received and not consumed by the recv op yet */
+char* httpd_recv_buffer(struct httpd_conn* conn, int* len);
+void httpd_recv_consume(struct httpd_conn* conn, int len);
+
+void httpd_close(struct httpd_conn* conn);
+void httpd_close_after_send(struct httpd_conn* conn);
+/* true once httpd_close was called */
+bool httpd_closing(struct httpd_conn* conn);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,554 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#include <esp_attr.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <freertos/timers.h>
+#include <lwip/sockets.h>
+
+#include "httpd.h"
+#include "logger.h"
+#include "pool.h"
+
+#ifdef CONFIG_HOMEKIT_HTTPD_LWIP
+#define TAG "HTTPD"
+
+/*
+ * A plain HAP transport on lwIP sockets, for accessories that don't need
+ * anything else of mongoose. Every connection has a static receive and
+ * send buffer and the ops work on them directly.
+ * The receive buffer holds an encrypted frame and the plain text pairing
+ * requests, a connection that fills it up without a complete request is
+ * closed.
+ * Sends never wait for the socket, the poll loop writes the buffer out.
+ * When the peer doesn't keep up the send buffer moves to the heap and grows
+ * up to HTTPD_TX_MAX_LENGTH, a connection that needs more is closed.
+ */
+#ifndef HTTPD_RX_LENGTH
+#define HTTPD_RX_LENGTH 1536
+#endif
+#ifndef HTTPD_TX_LENGTH
+#define HTTPD_TX_LENGTH 2048
+#endif
+#ifndef HTTPD_TX_MAX_LENGTH
+#define HTTPD_TX_MAX_LENGTH (32 * 1024)
+#endif
+/* before a failed select is retried */
+#define HTTPD_SELECT_RETRY_MS 100
+#define HTTPD_IDLE_TIMEOUT_MS (60 * 60 * 1000)
+#define HTTPD_BACKLOG 4
+
+/* one more than hap keeps, it refuses or evicts the extra one */
+#define HTTPD_NR_CONNECTIONS (POOL_NR_CONNECTIONS + 1)
+#define HTTPD_NR_LISTENERS 4
+
+struct httpd_conn {
+    int sock;   /* -1 while the slot is free */
+    bool close;
+    bool close_after_send;
+    void* user_data;
+    double last_io;
+    double timer;   /* 0 when not set */
+
+    char* rx;
+    int rx_len;
+    char* tx;       /* the static buffer of the slot or a grown one */
+    int tx_size;
+    int tx_offset;  /* sent up to here */
+    int tx_len;
+};
+
+static struct httpd_ops _ops;
+static SemaphoreHandle_t _httpd_mutex;
+static volatile int _nr_mutex_waiters;
+
+static char _rx[HTTPD_NR_CONNECTIONS][HTTPD_RX_LENGTH];
+static char _tx[HTTPD_NR_CONNECTIONS][HTTPD_TX_LENGTH];
+static struct httpd_conn _conns[HTTPD_NR_CONNECTIONS];
+static struct httpd_conn _listeners[HTTPD_NR_LISTENERS];
+
+/* the wakeup datagrams are sent to _wakeup_rx from _wakeup_tx */
+static int _wakeup_rx = -1;
+static int _wakeup_tx = -1;
+static struct sockaddr_in _wakeup_addr;
+
+static void _non_blocking(int sock) {
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+}
+
+/* back to the static buffer once a grown one is empty */
+static void _tx_shrink(struct httpd_conn* c) {
+    char* tx = _tx[c - _conns];
+    if (c->tx == tx)
+        return;
+
+    free(c->tx);
+    c->tx = tx;
+    c->tx_size = HTTPD_TX_LENGTH;
+}
+
+static int _tx_flush(struct httpd_conn* c) {
+    while (c->tx_offset < c->tx_len) {
+        int n = send(c->sock, c->tx + c->tx_offset, c->tx_len - c->tx_offset, 0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        c->tx_offset += n;
+        c->last_io = httpd_time();
+    }
+
+    if (c->tx_offset == c->tx_len) {
+        c->tx_offset = c->tx_len = 0;
+        _tx_shrink(c);
+    }
+    return 0;
+}
+
+/*
+ * makes room for len bytes at the end of the send buffer, without waiting.
+ * What the socket doesn't take now stays queued for the poll loop.
+ */
+static int _tx_room(struct httpd_conn* c, int len) {
+    if (c->tx_size - c->tx_len >= len)
+        return 0;
+
+    if (_tx_flush(c) < 0) {
+        c->close = true;
+        return -1;
+    }
+
+    int pending = c->tx_len - c->tx_offset;
+    if (c->tx_size - pending >= len) {
+        memmove(c->tx, c->tx + c->tx_offset, pending);
+        c->tx_len = pending;
+        c->tx_offset = 0;
+        return 0;
+    }
+
+    if (pending + len > HTTPD_TX_MAX_LENGTH) {
+        HAP_LOGW(TAG, "connection %p doesn't keep up, closing", c);
+        c->close = true;
+        return -1;
+    }
+
+    int size = c->tx_size * 2;
+    if (size < pending + len)
+        size = pending + len;
+    if (size > HTTPD_TX_MAX_LENGTH)
+        size = HTTPD_TX_MAX_LENGTH;
+
+    char* tx = malloc(size);
+    if (tx == NULL) {
+        HAP_LOGE(TAG, "malloc failed. size:%d", size);
+        c->close = true;
+        return -1;
+    }
+    memcpy(tx, c->tx + c->tx_offset, pending);
+
+    _tx_shrink(c);
+    c->tx = tx;
+    c->tx_size = size;
+    c->tx_len = pending;
+    c->tx_offset = 0;
+    return 0;
+}
+
+static void _conn_close(struct httpd_conn* c) {
+    HAP_LOGI(TAG, "connection %p closed", c);
+    if (_ops.close)
+        _ops.close(c->user_data, c);
+
+    closesocket(c->sock);
+    c->sock = -1;
+    _tx_shrink(c);
+}
+
+static void _accept(struct httpd_conn* l) {
+    struct sockaddr_in sa;
+    socklen_t sa_len = sizeof(sa);
+    int sock = accept(l->sock, (struct sockaddr*)&sa, &sa_len);
+    if (sock < 0)
+        return;
+
+    struct httpd_conn* c = NULL;
+    for (int i=0; i<HTTPD_NR_CONNECTIONS; i++) {
+        if (_conns[i].sock < 0) {
+            c = &_conns[i];
+            break;
+        }
+    }
+    if (c == NULL) {
+        HAP_LOGW(TAG, "no free connection, refused");
+        closesocket(sock);
+        return;
+    }
+
+    _non_blocking(sock);
+    int i = c - _conns;
+    *c = (struct httpd_conn) {
+        .sock = sock,
+        .user_data = l->user_data,
+        .last_io = httpd_time(),
+        .rx = _rx[i],
+        .tx = _tx[i],
+        .tx_size = HTTPD_TX_LENGTH,
+    };
+
+    uint8_t* ip = (uint8_t*)&sa.sin_addr.s_addr;
+    HAP_LOGI(TAG, "connection %p from %u.%u.%u.%u:%u", c,
+            ip[0], ip[1], ip[2], ip[3], ntohs(sa.sin_port));
+    if (_ops.accept)
+        _ops.accept(c->user_data, c);
+}
+
+static void _recv(struct httpd_conn* c) {
+    int n = recv(c->sock, c->rx + c->rx_len, HTTPD_RX_LENGTH - c->rx_len, 0);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        c->close = true;
+        return;
+    }
+    if (n < 0)
+        return;
+
+    HAP_LOGD(TAG, "recv %p %d bytes", c, n);
+    c->rx_len += n;
+    c->last_io = httpd_time();
+    if (_ops.recv) {
+        int consumed = _ops.recv(c->user_data, c, c->rx, c->rx_len);
+        if (consumed > 0)
+            httpd_recv_consume(c, consumed);
+    }
+
+    if (c->rx_len == HTTPD_RX_LENGTH) {
+        HAP_LOGW(TAG, "connection %p receive buffer full, closing", c);
+        c->close = true;
+    }
+}
+
+static bool _sock_bad(int sock) {
+    return fcntl(sock, F_GETFL, 0) < 0 && errno == EBADF;
+}
+
+/* after a failed select, closes what made it fail */
+static void _select_failed(void) {
+    HAP_LOGE(TAG, "select failed. errno:%d", errno);
+
+    for (int i=0; i<HTTPD_NR_LISTENERS; i++) {
+        struct httpd_conn* l = &_listeners[i];
+        if (l->sock >= 0 && _sock_bad(l->sock)) {
+            HAP_LOGE(TAG, "listener %p socket %d is bad, dropped", l, l->sock);
+            l->sock = -1;
+        }
+    }
+
+    for (int i=0; i<HTTPD_NR_CONNECTIONS; i++) {
+        struct httpd_conn* c = &_conns[i];
+        if (c->sock >= 0 && _sock_bad(c->sock)) {
+            HAP_LOGE(TAG, "connection %p socket %d is bad, closing", c, c->sock);
+            c->close = true;
+        }
+    }
+}
+
+/* -1 when select failed, the caller waits a bit before the next poll */
+static int _httpd_poll(void) {
+    int err = 0;
+
+    fd_set rfds, wfds;
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    int max_sock = _wakeup_rx;
+    FD_SET(_wakeup_rx, &rfds);
+
+    double now = httpd_time();
+    double due = now + HTTPD_IDLE_TIMEOUT_MS / 1000.0;
+
+    for (int i=0; i<HTTPD_NR_LISTENERS; i++) {
+        struct httpd_conn* l = &_listeners[i];
+        if (l->sock < 0)
+            continue;
+        FD_SET(l->sock, &rfds);
+        if (l->sock > max_sock)
+            max_sock = l->sock;
+        if (l->timer && l->timer < due)
+            due = l->timer;
+    }
+
+    for (int i=0; i<HTTPD_NR_CONNECTIONS; i++) {
+        struct httpd_conn* c = &_conns[i];
+        if (c->sock < 0)
+            continue;
+        FD_SET(c->sock, &rfds);
+        if (c->tx_offset < c->tx_len)
+            FD_SET(c->sock, &wfds);
+        if (c->sock > max_sock)
+            max_sock = c->sock;
+        if (c->timer && c->timer < due)
+            due = c->timer;
+    }
+
+    double timeout = (due > now) ? due - now : 0;
+    struct timeval tv = {
+        .tv_sec = (int)timeout,
+        .tv_usec = (int)((timeout - (int)timeout) * 1000000),
+    };
+    if (select(max_sock + 1, &rfds, &wfds, NULL, &tv) < 0) {
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        if (errno != EINTR) {
+            _select_failed();
+            err = -1;
+        }
+    }
+
+    if (FD_ISSET(_wakeup_rx, &rfds)) {
+        char buf[8];
+        while (recv(_wakeup_rx, buf, sizeof(buf), 0) > 0)
+            ;
+    }
+
+    for (int i=0; i<HTTPD_NR_CONNECTIONS; i++) {
+        struct httpd_conn* c = &_conns[i];
+        if (c->sock < 0)
+            continue;
+        if (FD_ISSET(c->sock, &wfds) && _tx_flush(c) < 0)
+            c->close = true;
+        if (!c->close && FD_ISSET(c->sock, &rfds))
+            _recv(c);
+    }
+
+    for (int i=0; i<HTTPD_NR_LISTENERS; i++) {
+        if (_listeners[i].sock >= 0 && FD_ISSET(_listeners[i].sock, &rfds))
+            _accept(&_listeners[i]);
+    }
+
+    now = httpd_time();
+    for (int i=0; i<HTTPD_NR_LISTENERS; i++) {
+        struct httpd_conn* l = &_listeners[i];
+        if (l->sock < 0)
+            continue;
+        if (l->timer && l->timer <= now)
+            l->timer = 0;
+        if (_ops.poll)
+            _ops.poll(l->user_data);
+    }
+
+    for (int i=0; i<HTTPD_NR_CONNECTIONS; i++) {
+        struct httpd_conn* c = &_conns[i];
+        if (c->sock < 0)
+            continue;
+        if (c->timer && c->timer <= now)
+            c->timer = 0;
+        if (c->close || (c->close_after_send && c->tx_offset == c->tx_len))
+            _conn_close(c);
+    }
+
+    return err;
+}
+
+static void _httpd_task(void* arg) {
+    while (1) {
+        xSemaphoreTake(_httpd_mutex, portMAX_DELAY);
+        int err = _httpd_poll();
+        xSemaphoreGive(_httpd_mutex);
+
+        if (err < 0)
+            vTaskDelay(pdMS_TO_TICKS(HTTPD_SELECT_RETRY_MS));
+
+        while (_nr_mutex_waiters)
+            vTaskDelay(1);
+    }
+}
+
+static int _wakeup_init(void) {
+    _wakeup_rx = socket(AF_INET, SOCK_DGRAM, 0);
+    _wakeup_tx = socket(AF_INET, SOCK_DGRAM, 0);
+    if (_wakeup_rx < 0 || _wakeup_tx < 0) {
+        printf("[ERR] wakeup socket failed\n");
+        return -1;
+    }
+
+    _wakeup_addr.sin_family = AF_INET;
+    _wakeup_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    _wakeup_addr.sin_port = 0;
+    socklen_t len = sizeof(_wakeup_addr);
+    if (bind(_wakeup_rx, (struct sockaddr*)&_wakeup_addr, sizeof(_wakeup_addr)) < 0 ||
+            getsockname(_wakeup_rx, (struct sockaddr*)&_wakeup_addr, &len) < 0) {
+        printf("[ERR] wakeup bind failed\n");
+        return -1;
+    }
+    _non_blocking(_wakeup_rx);
+    _non_blocking(_wakeup_tx);
+
+    return 0;
+}
+
+void httpd_wakeup(void) {
+    if (_wakeup_tx < 0)
+        return;
+
+    /* a full socket buffer means a wakeup is pending already */
+    char c = 0;
+    sendto(_wakeup_tx, &c, 1, 0, (struct sockaddr*)&_wakeup_addr, sizeof(_wakeup_addr));
+}
+
+static void _httpd_wakeup_pended(void* arg1, uint32_t arg2) {
+    httpd_wakeup();
+}
+
+/* the timer task sends the datagram, sockets can't be used from an ISR */
+void IRAM_ATTR httpd_wakeup_from_isr(BaseType_t* woken) {
+    xTimerPendFunctionCallFromISR(_httpd_wakeup_pended, NULL, 0, woken);
+}
+
+void* httpd_bind(int port, void* user_data) {
+    if (port <= 0)
+        return NULL;
+
+    struct httpd_conn* l = NULL;
+
+    _nr_mutex_waiters++;
+    httpd_wakeup();
+    xSemaphoreTake(_httpd_mutex, portMAX_DELAY);
+    _nr_mutex_waiters--;
+
+    for (int i=0; i<HTTPD_NR_LISTENERS; i++) {
+        if (_listeners[i].sock < 0) {
+            l = &_listeners[i];
+            break;
+        }
+    }
+    if (l == NULL) {
+        printf("[ERR] no free listener\n");
+        goto out;
+    }
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        printf("[ERR] socket failed\n");
+        l = NULL;
+        goto out;
+    }
+
+    int on = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in sa = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+        .sin_port = htons(port),
+    };
+    if (bind(sock, (struct sockaddr*)&sa, sizeof(sa)) < 0 || listen(sock, HTTPD_BACKLOG) < 0) {
+        printf("[ERR] bind failed. port:%d\n", port);
+        closesocket(sock);
+        l = NULL;
+        goto out;
+    }
+    _non_blocking(sock);
+
+    *l = (struct httpd_conn) {
+        .sock = sock,
+        .user_data = user_data,
+    };
+
+out:
+    xSemaphoreGive(_httpd_mutex);
+    return l;
+}
+
+void httpd_init(struct httpd_ops* ops) {
+#define HTTPD_STACK (1024*8)
+    for (int i=0; i<HTTPD_NR_CONNECTIONS; i++)
+        _conns[i].sock = -1;
+    for (int i=0; i<HTTPD_NR_LISTENERS; i++)
+        _listeners[i].sock = -1;
+
+    _httpd_mutex = xSemaphoreCreateMutex();
+    _ops = *ops;
+    _wakeup_init();
+    /* the other core is left to the pairing worker */
+    xTaskCreatePinnedToCore(_httpd_task, "httpd_task", HTTPD_STACK, NULL, 5, NULL, 0);
+}
+
+void httpd_user_data_set(struct httpd_conn* conn, void* user_data) {
+    conn->user_data = user_data;
+}
+
+double httpd_time(void) {
+    return esp_timer_get_time() / 1000000.0;
+}
+
+double httpd_last_io(struct httpd_conn* conn) {
+    return conn->last_io;
+}
+
+void httpd_timer_set(struct httpd_conn* conn, double when) {
+    conn->timer = when;
+}
+
+int httpd_send(struct httpd_conn* conn, const void* data, int len) {
+    const char* p = data;
+    while (len > 0) {
+        int room;
+        char* out = httpd_send_buffer(conn, len, 1, &room);
+        if (out == NULL)
+            return -1;
+        memcpy(out, p, room);
+        httpd_send_commit(conn, room);
+        p += room;
+        len -= room;
+    }
+    return 0;
+}
+
+char* httpd_send_buffer(struct httpd_conn* conn, int want, int min, int* len) {
+    if (conn->close)
+        return NULL;
+    if (min > HTTPD_TX_MAX_LENGTH || _tx_room(conn, min) < 0) {
+        printf("[ERR] send buffer full. length:%d\n", min);
+        return NULL;
+    }
+
+    int room = conn->tx_size - conn->tx_len;
+    *len = (want < room) ? want : room;
+    return conn->tx + conn->tx_len;
+}
+
+void httpd_send_commit(struct httpd_conn* conn, int len) {
+    HAP_LOGD(TAG, "sent %p %d bytes", conn, len);
+    conn->tx_len += len;
+    conn->last_io = httpd_time();
+}
+
+char* httpd_recv_buffer(struct httpd_conn* conn, int* len) {
+    *len = conn->rx_len;
+    return conn->rx;
+}
+
+void httpd_recv_consume(struct httpd_conn* conn, int len) {
+    if (len <= 0 || len > conn->rx_len)
+        return;
+    memmove(conn->rx, conn->rx + len, conn->rx_len - len);
+    conn->rx_len -= len;
+}
+
+void httpd_close(struct httpd_conn* conn) {
+    conn->close = true;
+}
+
+void httpd_close_after_send(struct httpd_conn* conn) {
+    conn->close_after_send = true;
+}
+
+bool httpd_closing(struct httpd_conn* conn) {
+    return conn->close;
+}
+#endif //#ifdef CONFIG_HOMEKIT_HTTPD_LWIP
@@ -3,95 +3,292 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
 #include "ed25519.h"
 #include "iosdevice.h"
 #include "nvs.h"
 
+/* changes within this window go to flash in one write */
+#ifndef IOSDEVICE_COMMIT_DELAY_MS
+#define IOSDEVICE_COMMIT_DELAY_MS 1000
+#endif
+
+/*
+ * The whole table is one NVS record:
+ * version(1) nr_iosdevices(1) then (id, key, permission) of each paired
+ * controller. Version 1 had no permission, those controllers are admins.
+ */
+#define RECORD_VERSION              2
+#define RECORD_ENTRY_V1_LEN         (IOSDEVICE_ID_LEN + ED25519_PUBLIC_KEY_LENGTH)
+#define RECORD_ENTRY_LEN            (RECORD_ENTRY_V1_LEN + 1)
+#define RECORD_LEN                  (2 + IOSDEVICE_PER_ACCESSORY_MAX * RECORD_ENTRY_LEN)
+
+/* open addressing on the id hash, kept at most half full */
+#define INDEX_SIZE                  (IOSDEVICE_PER_ACCESSORY_MAX * 2)
+
 #define ACCESSORY_ID_COMPACT_LEN    12
 struct iosdevice_pairings {
-    char id[ACCESSORY_ID_COMPACT_LEN];
+    char id[ACCESSORY_ID_COMPACT_LEN + 1];
     int nr_iosdevices;
+    /* pair-verify runs on the worker while /pairings edits on the httpd task */
+    SemaphoreHandle_t mutex;
     struct {
         int slot;
+        uint32_t hash;
+        uint8_t permission;
         char id[IOSDEVICE_ID_LEN];
         char key[ED25519_PUBLIC_KEY_LENGTH];
+        void* ltpk;
     } iosdevices[IOSDEVICE_PER_ACCESSORY_MAX];
+    /* slot of each index bucket or -1 */
+    int8_t index[INDEX_SIZE];
+
+    /* the table changed since the last commit, see iosdevice_pairings_commit */
+    bool dirty;
+    int64_t commit_time;
+    /* slots still saved in the per slot records of older firmware */
+    uint32_t legacy;
+    uint8_t record[RECORD_LEN];
 };
 
-static int _pairing_match(void* handle, char id[], char key[])
+/* FNV-1a */
+static uint32_t _id_hash(const char id[])
 {
-    struct iosdevice_pairings *ipairings = (struct iosdevice_pairings*)handle;
+    uint32_t hash = 2166136261u;
+    for (int i=0; i<IOSDEVICE_ID_LEN; i++) {
+        hash ^= (uint8_t)id[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static void _index_insert(struct iosdevice_pairings* ipairings, int slot)
+{
+    int bucket = ipairings->iosdevices[slot].hash % INDEX_SIZE;
+    while (ipairings->index[bucket] != -1)
+        bucket = (bucket + 1) % INDEX_SIZE;
+
+    ipairings->index[bucket] = slot;
+}
+
+/* removing from open addressing breaks probe chains, the table is tiny */
+static void _index_build(struct iosdevice_pairings* ipairings)
+{
+    memset(ipairings->index, -1, sizeof(ipairings->index));
     for (int i=0; i<IOSDEVICE_PER_ACCESSORY_MAX; i++) {
-        if (ipairings->iosdevices[i].slot == -1)
-            continue;
-        if (memcmp(ipairings->iosdevices[i].id, id, IOSDEVICE_ID_LEN) != 0)
-            continue;
-        if (memcmp(ipairings->iosdevices[i].key, key, ED25519_PUBLIC_KEY_LENGTH) != 0)
-            continue;
+        if (ipairings->iosdevices[i].slot != -1)
+            _index_insert(ipairings, i);
+    }
+}
 
-        return i;
-        }
+static int _index_lookup(struct iosdevice_pairings* ipairings, const char id[])
+{
+    uint32_t hash = _id_hash(id);
+    int bucket = hash % INDEX_SIZE;
+
+    for (int i=0; i<INDEX_SIZE; i++) {
+        int slot = ipairings->index[bucket];
+        if (slot == -1)
+            break;
+
+        if (ipairings->iosdevices[slot].hash == hash && 
+                memcmp(ipairings->iosdevices[slot].id, id, IOSDEVICE_ID_LEN) == 0)
+            return slot;
+
+        bucket = (bucket + 1) % INDEX_SIZE;
+    }
 
     return -1;
 }
 
-static int _pairing_match_with_id(void* handle, char id[])
+static void _dirty_set(struct iosdevice_pairings* ipairings)
 {
-    struct iosdevice_pairings *ipairings = (struct iosdevice_pairings*)handle;
+    ipairings->dirty = true;
+    ipairings->commit_time = esp_timer_get_time() + IOSDEVICE_COMMIT_DELAY_MS * 1000LL;
+}
+
+static int _record_build(struct iosdevice_pairings* ipairings)
+{
+    uint8_t* p = ipairings->record;
+    *p++ = RECORD_VERSION;
+    *p++ = ipairings->nr_iosdevices;
+
     for (int i=0; i<IOSDEVICE_PER_ACCESSORY_MAX; i++) {
         if (ipairings->iosdevices[i].slot == -1)
             continue;
-        if (memcmp(ipairings->iosdevices[i].id, id, IOSDEVICE_ID_LEN) != 0)
+
+        memcpy(p, ipairings->iosdevices[i].id, IOSDEVICE_ID_LEN);
+        memcpy(p + IOSDEVICE_ID_LEN, ipairings->iosdevices[i].key, ED25519_PUBLIC_KEY_LENGTH);
+        p[RECORD_ENTRY_V1_LEN] = ipairings->iosdevices[i].permission;
+        p += RECORD_ENTRY_LEN;
+    }
+
+    return p - ipairings->record;
+}
+
+static void _slot_load(struct iosdevice_pairings* ipairings, int slot, uint8_t* entry, uint8_t permission)
+{
+    ipairings->nr_iosdevices++;
+    ipairings->iosdevices[slot].slot = slot;
+    ipairings->iosdevices[slot].hash = _id_hash((char*)entry);
+    ipairings->iosdevices[slot].permission = permission;
+
+    memcpy(ipairings->iosdevices[slot].id, entry, IOSDEVICE_ID_LEN);
+    printf("[IOSDEVICE] ID:%.*s\n", IOSDEVICE_ID_LEN, ipairings->iosdevices[slot].id);
+    memcpy(ipairings->iosdevices[slot].key, entry + IOSDEVICE_ID_LEN, ED25519_PUBLIC_KEY_LENGTH);
+    ipairings->iosdevices[slot].ltpk = ed25519_key_create((uint8_t*)ipairings->iosdevices[slot].key, NULL);
+}
+
+static int _record_load(struct iosdevice_pairings* ipairings)
+{
+    char nvs_key[64] = {0,};
+    sprintf(nvs_key, "%sPT", ipairings->id);
+
+    int len = nvs_get(nvs_key, ipairings->record, RECORD_LEN);
+    if (len < 2)
+        return -1;
+
+    uint8_t* p = ipairings->record;
+    int entry_len = (p[0] == 1) ? RECORD_ENTRY_V1_LEN : RECORD_ENTRY_LEN;
+    if (p[0] < 1 || p[0] > RECORD_VERSION || p[1] > IOSDEVICE_PER_ACCESSORY_MAX || 
+            len != 2 + p[1] * entry_len) {
+        printf("[ERR] pairing table is broken. version:%d length:%d\n", p[0], len);
+        return -1;
+    }
+
+    int nr_iosdevices = p[1];
+    for (int i=0; i<nr_iosdevices; i++) {
+        uint8_t* entry = p + 2 + i * entry_len;
+        uint8_t permission = (p[0] == 1) ? IOSDEVICE_PERMISSION_ADMIN : entry[RECORD_ENTRY_V1_LEN];
+        _slot_load(ipairings, i, entry, permission);
+    }
+
+    /* older versions are rewritten in the current one */
+    if (p[0] != RECORD_VERSION) {
+        ipairings->dirty = true;
+        ipairings->commit_time = 0;
+    }
+
+    return 0;
+}
+
+/* moves the per slot records of older firmware over on the first commit */
+static void _legacy_load(struct iosdevice_pairings* ipairings)
+{
+    uint8_t value[RECORD_ENTRY_V1_LEN] = {0,};
+    char nvs_key[64] = {0,};
+
+    for (int i=0; i<IOSDEVICE_PER_ACCESSORY_MAX; i++) {
+        sprintf(nvs_key, "%sD%d", ipairings->id, i);
+        if (nvs_get(nvs_key, value, RECORD_ENTRY_V1_LEN) == 0)
             continue;
-        return i;
+
+        _slot_load(ipairings, i, value, IOSDEVICE_PERMISSION_ADMIN);
+        ipairings->legacy |= 1 << i;
     }
 
-    return -1;
+    if (ipairings->legacy) {
+        ipairings->dirty = true;
+        ipairings->commit_time = 0;
+    }
+}
+
+static int _pairing_match(void* handle, char id[], char key[])
+{
+    struct iosdevice_pairings *ipairings = (struct iosdevice_pairings*)handle;
+    int slot = _index_lookup(ipairings, id);
+    if (slot < 0)
+        return -1;
+
+    if (memcmp(ipairings->iosdevices[slot].key, key, ED25519_PUBLIC_KEY_LENGTH) != 0)
+        return -1;
+
+    return slot;
+}
+
+static int _pairing_match_with_id(void* handle, char id[])
+{
+    return _index_lookup((struct iosdevice_pairings*)handle, id);
 }
 
-int iosdevice_pairings(void* handle, struct iosdevice *idevice)
+int iosdevice_pairings_foreach(void* handle, 
+        void (*fn)(void* arg, const struct iosdevice* idevice), void* arg)
 {
     struct iosdevice_pairings *ipairings = (struct iosdevice_pairings*)handle;
     int nr_paired_device = 0;
 
+    xSemaphoreTake(ipairings->mutex, portMAX_DELAY);
     for (int i=0; i<IOSDEVICE_PER_ACCESSORY_MAX; i++) {
         if (ipairings->iosdevices[i].slot == -1)
             continue;
 
-        memcpy(idevice[nr_paired_device].id, ipairings->iosdevices[i].id, IOSDEVICE_ID_LEN);
-        memcpy(idevice[nr_paired_device].key, ipairings->iosdevices[i].key, ED25519_PUBLIC_KEY_LENGTH);
+        if (fn) {
+            struct iosdevice idevice = {
+                .id = ipairings->iosdevices[i].id,
+                .key = ipairings->iosdevices[i].key,
+                .permission = ipairings->iosdevices[i].permission,
+            };
+            fn(arg, &idevice);
+        }
         nr_paired_device++;
     }
+    xSemaphoreGive(ipairings->mutex);
 
     return nr_paired_device;
 }
 
 int iosdevice_pairings_remove(void* handle, char id[])
 {
+    struct iosdevice_pairings *ipairings = (struct iosdevice_pairings*)handle;
+
+    xSemaphoreTake(ipairings->mutex, portMAX_DELAY);
     int slot = _pairing_match_with_id(handle, id);
     if (slot < 0) {
+        xSemaphoreGive(ipairings->mutex);
         printf("[ERR] no iosdevice to be removed\n");
         return -1;
     }
 
-    struct iosdevice_pairings *ipairings = (struct iosdevice_pairings*)handle;
     ipairings->iosdevices[slot].slot = -1;
+    ed25519_key_free(ipairings->iosdevices[slot].ltpk);
+    ipairings->iosdevices[slot].ltpk = NULL;
     ipairings->nr_iosdevices--;
-
-    char nvs_key[64] = {0,};
-    sprintf(nvs_key, "%sD%d", ipairings->id, slot);
-    nvs_erase(nvs_key);
+    _index_build(ipairings);
+    _dirty_set(ipairings);
+    xSemaphoreGive(ipairings->mutex);
 
     return 0;
 }
 
-int iosdevice_pairings_add(void* handle, char id[], char key[])
+int iosdevice_pairings_add(void* handle, char id[], char key[], uint8_t permission)
 {
-    if (iosdevice_pairing_match(handle, id, key))
-        return 0;
-
     struct iosdevice_pairings *ipairings = (struct iosdevice_pairings*)handle;
+
+    xSemaphoreTake(ipairings->mutex, portMAX_DELAY);
+    int slot = _pairing_match_with_id(handle, id);
+    if (slot >= 0) {
+        /* a known controller only gets its permission updated */
+        int err = -1;
+        if (memcmp(ipairings->iosdevices[slot].key, key, ED25519_PUBLIC_KEY_LENGTH) == 0) {
+            if (ipairings->iosdevices[slot].permission != permission) {
+                ipairings->iosdevices[slot].permission = permission;
+                _dirty_set(ipairings);
+            }
+            err = 0;
+        }
+        else {
+            printf("[ERR] iosdevice is paired with another key\n");
+        }
+        xSemaphoreGive(ipairings->mutex);
+        return err;
+    }
+
     if (ipairings->nr_iosdevices == IOSDEVICE_PER_ACCESSORY_MAX) {
+        xSemaphoreGive(ipairings->mutex);
         printf("[ERR] pairings are full\n");
         return -1;
     }
@@ -99,39 +296,117 @@ int iosdevice_pairings_add(void* handle, char id[], char key[])
     for (int i=0; i<IOSDEVICE_PER_ACCESSORY_MAX; i++) {
         if (ipairings->iosdevices[i].slot == -1) {
             ipairings->iosdevices[i].slot = i;
+            ipairings->iosdevices[i].hash = _id_hash(id);
+            ipairings->iosdevices[i].permission = permission;
             memcpy(ipairings->iosdevices[i].id, id, IOSDEVICE_ID_LEN);
             memcpy(ipairings->iosdevices[i].key, key, ED25519_PUBLIC_KEY_LENGTH);
-
-            char nvs_key[64] = {0,};
-            sprintf(nvs_key, "%sD%d", ipairings->id, i);
-
-            uint8_t value[128] = {0,};
-            memcpy(value, id, IOSDEVICE_ID_LEN);
-            memcpy(value+IOSDEVICE_ID_LEN, key, ED25519_PUBLIC_KEY_LENGTH);
-
-            nvs_set(nvs_key, value, IOSDEVICE_ID_LEN+ED25519_PUBLIC_KEY_LENGTH);
-
+            ipairings->iosdevices[i].ltpk = ed25519_key_create((uint8_t*)key, NULL);
             ipairings->nr_iosdevices++;
+            _index_insert(ipairings, i);
+            _dirty_set(ipairings);
             break;
         }
     }
+    xSemaphoreGive(ipairings->mutex);
+
     return 0;
 }
 
 bool iosdevice_pairing_match(void* handle, char id[], char key[])
 {
-    if (_pairing_match(handle, id, key) < 0) {
-        return false;
+    struct iosdevice_pairings *ipairings = (struct iosdevice_pairings*)handle;
+
+    xSemaphoreTake(ipairings->mutex, portMAX_DELAY);
+    int slot = _pairing_match(handle, id, key);
+    xSemaphoreGive(ipairings->mutex);
+
+    return slot >= 0;
+}
+
+int iosdevice_permission(void* handle, char id[])
+{
+    struct iosdevice_pairings *ipairings = (struct iosdevice_pairings*)handle;
+
+    xSemaphoreTake(ipairings->mutex, portMAX_DELAY);
+    int slot = _pairing_match_with_id(handle, id);
+    int permission = slot < 0 ? -1 : ipairings->iosdevices[slot].permission;
+    xSemaphoreGive(ipairings->mutex);
+
+    return permission;
+}
+
+int iosdevice_signature_verify(void* handle, char id[], 
+        uint8_t* signature, int signature_len, uint8_t* msg, int msg_len)
+{
+    struct iosdevice_pairings *ipairings = (struct iosdevice_pairings*)handle;
+
+    xSemaphoreTake(ipairings->mutex, portMAX_DELAY);
+    int slot = _pairing_match_with_id(handle, id);
+    if (slot < 0) {
+        printf("[ERR] unknown iosdevice\n");
+        xSemaphoreGive(ipairings->mutex);
+        return -1;
     }
 
-    return true;
+    int err = ed25519_key_verify(ipairings->iosdevices[slot].ltpk, 
+            signature, signature_len, msg, msg_len);
+    xSemaphoreGive(ipairings->mutex);
+
+    return err < 0 ? -1 : 0;
 }
 
-void* iosdevice_pairings_init(char accessory_id[])
+int iosdevice_pairings_commit(void* handle, bool force)
 {
-    uint8_t value[128] = {0,};
+    struct iosdevice_pairings *ipairings = (struct iosdevice_pairings*)handle;
+
+    xSemaphoreTake(ipairings->mutex, portMAX_DELAY);
+    if (!ipairings->dirty) {
+        xSemaphoreGive(ipairings->mutex);
+        return 0;
+    }
+
+    int64_t wait = ipairings->commit_time - esp_timer_get_time();
+    if (!force && wait > 0) {
+        xSemaphoreGive(ipairings->mutex);
+        return (int)((wait + 999) / 1000);
+    }
+
+    int len = _record_build(ipairings);
+    ipairings->dirty = false;
+    xSemaphoreGive(ipairings->mutex);
+
     char nvs_key[64] = {0,};
+    sprintf(nvs_key, "%sPT", ipairings->id);
+    if (nvs_set(nvs_key, ipairings->record, len) < 0) {
+        xSemaphoreTake(ipairings->mutex, portMAX_DELAY);
+        _dirty_set(ipairings);
+        xSemaphoreGive(ipairings->mutex);
+        return IOSDEVICE_COMMIT_DELAY_MS;
+    }
+
+    for (int i=0; i<IOSDEVICE_PER_ACCESSORY_MAX; i++) {
+        if ((ipairings->legacy & (1 << i)) == 0)
+            continue;
+
+        sprintf(nvs_key, "%sD%d", ipairings->id, i);
+        nvs_erase(nvs_key);
+    }
+    ipairings->legacy = 0;
+
+    return 0;
+}
+
+void* iosdevice_pairings_init(char accessory_id[])
+{
     struct iosdevice_pairings *ipairings = calloc(1, sizeof(struct iosdevice_pairings));
+    if (!ipairings)
+        return NULL;
+
+    ipairings->mutex = xSemaphoreCreateMutex();
+    if (!ipairings->mutex) {
+        free(ipairings);
+        return NULL;
+    }
 
     ipairings->id[0] = accessory_id[0];
     ipairings->id[1] = accessory_id[1];
@@ -146,24 +421,27 @@ void* iosdevice_pairings_init(char accessory_id[])
     ipairings->id[10] = accessory_id[15];
     ipairings->id[11] = accessory_id[16];
 
+    for (int i=0; i<IOSDEVICE_PER_ACCESSORY_MAX; i++)
+        ipairings->iosdevices[i].slot = -1;
 
-    for (int i=0; i<IOSDEVICE_PER_ACCESSORY_MAX; i++) {
-        memset(nvs_key, 0, sizeof(nvs_key));
-        memset(value, 0, sizeof(value));
-        sprintf(nvs_key, "%sD%d", ipairings->id, i);
-        //nvs_erase(nvs_key);
-        if (nvs_get(nvs_key, value, IOSDEVICE_ID_LEN + ED25519_PUBLIC_KEY_LENGTH) == 0) {
-            ipairings->iosdevices[i].slot = -1;
-            continue;
-        }
+    if (_record_load(ipairings) < 0)
+        _legacy_load(ipairings);
+    _index_build(ipairings);
 
-        ipairings->nr_iosdevices++;
-        ipairings->iosdevices[i].slot = i;
+    return ipairings;
+}
 
-        memcpy(ipairings->iosdevices[i].id, value, IOSDEVICE_ID_LEN);
-        printf("[IOSDEVICE] ID:%.*s\n", IOSDEVICE_ID_LEN, ipairings->iosdevices[i].id);
-        memcpy(ipairings->iosdevices[i].key, value+IOSDEVICE_ID_LEN, ED25519_PUBLIC_KEY_LENGTH);
-    }
+void iosdevice_pairings_cleanup(void* handle)
+{
+    struct iosdevice_pairings *ipairings = (struct iosdevice_pairings*)handle;
+    if (!ipairings)
+        return;
 
-    return ipairings;
+    iosdevice_pairings_commit(ipairings, true);
+
+    for (int i=0; i<IOSDEVICE_PER_ACCESSORY_MAX; i++)
+        ed25519_key_free(ipairings->iosdevices[i].ltpk);
+
+    vSemaphoreDelete(ipairings->mutex);
+    free(ipairings);
 }
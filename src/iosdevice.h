@@ -10,21 +10,42 @@ extern "C" {
 
 #include "ed25519.h"
 
-#define IOSDEVICE_PER_ACCESSORY_MAX  8
+/* HAP allows an accessory 16 controllers */
+#define IOSDEVICE_PER_ACCESSORY_MAX  16
 #define IOSDEVICE_ID_LEN       36
 
+#define IOSDEVICE_PERMISSION_USER    0
+#define IOSDEVICE_PERMISSION_ADMIN   1
+
+/* points into the pairing table, only valid inside the foreach callback */
 struct iosdevice {
-    char id[IOSDEVICE_ID_LEN];
-    char key[ED25519_PUBLIC_KEY_LENGTH];
+    const char* id;
+    const char* key;
+    uint8_t permission;
 };
 
-/* idevice is array pointer. array size is IOSDEVICE_PER_ACCESSORY_MAX */
-int iosdevice_pairings(void* handle, struct iosdevice *idevice);
+/* calls fn with every paired controller, fn may be NULL. Returns the count */
+int iosdevice_pairings_foreach(void* handle, 
+        void (*fn)(void* arg, const struct iosdevice* idevice), void* arg);
 
 int iosdevice_pairings_remove(void* handle, char id[]);
-int iosdevice_pairings_add(void* handle, char id[], char key[]);
+/* adding a known controller with the same key updates its permission */
+int iosdevice_pairings_add(void* handle, char id[], char key[], uint8_t permission);
 bool iosdevice_pairing_match(void* handle, char id[], char key[]);
+/* IOSDEVICE_PERMISSION_xxx of the controller, -1 when it is not paired */
+int iosdevice_permission(void* handle, char id[]);
+/* verifies with the controller's cached LTPK context. 0 on success */
+int iosdevice_signature_verify(void* handle, char id[], 
+        uint8_t* signature, int signature_len, uint8_t* msg, int msg_len);
+/*
+ * Changes are written to flash together, IOSDEVICE_COMMIT_DELAY_MS after the
+ * last one, or right away with force. Pair-setup M6 and /pairings Remove
+ * force it before answering. Returns the ms until the pending commit is
+ * due, 0 when there is nothing left to write.
+ */
+int iosdevice_pairings_commit(void* handle, bool force);
 void* iosdevice_pairings_init(char accessory_id[]);
+void iosdevice_pairings_cleanup(void* handle);
 
 #ifdef __cplusplus
 }
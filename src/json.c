@@ -0,0 +1,419 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json.h"
+
+static void _putc(struct json* json, char c)
+{
+    if (json->buf && json->len < json->size)
+        json->buf[json->len] = c;
+    json->len++;
+}
+
+void json_init(struct json* json, char* buf, int size)
+{
+    json->buf = buf;
+    json->size = buf ? size : 0;
+    json->len = 0;
+}
+
+void json_raw(struct json* json, const char* raw, int len)
+{
+    if (json->buf && json->len < json->size) {
+        int room = json->size - json->len;
+        memcpy(json->buf + json->len, raw, len < room ? len : room);
+    }
+    json->len += len;
+}
+
+void json_string(struct json* json, const char* str)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    _putc(json, '"');
+    for (const unsigned char* p = (const unsigned char*)str; *p; p++) {
+        switch (*p) {
+        case '"':  json_literal(json, "\\\""); break;
+        case '\\': json_literal(json, "\\\\"); break;
+        case '\b': json_literal(json, "\\b"); break;
+        case '\f': json_literal(json, "\\f"); break;
+        case '\n': json_literal(json, "\\n"); break;
+        case '\r': json_literal(json, "\\r"); break;
+        case '\t': json_literal(json, "\\t"); break;
+        default:
+            if (*p < 0x20) {
+                json_literal(json, "\\u00");
+                _putc(json, hex[*p >> 4]);
+                _putc(json, hex[*p & 0x0f]);
+            }
+            else {
+                _putc(json, *p);
+            }
+            break;
+        }
+    }
+    _putc(json, '"');
+}
+
+void json_int(struct json* json, int64_t value)
+{
+    char number[24];
+    int len = snprintf(number, sizeof(number), "%lld", (long long)value);
+    json_raw(json, number, len);
+}
+
+void json_uint(struct json* json, uint64_t value)
+{
+    char number[24];
+    int len = snprintf(number, sizeof(number), "%llu", (unsigned long long)value);
+    json_raw(json, number, len);
+}
+
+void json_float(struct json* json, float value)
+{
+    if (isnan(value) || isinf(value)) {
+        json_null(json);
+        return;
+    }
+
+    char number[32];
+    int len = 0;
+    for (int precision=6; precision<=9; precision++) {
+        len = snprintf(number, sizeof(number), "%1.*g", precision, value);
+        if (strtof(number, NULL) == value)
+            break;
+    }
+
+    json_raw(json, number, len);
+}
+
+void json_double(struct json* json, double value)
+{
+    if (isnan(value) || isinf(value)) {
+        json_null(json);
+        return;
+    }
+
+    /* same representation as cJSON_PrintUnformatted */
+    char number[32];
+    int len = snprintf(number, sizeof(number), "%1.15g", value);
+    if (strtod(number, NULL) != value)
+        len = snprintf(number, sizeof(number), "%1.17g", value);
+
+    json_raw(json, number, len);
+}
+
+void json_bool(struct json* json, bool value)
+{
+    if (value)
+        json_literal(json, "true");
+    else
+        json_literal(json, "false");
+}
+
+void json_null(struct json* json)
+{
+    json_literal(json, "null");
+}
+
+static const char base64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+void json_base64(struct json* json, const uint8_t* data, int len)
+{
+    _putc(json, '"');
+    for (int i=0; i<len; i+=3) {
+        uint32_t bits = data[i] << 16;
+        if (i + 1 < len)
+            bits |= data[i + 1] << 8;
+        if (i + 2 < len)
+            bits |= data[i + 2];
+
+        _putc(json, base64[(bits >> 18) & 0x3f]);
+        _putc(json, base64[(bits >> 12) & 0x3f]);
+        _putc(json, i + 1 < len ? base64[(bits >> 6) & 0x3f] : '=');
+        _putc(json, i + 2 < len ? base64[bits & 0x3f] : '=');
+    }
+    _putc(json, '"');
+}
+
+void json_reader_init(struct json_reader* reader, char* buf, int len)
+{
+    reader->p = buf;
+    reader->end = buf + len;
+}
+
+static int _hex4(struct json_reader* reader, uint32_t* value)
+{
+    if (reader->end - reader->p < 4)
+        return -1;
+
+    *value = 0;
+    for (int i=0; i<4; i++) {
+        char c = *reader->p++;
+        *value <<= 4;
+        if (c >= '0' && c <= '9')
+            *value |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            *value |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            *value |= c - 'A' + 10;
+        else
+            return -1;
+    }
+
+    return 0;
+}
+
+static int _utf8(char* out, uint32_t cp)
+{
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = 0xc0 | (cp >> 6);
+        out[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = 0xe0 | (cp >> 12);
+        out[1] = 0x80 | ((cp >> 6) & 0x3f);
+        out[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    }
+    out[0] = 0xf0 | (cp >> 18);
+    out[1] = 0x80 | ((cp >> 12) & 0x3f);
+    out[2] = 0x80 | ((cp >> 6) & 0x3f);
+    out[3] = 0x80 | (cp & 0x3f);
+    return 4;
+}
+
+/* an escape sequence is never shorter than what it decodes to */
+static enum json_type _read_string(struct json_reader* reader, struct json_token* token)
+{
+    char* out = reader->p;
+    token->text = out;
+
+    while (reader->p < reader->end) {
+        char c = *reader->p++;
+        if (c == '"') {
+            *out = 0;
+            token->len = out - token->text;
+            return JSON_STRING;
+        }
+
+        if (c != '\\') {
+            *out++ = c;
+            continue;
+        }
+
+        if (reader->p == reader->end)
+            return JSON_ERROR;
+
+        c = *reader->p++;
+        switch (c) {
+        case 'b': *out++ = '\b'; break;
+        case 'f': *out++ = '\f'; break;
+        case 'n': *out++ = '\n'; break;
+        case 'r': *out++ = '\r'; break;
+        case 't': *out++ = '\t'; break;
+        case 'u': {
+            uint32_t cp;
+            if (_hex4(reader, &cp) < 0)
+                return JSON_ERROR;
+
+            if (cp >= 0xd800 && cp < 0xdc00) {
+                uint32_t low;
+                if (reader->end - reader->p < 2 || reader->p[0] != '\\' || reader->p[1] != 'u')
+                    return JSON_ERROR;
+                reader->p += 2;
+                if (_hex4(reader, &low) < 0 || low < 0xdc00 || low > 0xdfff)
+                    return JSON_ERROR;
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+            }
+
+            out += _utf8(out, cp);
+            break;
+        }
+        default:
+            *out++ = c;
+            break;
+        }
+    }
+
+    return JSON_ERROR;
+}
+
+static enum json_type _read_literal(struct json_reader* reader, struct json_token* token,
+        const char* literal, int len, enum json_type type)
+{
+    if (reader->end - reader->p < len || memcmp(reader->p, literal, len) != 0)
+        return JSON_ERROR;
+
+    reader->p += len;
+    token->len = len + 1;
+    return type;
+}
+
+static enum json_type _read(struct json_reader* reader, struct json_token* token)
+{
+    while (reader->p < reader->end) {
+        char c = *reader->p;
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == ',' || c == ':')
+            reader->p++;
+        else
+            break;
+    }
+
+    if (reader->p == reader->end)
+        return JSON_END;
+
+    token->text = reader->p;
+    token->len = 1;
+    switch (*reader->p++) {
+    case '{': return JSON_OBJECT_BEGIN;
+    case '}': return JSON_OBJECT_END;
+    case '[': return JSON_ARRAY_BEGIN;
+    case ']': return JSON_ARRAY_END;
+    case '"': return _read_string(reader, token);
+    case 't': return _read_literal(reader, token, "rue", 3, JSON_TRUE);
+    case 'f': return _read_literal(reader, token, "alse", 4, JSON_FALSE);
+    case 'n': return _read_literal(reader, token, "ull", 3, JSON_NULL);
+    default:
+        break;
+    }
+
+    reader->p = token->text;
+    while (reader->p < reader->end && *reader->p && strchr("+-.eE0123456789", *reader->p))
+        reader->p++;
+
+    token->len = reader->p - token->text;
+    return token->len ? JSON_NUMBER : JSON_ERROR;
+}
+
+enum json_type json_read(struct json_reader* reader, struct json_token* token)
+{
+    token->type = _read(reader, token);
+    return token->type;
+}
+
+int json_skip(struct json_reader* reader, struct json_token* token)
+{
+    int depth = 0;
+    struct json_token t = *token;
+
+    for (;;) {
+        switch (t.type) {
+        case JSON_OBJECT_BEGIN:
+        case JSON_ARRAY_BEGIN:
+            depth++;
+            break;
+        case JSON_OBJECT_END:
+        case JSON_ARRAY_END:
+            depth--;
+            break;
+        case JSON_ERROR:
+        case JSON_END:
+            return -1;
+        default:
+            break;
+        }
+
+        if (depth <= 0)
+            return depth == 0 ? 0 : -1;
+
+        json_read(reader, &t);
+    }
+}
+
+double json_number(struct json_token* token)
+{
+    switch (token->type) {
+    case JSON_TRUE:
+        return 1;
+    case JSON_NUMBER: {
+        char number[32];
+        if (token->len >= sizeof(number))
+            return 0;
+        memcpy(number, token->text, token->len);
+        number[token->len] = 0;
+        return strtod(number, NULL);
+    }
+    default:
+        return 0;
+    }
+}
+
+uint64_t json_unsigned(struct json_token* token)
+{
+    if (token->type != JSON_NUMBER)
+        return json_number(token) != 0;
+
+    /* plain digits are taken exactly, anything else goes through strtod */
+    uint64_t value = 0;
+    for (int i=0; i<token->len; i++) {
+        char c = token->text[i];
+        if (c < '0' || c > '9') {
+            double number = json_number(token);
+            return number > 0 ? (uint64_t)number : 0;
+        }
+        value = value * 10 + (c - '0');
+    }
+
+    return value;
+}
+
+static int _base64_value(char c)
+{
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A';
+    if (c >= 'a' && c <= 'z')
+        return c - 'a' + 26;
+    if (c >= '0' && c <= '9')
+        return c - '0' + 52;
+    if (c == '+')
+        return 62;
+    if (c == '/')
+        return 63;
+    return -1;
+}
+
+/* every 4 characters decode to at most 3 bytes, so the output never overtakes */
+int json_base64_decode(struct json_token* token)
+{
+    if (token->type != JSON_STRING || token->len % 4)
+        return -1;
+
+    const char* in = token->text;
+    uint8_t* out = (uint8_t*)token->text;
+    int len = token->len;
+    int padding = 0;
+    if (len && in[len - 1] == '=')
+        padding++;
+    if (len > 1 && in[len - 2] == '=')
+        padding++;
+
+    for (int i=0; i<len; i+=4) {
+        uint32_t bits = 0;
+        for (int j=0; j<4; j++) {
+            int v = 0;
+            if (i + j < len - padding) {
+                v = _base64_value(in[i + j]);
+                if (v < 0)
+                    return -1;
+            }
+            bits = (bits << 6) | v;
+        }
+
+        *out++ = bits >> 16;
+        *out++ = bits >> 8;
+        *out++ = bits;
+    }
+
+    token->len = len / 4 * 3 - padding;
+    return token->len;
+}
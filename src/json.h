@@ -0,0 +1,90 @@
+#ifndef _JSON_H_
+#define _JSON_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Minimal JSON text writer.
+ * Writes into buf while it fits, but always counts the full length like
+ * snprintf does. With buf NULL it only measures.
+ */
+struct json {
+    char* buf;
+    int size;
+    int len;
+};
+
+void json_init(struct json* json, char* buf, int size);
+
+void json_raw(struct json* json, const char* raw, int len);
+void json_string(struct json* json, const char* str);
+void json_int(struct json* json, int64_t value);
+void json_uint(struct json* json, uint64_t value);
+void json_double(struct json* json, double value);
+/* shortest text that reads back as the same float */
+void json_float(struct json* json, float value);
+void json_bool(struct json* json, bool value);
+void json_null(struct json* json);
+/* base64 of the bytes as a JSON string, encoded straight into the buffer */
+void json_base64(struct json* json, const uint8_t* data, int len);
+
+#define json_literal(json, literal) json_raw(json, literal, sizeof(literal) - 1)
+
+/*
+ * Minimal pull parser over a mutable buffer.
+ * Tokens are handed out one at a time and the structure is left to the
+ * caller. Strings are unescaped in place and NUL terminated, so nothing is
+ * allocated. ',' and ':' are only treated as separators.
+ */
+enum json_type {
+    JSON_ERROR,
+    JSON_END,
+    JSON_OBJECT_BEGIN,
+    JSON_OBJECT_END,
+    JSON_ARRAY_BEGIN,
+    JSON_ARRAY_END,
+    JSON_STRING,
+    JSON_NUMBER,
+    JSON_TRUE,
+    JSON_FALSE,
+    JSON_NULL,
+};
+
+struct json_token {
+    enum json_type type;
+    char* text;
+    int len;
+};
+
+struct json_reader {
+    char* p;
+    char* end;
+};
+
+void json_reader_init(struct json_reader* reader, char* buf, int len);
+enum json_type json_read(struct json_reader* reader, struct json_token* token);
+
+/* skips the rest of the value token starts */
+int json_skip(struct json_reader* reader, struct json_token* token);
+
+/* numbers and booleans as double, anything else is 0 */
+double json_number(struct json_token* token);
+/* exact for integers beyond the 53 bits of a double, negatives are 0 */
+uint64_t json_unsigned(struct json_token* token);
+
+/*
+ * Decodes the base64 text of a string token in place.
+ * The token is left holding the bytes, returns -1 if the text isn't base64.
+ */
+int json_base64_decode(struct json_token* token);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //#ifndef _JSON_H_
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "logger.h"
+
+#ifndef LOGGER_RING_LENGTH
+#define LOGGER_RING_LENGTH 64   /* a power of two */
+#endif
+#define LOGGER_STACK (1024*3)
+#define LOGGER_PRIORITY (tskIDLE_PRIORITY + 1)
+#define LOGGER_DRAIN_INTERVAL_MS 50
+
+/*
+ * seq holds the start of the lap the slot is on, so the zeroed ring is free
+ * for the first one. The low bit marks it filled, draining it moves it on
+ * to the next lap.
+ */
+#define LOGGER_LAP(pos) ((pos) & ~(uint32_t)(LOGGER_RING_LENGTH - 1))
+#define LOGGER_FILLED 1
+
+struct logger_record {
+    volatile uint32_t seq;
+    uint32_t time;
+    int level;
+    const char* tag;
+    const char* fmt;
+    uint32_t args[LOGGER_NR_ARGS];
+};
+
+static struct logger_record _ring[LOGGER_RING_LENGTH];
+static volatile uint32_t _head;
+static uint32_t _tail;
+static volatile uint32_t _dropped;
+static TaskHandle_t _task;
+
+static const char _level_letters[] = { ' ', 'E', 'W', 'I', 'D' };
+
+/* compare and set loop, the writers may be on either core */
+static uint32_t _atomic_swap_add(volatile uint32_t* addr, uint32_t add, bool swap)
+{
+    while (1) {
+        uint32_t old = *addr;
+        uint32_t set = swap ? add : old + add;
+        uxPortCompareSet(addr, old, &set);
+        if (set == old)
+            return old;
+    }
+}
+
+void logger_write(int level, const char* tag, const char* fmt,
+        uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
+{
+    uint32_t pos = _head;
+    struct logger_record* r;
+
+    while (1) {
+        r = &_ring[pos & (LOGGER_RING_LENGTH - 1)];
+        int32_t diff = (int32_t)(r->seq - LOGGER_LAP(pos));
+        if (diff < 0) {
+            /* still busy with the record from a lap ago */
+            _atomic_swap_add(&_dropped, 1, false);
+            return;
+        }
+        if (diff > 0) {
+            pos = _head;
+            continue;
+        }
+
+        uint32_t claimed = pos + 1;
+        uxPortCompareSet(&_head, pos, &claimed);
+        if (claimed == pos)
+            break;
+        pos = claimed;
+    }
+
+    r->time = esp_log_timestamp();
+    r->level = level;
+    r->tag = tag;
+    r->fmt = fmt;
+    r->args[0] = a0;
+    r->args[1] = a1;
+    r->args[2] = a2;
+    r->args[3] = a3;
+    r->args[4] = a4;
+    r->args[5] = a5;
+
+    __sync_synchronize();
+    r->seq = LOGGER_LAP(pos) | LOGGER_FILLED;
+}
+
+static void _logger_print(struct logger_record* r)
+{
+    printf("%c (%u) %s: ", _level_letters[r->level], r->time, r->tag);
+    printf(r->fmt, r->args[0], r->args[1], r->args[2],
+            r->args[3], r->args[4], r->args[5]);
+    printf("\n");
+}
+
+static void _logger_drain(void)
+{
+    while (1) {
+        struct logger_record* slot = &_ring[_tail & (LOGGER_RING_LENGTH - 1)];
+        if (slot->seq != (LOGGER_LAP(_tail) | LOGGER_FILLED))
+            break;
+
+        /* copy it out so the slot is free again while we print */
+        struct logger_record r = *slot;
+        __sync_synchronize();
+        slot->seq = LOGGER_LAP(_tail) + LOGGER_RING_LENGTH;
+        _tail++;
+
+        if (r.level > LOGGER_NONE && r.level <= LOGGER_DEBUG)
+            _logger_print(&r);
+    }
+
+    uint32_t dropped = _atomic_swap_add(&_dropped, 0, true);
+    if (dropped)
+        printf("W (%u) LOGGER: %u records dropped\n", esp_log_timestamp(), dropped);
+}
+
+static void _logger_task(void* arg)
+{
+    while (1) {
+        _logger_drain();
+        vTaskDelay(LOGGER_DRAIN_INTERVAL_MS / portTICK_PERIOD_MS);
+    }
+}
+
+int logger_init(void)
+{
+    if (_task)
+        return 0;
+
+    if (xTaskCreate(_logger_task, "logger_task", LOGGER_STACK, NULL,
+                LOGGER_PRIORITY, &_task) != pdPASS) {
+        printf("[ERR] xTaskCreate failed\n");
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef _LOGGER_H_
+#define _LOGGER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define LOGGER_NONE     0
+#define LOGGER_ERROR    1
+#define LOGGER_WARN     2
+#define LOGGER_INFO     3
+#define LOGGER_DEBUG    4
+
+/* records above this level are not even compiled in */
+#ifndef LOGGER_LEVEL
+#ifdef CONFIG_HOMEKIT_LOG_LEVEL
+#define LOGGER_LEVEL CONFIG_HOMEKIT_LOG_LEVEL
+#else
+#define LOGGER_LEVEL LOGGER_INFO
+#endif
+#endif
+
+#define LOGGER_NR_ARGS 6
+
+/*
+ * Queues a binary record, the logger task formats and prints it later.
+ * fmt and tag are kept by pointer, so they must be string literals, and
+ * the arguments are words: integers, pointers and static strings only,
+ * never a buffer that may be gone by the time the record is printed.
+ * When the ring is full the record is dropped and counted.
+ */
+void logger_write(int level, const char* tag, const char* fmt,
+        uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5);
+
+/* starts the low priority task that drains the ring */
+int logger_init(void);
+
+#define _LOGGER_ARG(x) ((uint32_t)(uintptr_t)(x))
+#define _LOGGER_RECORD(level, tag, fmt, a0, a1, a2, a3, a4, a5, ...) do {    \
+    if (LOGGER_LEVEL >= level)                                              \
+        logger_write(level, tag, fmt, _LOGGER_ARG(a0), _LOGGER_ARG(a1),     \
+                _LOGGER_ARG(a2), _LOGGER_ARG(a3), _LOGGER_ARG(a4),          \
+                _LOGGER_ARG(a5));                                           \
+} while (0)
+
+#define HAP_LOGE(tag, fmt, ...) _LOGGER_RECORD(LOGGER_ERROR, tag, fmt, ##__VA_ARGS__, 0, 0, 0, 0, 0, 0)
+#define HAP_LOGW(tag, fmt, ...) _LOGGER_RECORD(LOGGER_WARN, tag, fmt, ##__VA_ARGS__, 0, 0, 0, 0, 0, 0)
+#define HAP_LOGI(tag, fmt, ...) _LOGGER_RECORD(LOGGER_INFO, tag, fmt, ##__VA_ARGS__, 0, 0, 0, 0, 0, 0)
+#define HAP_LOGD(tag, fmt, ...) _LOGGER_RECORD(LOGGER_DEBUG, tag, fmt, ##__VA_ARGS__, 0, 0, 0, 0, 0, 0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //#ifndef _LOGGER_H_
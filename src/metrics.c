@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+
+#include "hap.h"
+#include "json.h"
+#include "metrics.h"
+
+#ifdef CONFIG_HOMEKIT_METRICS
+/* upper bound of the first latency bucket, each next one is 4 times that */
+#define METRICS_BUCKET_US   250
+
+static portMUX_TYPE _metrics_mux = portMUX_INITIALIZER_UNLOCKED;
+static struct hap_metrics _metrics;
+
+int64_t metrics_time(void)
+{
+    return esp_timer_get_time();
+}
+
+static int _bucket(uint32_t us)
+{
+    uint32_t bound = METRICS_BUCKET_US;
+    for (int i=0; i<HAP_METRICS_NR_BUCKETS - 1; i++) {
+        if (us < bound)
+            return i;
+        bound *= 4;
+    }
+    return HAP_METRICS_NR_BUCKETS - 1;
+}
+
+void metrics_request(int endpoint, int64_t start)
+{
+    if (endpoint < 0 || endpoint >= HAP_METRICS_NR_ENDPOINTS)
+        return;
+
+    uint32_t us = esp_timer_get_time() - start;
+    struct hap_metrics_latency* latency = &_metrics.requests[endpoint];
+
+    portENTER_CRITICAL(&_metrics_mux);
+    latency->count++;
+    latency->total_us += us;
+    if (latency->max_us < us)
+        latency->max_us = us;
+    latency->buckets[_bucket(us)]++;
+    portEXIT_CRITICAL(&_metrics_mux);
+}
+
+void metrics_crypto(int encrypted, int decrypted, int64_t start)
+{
+    int64_t us = esp_timer_get_time() - start;
+
+    portENTER_CRITICAL(&_metrics_mux);
+    _metrics.bytes_encrypted += encrypted;
+    _metrics.bytes_decrypted += decrypted;
+    _metrics.crypto_us += us;
+    portEXIT_CRITICAL(&_metrics_mux);
+}
+
+void metrics_event_posted(void)
+{
+    portENTER_CRITICAL(&_metrics_mux);
+    _metrics.events_posted++;
+    portEXIT_CRITICAL(&_metrics_mux);
+}
+
+void metrics_event_sent(void)
+{
+    portENTER_CRITICAL(&_metrics_mux);
+    _metrics.events_sent++;
+    portEXIT_CRITICAL(&_metrics_mux);
+}
+
+void metrics_session(int delta)
+{
+    portENTER_CRITICAL(&_metrics_mux);
+    _metrics.sessions += delta;
+    if (_metrics.sessions_max < _metrics.sessions)
+        _metrics.sessions_max = _metrics.sessions;
+    portEXIT_CRITICAL(&_metrics_mux);
+}
+
+int hap_metrics_get(struct hap_metrics* metrics)
+{
+    portENTER_CRITICAL(&_metrics_mux);
+    *metrics = _metrics;
+    portEXIT_CRITICAL(&_metrics_mux);
+
+    metrics->heap_free = esp_get_free_heap_size();
+    metrics->heap_free_min = esp_get_minimum_free_heap_size();
+    return 0;
+}
+
+void hap_metrics_reset(void)
+{
+    portENTER_CRITICAL(&_metrics_mux);
+    uint32_t sessions = _metrics.sessions;
+    memset(&_metrics, 0, sizeof(_metrics));
+    _metrics.sessions = sessions;
+    _metrics.sessions_max = sessions;
+    portEXIT_CRITICAL(&_metrics_mux);
+}
+
+static const char* _endpoint_names[HAP_METRICS_NR_ENDPOINTS] = {
+    [HAP_METRICS_PAIR_SETUP] = "pair-setup",
+    [HAP_METRICS_PAIR_VERIFY] = "pair-verify",
+    [HAP_METRICS_ACCESSORIES] = "accessories",
+    [HAP_METRICS_CHARACTERISTICS_GET] = "characteristics-get",
+    [HAP_METRICS_CHARACTERISTICS_PUT] = "characteristics-put",
+    [HAP_METRICS_PAIRINGS] = "pairings",
+};
+
+static void _json_field(struct json* json, const char* name, uint64_t value)
+{
+    json_string(json, name);
+    json_literal(json, ":");
+    json_uint(json, value);
+}
+
+int hap_metrics_json(char* buf, int size)
+{
+    struct hap_metrics metrics;
+    hap_metrics_get(&metrics);
+
+    struct json json;
+    json_init(&json, buf, size);
+
+    json_literal(&json, "{\"requests\":{");
+    for (int i=0; i<HAP_METRICS_NR_ENDPOINTS; i++) {
+        struct hap_metrics_latency* latency = &metrics.requests[i];
+        if (i)
+            json_literal(&json, ",");
+        json_string(&json, _endpoint_names[i]);
+        json_literal(&json, ":{");
+        _json_field(&json, "count", latency->count);
+        json_literal(&json, ",");
+        _json_field(&json, "max_us", latency->max_us);
+        json_literal(&json, ",");
+        _json_field(&json, "total_us", latency->total_us);
+        json_literal(&json, ",\"buckets\":[");
+        for (int j=0; j<HAP_METRICS_NR_BUCKETS; j++) {
+            if (j)
+                json_literal(&json, ",");
+            json_uint(&json, latency->buckets[j]);
+        }
+        json_literal(&json, "]}");
+    }
+    json_literal(&json, "},");
+
+    _json_field(&json, "events_posted", metrics.events_posted);
+    json_literal(&json, ",");
+    _json_field(&json, "events_sent", metrics.events_sent);
+    json_literal(&json, ",");
+    _json_field(&json, "bytes_encrypted", metrics.bytes_encrypted);
+    json_literal(&json, ",");
+    _json_field(&json, "bytes_decrypted", metrics.bytes_decrypted);
+    json_literal(&json, ",");
+    _json_field(&json, "crypto_us", metrics.crypto_us);
+    json_literal(&json, ",");
+    _json_field(&json, "sessions", metrics.sessions);
+    json_literal(&json, ",");
+    _json_field(&json, "sessions_max", metrics.sessions_max);
+    json_literal(&json, ",");
+    _json_field(&json, "heap_free", metrics.heap_free);
+    json_literal(&json, ",");
+    _json_field(&json, "heap_free_min", metrics.heap_free_min);
+    json_literal(&json, "}");
+
+    /* terminated when it fits, like snprintf */
+    if (json.len < size)
+        buf[json.len] = 0;
+
+    return json.len;
+}
+#else
+int hap_metrics_get(struct hap_metrics* metrics)
+{
+    return -1;
+}
+
+void hap_metrics_reset(void)
+{
+}
+
+int hap_metrics_json(char* buf, int size)
+{
+    return -1;
+}
+#endif
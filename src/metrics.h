@@ -0,0 +1,38 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "hap.h"
+
+/*
+ * Recorders of the counters behind hap_metrics_get(). Without
+ * CONFIG_HOMEKIT_METRICS they compile to nothing, and metrics_time()
+ * doesn't even read the clock.
+ */
+#ifdef CONFIG_HOMEKIT_METRICS
+int64_t metrics_time(void);
+/* endpoints past HAP_METRICS_NR_ENDPOINTS are ignored */
+void metrics_request(int endpoint, int64_t start);
+void metrics_crypto(int encrypted, int decrypted, int64_t start);
+void metrics_event_posted(void);
+void metrics_event_sent(void);
+void metrics_session(int delta);
+#else
+static inline int64_t metrics_time(void) { return 0; }
+static inline void metrics_request(int endpoint, int64_t start) {}
+static inline void metrics_crypto(int encrypted, int decrypted, int64_t start) {}
+static inline void metrics_event_posted(void) {}
+static inline void metrics_event_sent(void) {}
+static inline void metrics_session(int delta) {}
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //#ifndef _METRICS_H_
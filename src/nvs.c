@@ -1,4 +1,5 @@
 #include <esp_log.h>
+#include <stdbool.h>
 #include <stdio.h>
 
 #include "nvs_flash.h"
@@ -7,12 +8,34 @@
 #define TAG "nvs"
 #define STORAGE_NAMESPACE "storage"
 
+/*
+ * One handle for the lifetime of the firmware. NVS serializes access on its
+ * own, the handle is opened on first use from hap_init.
+ */
+static nvs_handle _handle;
+static bool _opened;
+
+static int _handle_get(nvs_handle* handle)
+{
+    if (!_opened) {
+        esp_err_t err = nvs_open(STORAGE_NAMESPACE, NVS_READWRITE, &_handle);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "nvs_open failed. namespace:%s err:%d\n", 
+                    STORAGE_NAMESPACE, err);
+            return -1;
+        }
+        _opened = true;
+    }
+
+    *handle = _handle;
+    return 0;
+}
+
 static int _value_length_get(nvs_handle handle, char* key) {
     size_t value_length = 0;
     esp_err_t err = nvs_get_blob (handle, key, NULL, &value_length);
     if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
         ESP_LOGE(TAG, "nvs_get_blob failed. err:%d\n", err);
-        nvs_close(handle);
         return 0;
     }
 
@@ -27,88 +50,68 @@ int nvs_get(char* key, uint8_t* value, int len)
     }
 
     nvs_handle handle;
-    esp_err_t err = nvs_open(STORAGE_NAMESPACE, NVS_READWRITE, &handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "nvs_open failed. namespace:%s err:%d\n", 
-                STORAGE_NAMESPACE, err);
+    if (_handle_get(&handle) < 0)
         return 0;
-    }
 
     int value_length = _value_length_get(handle, key);
     if (value_length == 0) {
         ESP_LOGE(TAG, "nothing saved. key:%s\n", key);
-        nvs_close(handle);
         return 0;
     }
 
     if (value_length > len) {
         ESP_LOGE(TAG, "value buffer is short\n");
-        nvs_close(handle);
         return len - value_length;
     }
 
-    err = nvs_get_blob(handle, key, value, (size_t*)&value_length);
+    esp_err_t err = nvs_get_blob(handle, key, value, (size_t*)&value_length);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "nvs_get_blob failed. key:%s err:%d\n", key, err);
-        nvs_close(handle);
         return 0;
     }
 
-    nvs_close(handle);
     return value_length;
 }
 
 int nvs_set(char* key, uint8_t* value, int len)
 {
     nvs_handle handle;
-    esp_err_t err = nvs_open(STORAGE_NAMESPACE, NVS_READWRITE, &handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "nvs_open failed. err:%d\n", err);
+    if (_handle_get(&handle) < 0)
         return -1;
-    }
 
-    err = nvs_set_blob(handle, key, value, len);
+    esp_err_t err = nvs_set_blob(handle, key, value, len);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "nvs_set_blob failed. key:%s err:%d\n", key, err);
-        nvs_close(handle);
         return -1;
     }
 
     err = nvs_commit(handle);
     if (err != ESP_OK)  {
         ESP_LOGE(TAG, "nvs_commit failed. err:%d\n", err);
-        nvs_close(handle);
         return -1;
     }
 
-    nvs_close(handle);
     return 0;
 }
 
 int nvs_erase(char* key)
 {
     nvs_handle handle;
-    esp_err_t err = nvs_open(STORAGE_NAMESPACE, NVS_READWRITE, &handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "nvs_open failed. err:%d\n", err);
+    if (_handle_get(&handle) < 0)
         return -1;
-    }
 
-    err = nvs_erase_key(handle, key);
+    esp_err_t err = nvs_erase_key(handle, key);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "nvs_erase_key failed. key:%s err:%d\n", key, err);
-        nvs_close(handle);
         return -1;
     }
 
     err = nvs_commit(handle);
     if (err != ESP_OK)  {
         ESP_LOGE(TAG, "nvs_commit failed. err:%d\n", err);
-        nvs_close(handle);
         return -1;
     }
 
-    nvs_close(handle);
     return 0;
 }
 
@@ -22,8 +22,9 @@ int pair_error(enum hap_tlv_error_codes error_codes,
         return -1;
     }
 
-    uint8_t* tlv_encode_ptr = *acc_msg;
-    tlv_encode_ptr += tlv_encode(HAP_TLV_TYPE_ERROR, sizeof(error), error, tlv_encode_ptr);
+    struct tlv_writer writer;
+    tlv_writer_init(&writer, *acc_msg, *acc_msg_length);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_ERROR, sizeof(error), error);
 
     return 0;
 }
@@ -2,19 +2,40 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <esp_timer.h>
+
 #include "chacha20_poly1305.h"
 #include "concat.h"
 #include "curve25519.h"
 #include "ed25519.h"
 #include "hap_internal.h"
 #include "hkdf.h"
+#include "http_header.h"
 #include "iosdevice.h"
+#include "logger.h"
+#include "metrics.h"
 #include "pair_error.h"
+#include "pool.h"
 #include "srp.h"
 #include "tlv.h"
 
 //#define DEBUG
 
+#define TAG "PAIR_SETUP"
+
+/* unsuccessful M3s, after that pair-setup is refused until the next boot */
+#ifndef PAIR_SETUP_MAX_TRIES
+#define PAIR_SETUP_MAX_TRIES 100
+#endif
+/* the wait after a failed M3 doubles from 1 s up to 2^PAIR_SETUP_BACKOFF_SHIFT_MAX s */
+#ifndef PAIR_SETUP_BACKOFF_SHIFT_MAX
+#define PAIR_SETUP_BACKOFF_SHIFT_MAX 10
+#endif
+/* a pairing that doesn't move on for this long may be taken over by another */
+#ifndef PAIR_SETUP_LOCK_TIMEOUT_US
+#define PAIR_SETUP_LOCK_TIMEOUT_US (60 * 1000000LL)
+#endif
+
 struct pair_setup {
     char* acc_id;
     char* setup_code;
@@ -23,15 +44,33 @@ struct pair_setup {
 
     struct {
         uint8_t* public;
-        uint8_t* private;
+        void* ltk;
     } keys;
+
+    /* outcome of the last step for pair_setup_done, written on the worker */
+    uint8_t reached;
+    bool auth_failed;
 };
 
-static const char* header_fmt = 
+/*
+ * Shared by all connections, one pairing runs at a time. Only the httpd
+ * task touches it, in pair_setup_admit, pair_setup_done and
+ * pair_setup_cleanup.
+ */
+static struct {
+    struct pair_setup* owner;
+    int64_t owner_time;
+    int nr_failures;
+    int64_t retry_time;
+} _throttle;
+
+POOL_DEFINE(_pair_setup_pool, struct pair_setup, POOL_NR_CONNECTIONS);
+
+static const struct http_header header = HTTP_HEADER(
     "HTTP/1.1 200 OK\r\n"
-    "Content-Length: %d\r\n"
+    "Connection: keep-alive\r\n"
     "Content-Type: application/pairing+tlv8\r\n"
-    "\r\n";
+    "Content-Length: ");
 
 static void _dump_hex(uint8_t* data, int len)
 {
@@ -46,12 +85,11 @@ static void _dump_hex(uint8_t* data, int len)
 
 static int _subtlv_decrypt(enum hkdf_key_type htype,
         enum chacha20_poly1305_type cptype,
-        uint8_t* srp_key, uint8_t* device_msg, int device_msg_length, uint8_t** subtlv, int* subtlv_length)
+        uint8_t* srp_key, struct tlv_reader* device_msg, uint8_t** subtlv, int* subtlv_length)
 {
-    struct tlv* encrypted_tlv = tlv_decode((uint8_t*)device_msg, device_msg_length,
-            HAP_TLV_TYPE_ENCRYPTED_DATA);
-    if (encrypted_tlv == NULL) {
-        printf("tlv_devoce HAP_TLV_TYPE_ENCRYPTED_DATA failed\n");
+    const struct tlv_item* encrypted_tlv = tlv_reader_get(device_msg, HAP_TLV_TYPE_ENCRYPTED_DATA);
+    if (encrypted_tlv == NULL || encrypted_tlv->length < CHACHA20_POLY1305_AUTH_TAG_LENGTH) {
+        printf("tlv_reader_get HAP_TLV_TYPE_ENCRYPTED_DATA failed\n");
         return -1;
     }
 
@@ -59,17 +97,20 @@ static int _subtlv_decrypt(enum hkdf_key_type htype,
     hkdf_key_get(htype, srp_key, SRP_SESSION_KEY_LENGTH, subtlv_key);
 
     *subtlv = malloc(encrypted_tlv->length);
+    if (*subtlv == NULL) {
+        printf("malloc failed. size:%d\n", encrypted_tlv->length);
+        return -1;
+    }
+
     int err = chacha20_poly1305_decrypt(cptype, subtlv_key, NULL, 0,
-            (uint8_t*)&encrypted_tlv->value, encrypted_tlv->length, *subtlv);
+            (uint8_t*)encrypted_tlv->value, encrypted_tlv->length, *subtlv);
 
     if (err < 0) {
         printf("chacha20_poly1305_decrypt failed\n");
         free(*subtlv);
         return -1;
     }
-    //*subtlv_length = strlen((char*)*subtlv);
-    *subtlv_length = encrypted_tlv->length;
-    tlv_decoded_item_free(encrypted_tlv);
+    *subtlv_length = encrypted_tlv->length - CHACHA20_POLY1305_AUTH_TAG_LENGTH;
 
     return 0;
 }
@@ -80,72 +121,78 @@ static void _subtlv_free(uint8_t* subtlv)
         free(subtlv);
 }
 
-static uint8_t _state_get(uint8_t* device_msg, int device_msg_length)
+static uint8_t _state_get(struct tlv_reader* device_msg)
 {
-    struct tlv* state_tlv = tlv_decode((uint8_t*)device_msg, device_msg_length, 
-            HAP_TLV_TYPE_STATE);
-    if (state_tlv == NULL) {
-        printf("tlv_decode failed. type:%d\n", HAP_TLV_TYPE_STATE);
+    const struct tlv_item* state_tlv = tlv_reader_get(device_msg, HAP_TLV_TYPE_STATE);
+    if (state_tlv == NULL || state_tlv->length < 1) {
+        printf("tlv_reader_get failed. type:%d\n", HAP_TLV_TYPE_STATE);
         return 0;
     }
 
-    uint8_t state = ((uint8_t*)&state_tlv->value)[0];
-
-    tlv_decoded_item_free(state_tlv);
-    return state;
+    return state_tlv->value[0];
 }
 
-static int _ios_device_signature_verify(void* iosdevices, uint8_t* srp_key, uint8_t* subtlv, int subtlv_length)
+/* the controller is stored only once its signature checks out, returns 0 or the TLV error for M6 */
+static enum hap_tlv_error_codes _ios_device_signature_verify(void* iosdevices, uint8_t* srp_key, uint8_t* subtlv, int subtlv_length)
 {
     uint8_t ios_devicex[HKDF_KEY_LEN] = {0,};
     hkdf_key_get(HKDF_KEY_TYPE_PAIR_SETUP_CONTROLLER, srp_key, SRP_SESSION_KEY_LENGTH, 
             ios_devicex);
 
-    struct tlv* ios_device_pairing_id = tlv_decode(subtlv, subtlv_length, HAP_TLV_TYPE_IDENTIFIER);
-    if (!ios_device_pairing_id) { 
-        printf("tlv_decode failed. type:%d\n", HAP_TLV_TYPE_IDENTIFIER);
+    struct tlv_reader reader;
+    if (tlv_reader_init(&reader, subtlv, subtlv_length) < 0) {
+        printf("tlv_reader_init failed\n");
         printf("tlv length:%d 0x%02X", subtlv_length, subtlv_length);
         _dump_hex(subtlv, subtlv_length);
-        return -1;
+        return HAP_TLV_ERROR_UNKNOWN;
     }
-    struct tlv* ios_device_ltpk = tlv_decode(subtlv, subtlv_length, HAP_TLV_TYPE_PUBLICKEY);
-    if (!ios_device_ltpk) { 
-        printf("tlv_decode failed. type:%d\n", HAP_TLV_TYPE_PUBLICKEY);
-        printf("tlv length:%d 0x%02X", subtlv_length, subtlv_length);
+
+    const struct tlv_item* ios_device_pairing_id = tlv_reader_get(&reader, HAP_TLV_TYPE_IDENTIFIER);
+    const struct tlv_item* ios_device_ltpk = tlv_reader_get(&reader, HAP_TLV_TYPE_PUBLICKEY);
+    const struct tlv_item* ios_device_signature = tlv_reader_get(&reader, HAP_TLV_TYPE_SIGNATURE);
+    if (!ios_device_pairing_id || !ios_device_ltpk || !ios_device_signature) { 
+        printf("tlv_reader_get failed. id:%p ltpk:%p signature:%p\n", 
+                ios_device_pairing_id, ios_device_ltpk, ios_device_signature);
         _dump_hex(subtlv, subtlv_length);
-        return -1;
+        tlv_reader_free(&reader);
+        return HAP_TLV_ERROR_UNKNOWN;
     }
-    struct tlv* ios_device_signature = tlv_decode(subtlv, subtlv_length, HAP_TLV_TYPE_SIGNATURE);
-    if (!ios_device_signature) { 
-        printf("tlv_decode failed. type:%d\n", HAP_TLV_TYPE_SIGNATURE);
-        printf("tlv length:%d 0x%02X", subtlv_length, subtlv_length);
-        _dump_hex(subtlv, subtlv_length);
-        return -1;
+    /* the pairings keep fixed size ids and keys */
+    if (ios_device_pairing_id->length != IOSDEVICE_ID_LEN || ios_device_ltpk->length != ED25519_PUBLIC_KEY_LENGTH) {
+        printf("invalid id or ltpk length. id:%d ltpk:%d\n", ios_device_pairing_id->length, ios_device_ltpk->length);
+        tlv_reader_free(&reader);
+        return HAP_TLV_ERROR_UNKNOWN;
     }
 
     int ios_device_info_len = 0;
     uint8_t* ios_device_info = concat3(ios_devicex, sizeof(ios_devicex), 
-            (uint8_t*)&ios_device_pairing_id->value, ios_device_pairing_id->length, 
-            (uint8_t*)&ios_device_ltpk->value, ios_device_ltpk->length,
+            (uint8_t*)ios_device_pairing_id->value, ios_device_pairing_id->length, 
+            (uint8_t*)ios_device_ltpk->value, ios_device_ltpk->length,
             &ios_device_info_len);
 
-    int verified = ed25519_verify((uint8_t*)&ios_device_ltpk->value, ios_device_ltpk->length,
-            (uint8_t*)&ios_device_signature->value, ios_device_signature->length,
+    int verified = ed25519_verify((uint8_t*)ios_device_ltpk->value, ios_device_ltpk->length,
+            (uint8_t*)ios_device_signature->value, ios_device_signature->length,
             ios_device_info, ios_device_info_len);
 
     concat_free(ios_device_info);
 
-    iosdevice_pairings_add(iosdevices, (char*)&ios_device_pairing_id->value, 
-            (char*)&ios_device_ltpk->value);
+    enum hap_tlv_error_codes error = 0;
+    if (verified < 0) {
+        printf("ed25519_verify failed\n");
+        error = HAP_TLV_ERROR_AUTHENTICATION;
+    }
+    else if (iosdevice_pairings_add(iosdevices, (char*)ios_device_pairing_id->value, 
+                (char*)ios_device_ltpk->value, IOSDEVICE_PERMISSION_ADMIN) < 0) {
+        printf("iosdevice_pairings_add failed\n");
+        error = HAP_TLV_ERROR_MAX_PEERS;
+    }
 
-    tlv_decoded_item_free(ios_device_pairing_id);
-    tlv_decoded_item_free(ios_device_ltpk);
-    tlv_decoded_item_free(ios_device_signature);
+    tlv_reader_free(&reader);
 
-    return verified;
+    return error;
 }
 
-static int _acc_m6_subtlv(uint8_t* srp_key, char* acc_id, uint8_t* acc_ltk_public, uint8_t* acc_ltk_private,  uint8_t** acc_subtlv, int* acc_subtlv_length)
+static int _acc_m6_subtlv(uint8_t* srp_key, char* acc_id, uint8_t* acc_ltk_public, void* acc_ltk, uint8_t** acc_subtlv, int* acc_subtlv_length)
 {
     uint8_t accessoryx[HKDF_KEY_LEN] = {0,};
     hkdf_key_get(HKDF_KEY_TYPE_PAIR_SETUP_ACCESSORY, srp_key, SRP_SESSION_KEY_LENGTH, 
@@ -158,7 +205,7 @@ static int _acc_m6_subtlv(uint8_t* srp_key, char* acc_id, uint8_t* acc_ltk_publi
 
     int acc_signature_length = ED25519_SIGN_LENGTH;
     uint8_t acc_signature[ED25519_SIGN_LENGTH] = {0,};
-    ed25519_sign(acc_ltk_public, acc_ltk_private, acc_info, acc_info_len,
+    ed25519_key_sign(acc_ltk, acc_info, acc_info_len,
             acc_signature, &acc_signature_length);
 
     concat_free(acc_info);
@@ -168,11 +215,12 @@ static int _acc_m6_subtlv(uint8_t* srp_key, char* acc_id, uint8_t* acc_ltk_publi
     acc_plain_subtlv_length += tlv_encode_length(acc_signature_length);
 
     uint8_t* acc_plain_subtlv = malloc(acc_plain_subtlv_length);
-    uint8_t* sub_tlv_write_ptr = acc_plain_subtlv;
+    struct tlv_writer writer;
+    tlv_writer_init(&writer, acc_plain_subtlv, acc_plain_subtlv_length);
 
-    sub_tlv_write_ptr += tlv_encode(HAP_TLV_TYPE_IDENTIFIER, strlen(acc_id), (uint8_t*)acc_id, sub_tlv_write_ptr);
-    sub_tlv_write_ptr += tlv_encode(HAP_TLV_TYPE_PUBLICKEY, ED25519_PUBLIC_KEY_LENGTH, acc_ltk_public, sub_tlv_write_ptr);
-    sub_tlv_write_ptr += tlv_encode(HAP_TLV_TYPE_SIGNATURE, ED25519_SIGN_LENGTH, acc_signature, sub_tlv_write_ptr);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_IDENTIFIER, strlen(acc_id), (uint8_t*)acc_id);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_PUBLICKEY, ED25519_PUBLIC_KEY_LENGTH, acc_ltk_public);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_SIGNATURE, ED25519_SIGN_LENGTH, acc_signature);
 
 #if 0
     printf("ACC PLAIN SUBTLV LEN:%d\n", acc_plain_subtlv_length);
@@ -197,9 +245,14 @@ static int _acc_m6_subtlv(uint8_t* srp_key, char* acc_id, uint8_t* acc_ltk_publi
 }
 
 static int _setup_m6(struct pair_setup* ps,
-        uint8_t* device_msg, int device_msg_length, 
+        struct tlv_reader* device_msg, 
         uint8_t** acc_msg, int* acc_msg_length)
 {
+    if (ps->srp == NULL) {
+        printf("M5 without M1\n");
+        return pair_error(HAP_TLV_ERROR_UNKNOWN, acc_msg, acc_msg_length);
+    }
+
     uint8_t srp_key[SRP_SESSION_KEY_LENGTH] = {0,};
     srp_host_session_key(ps->srp, srp_key);
 
@@ -207,21 +260,27 @@ static int _setup_m6(struct pair_setup* ps,
     uint8_t* device_subtlv;
     int err = _subtlv_decrypt(HKDF_KEY_TYPE_PAIR_SETUP_ENCRYPT, 
             CHACHA20_POLY1305_TYPE_PS05,
-            srp_key, device_msg, device_msg_length, &device_subtlv, &device_subtlv_length);
+            srp_key, device_msg, &device_subtlv, &device_subtlv_length);
     if (err < 0) {
         printf("_subtlv_decrypt failed\n");
         return pair_error(HAP_TLV_ERROR_AUTHENTICATION, acc_msg, acc_msg_length);
     }
 
-    if (_ios_device_signature_verify(ps->iosdevices, srp_key, device_subtlv, device_subtlv_length) < 0) {
-        printf("_ios_device_signature_verify failed\n");
-        return pair_error(HAP_TLV_ERROR_AUTHENTICATION, acc_msg, acc_msg_length);
+    enum hap_tlv_error_codes error = _ios_device_signature_verify(ps->iosdevices, srp_key, device_subtlv, device_subtlv_length);
+    if (error) {
+        printf("_ios_device_signature_verify failed. error:%d\n", error);
+        _subtlv_free(device_subtlv);
+        return pair_error(error, acc_msg, acc_msg_length);
     }
     _subtlv_free(device_subtlv);
 
+    /* M6 tells the controller it is paired, the pairing must be in flash by then */
+    if (iosdevice_pairings_commit(ps->iosdevices, true) != 0)
+        printf("iosdevice_pairings_commit failed, retried later\n");
+
     uint8_t* acc_subtlv;
     int acc_subtlv_length = 0;
-    _acc_m6_subtlv(srp_key, ps->acc_id, ps->keys.public, ps->keys.private, &acc_subtlv, &acc_subtlv_length);
+    _acc_m6_subtlv(srp_key, ps->acc_id, ps->keys.public, ps->keys.ltk, &acc_subtlv, &acc_subtlv_length);
 
     uint8_t state[] = {0x06};
     *acc_msg_length = tlv_encode_length(sizeof(state));
@@ -233,50 +292,55 @@ static int _setup_m6(struct pair_setup* ps,
         return pair_error(HAP_TLV_ERROR_UNKNOWN, acc_msg, acc_msg_length);
     }
 
-    uint8_t* tlv_encode_ptr = *acc_msg;
-    tlv_encode_ptr += tlv_encode(HAP_TLV_TYPE_STATE, sizeof(state), state, tlv_encode_ptr);
-    tlv_encode_ptr += tlv_encode(HAP_TLV_TYPE_ENCRYPTED_DATA, acc_subtlv_length, acc_subtlv, tlv_encode_ptr);
+    struct tlv_writer writer;
+    tlv_writer_init(&writer, *acc_msg, *acc_msg_length);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_STATE, sizeof(state), state);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_ENCRYPTED_DATA, acc_subtlv_length, acc_subtlv);
 
     _subtlv_free(acc_subtlv);
+    ps->reached = 6;
     return 0;
 }
 
 static int _setup_m4(struct pair_setup* ps, 
-        uint8_t* device_msg, int device_msg_length, 
+        struct tlv_reader* device_msg, 
         uint8_t** acc_msg, int* acc_msg_length)
 {
-    struct tlv* ios_srp_public_key = tlv_decode(device_msg, device_msg_length, 
-            HAP_TLV_TYPE_PUBLICKEY);
-    if (!ios_srp_public_key) {
-        printf("tlv_decode failed. type:%d\n", HAP_TLV_TYPE_PUBLICKEY);
+    const struct tlv_item* ios_srp_public_key = tlv_reader_get(device_msg, HAP_TLV_TYPE_PUBLICKEY);
+    if (!ios_srp_public_key || ios_srp_public_key->length != SRP_PUBLIC_KEY_LENGTH) {
+        printf("tlv_reader_get failed. type:%d\n", HAP_TLV_TYPE_PUBLICKEY);
         return -1;
     }
 #if 0
     ESP_LOGI(TAG, "A");
-    _array_print((char*)&ios_srp_public_key->value, ios_srp_public_key->length);
+    _array_print((char*)ios_srp_public_key->value, ios_srp_public_key->length);
 #endif
 
-    int err = srp_client_key_set(ps->srp, (uint8_t*)&ios_srp_public_key->value);
-    tlv_decoded_item_free(ios_srp_public_key);
+    if (ps->srp == NULL) {
+        printf("M3 without M1\n");
+        return pair_error(HAP_TLV_ERROR_UNKNOWN, acc_msg, acc_msg_length);
+    }
+
+    int err = srp_client_key_set(ps->srp, (uint8_t*)ios_srp_public_key->value);
     if (err < 0) {
         printf("srp_client_key_set failed");
+        ps->auth_failed = true;
         return pair_error(HAP_TLV_ERROR_AUTHENTICATION, acc_msg, acc_msg_length);
     }
 
-    struct tlv* ios_srp_proof = tlv_decode((uint8_t*)device_msg, device_msg_length, 
-            HAP_TLV_TYPE_PROOF);
-    if (!ios_srp_proof) {
-        printf("tlv_decode failed. type:%d\n", HAP_TLV_TYPE_PROOF);
+    const struct tlv_item* ios_srp_proof = tlv_reader_get(device_msg, HAP_TLV_TYPE_PROOF);
+    if (!ios_srp_proof || ios_srp_proof->length != SRP_PROOF_LENGTH) {
+        printf("tlv_reader_get failed. type:%d\n", HAP_TLV_TYPE_PROOF);
         return -1;
     }
 #if 0
     ESP_LOGI(TAG, "IOS PROOF");
-    _array_print((char*)&ios_srp_proof->value, ios_srp_proof->length);
+    _array_print((char*)ios_srp_proof->value, ios_srp_proof->length);
 #endif
-    err = srp_client_proof_verify(ps->srp, (uint8_t*)&ios_srp_proof->value);
-    tlv_decoded_item_free(ios_srp_proof);
+    err = srp_client_proof_verify(ps->srp, (uint8_t*)ios_srp_proof->value);
     if (err < 0) {
         printf("srp_client_proof_verify failed\n");
+        ps->auth_failed = true;
         return pair_error(HAP_TLV_ERROR_AUTHENTICATION, acc_msg, acc_msg_length);
     }
 
@@ -297,22 +361,30 @@ static int _setup_m4(struct pair_setup* ps,
         return pair_error(HAP_TLV_ERROR_UNKNOWN, acc_msg, acc_msg_length);
     }
 
-    uint8_t* tlv_encode_ptr = *acc_msg;
-    tlv_encode_ptr += tlv_encode(HAP_TLV_TYPE_PROOF, SRP_PROOF_LENGTH, acc_srp_proof, tlv_encode_ptr);
-    tlv_encode_ptr += tlv_encode(HAP_TLV_TYPE_STATE, sizeof(state), state, tlv_encode_ptr);
-    
+    struct tlv_writer writer;
+    tlv_writer_init(&writer, *acc_msg, *acc_msg_length);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_PROOF, SRP_PROOF_LENGTH, acc_srp_proof);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_STATE, sizeof(state), state);
+
+    ps->reached = 4;
     return 0;
 }
 
 static int _setup_m2(struct pair_setup* ps, 
-        uint8_t* device_msg, int device_msg_length, 
+        struct tlv_reader* device_msg, 
         uint8_t** acc_msg, int* acc_msg_length)
 {
     if (ps->srp) {
         srp_cleanup(ps->srp);
     }
 
-    ps->srp = srp_init(ps->setup_code);
+    /* the verifier and the public key, both 3072-bit exponentiations */
+    ps->srp = srp_init(ps->setup_code, ps->acc_id);
+    if (ps->srp == NULL) {
+        printf("srp_init failed\n");
+        return pair_error(HAP_TLV_ERROR_UNKNOWN, acc_msg, acc_msg_length);
+    }
+
     uint8_t host_public_key[SRP_PUBLIC_KEY_LENGTH] = {0,};
     if (srp_host_key_get(ps->srp, host_public_key) < 0) {
         printf("srp_host_key_get failed\n");
@@ -346,72 +418,211 @@ static int _setup_m2(struct pair_setup* ps,
         return pair_error(HAP_TLV_ERROR_UNKNOWN, acc_msg, acc_msg_length);
     }
 
-    uint8_t* tlv_encode_ptr = *acc_msg;
-    tlv_encode_ptr += tlv_encode(HAP_TLV_TYPE_SALT, SRP_SALT_LENGTH, salt, tlv_encode_ptr);
-    tlv_encode_ptr += tlv_encode(HAP_TLV_TYPE_PUBLICKEY, SRP_PUBLIC_KEY_LENGTH, host_public_key, tlv_encode_ptr);
-    tlv_encode_ptr += tlv_encode(HAP_TLV_TYPE_STATE, sizeof(state), state, tlv_encode_ptr);
+    struct tlv_writer writer;
+    tlv_writer_init(&writer, *acc_msg, *acc_msg_length);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_SALT, SRP_SALT_LENGTH, salt);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_PUBLICKEY, SRP_PUBLIC_KEY_LENGTH, host_public_key);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_STATE, sizeof(state), state);
 
+    ps->reached = 2;
     return 0;
 }
 
 int pair_setup_do(void* _ps, char* req_body, int req_body_len, 
-        char** res_header, int* res_header_len, char** res_body, int* res_body_len)
+        char* res_header, int* res_header_len, char** res_body, int* res_body_len)
 {
     struct pair_setup* ps = _ps;
 
-    uint8_t state = _state_get((uint8_t*)req_body, req_body_len);
+    /* fragmented items, the SRP public key and M5's encrypted data, are joined once */
+    struct tlv_reader reader;
+    if (tlv_reader_init(&reader, (uint8_t*)req_body, req_body_len) < 0) {
+        printf("[PAIR-SETUP][ERR] Invalid TLV. length:%d\n", req_body_len);
+        return -1;
+    }
+
+    uint8_t state = _state_get(&reader);
     printf("[PAIR-SETUP] STATE:%d", state);
 
+    ps->reached = 0;
+    ps->auth_failed = false;
+
+#ifdef CONFIG_HOMEKIT_METRICS
+    int64_t start = metrics_time();
+#endif
     int error = 0;
     switch (state) {
     case 0x01:
-        error = _setup_m2(ps, (uint8_t*)req_body, req_body_len, (uint8_t**)res_body, res_body_len);
+        error = _setup_m2(ps, &reader, (uint8_t**)res_body, res_body_len);
         break;
     case 0x03:
-        error = _setup_m4(ps, (uint8_t*)req_body, req_body_len, (uint8_t**)res_body, res_body_len);
+        error = _setup_m4(ps, &reader, (uint8_t**)res_body, res_body_len);
         break;
     case 0x05:
-        error = _setup_m6(ps, (uint8_t*)req_body, req_body_len, (uint8_t**)res_body, res_body_len);
+        error = _setup_m6(ps, &reader, (uint8_t**)res_body, res_body_len);
         break;
     default:
         printf("[PAIR-SETUP][ERR] Invalid state number. %d\n", state);
+        tlv_reader_free(&reader);
         return -1;
     }
+    tlv_reader_free(&reader);
+
+    /* compare builds with and without CONFIG_HOMEKIT_CRYPTO_HW */
+#ifdef CONFIG_HOMEKIT_METRICS
+    HAP_LOGI(TAG, "M%d took %d us", state + 1, (int)(metrics_time() - start));
+#endif
 
     if (error) {
         return -1;
     }
 
-    *res_header = malloc(strlen(header_fmt) + 16);
-    sprintf(*res_header, header_fmt, *res_body_len);
-    *res_header_len = strlen(*res_header);
+    if (http_header_write(&header, *res_body_len, res_header, res_header_len) < 0) {
+        free(*res_body);
+        *res_body = NULL;
+        return -1;
+    }
 
     return 0;
 }
 
-void pair_setup_do_free(char* res_header, char*res_body)
+/* the reply to a request that is turned away, it has no other items */
+static int _setup_refuse(uint8_t state, enum hap_tlv_error_codes error, int retry_delay,
+        uint8_t** acc_msg, int* acc_msg_length)
 {
-    if (res_header)
-        free(res_header);
+    uint8_t state_item[] = {state};
+    uint8_t error_item[] = {error};
+    uint8_t delay_item[] = {retry_delay & 0xff, (retry_delay >> 8) & 0xff};
+
+    *acc_msg_length = tlv_encode_length(sizeof(state_item));
+    *acc_msg_length += tlv_encode_length(sizeof(error_item));
+    if (retry_delay)
+        *acc_msg_length += tlv_encode_length(sizeof(delay_item));
+
+    (*acc_msg) = malloc(*acc_msg_length);
+    if (*acc_msg == NULL) {
+        printf("malloc failed. size:%d\n", *acc_msg_length);
+        return -1;
+    }
+
+    struct tlv_writer writer;
+    tlv_writer_init(&writer, *acc_msg, *acc_msg_length);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_STATE, sizeof(state_item), state_item);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_ERROR, sizeof(error_item), error_item);
+    if (retry_delay)
+        tlv_writer_put(&writer, HAP_TLV_TYPE_RETRY_DELAY, sizeof(delay_item), delay_item);
+
+    return 0;
+}
+
+int pair_setup_admit(void* _ps, const char* req_body, int req_body_len, 
+        char* res_header, int* res_header_len, char** res_body, int* res_body_len)
+{
+    struct pair_setup* ps = _ps;
+
+    struct tlv_reader reader;
+    if (tlv_reader_init(&reader, (uint8_t*)req_body, req_body_len) < 0) {
+        printf("[PAIR-SETUP][ERR] Invalid TLV. length:%d\n", req_body_len);
+        return -1;
+    }
+    uint8_t state = _state_get(&reader);
+    tlv_reader_free(&reader);
+
+    int64_t now = esp_timer_get_time();
+    enum hap_tlv_error_codes error = 0;
+    int retry_delay = 0;
+
+    if (state == 0x01) {
+        if (_throttle.owner && _throttle.owner != ps &&
+                now - _throttle.owner_time > PAIR_SETUP_LOCK_TIMEOUT_US) {
+            printf("[PAIR-SETUP] taking over a stalled pairing\n");
+            _throttle.owner = NULL;
+        }
+
+        if (_throttle.nr_failures >= PAIR_SETUP_MAX_TRIES) {
+            error = HAP_TLV_ERROR_MAX_TRIES;
+        }
+        else if (_throttle.owner && _throttle.owner != ps) {
+            error = HAP_TLV_ERROR_BUSY;
+        }
+        else if (now < _throttle.retry_time) {
+            error = HAP_TLV_ERROR_BACKOFF;
+            retry_delay = (int)((_throttle.retry_time - now + 999999) / 1000000);
+        }
+        else {
+            _throttle.owner = ps;
+            _throttle.owner_time = now;
+        }
+    }
+    else if (_throttle.owner != ps) {
+        /* M3 or M5 of a pairing that was given up or taken over */
+        error = HAP_TLV_ERROR_UNKNOWN;
+    }
 
+    if (error == 0)
+        return 0;
+
+    printf("[PAIR-SETUP] M%d refused. error:%d retry:%d\n", state, error, retry_delay);
+    if (_setup_refuse(state + 1, error, retry_delay, (uint8_t**)res_body, res_body_len) < 0)
+        return -1;
+
+    if (http_header_write(&header, *res_body_len, res_header, res_header_len) < 0) {
+        free(*res_body);
+        *res_body = NULL;
+        return -1;
+    }
+
+    return 1;
+}
+
+void pair_setup_done(void* _ps)
+{
+    struct pair_setup* ps = _ps;
+    int64_t now = esp_timer_get_time();
+
+    if (ps->auth_failed) {
+        _throttle.nr_failures++;
+        int shift = _throttle.nr_failures - 1;
+        if (shift > PAIR_SETUP_BACKOFF_SHIFT_MAX)
+            shift = PAIR_SETUP_BACKOFF_SHIFT_MAX;
+        _throttle.retry_time = now + (1000000LL << shift);
+        printf("[PAIR-SETUP] %d failed attempts, next one in %d s\n", _throttle.nr_failures, 1 << shift);
+    }
+    else if (ps->reached == 6) {
+        _throttle.nr_failures = 0;
+    }
+
+    if (_throttle.owner != ps)
+        return;
+
+    /* done, or failed; a pairing half way keeps the lock */
+    if (ps->reached == 0 || ps->reached == 6)
+        _throttle.owner = NULL;
+    else
+        _throttle.owner_time = now;
+}
+
+void pair_setup_do_free(char* res_body)
+{
     if (res_body)
         free(res_body);
 }
 
-void* pair_setup_init(char* acc_id, char* setup_code, void* iosdevices, uint8_t* public_key, uint8_t* private_key)
+void* pair_setup_init(char* acc_id, char* setup_code, void* iosdevices, uint8_t* public_key, void* ltk)
 {
-    struct pair_setup* ps = calloc(1, sizeof(struct pair_setup));
+    struct pair_setup* ps = pool_alloc(&_pair_setup_pool);
     if (ps == NULL) {
         return NULL;
     }
 
     ps->keys.public = public_key;
-    ps->keys.private = private_key;
+    ps->keys.ltk = ltk;
     ps->acc_id = acc_id;
     ps->setup_code = setup_code;
     ps->iosdevices = iosdevices;
-    ps->srp = srp_init(setup_code);
-
+    /* the SRP state is set up by M1, on the worker */
+    ps->srp = NULL;
+    ps->reached = 0;
+    ps->auth_failed = false;
 
     printf("[INFO][PAIR-SETUP] init\n");
 
@@ -421,8 +632,11 @@ void* pair_setup_init(char* acc_id, char* setup_code, void* iosdevices, uint8_t*
 void pair_setup_cleanup(void* _ps)
 {
     struct pair_setup* ps = _ps;
+    if (_throttle.owner == ps)
+        _throttle.owner = NULL;
+
     if (ps->srp)
         srp_cleanup(ps->srp);
 
-    free(ps);
+    pool_free(&_pair_setup_pool, ps);
 }
@@ -5,11 +5,22 @@
 extern "C" {
 #endif
 
-void pair_setup_do_free(char* res_header, char*res_body);
+void pair_setup_do_free(char* res_body);
 int pair_setup_do(void* _ps, const char* req_body, int req_body_len, 
-        char** res_header, int* res_header_len, char** res_body, int* res_body_len);
+        char* res_header, int* res_header_len, char** res_body, int* res_body_len);
 
-void* pair_setup_init(char* acc_id, char* setup_code, void* iosdevices, uint8_t* public_key, uint8_t* private_key);
+/*
+ * On the httpd task before pair_setup_do goes to the worker. Returns 0 when
+ * the request may go on, or 1 with a refusal in res_header and res_body:
+ * Busy while another connection is pairing, Backoff after a failed attempt
+ * and MaxTries after too many. -1 on failure.
+ */
+int pair_setup_admit(void* _ps, const char* req_body, int req_body_len, 
+        char* res_header, int* res_header_len, char** res_body, int* res_body_len);
+/* on the httpd task once pair_setup_do returned, counts failed attempts */
+void pair_setup_done(void* _ps);
+
+void* pair_setup_init(char* acc_id, char* setup_code, void* iosdevices, uint8_t* public_key, void* ltk);
 void pair_setup_cleanup(void* _ps);;
 
 #ifdef __cplusplus
@@ -3,14 +3,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <freertos/FreeRTOS.h>
+#include <os.h>
+
 #include "chacha20_poly1305.h"
 #include "concat.h"
 #include "curve25519.h"
 #include "ed25519.h"
 #include "hap_internal.h"
 #include "hkdf.h"
+#include "http_header.h"
 #include "iosdevice.h"
 #include "pair_error.h"
+#include "pool.h"
 #include "tlv.h"
 
 struct pair_verify {
@@ -19,16 +24,149 @@ struct pair_verify {
     
     struct {
         uint8_t* public;
-        uint8_t* private;
+        void* ltk;
     } keys;
     uint8_t session_key[CURVE25519_SECRET_LENGTH];
+    uint8_t acc_curve_public_key[CURVE25519_KEY_LENGTH];
+    uint8_t ios_device_curve_public_key[CURVE25519_KEY_LENGTH];
+    /* the controller that proved itself, /pairings checks its permission */
+    char controller_id[IOSDEVICE_ID_LEN];
 };
 
-static const char* header_fmt = 
+POOL_DEFINE(_pair_verify_pool, struct pair_verify, POOL_NR_CONNECTIONS);
+
+static const struct http_header header = HTTP_HEADER(
     "HTTP/1.1 200 OK\r\n"
-    "Content-Length: %d\r\n"
+    "Connection: keep-alive\r\n"
     "Content-Type: application/pairing+tlv8\r\n"
-    "\r\n";
+    "Content-Length: ");
+
+/*
+ * Pair resume.
+ * A successful verify leaves its shared secret in a small cache, under a
+ * session id both sides derive from it. A controller reconnecting with that
+ * id proves it knows the secret and both sides derive a new one from it, so
+ * no Curve25519 or Ed25519 operation is needed. Anything that doesn't match
+ * falls back to the full verify.
+ */
+#define PAIR_RESUME_SESSIONS            8
+#define PAIR_RESUME_SESSION_ID_LENGTH   8
+
+struct pair_resume_session {
+    uint32_t last_used;
+    char id[IOSDEVICE_ID_LEN];
+    int id_len;
+    uint8_t session_id[PAIR_RESUME_SESSION_ID_LENGTH];
+    uint8_t shared_secret[CURVE25519_SECRET_LENGTH];
+};
+
+static struct pair_resume_session _sessions[PAIR_RESUME_SESSIONS];
+static uint32_t _sessions_clock;
+static portMUX_TYPE _sessions_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static void _resume_session_save_as(const char* id, int id_len, 
+        const uint8_t* session_id, uint8_t* shared_secret)
+{
+    if (id_len > IOSDEVICE_ID_LEN)
+        id_len = IOSDEVICE_ID_LEN;
+
+    portENTER_CRITICAL(&_sessions_mux);
+    /* one session per controller, otherwise the least recently used slot */
+    struct pair_resume_session* session = &_sessions[0];
+    for (int i=0; i<PAIR_RESUME_SESSIONS; i++) {
+        struct pair_resume_session* s = &_sessions[i];
+        if (s->id_len == id_len && memcmp(s->id, id, id_len) == 0) {
+            session = s;
+            break;
+        }
+        if (s->last_used < session->last_used)
+            session = s;
+    }
+
+    memcpy(session->id, id, id_len);
+    session->id_len = id_len;
+    memcpy(session->session_id, session_id, PAIR_RESUME_SESSION_ID_LENGTH);
+    memcpy(session->shared_secret, shared_secret, CURVE25519_SECRET_LENGTH);
+    session->last_used = ++_sessions_clock;
+    portEXIT_CRITICAL(&_sessions_mux);
+}
+
+/* after a full verify, under the id both sides derive from the secret */
+static void _resume_session_save(const char* id, int id_len, uint8_t* shared_secret)
+{
+    uint8_t session_id[HKDF_KEY_LEN];
+    if (hkdf_key_get(HKDF_KEY_TYPE_PAIR_VERIFY_RESUME_SESSION_ID, shared_secret, 
+                CURVE25519_SECRET_LENGTH, session_id) < 0)
+        return;
+
+    _resume_session_save_as(id, id_len, session_id, shared_secret);
+}
+
+/* copies the session out, it stays cached until _resume_session_take */
+static bool _resume_session_find(const uint8_t* session_id, struct pair_resume_session* session)
+{
+    bool found = false;
+
+    portENTER_CRITICAL(&_sessions_mux);
+    for (int i=0; i<PAIR_RESUME_SESSIONS; i++) {
+        struct pair_resume_session* s = &_sessions[i];
+        if (s->id_len && memcmp(s->session_id, session_id, PAIR_RESUME_SESSION_ID_LENGTH) == 0) {
+            *session = *s;
+            found = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&_sessions_mux);
+
+    return found;
+}
+
+/* 
+ * takes the session out of the cache, a session id is only good once.
+ * False when it is gone already, e.g. another resume with it got there first.
+ */
+static bool _resume_session_take(const uint8_t* session_id, struct pair_resume_session* session)
+{
+    bool found = false;
+
+    portENTER_CRITICAL(&_sessions_mux);
+    for (int i=0; i<PAIR_RESUME_SESSIONS; i++) {
+        struct pair_resume_session* s = &_sessions[i];
+        if (s->id_len && memcmp(s->session_id, session_id, PAIR_RESUME_SESSION_ID_LENGTH) == 0) {
+            *session = *s;
+            memset(s, 0, sizeof(*s));
+            found = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&_sessions_mux);
+
+    return found;
+}
+
+static void _resume_session_put(struct pair_resume_session* session)
+{
+    portENTER_CRITICAL(&_sessions_mux);
+    for (int i=0; i<PAIR_RESUME_SESSIONS; i++) {
+        if (_sessions[i].id_len == 0) {
+            _sessions[i] = *session;
+            _sessions[i].last_used = ++_sessions_clock;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&_sessions_mux);
+}
+
+void pair_verify_resume_forget(const char* id, int id_len)
+{
+    portENTER_CRITICAL(&_sessions_mux);
+    for (int i=0; i<PAIR_RESUME_SESSIONS; i++) {
+        struct pair_resume_session* s = &_sessions[i];
+        if (s->id_len == id_len && memcmp(s->id, id, id_len) == 0)
+            memset(s, 0, sizeof(*s));
+    }
+    portEXIT_CRITICAL(&_sessions_mux);
+}
 
 static void _subtlv_free(uint8_t* subtlv)
 {
@@ -36,23 +174,19 @@ static void _subtlv_free(uint8_t* subtlv)
         free(subtlv);
 }
 
-static uint8_t _state_get(uint8_t* device_msg, int device_msg_length)
+static uint8_t _state_get(struct tlv_reader* device_msg)
 {
-    struct tlv* state_tlv = tlv_decode((uint8_t*)device_msg, device_msg_length, 
-            HAP_TLV_TYPE_STATE);
-    if (state_tlv == NULL) {
-        printf("tlv_decode failed. type:%d\n", HAP_TLV_TYPE_STATE);
+    const struct tlv_item* state_tlv = tlv_reader_get(device_msg, HAP_TLV_TYPE_STATE);
+    if (state_tlv == NULL || state_tlv->length < 1) {
+        printf("tlv_reader_get failed. type:%d\n", HAP_TLV_TYPE_STATE);
         return 0;
     }
 
-    uint8_t state = ((uint8_t*)&state_tlv->value)[0];
-
-    tlv_decoded_item_free(state_tlv);
-    return state;
+    return state_tlv->value[0];
 }
 
 static int _verify_m2(struct pair_verify* pv, 
-        uint8_t* device_msg, int device_msg_length, 
+        struct tlv_reader* device_msg, 
         uint8_t** acc_msg, int* acc_msg_length)
 {
     uint8_t acc_curve_public_key[CURVE25519_KEY_LENGTH] = {0,};
@@ -62,16 +196,15 @@ static int _verify_m2(struct pair_verify* pv,
         return -1;
     }
 
-    struct tlv* ios_device_curve_key = tlv_decode((uint8_t*)device_msg, 
-            device_msg_length, HAP_TLV_TYPE_PUBLICKEY);
-    if (!ios_device_curve_key) {
-        printf("tlv_decode failed. type:%d\n", HAP_TLV_TYPE_PUBLICKEY);
+    const struct tlv_item* ios_device_curve_key = tlv_reader_get(device_msg, HAP_TLV_TYPE_PUBLICKEY);
+    if (!ios_device_curve_key || ios_device_curve_key->length != CURVE25519_KEY_LENGTH) {
+        printf("tlv_reader_get failed. type:%d\n", HAP_TLV_TYPE_PUBLICKEY);
         return -1;
     }
 
     uint8_t session_key[CURVE25519_SECRET_LENGTH] = {0,};
     int session_key_length = CURVE25519_SECRET_LENGTH;
-    if (curve25519_shared_secret((uint8_t*)&ios_device_curve_key->value,
+    if (curve25519_shared_secret((uint8_t*)ios_device_curve_key->value,
             acc_curve_private_key, session_key, &session_key_length) < 0) {
         printf("curve25519_shared_secret failed\n");
         return -1;
@@ -80,14 +213,15 @@ static int _verify_m2(struct pair_verify* pv,
     int acc_info_len;
     uint8_t* acc_info = concat3(acc_curve_public_key, CURVE25519_KEY_LENGTH,
             (uint8_t*)pv->acc_id, strlen(pv->acc_id),
-            (uint8_t*)&ios_device_curve_key->value, ios_device_curve_key->length,
+            (uint8_t*)ios_device_curve_key->value, ios_device_curve_key->length,
             &acc_info_len);
 
-    tlv_decoded_item_free(ios_device_curve_key);
+    memcpy(pv->acc_curve_public_key, acc_curve_public_key, CURVE25519_KEY_LENGTH);
+    memcpy(pv->ios_device_curve_public_key, ios_device_curve_key->value, CURVE25519_KEY_LENGTH);
 
     int acc_signature_length = ED25519_SIGN_LENGTH;
     uint8_t acc_signature[ED25519_SIGN_LENGTH] = {0,};
-    ed25519_sign(pv->keys.public, pv->keys.private, 
+    ed25519_key_sign(pv->keys.ltk, 
             acc_info, acc_info_len,
             acc_signature, &acc_signature_length);
 
@@ -97,10 +231,11 @@ static int _verify_m2(struct pair_verify* pv,
     acc_plain_subtlv_length += tlv_encode_length(acc_signature_length);
 
     uint8_t* acc_plain_subtlv = malloc(acc_plain_subtlv_length);
-    uint8_t* sub_tlv_write_ptr = acc_plain_subtlv;
+    struct tlv_writer subtlv_writer;
+    tlv_writer_init(&subtlv_writer, acc_plain_subtlv, acc_plain_subtlv_length);
 
-    sub_tlv_write_ptr += tlv_encode(HAP_TLV_TYPE_IDENTIFIER, strlen(pv->acc_id), (uint8_t*)pv->acc_id, sub_tlv_write_ptr);
-    sub_tlv_write_ptr += tlv_encode(HAP_TLV_TYPE_SIGNATURE, ED25519_SIGN_LENGTH, acc_signature, sub_tlv_write_ptr);
+    tlv_writer_put(&subtlv_writer, HAP_TLV_TYPE_IDENTIFIER, strlen(pv->acc_id), (uint8_t*)pv->acc_id);
+    tlv_writer_put(&subtlv_writer, HAP_TLV_TYPE_SIGNATURE, ED25519_SIGN_LENGTH, acc_signature);
 
     int acc_subtlv_length = acc_plain_subtlv_length + CHACHA20_POLY1305_AUTH_TAG_LENGTH;
     uint8_t* acc_subtlv = (uint8_t*)calloc(1, acc_subtlv_length);
@@ -122,10 +257,11 @@ static int _verify_m2(struct pair_verify* pv,
         return pair_error(HAP_TLV_ERROR_UNKNOWN, acc_msg, acc_msg_length);
     }
 
-    uint8_t* tlv_encode_ptr = *acc_msg;
-    tlv_encode_ptr += tlv_encode(HAP_TLV_TYPE_STATE, sizeof(state), state, tlv_encode_ptr);
-    tlv_encode_ptr += tlv_encode(HAP_TLV_TYPE_PUBLICKEY, CURVE25519_KEY_LENGTH, acc_curve_public_key, tlv_encode_ptr);
-    tlv_encode_ptr += tlv_encode(HAP_TLV_TYPE_ENCRYPTED_DATA, acc_subtlv_length, acc_subtlv, tlv_encode_ptr);
+    struct tlv_writer writer;
+    tlv_writer_init(&writer, *acc_msg, *acc_msg_length);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_STATE, sizeof(state), state);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_PUBLICKEY, CURVE25519_KEY_LENGTH, acc_curve_public_key);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_ENCRYPTED_DATA, acc_subtlv_length, acc_subtlv);
 
     _subtlv_free(acc_subtlv);
 
@@ -134,47 +270,163 @@ static int _verify_m2(struct pair_verify* pv,
     return 0;
 }
 
+static int _resume_m2(struct pair_verify* pv, 
+        struct tlv_reader* device_msg, 
+        uint8_t** acc_msg, int* acc_msg_length)
+{
+    const struct tlv_item* method = tlv_reader_get(device_msg, HAP_TLV_TYPE_METHOD);
+    if (method == NULL || method->length != 1 || method->value[0] != HAP_PAIRING_METHOD_RESUME)
+        return -1;
+
+    const struct tlv_item* ios_device_curve_key = tlv_reader_get(device_msg, HAP_TLV_TYPE_PUBLICKEY);
+    const struct tlv_item* session_id = tlv_reader_get(device_msg, HAP_TLV_TYPE_SESSION_ID);
+    const struct tlv_item* encrypted = tlv_reader_get(device_msg, HAP_TLV_TYPE_ENCRYPTED_DATA);
+
+    struct pair_resume_session session;
+    if (ios_device_curve_key == NULL || ios_device_curve_key->length != CURVE25519_KEY_LENGTH ||
+            session_id == NULL || session_id->length != PAIR_RESUME_SESSION_ID_LENGTH ||
+            encrypted == NULL || encrypted->length != CHACHA20_POLY1305_AUTH_TAG_LENGTH) {
+        return -1;
+    }
+
+    if (!_resume_session_find((uint8_t*)session_id->value, &session)) {
+        printf("[PAIR-VERIFY] Unknown resume session\n");
+        return -1;
+    }
+
+    /* salt is the controller's public key followed by a session id */
+    uint8_t salt[CURVE25519_KEY_LENGTH + PAIR_RESUME_SESSION_ID_LENGTH];
+    memcpy(salt, ios_device_curve_key->value, CURVE25519_KEY_LENGTH);
+    memcpy(salt + CURVE25519_KEY_LENGTH, session_id->value, PAIR_RESUME_SESSION_ID_LENGTH);
+
+    uint8_t key[HKDF_KEY_LEN];
+    uint8_t empty[1];
+    hkdf_key_get_with_salt(HKDF_KEY_TYPE_PAIR_RESUME_REQUEST, salt, sizeof(salt), 
+            session.shared_secret, CURVE25519_SECRET_LENGTH, key);
+    if (chacha20_poly1305_decrypt(CHACHA20_POLY1305_TYPE_PR01, key, NULL, 0, 
+                (uint8_t*)encrypted->value, encrypted->length, empty) < 0) {
+        printf("[PAIR-VERIFY] Resume request authentication failed\n");
+        return -1;
+    }
+
+    /* only a request that proved the secret uses the session up */
+    if (!_resume_session_take((uint8_t*)session_id->value, &session)) {
+        printf("[PAIR-VERIFY] Resume session already used\n");
+        return -1;
+    }
+
+    uint8_t new_session_id[PAIR_RESUME_SESSION_ID_LENGTH];
+    os_get_random(new_session_id, sizeof(new_session_id));
+    memcpy(salt + CURVE25519_KEY_LENGTH, new_session_id, PAIR_RESUME_SESSION_ID_LENGTH);
+
+    uint8_t auth_tag[CHACHA20_POLY1305_AUTH_TAG_LENGTH];
+    hkdf_key_get_with_salt(HKDF_KEY_TYPE_PAIR_RESUME_RESPONSE, salt, sizeof(salt), 
+            session.shared_secret, CURVE25519_SECRET_LENGTH, key);
+    chacha20_poly1305_encrypt(CHACHA20_POLY1305_TYPE_PR02, key, NULL, 0, empty, 0, auth_tag);
+
+    hkdf_key_get_with_salt(HKDF_KEY_TYPE_PAIR_RESUME_SHARED_SECRET, salt, sizeof(salt), 
+            session.shared_secret, CURVE25519_SECRET_LENGTH, pv->session_key);
+
+    uint8_t state[] = {0x02};
+    uint8_t method_resume[] = {HAP_PAIRING_METHOD_RESUME};
+    *acc_msg_length = tlv_encode_length(sizeof(state));
+    *acc_msg_length += tlv_encode_length(sizeof(method_resume));
+    *acc_msg_length += tlv_encode_length(sizeof(new_session_id));
+    *acc_msg_length += tlv_encode_length(sizeof(auth_tag));
+
+    (*acc_msg) = malloc(*acc_msg_length);
+    if (*acc_msg == NULL) {
+        printf("malloc failed. size:%d\n", *acc_msg_length);
+        _resume_session_put(&session);
+        return -1;
+    }
+
+    struct tlv_writer writer;
+    tlv_writer_init(&writer, *acc_msg, *acc_msg_length);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_STATE, sizeof(state), state);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_METHOD, sizeof(method_resume), method_resume);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_SESSION_ID, sizeof(new_session_id), new_session_id);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_ENCRYPTED_DATA, sizeof(auth_tag), auth_tag);
+
+    memset(pv->controller_id, 0, IOSDEVICE_ID_LEN);
+    memcpy(pv->controller_id, session.id, session.id_len);
+
+    /* the resumed session can be resumed again, with the id it was just sent */
+    _resume_session_save_as(session.id, session.id_len, new_session_id, pv->session_key);
+
+    return 0;
+}
+
 static int _verify_m4(struct pair_verify* pv, 
-        uint8_t* device_msg, int device_msg_length, 
+        struct tlv_reader* device_msg, 
         uint8_t** acc_msg, int* acc_msg_length)
 {
-    struct tlv* encrypted_tlv = tlv_decode((uint8_t*)device_msg, device_msg_length,
-            HAP_TLV_TYPE_ENCRYPTED_DATA);
-    if (encrypted_tlv == NULL) {
-        printf("tlv_devoce HAP_TLV_TYPE_ENCRYPTED_DATA failed\n");
+    const struct tlv_item* encrypted_tlv = tlv_reader_get(device_msg, HAP_TLV_TYPE_ENCRYPTED_DATA);
+    if (encrypted_tlv == NULL || encrypted_tlv->length < CHACHA20_POLY1305_AUTH_TAG_LENGTH) {
+        printf("tlv_reader_get HAP_TLV_TYPE_ENCRYPTED_DATA failed\n");
         return pair_error(HAP_TLV_ERROR_UNKNOWN, acc_msg, acc_msg_length);
     }
 
     uint8_t subtlv_key[HKDF_KEY_LEN] = {0,};
     hkdf_key_get(HKDF_KEY_TYPE_PAIR_VERIFY_ENCRYPT, pv->session_key, CURVE25519_SECRET_LENGTH, subtlv_key);
     uint8_t* subtlv = malloc(encrypted_tlv->length);
-    chacha20_poly1305_decrypt(CHACHA20_POLY1305_TYPE_PV03, subtlv_key, NULL, 0, (uint8_t*)&encrypted_tlv->value, encrypted_tlv->length, subtlv);
+    if (subtlv == NULL) {
+        printf("malloc failed. size:%d\n", encrypted_tlv->length);
+        return pair_error(HAP_TLV_ERROR_UNKNOWN, acc_msg, acc_msg_length);
+    }
+    if (chacha20_poly1305_decrypt(CHACHA20_POLY1305_TYPE_PV03, subtlv_key, NULL, 0, 
+                (uint8_t*)encrypted_tlv->value, encrypted_tlv->length, subtlv) < 0) {
+        printf("chacha20_poly1305_decrypt failed\n");
+        free(subtlv);
+        return pair_error(HAP_TLV_ERROR_AUTHENTICATION, acc_msg, acc_msg_length);
+    }
 
-    tlv_decoded_item_free(encrypted_tlv);
+    int subtlv_length = encrypted_tlv->length - CHACHA20_POLY1305_AUTH_TAG_LENGTH;
 
-    int subtlv_length = strlen((char*)subtlv);;
-    struct tlv* ios_device_pairng_id = tlv_decode(subtlv, subtlv_length, 
-            HAP_TLV_TYPE_IDENTIFIER);
-    if (ios_device_pairng_id == NULL) {
-        printf("tlv_devoce HAP_TLV_TYPE_IDENTIFIER failed\n");
+    struct tlv_reader reader;
+    const struct tlv_item* ios_device_pairng_id = NULL;
+    const struct tlv_item* ios_device_signature = NULL;
+    if (tlv_reader_init(&reader, subtlv, subtlv_length) == 0) {
+        ios_device_pairng_id = tlv_reader_get(&reader, HAP_TLV_TYPE_IDENTIFIER);
+        ios_device_signature = tlv_reader_get(&reader, HAP_TLV_TYPE_SIGNATURE);
+    }
+    if (ios_device_pairng_id == NULL || ios_device_signature == NULL) {
+        printf("tlv_reader_get failed. id:%p signature:%p\n", ios_device_pairng_id, ios_device_signature);
+        tlv_reader_free(&reader);
         free(subtlv);
         return pair_error(HAP_TLV_ERROR_UNKNOWN, acc_msg, acc_msg_length);
     }
-
-    struct tlv* ios_device_signature = tlv_decode(subtlv, subtlv_length, 
-            HAP_TLV_TYPE_SIGNATURE);
-    if (ios_device_signature == NULL) {
-        printf("tlv_devoce HAP_TLV_TYPE_SIGNATURE failed\n");
+    /* the pairings always compare and hash IOSDEVICE_ID_LEN bytes */
+    if (ios_device_pairng_id->length != IOSDEVICE_ID_LEN) {
+        printf("invalid id length:%d\n", ios_device_pairng_id->length);
+        tlv_reader_free(&reader);
         free(subtlv);
         return pair_error(HAP_TLV_ERROR_UNKNOWN, acc_msg, acc_msg_length);
     }
 
-    free(subtlv);
+    int ios_device_info_len = 0;
+    uint8_t* ios_device_info = concat3(pv->ios_device_curve_public_key, CURVE25519_KEY_LENGTH,
+            (uint8_t*)ios_device_pairng_id->value, ios_device_pairng_id->length,
+            pv->acc_curve_public_key, CURVE25519_KEY_LENGTH,
+            &ios_device_info_len);
+
+    int err = iosdevice_signature_verify(pv->iosdevices, (char*)ios_device_pairng_id->value,
+            (uint8_t*)ios_device_signature->value, ios_device_signature->length,
+            ios_device_info, ios_device_info_len);
+    concat_free(ios_device_info);
+    if (err < 0) {
+        printf("iosdevice_signature_verify failed\n");
+        tlv_reader_free(&reader);
+        free(subtlv);
+        return pair_error(HAP_TLV_ERROR_AUTHENTICATION, acc_msg, acc_msg_length);
+    }
 
-    //TODO MATCH pairiing_id, signature
+    memcpy(pv->controller_id, ios_device_pairng_id->value, IOSDEVICE_ID_LEN);
 
-    tlv_decoded_item_free(ios_device_pairng_id);
-    tlv_decoded_item_free(ios_device_signature);
+    _resume_session_save((char*)ios_device_pairng_id->value, ios_device_pairng_id->length, pv->session_key);
+
+    tlv_reader_free(&reader);
+    free(subtlv);
 
     uint8_t state[] = {4};
     *acc_msg_length = tlv_encode_length(sizeof(state));
@@ -185,59 +437,74 @@ static int _verify_m4(struct pair_verify* pv,
         return pair_error(HAP_TLV_ERROR_UNKNOWN, acc_msg, acc_msg_length);
     }
 
-    uint8_t* tlv_encode_ptr = *acc_msg;
-    tlv_encode_ptr += tlv_encode(HAP_TLV_TYPE_STATE, sizeof(state), state, tlv_encode_ptr);
+    struct tlv_writer writer;
+    tlv_writer_init(&writer, *acc_msg, *acc_msg_length);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_STATE, sizeof(state), state);
 
     return 0;
 }
 
 int pair_verify_do(void* _pv, const char* req_body, int req_body_len, 
-        char** res_header, int* res_header_len, char** res_body, int* res_body_len, 
-        bool* verified, char* session_key)
+        char* res_header, int* res_header_len, char** res_body, int* res_body_len, 
+        bool* verified, char* session_key, char* controller_id)
 {
     struct pair_verify* pv = _pv;
-    uint8_t state = _state_get((uint8_t*)req_body, req_body_len);
+
+    struct tlv_reader reader;
+    if (tlv_reader_init(&reader, (uint8_t*)req_body, req_body_len) < 0) {
+        printf("[PAIR-VERIFY][ERR] Invalid TLV. length:%d\n", req_body_len);
+        return -1;
+    }
+    uint8_t state = _state_get(&reader);
 
     int error = 0;
     switch (state) {
     case 0x01:
-        error = _verify_m2(pv, (uint8_t*)req_body, req_body_len, (uint8_t**)res_body, res_body_len); 
+        if (_resume_m2(pv, &reader, (uint8_t**)res_body, res_body_len) == 0) {
+            *verified = true;
+            memcpy(session_key, pv->session_key, CURVE25519_SECRET_LENGTH);
+            memcpy(controller_id, pv->controller_id, IOSDEVICE_ID_LEN);
+            break;
+        }
+        error = _verify_m2(pv, &reader, (uint8_t**)res_body, res_body_len); 
         break;
     case 0x03:
-        error = _verify_m4(pv, (uint8_t*)req_body, req_body_len, (uint8_t**)res_body, res_body_len); 
+        error = _verify_m4(pv, &reader, (uint8_t**)res_body, res_body_len); 
         if (error == 0) {
             *verified = true;
             memcpy(session_key, pv->session_key, CURVE25519_SECRET_LENGTH);
+            memcpy(controller_id, pv->controller_id, IOSDEVICE_ID_LEN);
         }
         break;
     default:
         printf("[PAIR-VERIFY][ERR] Invalid state number. %d\n", state);
+        tlv_reader_free(&reader);
         return -1;
     }
+    tlv_reader_free(&reader);
 
     if (error) {
         return -1;
     }
 
-    *res_header = malloc(strlen(header_fmt) + 16);
-    sprintf(*res_header, header_fmt, *res_body_len);
-    *res_header_len = strlen(*res_header);
+    if (http_header_write(&header, *res_body_len, res_header, res_header_len) < 0) {
+        free(*res_body);
+        *res_body = NULL;
+        return -1;
+    }
 
     return 0;
 }
 
-void pair_verify_do_free(char* res_header, char*res_body)
+void pair_verify_do_free(char* res_body)
 {
-    if (res_header)
-        free(res_header);
-
     if (res_body)
         free(res_body);
 }
 
-void* pair_verify_init(char* acc_id, void* iosdevices, uint8_t* public_key, uint8_t* private_key)
+void* pair_verify_init(char* acc_id, void* iosdevices, uint8_t* public_key, void* ltk)
 {
-    struct pair_verify* pv = calloc(1, sizeof(struct pair_verify));
+    struct pair_verify* pv = pool_alloc(&_pair_verify_pool);
     if (pv == NULL) {
         return NULL;
     }
@@ -245,7 +512,7 @@ void* pair_verify_init(char* acc_id, void* iosdevices, uint8_t* public_key, uint
     pv->acc_id = acc_id;
     pv->iosdevices = iosdevices;
     pv->keys.public = public_key;
-    pv->keys.private = private_key;
+    pv->keys.ltk = ltk;
 
     return pv;
 }
@@ -254,6 +521,6 @@ void pair_verify_cleanup(void* _pv)
 {
     struct pair_verify* pv = _pv;
 
-    free(pv);
+    pool_free(&_pair_verify_pool, pv);
 }
 
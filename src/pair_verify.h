@@ -7,14 +7,17 @@ extern "C" {
 
 #include <stdbool.h>
 
-void pair_verify_do_free(char* res_header, char*res_body);
+void pair_verify_do_free(char* res_body);
 int pair_verify_do(void* pair_verify, const char* req_body, int req_body_len, 
-        char** res_header, int* res_header_len, char** res_body, int* res_body_len,
-        bool* verified, char* session_key);
+        char* res_header, int* res_header_len, char** res_body, int* res_body_len,
+        bool* verified, char* session_key, char* controller_id);
 
-void* pair_verify_init(char* acc_id, void* iosdevices, uint8_t* public_key, uint8_t* private_key);
+void* pair_verify_init(char* acc_id, void* iosdevices, uint8_t* public_key, void* ltk);
 void pair_verify_cleanup(void* _pv);
 
+/* drops the resumable sessions of a controller whose pairing is removed */
+void pair_verify_resume_forget(const char* id, int id_len);
+
 #ifdef __cplusplus
 }
 #endif
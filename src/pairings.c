@@ -4,87 +4,97 @@
 #include <stdint.h>
 
 #include "hap_internal.h"
+#include "http_header.h"
 #include "iosdevice.h"
 #include "pair_error.h"
+#include "pair_verify.h"
 #include "tlv.h"
 
-static const char* header_fmt = 
+static const struct http_header header = HTTP_HEADER(
     "HTTP/1.1 200 OK\r\n"
-    "Content-Length: %d\r\n"
+    "Connection: keep-alive\r\n"
     "Content-Type: application/pairing+tlv8\r\n"
-    "\r\n";
+    "Content-Length: ");
 
-static uint8_t _state_get(const uint8_t* device_msg, int device_msg_length)
+static uint8_t _byte_get(struct tlv_reader* device_msg, uint8_t type)
 {
-    struct tlv* state_tlv = tlv_decode((const uint8_t*)device_msg, device_msg_length, 
-            HAP_TLV_TYPE_STATE);
-    if (state_tlv == NULL) {
-        printf("tlv_decode failed. type:%d\n", HAP_TLV_TYPE_STATE);
+    const struct tlv_item* item = tlv_reader_get(device_msg, type);
+    if (item == NULL || item->length < 1) {
+        printf("tlv_reader_get failed. type:%d\n", type);
         return 0;
     }
 
-    uint8_t state = ((uint8_t*)&state_tlv->value)[0];
-
-    tlv_decoded_item_free(state_tlv);
-    return state;
+    return item->value[0];
 }
 
-static enum hap_pairing_method _method_get(uint8_t* device_msg, int device_msg_length)
+#define LIST_ENTRY_LENGTH   (tlv_encode_length(IOSDEVICE_ID_LEN) + \
+        tlv_encode_length(ED25519_PUBLIC_KEY_LENGTH) + \
+        tlv_encode_length(sizeof(uint8_t)) + tlv_encode_length(0))
+
+struct list_encoder {
+    struct tlv_writer writer;
+    int nr_encoded;
+};
+
+static void _list_encode(void* arg, const struct iosdevice* idevice)
 {
-    struct tlv* method_tlv = tlv_decode((uint8_t*)device_msg, device_msg_length, 
-            HAP_TLV_TYPE_METHOD);
-    if (method_tlv == NULL) {
-        printf("tlv_decode failed. type:%d\n", HAP_TLV_TYPE_METHOD);
-        return 0;
-    }
+    struct list_encoder* encoder = arg;
 
-    uint8_t method = ((uint8_t*)&method_tlv->value)[0];
+    /* the table may have grown since the buffer was sized */
+    if (encoder->writer.len + LIST_ENTRY_LENGTH > encoder->writer.size)
+        return;
 
-    tlv_decoded_item_free(method_tlv);
-    return (enum hap_pairing_method)method;
+    if (encoder->nr_encoded++)
+        tlv_writer_put(&encoder->writer, HAP_TLV_TYPE_SEPARATOR, 0, NULL);
+    tlv_writer_put(&encoder->writer, HAP_TLV_TYPE_IDENTIFIER, IOSDEVICE_ID_LEN, (uint8_t*)idevice->id);
+    tlv_writer_put(&encoder->writer, HAP_TLV_TYPE_PUBLICKEY, ED25519_PUBLIC_KEY_LENGTH, (uint8_t*)idevice->key);
+    tlv_writer_put(&encoder->writer, HAP_TLV_TYPE_PERMISSION, sizeof(uint8_t), &idevice->permission);
 }
 
-#if 0
-static int _list(void* iosdevices, uint8_t* device_msg, int device_msg_length, uint8_t** acc_msg, int* acc_msg_length) {
-    struct iosdevice idevices[IOSDEVICE_PER_ACCESSORY_MAX];
-    int nr_devices = iosdevice_pairings(iosdevices, idevices);
-
-    int tlv_length_for_one_device = tlv_encode_length(IOSDEVICE_ID_LEN);
-    tlv_length_for_one_device += tlv_encode_length(ED25519_PUBLIC_KEY_LENGTH);
-    tlv_length_for_one_device += tlv_encode_length(sizeof(uint8_t)); /* length for KTLVType_Permission */
-    tlv_length_for_one_device += tlv_encode_length(0); /* length for KTLVType_Seperator */
+static int _list(void* iosdevices, struct tlv_reader* device_msg, uint8_t** acc_msg, int* acc_msg_length) {
+    /* the count only sizes the buffer, the table may change in between */
+    int nr_devices = iosdevice_pairings_foreach(iosdevices, NULL, NULL);
 
     uint8_t state[] = {2};
-    *acc_msg_length = tlv_encode_length(sizeof(state));
-    *acc_msg_length += tlv_length_for_one_device * nr_devices; 
+    int length = tlv_encode_length(sizeof(state)) + LIST_ENTRY_LENGTH * nr_devices;
 
-    (*acc_msg) = malloc(*acc_msg_length);
+    (*acc_msg) = malloc(length);
     if (*acc_msg == NULL) {
         printf("malloc failed\n");
         return pair_error(HAP_TLV_ERROR_UNKNOWN, acc_msg, acc_msg_length);
     }
 
-    uint8_t* tlv_encode_ptr = *acc_msg;
-    tlv_encode_ptr += tlv_encode(HAP_TLV_TYPE_STATE, sizeof(state), state, tlv_encode_ptr);
-    tlv_encode_ptr += tlv_encode(HAP_TLV_TYPE_IDENTIFIER, IOSDEVICE_ID_LEN, idevices[0].id, tlv_encode_ptr);
-    tlv_encode_ptr += tlv_encode(HAP_TLV_TYPE_PUBLICKEY, ED25519_PUBLIC_KEY_LENGTH, idevices[0].key, tlv_encode_ptr);
-    tlv_encode_ptr += tlv_encode(HAP_TLV_TYPE_PERMISSION, sizeof(uint8_t), &idevices[0].permission, tlv_encode_ptr);
+    struct list_encoder encoder = {0,};
+    tlv_writer_init(&encoder.writer, *acc_msg, length);
+    tlv_writer_put(&encoder.writer, HAP_TLV_TYPE_STATE, sizeof(state), state);
+    iosdevice_pairings_foreach(iosdevices, _list_encode, &encoder);
 
-    //TODO FIXME
+    *acc_msg_length = encoder.writer.len;
     return 0;
 }
-#endif
 
-static int _add(void* iosdevices, uint8_t* device_msg, int device_msg_length, uint8_t** acc_msg, int* acc_msg_length) {
-    struct tlv* identifier = tlv_decode(device_msg, device_msg_length, HAP_TLV_TYPE_IDENTIFIER);
-    struct tlv* public_key = tlv_decode(device_msg, device_msg_length, HAP_TLV_TYPE_PUBLICKEY);
-    struct tlv* permission = tlv_decode(device_msg, device_msg_length, HAP_TLV_TYPE_PERMISSION);
-    printf("[PAIRINGS] ADD ID:%.*s KEY:%.*s PERM:0x%x,%d\n", 
-            identifier->length, (uint8_t*)&identifier->value,
-            public_key->length, (uint8_t*)&public_key->value,
-            (uint8_t*)&permission->value, (uint8_t*)&permission->value);
+static int _add(void* iosdevices, struct tlv_reader* device_msg, uint8_t** acc_msg, int* acc_msg_length) {
+    const struct tlv_item* identifier = tlv_reader_get(device_msg, HAP_TLV_TYPE_IDENTIFIER);
+    const struct tlv_item* public_key = tlv_reader_get(device_msg, HAP_TLV_TYPE_PUBLICKEY);
+    const struct tlv_item* permission = tlv_reader_get(device_msg, HAP_TLV_TYPE_PERMISSION);
+    enum hap_tlv_error_codes error = 0;
 
-    iosdevice_pairings_add(iosdevices, (uint8_t*)&identifier->value, (uint8_t*)&public_key->value);
+    if (!identifier || !public_key || !permission || permission->length < 1 || 
+            identifier->length != IOSDEVICE_ID_LEN || public_key->length != ED25519_PUBLIC_KEY_LENGTH) {
+        printf("invalid pairing to be added\n");
+        error = HAP_TLV_ERROR_UNKNOWN;
+    }
+    else {
+        uint8_t perm = permission->value[0];
+        printf("[PAIRINGS] ADD ID:%.*s PERM:%d\n", 
+                identifier->length, identifier->value, perm);
+
+        if (iosdevice_pairings_add(iosdevices, (char*)identifier->value, (char*)public_key->value, perm) < 0)
+            error = HAP_TLV_ERROR_MAX_PEERS;
+    }
+
+    if (error)
+        return pair_error(error, acc_msg, acc_msg_length);
 
     uint8_t state[] = {2};
     *acc_msg_length = tlv_encode_length(sizeof(state));
@@ -95,23 +105,28 @@ static int _add(void* iosdevices, uint8_t* device_msg, int device_msg_length, ui
         return pair_error(HAP_TLV_ERROR_UNKNOWN, acc_msg, acc_msg_length);
     }
 
-    uint8_t* tlv_encode_ptr = *acc_msg;
-    tlv_encode_ptr += tlv_encode(HAP_TLV_TYPE_STATE, sizeof(state), state, tlv_encode_ptr);
+    struct tlv_writer writer;
+    tlv_writer_init(&writer, *acc_msg, *acc_msg_length);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_STATE, sizeof(state), state);
 
     return 0;
 }
 
-static int _remove(void* iosdevices, uint8_t* device_msg, int device_msg_length, uint8_t** acc_msg, int* acc_msg_length) {
-    struct tlv* remove_identifier = tlv_decode(device_msg, device_msg_length, HAP_TLV_TYPE_IDENTIFIER);
-    if (!remove_identifier) {
-        printf("tlv_decode failed. type:%d\n", HAP_TLV_TYPE_IDENTIFIER);
+static int _remove(void* iosdevices, struct tlv_reader* device_msg, uint8_t** acc_msg, int* acc_msg_length) {
+    const struct tlv_item* remove_identifier = tlv_reader_get(device_msg, HAP_TLV_TYPE_IDENTIFIER);
+    if (!remove_identifier || remove_identifier->length != IOSDEVICE_ID_LEN) {
+        printf("tlv_reader_get failed. type:%d\n", HAP_TLV_TYPE_IDENTIFIER);
         return -1;
     }
-    printf("%.*s\n",remove_identifier->length , ((uint8_t*)&remove_identifier->value));
-    iosdevice_pairings_remove(iosdevices, (uint8_t*)&remove_identifier->value);
+    printf("%.*s\n",remove_identifier->length , remove_identifier->value);
+    iosdevice_pairings_remove(iosdevices, (char*)remove_identifier->value);
+    pair_verify_resume_forget((char*)remove_identifier->value, remove_identifier->length);
+    /* not held back like other changes, a power cut must not bring the controller back */
+    if (iosdevice_pairings_commit(iosdevices, true) != 0)
+        printf("iosdevice_pairings_commit failed, retried later\n");
 #if 0
     for (int i=0; i<remove_identifier->length; i++) {
-        printf("%X ", ((uint8_t*)&remove_identifier->value)[i]);
+        printf("%X ", remove_identifier->value[i]);
     }
 #endif
 
@@ -124,49 +139,56 @@ static int _remove(void* iosdevices, uint8_t* device_msg, int device_msg_length,
         return pair_error(HAP_TLV_ERROR_UNKNOWN, acc_msg, acc_msg_length);
     }
 
-    uint8_t* tlv_encode_ptr = *acc_msg;
-    tlv_encode_ptr += tlv_encode(HAP_TLV_TYPE_STATE, sizeof(state), state, tlv_encode_ptr);
+    struct tlv_writer writer;
+    tlv_writer_init(&writer, *acc_msg, *acc_msg_length);
+    tlv_writer_put(&writer, HAP_TLV_TYPE_STATE, sizeof(state), state);
 
     return 0;
 }
 
-int pairings_do(void* iosdevices, const char* req_body, int req_body_len, 
-        char** res_header, int* res_header_len, char** res_body, int* res_body_len)
+int pairings_do(void* iosdevices, const char* controller_id, const char* req_body, int req_body_len, 
+        char* res_header, int* res_header_len, char** res_body, int* res_body_len)
 {
-    uint8_t state = _state_get((uint8_t*)req_body, req_body_len);
-    enum hap_pairing_method method = _method_get((uint8_t*)req_body, req_body_len);
+    struct tlv_reader reader;
+    if (tlv_reader_init(&reader, (uint8_t*)req_body, req_body_len) < 0) {
+        printf("[PAIRINGS][ERR] Invalid TLV. length:%d\n", req_body_len);
+        *res_header_len = 0;
+        return 0;
+    }
+
+    uint8_t state = _byte_get(&reader, HAP_TLV_TYPE_STATE);
+    enum hap_pairing_method method = _byte_get(&reader, HAP_TLV_TYPE_METHOD);
 
     printf("[PAIRINGS] STATE:%d METHOD:%d\n", state, method);
 
-    if (method == HAP_PAIRING_METHOD_ADD) {
-        _add(iosdevices, (uint8_t*)req_body, req_body_len, (uint8_t**)res_body, res_body_len);
-        *res_header = malloc(strlen(header_fmt) + 16);
-        sprintf(*res_header, header_fmt, *res_body_len);
-        *res_header_len = strlen(*res_header);
+    if (method != HAP_PAIRING_METHOD_ADD && method != HAP_PAIRING_METHOD_REMOVE &&
+            method != HAP_PAIRING_METHOD_LIST) {
+        tlv_reader_free(&reader);
+        *res_header_len = 0;
+        return 0;
+    }
+
+    /* listing and editing the table are for admin controllers only */
+    if (iosdevice_permission(iosdevices, (char*)controller_id) != IOSDEVICE_PERMISSION_ADMIN) {
+        printf("[PAIRINGS][ERR] Controller is not an admin\n");
+        pair_error(HAP_TLV_ERROR_AUTHENTICATION, (uint8_t**)res_body, res_body_len);
+    }
+    else if (method == HAP_PAIRING_METHOD_ADD) {
+        _add(iosdevices, &reader, (uint8_t**)res_body, res_body_len);
     }
     else if (method == HAP_PAIRING_METHOD_REMOVE) {
-        _remove(iosdevices, (uint8_t*)req_body, req_body_len, (uint8_t**)res_body, res_body_len);
-        *res_header = malloc(strlen(header_fmt) + 16);
-        sprintf(*res_header, header_fmt, *res_body_len);
-        *res_header_len = strlen(*res_header);
+        _remove(iosdevices, &reader, (uint8_t**)res_body, res_body_len);
     }
-    /*
-    else if (method == HAP_PAIRING_METHOD_LIST) {
-        _list(iosdevices, (uint8_t*)req_body, req_body_len, (uint8_t**)res_body, res_body_len);
-        *res_header = malloc(strlen(header_fmt) + 16);
-        sprintf(*res_header, header_fmt, *res_body_len);
-        *res_header_len = strlen(*res_header);
+    else {
+        _list(iosdevices, &reader, (uint8_t**)res_body, res_body_len);
     }
-    */
+    tlv_reader_free(&reader);
 
-    return 0;
+    return http_header_write(&header, *res_body_len, res_header, res_header_len);
 }
 
-void pairings_do_free(char* res_header, char*res_body)
+void pairings_do_free(char* res_body)
 {
-    if (res_header)
-        free(res_header);
-
     if (res_body)
         free(res_body);
 }
@@ -6,9 +6,10 @@
 extern "C" {
 #endif
 
-int pairings_do(void* iosdevices, const char* req_body, int req_body_len, 
-        char** res_header, int* res_header_len, char** res_body, int* res_body_len);
-void pairings_do_free(char* res_header, char*res_body);
+/* controller_id is the verified controller of the session, only admins may edit */
+int pairings_do(void* iosdevices, const char* controller_id, const char* req_body, int req_body_len, 
+        char* res_header, int* res_header_len, char** res_body, int* res_body_len);
+void pairings_do_free(char* res_body);
 
 #ifdef __cplusplus
 }
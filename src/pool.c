@@ -0,0 +1,45 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "pool.h"
+
+void* pool_alloc(struct pool* pool)
+{
+    int slot = -1;
+
+    portENTER_CRITICAL(&pool->mux);
+    for (int i=0; i<pool->nr_blocks; i++) {
+        if (!pool->used[i]) {
+            pool->used[i] = 1;
+            slot = i;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&pool->mux);
+
+    if (slot < 0) {
+        printf("[POOL][ERR] exhausted. blocks:%d size:%d\n", pool->nr_blocks, pool->block_size);
+        return NULL;
+    }
+
+    uint8_t* block = pool->blocks + slot * pool->block_size;
+    memset(block, 0, pool->block_size);
+    return block;
+}
+
+void pool_free(struct pool* pool, void* block)
+{
+    if (!block)
+        return;
+
+    int offset = (uint8_t*)block - pool->blocks;
+    int slot = offset / pool->block_size;
+    if (offset < 0 || slot >= pool->nr_blocks || offset % pool->block_size) {
+        printf("[POOL][ERR] block %p is not from this pool\n", block);
+        return;
+    }
+
+    portENTER_CRITICAL(&pool->mux);
+    pool->used[slot] = 0;
+    portEXIT_CRITICAL(&pool->mux);
+}
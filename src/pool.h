@@ -0,0 +1,51 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include <freertos/FreeRTOS.h>
+
+/*
+ * Fixed-capacity pools of equally sized blocks. The storage is static, so
+ * what the library can hold at once is decided at link time and an
+ * allocation never depends on how fragmented the heap is.
+ * pool_alloc() returns a zeroed block or NULL when every block is in use.
+ * Both calls are safe from any task.
+ */
+#ifdef CONFIG_HOMEKIT_MAX_CONNECTIONS
+#define POOL_NR_CONNECTIONS CONFIG_HOMEKIT_MAX_CONNECTIONS
+#else
+#define POOL_NR_CONNECTIONS 8
+#endif
+
+struct pool {
+    portMUX_TYPE mux;
+    int block_size;
+    int nr_blocks;
+    uint8_t* blocks;
+    uint8_t* used;
+};
+
+#define POOL_DEFINE(_name, _type, _nr)                          \
+    static _type _name##_blocks[_nr];                           \
+    static uint8_t _name##_used[_nr];                           \
+    static struct pool _name = {                                \
+        .mux = portMUX_INITIALIZER_UNLOCKED,                    \
+        .block_size = sizeof(_type),                            \
+        .nr_blocks = _nr,                                       \
+        .blocks = (uint8_t*)_name##_blocks,                     \
+        .used = _name##_used,                                   \
+    }
+
+void* pool_alloc(struct pool* pool);
+void pool_free(struct pool* pool, void* block);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //#ifndef _POOL_H_
@@ -3,6 +3,8 @@
 #include <wolfssl/wolfcrypt/srp.h>
 #include <wolfssl/wolfcrypt/sha512.h>
 
+#include "nvs.h"
+#include "pool.h"
 #include "srp.h"
 
 //#define DEBUG
@@ -12,6 +14,16 @@
 #define VERIFIER_LENGTH     384
 #define PRIVATE_KEY_LENGTH  32
 
+/*
+ * The verifier only depends on the salt and the setup code, so it is
+ * computed once and kept in NVS under "<compact acc id>SR" together with
+ * the salt and a digest of salt|setup code. A different setup code no
+ * longer matches the digest and a new salt and verifier are generated.
+ */
+#define NVS_KEY_SUFFIX      "SR"
+#define CACHE_DIGEST_LENGTH SHA512_DIGEST_SIZE
+#define CACHE_LENGTH        (SRP_SALT_LENGTH + CACHE_DIGEST_LENGTH + 2 + VERIFIER_LENGTH)
+
 struct srp_desc {
     Srp wolfcrypt;
     uint8_t salt[SRP_SALT_LENGTH];
@@ -19,6 +31,9 @@ struct srp_desc {
     uint8_t B[SRP_PUBLIC_KEY_LENGTH];
 };
 
+/* pair-setup holds at most one at a time */
+POOL_DEFINE(_srp_pool, struct srp_desc, POOL_NR_CONNECTIONS);
+
 static const uint8_t N[] = {
     0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xc9, 0x0f, 0xda, 0xa2,
     0x21, 0x68, 0xc2, 0x34, 0xc4, 0xc6, 0x62, 0x8b, 0x80, 0xdc, 0x1c, 0xd1,
@@ -55,7 +70,102 @@ static const uint8_t N[] = {
 };
 static const uint8_t g[] = {5};
 
-static int _verifier_set(struct srp_desc* srp)
+static void _cache_key(const char* acc_id, char* key)
+{
+    char acc_id_compact[13] = {0,};
+    for (int i=0; i<6; i++) {
+        acc_id_compact[i*2] = acc_id[i*3];
+        acc_id_compact[i*2+1] = acc_id[i*3+1];
+    }
+
+    sprintf(key, "%s%s", acc_id_compact, NVS_KEY_SUFFIX);
+}
+
+static int _cache_digest(const uint8_t* salt, const char* setup_code, uint8_t* digest)
+{
+    Sha512 sha;
+    int r = wc_InitSha512(&sha);
+    if (!r) r = wc_Sha512Update(&sha, salt, SRP_SALT_LENGTH);
+    if (!r) r = wc_Sha512Update(&sha, (const byte*)setup_code, strlen(setup_code));
+    if (!r) r = wc_Sha512Final(&sha, digest);
+    wc_Sha512Free(&sha);
+
+    return r == 0 ? 0 : -1;
+}
+
+static int _cache_load(const char* acc_id, const char* setup_code, 
+        uint8_t* salt, uint8_t* verifier, uint32_t* verifier_length)
+{
+    uint8_t* cache = malloc(CACHE_LENGTH);
+    if (!cache) {
+        ESP_LOGE(TAG, "malloc failed. size:%d\n", CACHE_LENGTH);
+        return -1;
+    }
+
+    char key[32] = {0,};
+    _cache_key(acc_id, key);
+    if (nvs_get(key, cache, CACHE_LENGTH) != CACHE_LENGTH) {
+        free(cache);
+        return -1;
+    }
+
+    uint8_t digest[CACHE_DIGEST_LENGTH];
+    uint8_t* ptr = cache;
+    memcpy(salt, ptr, SRP_SALT_LENGTH);
+    ptr += SRP_SALT_LENGTH;
+
+    if (_cache_digest(salt, setup_code, digest) < 0 || 
+            memcmp(digest, ptr, CACHE_DIGEST_LENGTH)) {
+        ESP_LOGI(TAG, "setup code changed, verifier regenerated\n");
+        free(cache);
+        return -1;
+    }
+    ptr += CACHE_DIGEST_LENGTH;
+
+    *verifier_length = (ptr[0] << 8) | ptr[1];
+    ptr += 2;
+    if (*verifier_length == 0 || *verifier_length > VERIFIER_LENGTH) {
+        free(cache);
+        return -1;
+    }
+    memcpy(verifier, ptr, *verifier_length);
+
+    free(cache);
+    return 0;
+}
+
+static void _cache_save(const char* acc_id, const char* setup_code, 
+        uint8_t* salt, uint8_t* verifier, uint32_t verifier_length)
+{
+    uint8_t* cache = calloc(1, CACHE_LENGTH);
+    if (!cache) {
+        ESP_LOGE(TAG, "malloc failed. size:%d\n", CACHE_LENGTH);
+        return;
+    }
+
+    uint8_t* ptr = cache;
+    memcpy(ptr, salt, SRP_SALT_LENGTH);
+    ptr += SRP_SALT_LENGTH;
+
+    if (_cache_digest(salt, setup_code, ptr) < 0) {
+        free(cache);
+        return;
+    }
+    ptr += CACHE_DIGEST_LENGTH;
+
+    ptr[0] = (verifier_length >> 8) & 0xff;
+    ptr[1] = verifier_length & 0xff;
+    ptr += 2;
+    memcpy(ptr, verifier, verifier_length);
+
+    char key[32] = {0,};
+    _cache_key(acc_id, key);
+    nvs_set(key, cache, CACHE_LENGTH);
+
+    free(cache);
+}
+
+static int _verifier_set(struct srp_desc* srp, const char* acc_id, const char* setup_code)
 {
     uint8_t* verifier = malloc(VERIFIER_LENGTH);
     if (!verifier) {
@@ -64,8 +174,33 @@ static int _verifier_set(struct srp_desc* srp)
     }
 
     uint32_t verifier_length = VERIFIER_LENGTH;
-    if (wc_SrpGetVerifier(&srp->wolfcrypt, verifier, &verifier_length)  < 0) {
-        ESP_LOGE(TAG, "wc_SrpGetVerifier failed\n");
+    if (_cache_load(acc_id, setup_code, srp->salt, verifier, &verifier_length) < 0) {
+        os_get_random(srp->salt, SRP_SALT_LENGTH);
+        if (wc_SrpSetParams(&srp->wolfcrypt, N, sizeof(N), g, sizeof(g),
+                    srp->salt, sizeof(srp->salt)) < 0) {
+            ESP_LOGE(TAG, "wc_SrpSetParams failed\n");
+            free(verifier);
+            return -1;
+        }
+
+        if (wc_SrpSetPassword(&srp->wolfcrypt, (const byte*)setup_code, strlen(setup_code)) < 0) {
+            ESP_LOGE(TAG, "wc_SrpSetPassword failed\n");
+            free(verifier);
+            return -1;
+        }
+
+        verifier_length = VERIFIER_LENGTH;
+        if (wc_SrpGetVerifier(&srp->wolfcrypt, verifier, &verifier_length)  < 0) {
+            ESP_LOGE(TAG, "wc_SrpGetVerifier failed\n");
+            free(verifier);
+            return -1;
+        }
+
+        _cache_save(acc_id, setup_code, srp->salt, verifier, verifier_length);
+    }
+    else if (wc_SrpSetParams(&srp->wolfcrypt, N, sizeof(N), g, sizeof(g),
+                srp->salt, sizeof(srp->salt)) < 0) {
+        ESP_LOGE(TAG, "wc_SrpSetParams failed\n");
         free(verifier);
         return -1;
     }
@@ -95,6 +230,7 @@ static int _session_key_generate(Srp* wolfcrypt, byte* secret, word32 size)
     r = wc_InitSha512(&hash.data.sha512);
     if (!r) r = wc_Sha512Update(&hash.data.sha512, secret, size);
     if (!r) r = wc_Sha512Final(&hash.data.sha512, wolfcrypt->key);
+    wc_Sha512Free(&hash.data.sha512);
 
     memset(&hash,0,sizeof(SrpHash));
 
@@ -192,18 +328,18 @@ int srp_salt(void* instance, uint8_t salt[])
     return SRP_SALT_LENGTH;
 }
 
-void* srp_init(const char* setup_code)
+void* srp_init(const char* setup_code, const char* acc_id)
 {
-    if (!setup_code) {
+    if (!setup_code || !acc_id) {
         ESP_LOGE(TAG, "setup code is NULL\n");
         return NULL;
     }
 
     ESP_LOGI(TAG, "setup_code:%s\n", setup_code);
 
-    struct srp_desc *srp = malloc(sizeof(struct srp_desc));
+    struct srp_desc *srp = pool_alloc(&_srp_pool);
     if (!srp) {
-        ESP_LOGE(TAG, "malloc failed. size:%d\n", sizeof(struct srp_desc));
+        ESP_LOGE(TAG, "pool_alloc failed\n");
         goto err_malloc;
     }
 
@@ -219,19 +355,7 @@ void* srp_init(const char* setup_code)
         goto err_wc_SrpSetUsername;
     }
 
-    os_get_random(srp->salt, SRP_SALT_LENGTH);
-    if (wc_SrpSetParams(&srp->wolfcrypt, N, sizeof(N), g, sizeof(g),
-                srp->salt, sizeof(srp->salt)) < 0) {
-        ESP_LOGE(TAG, "wc_SrpSetParams failed\n");
-        goto err_wc_SrpSetParams;
-    }
-
-    if (wc_SrpSetPassword(&srp->wolfcrypt, (const byte*)setup_code, strlen(setup_code)) < 0) {
-        ESP_LOGE(TAG, "wc_SrpSetPassword failed\n");
-        goto err_wc_SrpSetPassword;
-    }
-
-    if (_verifier_set(srp) < 0) {
+    if (_verifier_set(srp, acc_id, setup_code) < 0) {
         ESP_LOGE(TAG, "_verifier_set failed\n");
         goto err_verifier_set;
     }
@@ -255,13 +379,11 @@ void* srp_init(const char* setup_code)
 err_wc_SrpGetPublic:
 err_wc_SrpSetPrivate:
 err_verifier_set:
-err_wc_SrpSetPassword:
-err_wc_SrpSetParams:
 err_wc_SrpSetUsername:
     wc_SrpTerm(&srp->wolfcrypt);
 
 err_wc_SrpInit:
-    free(srp);
+    pool_free(&_srp_pool, srp);
 
 err_malloc:
     return NULL;
@@ -274,5 +396,5 @@ void srp_cleanup(void* instance)
         return;
 
     wc_SrpTerm(&srp->wolfcrypt);
-    free(srp);
+    pool_free(&_srp_pool, srp);
 }
@@ -22,7 +22,7 @@ int srp_host_key_get(void* instance, uint8_t host_public_key[]);
 int srp_host_session_key(void* instance, uint8_t session_key[]);
 int srp_salt(void* instance, uint8_t salt[]);
 
-void* srp_init(const char* setup_code);
+void* srp_init(const char* setup_code, const char* acc_id);
 void srp_cleanup(void* instance);
 
 #ifdef __cplusplus
@@ -13,93 +13,137 @@
 
 #define TLV_MAX_FRAGMENTATION_SIZE   0xff
 
-#define tlv_for_each(pos, start, bound) \
-    for (pos = start; \
-         pos <= bound; \
-         pos += TLV_HEADER_LENGTH + pos[TLV_LENGTH_INDEX])
-
-static uint8_t* _item_find(const uint8_t* start, int length, uint8_t type) 
+/*
+ * A value longer than 255 bytes is split into items of the same type, every
+ * one but the last 255 bytes long. Two items of the same type after a
+ * shorter one are separate items, e.g. in a list without separators.
+ */
+int tlv_reader_init(struct tlv_reader* reader, const uint8_t* msg, int msg_len)
 {
-    uint8_t* pos;
-    tlv_for_each(pos, start, start + length -1) {
-        if (pos[TLV_TYPE_INDEX] == type) {
-            return pos;
+    struct tlv_item* item = NULL;
+    int last_length = 0;
+
+    reader->nr_items = 0;
+    for (int pos = 0; pos < msg_len; ) {
+        if (msg_len - pos < TLV_HEADER_LENGTH)
+            goto err;
+
+        const uint8_t* fragment = msg + pos;
+        int length = fragment[TLV_LENGTH_INDEX];
+        if (pos + TLV_HEADER_LENGTH + length > msg_len)
+            goto err;
+        pos += TLV_HEADER_LENGTH + length;
+
+        if (item && item->type == fragment[TLV_TYPE_INDEX] && 
+                last_length == TLV_MAX_FRAGMENTATION_SIZE) {
+            item->length += length;
+            item->nr_fragments++;
+        }
+        else {
+            if (reader->nr_items == TLV_READER_ITEMS_MAX) {
+                printf("[TLV] too many items. %d\n", reader->nr_items);
+                goto err;
+            }
+
+            item = &reader->items[reader->nr_items++];
+            item->type = fragment[TLV_TYPE_INDEX];
+            item->length = length;
+            item->value = &fragment[TLV_VALUE_INDEX];
+            item->first = fragment;
+            item->nr_fragments = 1;
+            item->joined = NULL;
         }
+        last_length = length;
     }
 
-    return NULL;
+    return 0;
+
+err:
+    reader->nr_items = 0;
+    return -1;
 }
 
-static int _item_length(uint8_t* item, uint8_t* bound)
+static int _item_join(struct tlv_item* item)
 {
-    int type = item[TLV_TYPE_INDEX];
-    int tlv_length = TLV_HEADER_LENGTH;
-
-    uint8_t* pos;
-    tlv_for_each(pos, item, bound) {
-        if (pos[TLV_TYPE_INDEX] == type)
-            tlv_length += pos[TLV_LENGTH_INDEX];
-        else
-            break;
+    item->joined = malloc(item->length);
+    if (item->joined == NULL) {
+        printf("[TLV] malloc failed. %d\n", item->length);
+        return -1;
     }
 
-    return tlv_length;
+    const uint8_t* fragment = item->first;
+    uint8_t* value = item->joined;
+    for (int i=0; i<item->nr_fragments; i++) {
+        memcpy(value, &fragment[TLV_VALUE_INDEX], fragment[TLV_LENGTH_INDEX]);
+        value += fragment[TLV_LENGTH_INDEX];
+        fragment += TLV_HEADER_LENGTH + fragment[TLV_LENGTH_INDEX];
+    }
+    item->value = item->joined;
+
+    return 0;
 }
 
-static struct tlv* _defragmentation(const uint8_t* item, uint8_t* bound) 
+const struct tlv_item* tlv_reader_get(struct tlv_reader* reader, uint8_t type)
 {
-    int tlv_item_length = _item_length(item, bound);
-    //printf("[TLV] tlv_item_length:%d\n", tlv_item_length);
-    struct tlv* tlv = malloc(sizeof(struct tlv) + tlv_item_length);
-    if (tlv == NULL) {
-        printf("[TLV] malloc failed. %d\n", sizeof(struct tlv) + tlv_item_length);
-        return NULL;
+    for (int i=0; i<reader->nr_items; i++) {
+        struct tlv_item* item = &reader->items[i];
+        if (item->type != type)
+            continue;
+
+        if (item->nr_fragments > 1 && item->joined == NULL && _item_join(item) < 0)
+            return NULL;
+
+        return item;
     }
 
-    tlv->type = item[TLV_TYPE_INDEX];
-    tlv->length = tlv_item_length - TLV_HEADER_LENGTH;
+    return NULL;
+}
 
-    uint8_t* pos;
-    uint8_t* tlv_value_ptr = (uint8_t*)&tlv->value;
-    tlv_for_each(pos, item, bound) {
-        if (pos[TLV_TYPE_INDEX] == tlv->type) {
-            memcpy(tlv_value_ptr, &pos[TLV_VALUE_INDEX], pos[TLV_LENGTH_INDEX]);
-            tlv_value_ptr += pos[TLV_LENGTH_INDEX];
-        }
-        else 
-            break;
+void tlv_reader_free(struct tlv_reader* reader)
+{
+    for (int i=0; i<reader->nr_items; i++) {
+        if (reader->items[i].joined)
+            free(reader->items[i].joined);
+        reader->items[i].joined = NULL;
     }
+    reader->nr_items = 0;
+}
 
-    return tlv;
+void tlv_writer_init(struct tlv_writer* writer, uint8_t* buf, int size)
+{
+    writer->buf = buf;
+    writer->size = size;
+    writer->len = 0;
 }
 
-struct tlv* tlv_decode(const uint8_t* msg, int msg_len, uint8_t type)
+int tlv_writer_put(struct tlv_writer* writer, uint8_t type, int length, const uint8_t* value)
 {
-    uint8_t* item = _item_find(msg, msg_len, type);
-    if (item == NULL) {
-        return NULL;
+    if (writer->len + tlv_encode_length(length) > writer->size) {
+        printf("[TLV] buffer is short. type:%d length:%d\n", type, length);
+        return -1;
     }
 
-    return _defragmentation(item, msg + msg_len -1);
+    writer->len += tlv_encode(type, length, value, writer->buf + writer->len);
+    return 0;
 }
 
-void tlv_decoded_item_free(struct tlv* tlv_item)
+static int _nr_fragments(int value_length)
 {
-    if (!tlv_item)
-        return;
+    if (value_length == 0)
+        return 1;
 
-    free(tlv_item);
+    return (value_length + TLV_MAX_FRAGMENTATION_SIZE - 1) / TLV_MAX_FRAGMENTATION_SIZE;
 }
 
 int tlv_encode_length(int value_length)
 {
-    return value_length + TLV_HEADER_LENGTH + 
-        (value_length / (TLV_MAX_FRAGMENTATION_SIZE+1)) * TLV_HEADER_LENGTH;
+    return value_length + _nr_fragments(value_length) * TLV_HEADER_LENGTH;
 }
 
-int tlv_encode(uint8_t type, int length, uint8_t* value, uint8_t* item)
+int tlv_encode(uint8_t type, int length, const uint8_t* value, uint8_t* item)
 {
-    int nr_fragment = length / TLV_MAX_FRAGMENTATION_SIZE + 1;
+    int encoded_length = tlv_encode_length(length);
+    int nr_fragment = _nr_fragments(length);
 
     while (nr_fragment-- > 1) {
         item[TLV_TYPE_INDEX] = type;
@@ -108,11 +152,13 @@ int tlv_encode(uint8_t type, int length, uint8_t* value, uint8_t* item)
 
         value += TLV_MAX_FRAGMENTATION_SIZE;
         item += TLV_MAX_FRAGMENTATION_SIZE + TLV_HEADER_LENGTH;
+        length -= TLV_MAX_FRAGMENTATION_SIZE;
     }
 
     item[TLV_TYPE_INDEX] = type;
-    item[TLV_LENGTH_INDEX] = length % TLV_MAX_FRAGMENTATION_SIZE;
-    memcpy(&item[TLV_VALUE_INDEX], value, item[TLV_LENGTH_INDEX]);
+    item[TLV_LENGTH_INDEX] = length;
+    if (length)
+        memcpy(&item[TLV_VALUE_INDEX], value, length);
 
-    return tlv_encode_length(length);
+    return encoded_length;
 }
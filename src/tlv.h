@@ -7,17 +7,51 @@ extern "C" {
 
 #include <stdint.h>
 
-struct tlv {
+/* requests of the pairing protocols carry at most 5 items */
+#ifndef TLV_READER_ITEMS_MAX
+#define TLV_READER_ITEMS_MAX 8
+#endif
+
+/*
+ * An item of a message with its fragments joined. value points into the
+ * message unless the item came in fragments, then it points to a copy
+ * owned by the reader.
+ */
+struct tlv_item {
     uint8_t type;
     int length;
-    uint8_t* value;
+    const uint8_t* value;
+
+    const uint8_t* first;
+    int nr_fragments;
+    uint8_t* joined;
+};
+
+/* indexes a message in one pass. the message has to outlive the reader */
+struct tlv_reader {
+    int nr_items;
+    struct tlv_item items[TLV_READER_ITEMS_MAX];
+};
+
+/* -1 when an item runs past the end or there are too many items */
+int tlv_reader_init(struct tlv_reader* reader, const uint8_t* msg, int msg_len);
+/* first item of the type, NULL when there is none */
+const struct tlv_item* tlv_reader_get(struct tlv_reader* reader, uint8_t type);
+void tlv_reader_free(struct tlv_reader* reader);
+
+/* encodes into a caller's buffer, sized with tlv_encode_length */
+struct tlv_writer {
+    uint8_t* buf;
+    int size;
+    int len;
 };
 
-struct tlv* tlv_decode(const uint8_t* msg, int msg_len, uint8_t type);
-void tlv_decoded_item_free(struct tlv* tlv_item);
+void tlv_writer_init(struct tlv_writer* writer, uint8_t* buf, int size);
+/* -1 and nothing written when the item does not fit */
+int tlv_writer_put(struct tlv_writer* writer, uint8_t type, int length, const uint8_t* value);
 
 int tlv_encode_length(int value_length);
-int tlv_encode(uint8_t type, int length, uint8_t* value, uint8_t* encoded);
+int tlv_encode(uint8_t type, int length, const uint8_t* value, uint8_t* encoded);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,116 @@
+#include <stdio.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+#include "worker.h"
+
+#define WORKER_STACK (1024*8)
+#define WORKER_PRIORITY 5
+#define WORKER_BACKGROUND_PRIORITY (tskIDLE_PRIORITY + 1)
+#define WORKER_QUEUE_LENGTH 4
+
+#if portNUM_PROCESSORS > 1
+#define WORKER_CORE 1
+#else
+#define WORKER_CORE 0
+#endif
+
+struct worker_job {
+    void (*work)(void* arg);
+    void (*done)(void* arg);
+    void* arg;
+};
+
+static QueueHandle_t _jobs;
+static QueueHandle_t _background_jobs;
+static QueueHandle_t _completed;
+static void (*_notify)(void);
+
+static void _worker_task(void* arg)
+{
+    QueueHandle_t jobs = arg;
+    struct worker_job job;
+    while (1) {
+        if (xQueueReceive(jobs, &job, portMAX_DELAY) != pdTRUE)
+            continue;
+
+        job.work(job.arg);
+
+        /* never drop a completion, the submitter is waiting for it */
+        xQueueSend(_completed, &job, portMAX_DELAY);
+        if (_notify)
+            _notify();
+    }
+}
+
+int worker_init(void (*notify)(void))
+{
+    if (_jobs)
+        return 0;
+
+    _jobs = xQueueCreate(WORKER_QUEUE_LENGTH, sizeof(struct worker_job));
+    _background_jobs = xQueueCreate(WORKER_QUEUE_LENGTH, sizeof(struct worker_job));
+    /* room for the completions of both tasks */
+    _completed = xQueueCreate(WORKER_QUEUE_LENGTH * 2, sizeof(struct worker_job));
+    if (_jobs == NULL || _background_jobs == NULL || _completed == NULL) {
+        printf("[ERR] xQueueCreate failed\n");
+        return -1;
+    }
+    _notify = notify;
+
+    if (xTaskCreatePinnedToCore(_worker_task, "worker_task", WORKER_STACK, _jobs, 
+                WORKER_PRIORITY, NULL, WORKER_CORE) != pdPASS) {
+        printf("[ERR] xTaskCreatePinnedToCore failed\n");
+        return -1;
+    }
+
+    if (xTaskCreatePinnedToCore(_worker_task, "worker_bg_task", WORKER_STACK, _background_jobs, 
+                WORKER_BACKGROUND_PRIORITY, NULL, WORKER_CORE) != pdPASS) {
+        printf("[ERR] xTaskCreatePinnedToCore failed\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int _worker_submit(QueueHandle_t jobs, void (*work)(void* arg), void (*done)(void* arg), void* arg)
+{
+    struct worker_job job = {
+        .work = work,
+        .done = done,
+        .arg = arg,
+    };
+
+    if (jobs == NULL)
+        return -1;
+
+    if (xQueueSend(jobs, &job, 0) != pdTRUE)
+        return -1;
+
+    return 0;
+}
+
+int worker_submit(void (*work)(void* arg), void (*done)(void* arg), void* arg)
+{
+    return _worker_submit(_jobs, work, done, arg);
+}
+
+int worker_submit_background(void (*work)(void* arg), void (*done)(void* arg), void* arg)
+{
+    return _worker_submit(_background_jobs, work, done, arg);
+}
+
+void worker_complete(void)
+{
+    struct worker_job job;
+
+    if (_completed == NULL)
+        return;
+
+    while (xQueueReceive(_completed, &job, 0) == pdTRUE) {
+        if (job.done)
+            job.done(job.arg);
+    }
+}
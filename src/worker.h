@@ -0,0 +1,26 @@
+#ifndef _WORKER_H_
+#define _WORKER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A task pinned to the core the httpd task doesn't run on.
+ * work() runs on the worker, done() runs later on whatever task calls
+ * worker_complete(), after notify() told it there is something to complete.
+ */
+int worker_init(void (*notify)(void));
+int worker_submit(void (*work)(void* arg), void (*done)(void* arg), void* arg);
+/*
+ * Same, on a task of the lowest priority on that core. The jobs of
+ * worker_submit preempt it, so a long job here doesn't hold them up.
+ */
+int worker_submit_background(void (*work)(void* arg), void (*done)(void* arg), void* arg);
+void worker_complete(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //#ifndef _WORKER_H_
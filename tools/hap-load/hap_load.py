@@ -0,0 +1,673 @@
+#!/usr/bin/env python3
+"""
+Load and soak test for an accessory built with this component.
+
+    hap_load.py pair --host 192.168.1.50 --port 811 --pin 053-58-197 --controllers 4
+    hap_load.py run --sessions 16 --get 1.10,1.11 --put 1.10=0-100 --subscribe 1.10 \
+            --get-rate 2 --put-rate 0.2 --duration 14400 --csv soak.csv
+
+`pair` runs pair-setup once and adds more controllers over /pairings, the
+keys are kept in hap_load.json. `run` opens that many pair-verified sessions,
+spread over the controllers, and keeps them busy with GET and PUT
+/characteristics at the given rates per session. Every interval it prints
+p50/p99/max latency per operation, the lag from a PUT to the events it
+causes on the subscribed sessions, and the reconnects. A failed or stalled
+session is counted, dropped and verified again, --churn reconnects every
+session on purpose to stress session setup and the heap.
+
+Needs the cryptography package.
+"""
+
+import argparse
+import asyncio
+import collections
+import hashlib
+import json
+import math
+import os
+import random
+import struct
+import sys
+import time
+import uuid
+
+from cryptography.exceptions import InvalidSignature, InvalidTag
+from cryptography.hazmat.primitives import hashes, serialization
+from cryptography.hazmat.primitives.asymmetric.ed25519 import Ed25519PrivateKey, Ed25519PublicKey
+from cryptography.hazmat.primitives.asymmetric.x25519 import X25519PrivateKey, X25519PublicKey
+from cryptography.hazmat.primitives.ciphers.aead import ChaCha20Poly1305
+from cryptography.hazmat.primitives.kdf.hkdf import HKDF
+
+# TLV types and states, see src/hap_internal.h
+TLV_METHOD = 0
+TLV_IDENTIFIER = 1
+TLV_SALT = 2
+TLV_PUBLICKEY = 3
+TLV_PROOF = 4
+TLV_ENCRYPTED_DATA = 5
+TLV_STATE = 6
+TLV_ERROR = 7
+TLV_SIGNATURE = 10
+TLV_PERMISSION = 11
+
+METHOD_PAIR_SETUP = 0
+METHOD_ADD_PAIRING = 3
+
+FRAME_MAX_LENGTH = 1024
+TAG_LENGTH = 16
+
+# the 3072 bit group of RFC 5054, the same as src/srp.c
+SRP_N = int(
+    "FFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD129024E088A67CC74"
+    "020BBEA63B139B22514A08798E3404DDEF9519B3CD3A431B302B0A6DF25F1437"
+    "4FE1356D6D51C245E485B576625E7EC6F44C42E9A637ED6B0BFF5CB6F406B7ED"
+    "EE386BFB5A899FA5AE9F24117C4B1FE649286651ECE45B3DC2007CB8A163BF05"
+    "98DA48361C55D39A69163FA8FD24CF5F83655D23DCA3AD961C62F356208552BB"
+    "9ED529077096966D670C354E4ABC9804F1746C08CA18217C32905E462E36CE3B"
+    "E39E772C180E86039B2783A2EC07A28FB5C55DF06F4C52C9DE2BCBF695581718"
+    "3995497CEA956AE515D2261898FA051015728E5A8AAAC42DAD33170D04507A33"
+    "A85521ABDF1CBA64ECFB850458DBEF0A8AEA71575D060C7DB3970F85A6E1E4C7"
+    "ABF5AE8CDB0933D71E8C94E04A25619DCEE3D2261AD2EE6BF12FFA06D98A0864"
+    "D87602733EC86A64521F2B18177B200CBBE117577A615D6C770988C0BAD946E2"
+    "08E24FA074E5AB3143DB5BFCE0FD108E4B82D120A93AD2CAFFFFFFFFFFFFFFFF", 16)
+SRP_G = 5
+SRP_LENGTH = 384
+
+
+class HapError(Exception):
+    pass
+
+
+def tlv_encode(*items):
+    out = bytearray()
+    for t, v in items:
+        if not v:
+            out += bytes([t, 0])
+        for i in range(0, len(v), 255):
+            chunk = v[i:i + 255]
+            out += bytes([t, len(chunk)]) + chunk
+    return bytes(out)
+
+
+def tlv_decode(data):
+    items = {}
+    last = None
+    i = 0
+    while i + 2 <= len(data):
+        t, length = data[i], data[i + 1]
+        v = data[i + 2:i + 2 + length]
+        i += 2 + length
+        # consecutive items of one type are fragments of one value
+        items[t] = items[t] + v if t == last else v
+        last = t
+
+    if TLV_ERROR in items:
+        raise HapError("accessory returned TLV error %d" % items[TLV_ERROR][0])
+    return items
+
+
+def hkdf(key, salt, info):
+    return HKDF(algorithm=hashes.SHA512(), length=32,
+                salt=salt.encode(), info=info.encode()).derive(key)
+
+
+def label_nonce(label):
+    return b"\0\0\0\0" + label.encode()
+
+
+def counter_nonce(count):
+    return b"\0\0\0\0" + struct.pack("<Q", count)
+
+
+def raw_private(key):
+    return key.private_bytes(serialization.Encoding.Raw, serialization.PrivateFormat.Raw,
+                             serialization.NoEncryption())
+
+
+def raw_public(key):
+    return key.public_key().public_bytes(serialization.Encoding.Raw, serialization.PublicFormat.Raw)
+
+
+class HttpParser:
+    """Splits a byte stream into HTTP responses and EVENT messages."""
+
+    Message = collections.namedtuple("Message", "status headers body")
+
+    def __init__(self):
+        self.buf = b""
+
+    def feed(self, data):
+        self.buf += data
+        messages = []
+        while True:
+            end = self.buf.find(b"\r\n\r\n")
+            if end < 0:
+                break
+            lines = self.buf[:end].decode("latin-1").split("\r\n")
+            headers = {}
+            for line in lines[1:]:
+                name, _, value = line.partition(":")
+                headers[name.strip().lower()] = value.strip()
+            length = int(headers.get("content-length", "0"))
+            if len(self.buf) < end + 4 + length:
+                break
+            body = self.buf[end + 4:end + 4 + length]
+            self.buf = self.buf[end + 4 + length:]
+            messages.append(self.Message(lines[0], headers, body))
+        return messages
+
+
+def http_request(method, path, body=b"", content_type=None):
+    head = "%s %s HTTP/1.1\r\nHost: hap\r\n" % (method, path)
+    if content_type:
+        head += "Content-Type: %s\r\n" % content_type
+    if body or method in ("PUT", "POST"):
+        head += "Content-Length: %d\r\n" % len(body)
+    return head.encode() + b"\r\n" + body
+
+
+def status_code(message):
+    return int(message.status.split(" ")[1])
+
+
+class SrpClient:
+    """SRP-6a with SHA-512 as pair-setup and wolfCrypt use it."""
+
+    def __init__(self, pin):
+        self.username = b"Pair-Setup"
+        self.password = pin.encode()
+        self.a = int.from_bytes(os.urandom(32), "big")
+        self.A = pow(SRP_G, self.a, SRP_N)
+
+    @staticmethod
+    def _h(*parts):
+        digest = hashlib.sha512()
+        for part in parts:
+            digest.update(part)
+        return digest.digest()
+
+    @staticmethod
+    def _pad(n):
+        return n.to_bytes(SRP_LENGTH, "big")
+
+    @staticmethod
+    def _bytes(n):
+        return n.to_bytes((n.bit_length() + 7) // 8, "big")
+
+    def public_key(self):
+        return self._pad(self.A)
+
+    def process(self, salt, server_public):
+        B = int.from_bytes(server_public, "big")
+        if B % SRP_N == 0:
+            raise HapError("bad SRP public key")
+
+        k = int.from_bytes(self._h(self._bytes(SRP_N), self._pad(SRP_G)), "big")
+        u = int.from_bytes(self._h(self._pad(self.A), self._pad(B)), "big")
+        x = int.from_bytes(self._h(salt, self._h(self.username + b":" + self.password)), "big")
+        S = pow(B - k * pow(SRP_G, x, SRP_N), self.a + u * x, SRP_N)
+        self.K = self._h(self._bytes(S))
+
+        hn = self._h(self._bytes(SRP_N))
+        hg = self._h(self._bytes(SRP_G))
+        self.M1 = self._h(bytes(a ^ b for a, b in zip(hn, hg)), self._h(self.username),
+                          salt, self._pad(self.A), self._pad(B), self.K)
+        return self.M1
+
+    def verify(self, server_proof):
+        if server_proof != self._h(self._pad(self.A), self.M1, self.K):
+            raise HapError("accessory SRP proof doesn't match")
+
+
+class Stats:
+    """Latencies of the current interval and a log histogram of the whole run."""
+
+    class Series:
+        BASE = 1.05
+
+        def __init__(self):
+            self.samples = []
+            self.histogram = collections.Counter()
+            self.count = 0
+            self.errors = 0
+            self.interval_errors = 0
+            self.max = 0.0
+
+        def add(self, seconds):
+            ms = seconds * 1000.0
+            self.samples.append(ms)
+            self.histogram[int(math.log(max(ms, 0.01), self.BASE))] += 1
+            self.count += 1
+            self.max = max(self.max, ms)
+
+        def error(self):
+            self.errors += 1
+            self.interval_errors += 1
+
+        def interval(self):
+            samples = sorted(self.samples)
+            errors = self.interval_errors
+            self.samples = []
+            self.interval_errors = 0
+            if not samples:
+                return len(samples), 0.0, 0.0, 0.0, errors
+            return (len(samples), samples[len(samples) // 2],
+                    samples[int(0.99 * (len(samples) - 1))], samples[-1], errors)
+
+        def total_percentile(self, p):
+            rank = p * (self.count - 1)
+            seen = 0
+            for bucket in sorted(self.histogram):
+                seen += self.histogram[bucket]
+                if seen > rank:
+                    return self.BASE ** (bucket + 1)
+            return 0.0
+
+    def __init__(self):
+        self.series = collections.OrderedDict(
+            (name, self.Series()) for name in ("verify", "get", "put", "event_lag"))
+        self.sessions_up = 0
+        self.reconnects = 0
+        self.churned = 0
+        self.events = 0
+        # (aid, iid) -> {value: time of the last PUT of it}
+        self.puts = collections.defaultdict(dict)
+
+
+class Session:
+    def __init__(self, store, controller, stats, timeout):
+        self.store = store
+        self.controller = controller
+        self.stats = stats
+        self.timeout = timeout
+        self.writer = None
+        self.pending = collections.deque()
+        self.read_task = None
+        self.dead = asyncio.Event()
+
+    async def connect(self):
+        start = time.monotonic()
+        self.reader, self.writer = await asyncio.wait_for(
+            asyncio.open_connection(self.store["host"], self.store["port"]), self.timeout)
+        await asyncio.wait_for(self._pair_verify(), self.timeout)
+        self.stats.series["verify"].add(time.monotonic() - start)
+
+        self.parser = HttpParser()
+        self.encrypt_count = 0
+        self.decrypt_count = 0
+        self.read_task = asyncio.ensure_future(self._read_loop())
+
+    async def _plain_post(self, path, body):
+        content_type = "application/pairing+tlv8"
+        self.writer.write(http_request("POST", path, body, content_type))
+        parser = HttpParser()
+        while True:
+            data = await self.reader.read(4096)
+            if not data:
+                raise ConnectionError("closed during " + path)
+            messages = parser.feed(data)
+            if messages:
+                return tlv_decode(messages[0].body)
+
+    async def _pair_verify(self):
+        key = X25519PrivateKey.generate()
+        public = raw_public(key)
+
+        m2 = await self._plain_post("/pair-verify", tlv_encode((TLV_STATE, b"\x01"), (TLV_PUBLICKEY, public)))
+        accessory_public = m2[TLV_PUBLICKEY]
+        shared = key.exchange(X25519PublicKey.from_public_bytes(accessory_public))
+        session_key = hkdf(shared, "Pair-Verify-Encrypt-Salt", "Pair-Verify-Encrypt-Info")
+
+        sub = tlv_decode(ChaCha20Poly1305(session_key).decrypt(
+            label_nonce("PV-Msg02"), m2[TLV_ENCRYPTED_DATA], None))
+        accessory_id = sub[TLV_IDENTIFIER]
+        if accessory_id.decode() != self.store["accessory_id"]:
+            raise HapError("unknown accessory %s" % accessory_id.decode())
+        Ed25519PublicKey.from_public_bytes(bytes.fromhex(self.store["accessory_ltpk"])).verify(
+            sub[TLV_SIGNATURE], accessory_public + accessory_id + public)
+
+        controller_id = self.controller["id"].encode()
+        ltsk = Ed25519PrivateKey.from_private_bytes(bytes.fromhex(self.controller["ltsk"]))
+        signature = ltsk.sign(public + controller_id + accessory_public)
+        encrypted = ChaCha20Poly1305(session_key).encrypt(
+            label_nonce("PV-Msg03"), tlv_encode((TLV_IDENTIFIER, controller_id), (TLV_SIGNATURE, signature)), None)
+        await self._plain_post("/pair-verify", tlv_encode((TLV_STATE, b"\x03"), (TLV_ENCRYPTED_DATA, encrypted)))
+
+        self.write_key = ChaCha20Poly1305(hkdf(shared, "Control-Salt", "Control-Write-Encryption-Key"))
+        self.read_key = ChaCha20Poly1305(hkdf(shared, "Control-Salt", "Control-Read-Encryption-Key"))
+
+    def _send(self, data):
+        out = bytearray()
+        for i in range(0, len(data), FRAME_MAX_LENGTH):
+            chunk = data[i:i + FRAME_MAX_LENGTH]
+            aad = struct.pack("<H", len(chunk))
+            out += aad + self.write_key.encrypt(counter_nonce(self.encrypt_count), chunk, aad)
+            self.encrypt_count += 1
+        self.writer.write(bytes(out))
+
+    async def _read_loop(self):
+        buf = b""
+        try:
+            while True:
+                data = await self.reader.read(4096)
+                if not data:
+                    raise ConnectionError("closed by the accessory")
+                buf += data
+                while len(buf) >= 2:
+                    length = struct.unpack("<H", buf[:2])[0]
+                    if len(buf) < 2 + length + TAG_LENGTH:
+                        break
+                    plain = self.read_key.decrypt(counter_nonce(self.decrypt_count),
+                                                  buf[2:2 + length + TAG_LENGTH], buf[:2])
+                    self.decrypt_count += 1
+                    buf = buf[2 + length + TAG_LENGTH:]
+                    for message in self.parser.feed(plain):
+                        if message.status.startswith("EVENT/"):
+                            self._event(message)
+                        elif self.pending:
+                            self.pending.popleft().set_result(message)
+        except (OSError, ConnectionError, InvalidTag) as e:
+            self.error = e
+        finally:
+            self.dead.set()
+            while self.pending:
+                self.pending.popleft().set_exception(ConnectionError("session is gone"))
+
+    def _event(self, message):
+        now = time.monotonic()
+        self.stats.events += 1
+        for c in json.loads(message.body.decode()).get("characteristics", []):
+            put = self.stats.puts[(c["aid"], c["iid"])].get(value_key(c.get("value")))
+            if put is not None:
+                self.stats.series["event_lag"].add(now - put)
+
+    async def request(self, method, path, body=None):
+        if self.dead.is_set():
+            raise ConnectionError("session is gone")
+        future = asyncio.get_running_loop().create_future()
+        self.pending.append(future)
+        payload = json.dumps(body, separators=(",", ":")).encode() if body is not None else b""
+        self._send(http_request(method, path, payload, "application/hap+json" if body is not None else None))
+        return await asyncio.wait_for(future, self.timeout)
+
+    def close(self):
+        if self.read_task:
+            self.read_task.cancel()
+        if self.writer:
+            self.writer.close()
+
+
+def value_key(value):
+    if isinstance(value, bool):
+        return int(value)
+    if isinstance(value, float):
+        return round(value, 3)
+    return value
+
+
+def parse_ids(text):
+    ids = []
+    for item in filter(None, (text or "").split(",")):
+        aid, _, iid = item.partition(".")
+        ids.append((int(aid), int(iid)))
+    return ids
+
+
+def parse_puts(specs):
+    """1.9=bool or 1.10=0-100 for an integer range."""
+    puts = []
+    for spec in specs or []:
+        target, _, values = spec.partition("=")
+        (aid, iid), = parse_ids(target)
+        if values == "bool":
+            puts.append((aid, iid, lambda: random.random() < 0.5))
+        else:
+            low, _, high = values.partition("-")
+            puts.append((aid, iid, lambda low=int(low), high=int(high): random.randint(low, high)))
+    return puts
+
+
+async def session_worker(index, args, store, stats, stop):
+    controllers = store["controllers"]
+    controller = controllers[index % len(controllers)]
+    gets = parse_ids(args.get)
+    puts = parse_puts(args.put)
+    subscribe = parse_ids(args.subscribe)
+    query = "/characteristics?id=" + ",".join("%d.%d" % g for g in gets)
+    rate = (args.get_rate if gets else 0) + (args.put_rate if puts else 0)
+    backoff = 1
+
+    # spread the first connections out so they don't all verify at once
+    await asyncio.sleep(random.random() * args.ramp)
+    while not stop.is_set():
+        session = Session(store, controller, stats, args.timeout)
+        up = False
+        try:
+            await session.connect()
+            up = True
+            stats.sessions_up += 1
+            backoff = 1
+
+            if subscribe:
+                body = {"characteristics": [{"aid": a, "iid": i, "ev": True} for a, i in subscribe]}
+                message = await session.request("PUT", "/characteristics", body)
+                if status_code(message) not in (200, 204, 207):
+                    raise HapError("subscribe failed: " + message.status)
+
+            deadline = time.monotonic() + args.churn if args.churn else None
+            while not stop.is_set() and not session.dead.is_set():
+                wait = random.expovariate(rate) if rate else 1.0
+                if deadline is not None:
+                    wait = min(wait, max(deadline - time.monotonic(), 0))
+                try:
+                    await asyncio.wait_for(session.dead.wait(), wait)
+                except asyncio.TimeoutError:
+                    pass
+                if deadline is not None and time.monotonic() >= deadline:
+                    stats.churned += 1
+                    break
+                if not rate or session.dead.is_set() or stop.is_set():
+                    continue
+
+                if gets and random.random() * rate < args.get_rate:
+                    name = "get"
+                    start = time.monotonic()
+                    message = await session.request("GET", query)
+                else:
+                    name = "put"
+                    aid, iid, value = random.choice(puts)
+                    v = value()
+                    start = time.monotonic()
+                    stats.puts[(aid, iid)][value_key(v)] = start
+                    message = await session.request(
+                        "PUT", "/characteristics", {"characteristics": [{"aid": aid, "iid": iid, "value": v}]})
+
+                if status_code(message) in (200, 204, 207):
+                    stats.series[name].add(time.monotonic() - start)
+                else:
+                    stats.series[name].error()
+
+            if session.dead.is_set() and not stop.is_set():
+                raise ConnectionError(str(getattr(session, "error", "session died")))
+        except (OSError, ConnectionError, asyncio.TimeoutError, HapError, InvalidTag, InvalidSignature,
+                KeyError, ValueError) as e:
+            if not up:
+                stats.series["verify"].error()
+            stats.reconnects += 1
+            if args.verbose:
+                print("session %d: %s: %s" % (index, type(e).__name__, e), file=sys.stderr)
+            session.close()
+            await asyncio.sleep(backoff)
+            backoff = min(backoff * 2, 30)
+            continue
+        finally:
+            if up:
+                stats.sessions_up -= 1
+        session.close()
+
+
+async def reporter(args, stats, stop):
+    started = time.monotonic()
+    csv = open(args.csv, "a") if args.csv else None
+    if csv and csv.tell() == 0:
+        csv.write("elapsed,series,count,p50_ms,p99_ms,max_ms,errors,sessions_up,reconnects\n")
+
+    while not stop.is_set():
+        try:
+            await asyncio.wait_for(stop.wait(), args.interval)
+        except asyncio.TimeoutError:
+            pass
+        elapsed = time.monotonic() - started
+        print("%7.0fs sessions %d/%d reconnects %d churned %d events %d" % (
+            elapsed, stats.sessions_up, args.sessions, stats.reconnects, stats.churned, stats.events))
+        for name, series in stats.series.items():
+            count, p50, p99, worst, errors = series.interval()
+            if count or errors:
+                print("         %-9s n=%-6d %6.1f/s p50 %7.1f ms p99 %7.1f ms max %7.1f ms errors %d" % (
+                    name, count, count / args.interval, p50, p99, worst, errors))
+            if csv:
+                csv.write("%.0f,%s,%d,%.2f,%.2f,%.2f,%d,%d,%d\n" % (
+                    elapsed, name, count, p50, p99, worst, errors, stats.sessions_up, stats.reconnects))
+        if csv:
+            csv.flush()
+        sys.stdout.flush()
+
+    print("total")
+    for name, series in stats.series.items():
+        if series.count or series.errors:
+            print("         %-9s n=%-8d p50 ~%7.1f ms p99 ~%7.1f ms max %7.1f ms errors %d" % (
+                name, series.count, series.total_percentile(0.5), series.total_percentile(0.99),
+                series.max, series.errors))
+    if csv:
+        csv.close()
+
+
+async def run(args):
+    with open(args.store) as f:
+        store = json.load(f)
+    stats = Stats()
+    stop = asyncio.Event()
+
+    workers = [asyncio.ensure_future(session_worker(i, args, store, stats, stop)) for i in range(args.sessions)]
+    report = asyncio.ensure_future(reporter(args, stats, stop))
+    try:
+        if args.duration:
+            await asyncio.sleep(args.duration)
+        else:
+            await asyncio.Event().wait()
+    finally:
+        stop.set()
+        await asyncio.gather(*workers, return_exceptions=True)
+        await report
+
+
+async def pair(args):
+    reader, writer = await asyncio.open_connection(args.host, args.port)
+    parser = HttpParser()
+
+    async def post(path, body):
+        writer.write(http_request("POST", path, body, "application/pairing+tlv8"))
+        while True:
+            data = await reader.read(4096)
+            if not data:
+                raise ConnectionError("closed during " + path)
+            messages = parser.feed(data)
+            if messages:
+                return tlv_decode(messages[0].body)
+
+    srp = SrpClient(args.pin)
+    m2 = await post("/pair-setup", tlv_encode((TLV_STATE, b"\x01"), (TLV_METHOD, bytes([METHOD_PAIR_SETUP]))))
+    proof = srp.process(m2[TLV_SALT], m2[TLV_PUBLICKEY])
+    m4 = await post("/pair-setup", tlv_encode((TLV_STATE, b"\x03"), (TLV_PUBLICKEY, srp.public_key()),
+                                              (TLV_PROOF, proof)))
+    srp.verify(m4[TLV_PROOF])
+
+    ltsk = Ed25519PrivateKey.generate()
+    controller = {"id": str(uuid.uuid4()).upper(), "ltsk": raw_private(ltsk).hex(), "ltpk": raw_public(ltsk).hex()}
+
+    key = ChaCha20Poly1305(hkdf(srp.K, "Pair-Setup-Encrypt-Salt", "Pair-Setup-Encrypt-Info"))
+    x = hkdf(srp.K, "Pair-Setup-Controller-Sign-Salt", "Pair-Setup-Controller-Sign-Info")
+    signature = ltsk.sign(x + controller["id"].encode() + raw_public(ltsk))
+    sub = tlv_encode((TLV_IDENTIFIER, controller["id"].encode()), (TLV_PUBLICKEY, raw_public(ltsk)),
+                     (TLV_SIGNATURE, signature))
+    m6 = await post("/pair-setup", tlv_encode((TLV_STATE, b"\x05"),
+                                              (TLV_ENCRYPTED_DATA, key.encrypt(label_nonce("PS-Msg05"), sub, None))))
+
+    sub = tlv_decode(key.decrypt(label_nonce("PS-Msg06"), m6[TLV_ENCRYPTED_DATA], None))
+    accessory_id, accessory_ltpk = sub[TLV_IDENTIFIER], sub[TLV_PUBLICKEY]
+    x = hkdf(srp.K, "Pair-Setup-Accessory-Sign-Salt", "Pair-Setup-Accessory-Sign-Info")
+    Ed25519PublicKey.from_public_bytes(accessory_ltpk).verify(sub[TLV_SIGNATURE], x + accessory_id + accessory_ltpk)
+    writer.close()
+
+    store = {
+        "host": args.host,
+        "port": args.port,
+        "accessory_id": accessory_id.decode(),
+        "accessory_ltpk": accessory_ltpk.hex(),
+        "controllers": [controller],
+    }
+    print("paired with %s as %s" % (store["accessory_id"], controller["id"]))
+
+    # the other controllers are added by the first one, like a home hub would
+    if args.controllers > 1:
+        session = Session(store, controller, Stats(), 30)
+        await session.connect()
+        for _ in range(args.controllers - 1):
+            extra = Ed25519PrivateKey.generate()
+            added = {"id": str(uuid.uuid4()).upper(), "ltsk": raw_private(extra).hex(),
+                     "ltpk": raw_public(extra).hex()}
+            body = tlv_encode((TLV_STATE, b"\x01"), (TLV_METHOD, bytes([METHOD_ADD_PAIRING])),
+                              (TLV_IDENTIFIER, added["id"].encode()), (TLV_PUBLICKEY, raw_public(extra)),
+                              (TLV_PERMISSION, b"\x00"))
+            future = asyncio.get_running_loop().create_future()
+            session.pending.append(future)
+            session._send(http_request("POST", "/pairings", body, "application/pairing+tlv8"))
+            tlv_decode((await asyncio.wait_for(future, 30)).body)
+            store["controllers"].append(added)
+            print("added controller %s" % added["id"])
+        session.close()
+
+    with open(args.store, "w") as f:
+        json.dump(store, f, indent=2)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0].strip())
+    parser.add_argument("--store", default="hap_load.json", help="pairing keys (default hap_load.json)")
+    sub = parser.add_subparsers(dest="command")
+
+    p = sub.add_parser("pair", help="pair-setup once and keep the keys")
+    p.add_argument("--host", required=True)
+    p.add_argument("--port", type=int, default=811)
+    p.add_argument("--pin", default="053-58-197")
+    p.add_argument("--controllers", type=int, default=1, help="controllers to add over /pairings")
+
+    r = sub.add_parser("run", help="load the accessory with verified sessions")
+    r.add_argument("--sessions", type=int, default=8)
+    r.add_argument("--get", help="aid.iid list read by GET, e.g. 1.10,1.11")
+    r.add_argument("--put", action="append", help="aid.iid=bool or aid.iid=LOW-HIGH, repeatable")
+    r.add_argument("--subscribe", help="aid.iid list each session subscribes to")
+    r.add_argument("--get-rate", type=float, default=1.0, help="GETs per second per session")
+    r.add_argument("--put-rate", type=float, default=0.1, help="PUTs per second per session")
+    r.add_argument("--duration", type=float, default=0, help="seconds, 0 runs until interrupted")
+    r.add_argument("--interval", type=float, default=60, help="seconds between reports")
+    r.add_argument("--churn", type=float, default=0, help="reconnect every session after this many seconds")
+    r.add_argument("--ramp", type=float, default=10, help="seconds to spread the first connections over")
+    r.add_argument("--timeout", type=float, default=30, help="seconds before a request or verify fails")
+    r.add_argument("--csv", help="append every report to this file")
+    r.add_argument("--verbose", action="store_true", help="print why sessions failed")
+
+    args = parser.parse_args()
+    if args.command == "pair":
+        asyncio.run(pair(args))
+    elif args.command == "run":
+        try:
+            asyncio.run(run(args))
+        except KeyboardInterrupt:
+            pass
+    else:
+        parser.print_help()
+
+
+if __name__ == "__main__":
+    main()